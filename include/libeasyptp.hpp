@@ -114,10 +114,27 @@ libusb_exit(NULL);
 #include "libeasyptp/PTPBase.hpp"
 #include "libeasyptp/CHDKCamera.hpp"
 #include "libeasyptp/LVData.hpp"
+#include "libeasyptp/RawData.hpp"
+#include "libeasyptp/DNGWriter.hpp"
 #include "libeasyptp/PTPCamera.hpp"
 #include "libeasyptp/PTPContainer.hpp"
 #include "libeasyptp/IPTPComm.hpp"
 #include "libeasyptp/PTPUSB.hpp"
+#include "libeasyptp/PTPWorker.hpp"
+#include "libeasyptp/PTPTrace.hpp"
+#include "libeasyptp/PTPDeadline.hpp"
+#include "libeasyptp/PTPDataSink.hpp"
+#include "libeasyptp/PTPDataSource.hpp"
+#include "libeasyptp/PTPUring.hpp"
+#include "libeasyptp/CHDKOffload.hpp"
+#include "libeasyptp/CHDKRpc.hpp"
+#include "libeasyptp/CHDKTimelapse.hpp"
+#include "libeasyptp/CHDKRigTrigger.hpp"
+#include "libeasyptp/CHDKClockSync.hpp"
+#include "libeasyptp/CHDKTable.hpp"
+#include "libeasyptp/CRC32C.hpp"
+#include "libeasyptp/CHDKMessageStream.hpp"
+#include "libeasyptp/CHDKPropertyCache.hpp"
 
 namespace EasyPTP
 {
@@ -21,9 +21,17 @@
 #ifndef LIBEASYPTP_CHDKCAMERA_H_
 #define LIBEASYPTP_CHDKCAMERA_H_
 
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include "libeasyptp/PTPBase.hpp"
+#include "libeasyptp/PTPErrors.hpp"
 
 namespace EasyPTP
 {
@@ -31,6 +39,9 @@ namespace EasyPTP
 class PTPContainer;
 class LVData;
 class IPTPComm;
+class IPTPDataSource;
+class PTPDeadline;
+class CHDKTable;
 
 // Picked out of CHDK source in a header we don't want to include
 
@@ -42,21 +53,246 @@ enum CHDK_PTP_RESP
     CHDK_PTP_RC_InvalidParameter = 0x201D
 };
 
+/**
+ * @brief A value from a script, decoded according to its \c PTP_CHDK_TYPE_*
+ */
+struct CHDKScriptValue
+{
+    uint32_t type; // PTP_CHDK_TYPE_*
+    bool boolean; // PTP_CHDK_TYPE_BOOLEAN
+    int32_t integer; // PTP_CHDK_TYPE_INTEGER, and PTP_CHDK_TYPE_BOOLEAN as 0 or 1
+    std::string string; // PTP_CHDK_TYPE_STRING; the table as CHDK sent it for PTP_CHDK_TYPE_TABLE; the type name for PTP_CHDK_TYPE_UNSUPPORTED
+    std::map<std::string, std::string> table; // PTP_CHDK_TYPE_TABLE, from CHDK's "key\tvalue\n" lines
+
+    CHDKScriptValue() : type(1), boolean(false), integer(0) // PTP_CHDK_TYPE_NIL
+    {
+    }
+};
+
+/**
+ * @brief A message read from the camera's script system
+ */
+struct CHDKScriptMessage
+{
+    uint32_t type; // PTP_CHDK_S_MSGTYPE_*
+    uint32_t script_id;
+    uint32_t error_type; // PTP_CHDK_S_ERRTYPE_*, for PTP_CHDK_S_MSGTYPE_ERR
+    CHDKScriptValue value; // The message; for errors, a string describing it
+
+    CHDKScriptMessage() : type(0), script_id(0), error_type(0)
+    {
+    }
+};
+
+/**
+ * @brief One range of camera memory for \c CHDKCamera::read_memory to fetch
+ */
+struct CHDKMemoryRegion
+{
+    uint32_t address;
+    uint32_t size;
+    void * out; // At least size bytes
+    bool ok; // Set once read
+};
+
+/**
+ * @brief One firmware function call for \c CHDKCamera::call_functions to make
+ */
+struct CHDKFunctionCall
+{
+    static const int max_args = 10; // CHDK's limit for PTP_CHDK_CallFunction
+
+    uint32_t function; // Address of the function in the camera
+    int arg_count;
+    int32_t args[max_args];
+    int32_t result; // Set once called
+    bool ok; // Set once called
+
+    CHDKFunctionCall() : function(0), arg_count(0), result(0), ok(false)
+    {
+    }
+};
+
+/**
+ * @brief Where a remote capture chunk belongs in its file
+ */
+struct CHDKCaptureChunk
+{
+    uint32_t length;
+    int64_t position; // File offset to seek to first, or -1 to follow the last chunk
+    bool more; // Whether further chunks of the same format will follow
+};
+
+/**
+ * @brief How long a remote capture took to reach the host
+ */
+struct CHDKCaptureStats
+{
+    uint64_t bytes;
+    uint32_t image_number;
+    double ready_ms; // From asking for the shot to its first data being ready
+    double transfer_ms; // From the first data being ready to the last of it arriving
+    double total_ms; // From asking for the shot to the last of it arriving
+
+    CHDKCaptureStats() : bytes(0), image_number(0), ready_ms(0), transfer_ms(0), total_ms(0)
+    {
+    }
+};
+
+/**
+ * @brief One file for \c CHDKCamera::upload_files to send
+ */
+struct CHDKUpload
+{
+    std::string local_filename;
+    std::string remote_filename;
+};
+
+/**
+ * @brief One file to fetch from the camera in a batch transfer
+ */
+struct CHDKDownload
+{
+    std::string remote_filename;
+    std::string local_filename;
+};
+
+/**
+ * @brief What happened to one file in a batch transfer
+ */
+struct CHDKTransferResult
+{
+    bool ok;
+    LIBPTP_PP_ERRORS error; // ERR_NONE unless the transfer threw
+    std::exception_ptr exception; // Set if it threw anything else, where there is nobody to throw it to
+    PTPTransferStats stats;
+
+    CHDKTransferResult() : ok(false), error(ERR_NONE)
+    {
+    }
+};
+
+/**
+ * @brief How long a batch of transfers took, as a whole
+ */
+struct CHDKBatchStats
+{
+    uint32_t files;
+    uint64_t bytes;
+    double seconds;
+
+    CHDKBatchStats() : files(0), bytes(0), seconds(0)
+    {
+    }
+
+    double files_per_s() const
+    {
+        return (this->seconds > 0) ? this->files / this->seconds : 0;
+    }
+
+    double mb_per_s() const
+    {
+        return (this->seconds > 0) ? (this->bytes / 1e6) / this->seconds : 0;
+    }
+};
+
+/**
+ * @brief What \c CHDKCamera::sync_directory found, and fetched
+ */
+struct CHDKSyncStats
+{
+    uint32_t files; // Files on the camera
+    uint32_t files_downloaded; // New or changed since the last sync
+    uint32_t files_unchanged;
+    uint32_t files_failed;
+    uint64_t bytes; // Downloaded
+    double manifest_seconds; // Listing the camera's files
+    double seconds;
+
+    CHDKSyncStats() : files(0), files_downloaded(0), files_unchanged(0), files_failed(0), bytes(0), manifest_seconds(0), seconds(0)
+    {
+    }
+};
+
 class CHDKCamera : public PTPBase
 {
-    static uint8_t * _pack_file_for_upload(uint32_t * out_size, const std::string local_filename, const std::string remote_filename);
+    struct CoalescedResult;
+    typedef std::shared_future<std::shared_ptr<const CoalescedResult> > CoalescedFlight;
+
+    struct Flight
+    {
+        CoalescedFlight result;
+        bool done;
+        std::chrono::steady_clock::time_point completed_at;
+    };
+
+    // A script message read while looking for another script's
+    struct StashedMessage
+    {
+        uint32_t type;
+        uint32_t subtype;
+        uint32_t script_id;
+        uint32_t length;
+        std::string data;
+    };
+    std::deque<StashedMessage> stashed_messages; // Guarded by the session lock
+
+    std::atomic<bool> coalescing;
+    std::chrono::steady_clock::duration freshness;
+    std::mutex flights_mutex;
+    std::map<std::string, Flight> flights;
+
+    static const uint32_t read_ahead_limit = 4 * 1024 * 1024; // Bigger files are streamed instead of read into memory
+    static const int read_ahead_depth = 2; // Files prepared ahead of the one being sent
+    static const int block_timeout = 5000; // Milliseconds execute_lua waits for a blocking script
+    static const int capture_linger = 1000; // Milliseconds remote_shoot waits for its script to finish
+    static const uint32_t memory_chunk_size = 4 * 1024 * 1024; // Bytes per GetMemory/SetMemory transaction
+    static const size_t stashed_message_limit = 256; // Other scripts' messages kept for them; the oldest go first
+
+    std::shared_ptr<const CoalescedResult> _coalesced_transaction(PTPContainer& cmd);
+    bool _read_memory(const uint32_t address, unsigned char * out, const uint32_t size, const PTPDeadline& deadline);
+    bool _remote_capture_get_chunk(const uint32_t format, IPTPDataSink& sink, CHDKCaptureChunk& out, const PTPDeadline& deadline);
+    void _abandon_capture(const uint32_t script_id);
+    bool _call_function(CHDKFunctionCall& call, PTPContainer& cmd, PTPContainer& data, PTPContainer& resp, const PTPDeadline& deadline);
+    bool _take_stashed_message(const uint32_t script_id, PTPContainer& out_resp, PTPContainer& out_data);
+    static bool _decode_script_message(const PTPContainer& resp, const PTPContainer& data, CHDKScriptMessage& out);
 public:
+    static const char * const sync_index_name; // Kept in the local directory by sync_directory
+    static const char * const crc32c_script;
+    static const char * const sync_manifest_script;
+
     CHDKCamera();
     CHDKCamera(IPTPComm * protocol);
+    void set_coalescing(const bool enabled, const int freshness_ms = 0);
     float get_chdk_version(void);
     uint32_t check_script_status(void);
     uint32_t execute_lua(const std::string script, uint32_t * script_error, const bool block = false);
-    void read_script_message(PTPContainer& out_data, PTPContainer& out_resp);
+    void read_script_message(PTPContainer& out_resp, PTPContainer& out_data, const uint32_t script_id = 0);
+    bool read_script_message(CHDKScriptMessage& out, const uint32_t script_id = 0);
+    bool run_lua(const std::string script, CHDKScriptValue * result, std::vector<CHDKScriptMessage> * messages = NULL, const int timeout = 0);
+    bool run_lua(const std::string script, CHDKTable& result, const int timeout = 0);
+    static void decode_script_value(const uint32_t type, const unsigned char * data, const uint32_t length, CHDKScriptValue& out);
     uint32_t write_script_message(const std::string message, const uint32_t script_id = 0);
-    bool upload_file(const std::string local_filename, const std::string remote_filename, int timeout = 0);
-    char * download_file(const std::string filename, const int timeout);
+    bool upload_file(const std::string local_filename, const std::string remote_filename, const int timeout = 0, const PTPProgressCallback& progress = PTPProgressCallback(), PTPTransferStats * stats = NULL);
+    bool upload_file(IPTPDataSource& source, const std::string remote_filename, const int timeout = 0, const PTPProgressCallback& progress = PTPProgressCallback(), PTPTransferStats * stats = NULL);
+    std::vector<CHDKTransferResult> upload_files(const std::vector<CHDKUpload>& files, const int timeout = 0, CHDKBatchStats * stats = NULL, const bool read_ahead = false);
+    bool download_file(const std::string remote_filename, IPTPDataSink& sink, const int timeout = 0, const PTPProgressCallback& progress = PTPProgressCallback(), PTPTransferStats * stats = NULL);
+    bool download_file(const std::string remote_filename, const std::string local_filename, const int timeout = 0, const PTPProgressCallback& progress = PTPProgressCallback(), PTPTransferStats * stats = NULL);
+    bool get_file_crc32c(const std::string remote_filename, uint32_t& crc, uint64_t * size = NULL, const int timeout = 0);
+    bool download_file_verified(const std::string remote_filename, const std::string local_filename, const int timeout = 0, const PTPProgressCallback& progress = PTPProgressCallback(), PTPTransferStats * stats = NULL, uint32_t * crc = NULL);
+    bool sync_directory(const std::string remote_directory, const std::string local_directory, const int timeout = 0, CHDKSyncStats * stats = NULL);
+    bool read_memory(const uint32_t address, void * out, const uint32_t size, const int timeout = 0, PTPTransferStats * stats = NULL);
+    bool read_memory(std::vector<CHDKMemoryRegion>& regions, const int timeout = 0, PTPTransferStats * stats = NULL);
+    bool write_memory(const uint32_t address, const void * data, const uint32_t size, const int timeout = 0, PTPTransferStats * stats = NULL);
+    int32_t call_function(const uint32_t function, const std::vector<int32_t>& args, const int timeout = 0);
+    bool call_functions(std::vector<CHDKFunctionCall>& calls, const int timeout = 0);
+    uint32_t remote_capture_is_ready(uint32_t * image_number = NULL);
+    bool remote_capture_get_chunk(const uint32_t format, IPTPDataSink& sink, CHDKCaptureChunk& out, const int timeout = 0);
+    bool remote_shoot(const uint32_t formats, const std::string basename, const int timeout = 0, CHDKCaptureStats * stats = NULL);
+    bool remote_shoot(const uint32_t formats, IPTPDataSink& jpg_sink, IPTPDataSink& raw_sink, const int timeout = 0, CHDKCaptureStats * stats = NULL);
     void get_live_view_data(LVData& data_out, const bool liveview = true, const bool overlay = false, const bool palette = false);
     std::vector<std::string> _wait_for_script_return(const int timeout);
+    std::vector<CHDKScriptMessage> _wait_for_script_return(const int timeout, const uint32_t script_id);
 };
 
 }
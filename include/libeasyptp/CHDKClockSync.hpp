@@ -0,0 +1,114 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_CHDKCLOCKSYNC_H_
+#define LIBEASYPTP_CHDKCLOCKSYNC_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <deque>
+
+#include "libeasyptp/CHDKRpc.hpp"
+
+namespace EasyPTP
+{
+
+class CHDKCamera;
+
+/**
+ * @brief How well a camera's clock is known
+ */
+struct CHDKClockReport
+{
+    uint32_t samples; // Round trips made
+    uint32_t points; // Minimum round trip samples kept for the fit
+    double best_rtt_us; // The quickest round trip of those kept
+    double offset_us; // Host time less camera time, at the last point
+    double drift_ppm; // How much faster the host clock runs than the camera's
+    double residual_us; // RMS distance of the points from the fit
+    double accuracy_us; // Expected error of a conversion: half the best round trip, half a tick, and the residual
+
+    CHDKClockReport() : samples(0), points(0), best_rtt_us(0), offset_us(0), drift_ppm(0), residual_us(0), accuracy_us(0)
+    {
+    }
+};
+
+/**
+ * @class CHDKClockSync
+ * @brief Maps a camera's tick count onto the host's steady clock
+ *
+ * Works the way NTP does.  Each \c CHDKClockSync::sample makes a burst of
+ * short round trips, asking a \c CHDKRpc agent for \c get_tick_count, and
+ * keeps only the quickest: the less time a round trip took, the less
+ * room there is for the tick to have been read anywhere but half way
+ * through it.  A line fitted through the points kept from successive
+ * bursts gives the offset between the clocks and how fast it drifts, so
+ * calling \c CHDKClockSync::sample every so often keeps the mapping up to
+ * date.
+ *
+ * The agent occupies the camera's script system while it is running; see
+ * \c CHDKClockSync::stop.
+ */
+class CHDKClockSync
+{
+private:
+    struct Point
+    {
+        double host_us;
+        double tick_us;
+        double rtt_us;
+    };
+
+    CHDKRpc rpc;
+    std::deque<Point> points;
+    size_t max_points;
+    uint32_t samples;
+
+    // Ticks are 32 bits of milliseconds; these unwrap them
+    uint32_t last_raw_tick;
+    int64_t last_tick;
+
+    // host_us = tick_us + offset + slope * (tick_us - tick_mean)
+    double offset;
+    double slope;
+    double tick_mean;
+    double residual_us;
+
+    int64_t unwrap(const uint32_t raw) const;
+    void fit();
+
+    CHDKClockSync(const CHDKClockSync&);
+    CHDKClockSync& operator=(const CHDKClockSync&);
+public:
+    static const int default_burst = 16;
+    static const int tick_us = 1000; // get_tick_count() counts milliseconds
+
+    CHDKClockSync(CHDKCamera * camera, const size_t max_points = 64);
+    bool sample(const int burst = default_burst, const int timeout = 0);
+    bool stop(const int timeout = 0);
+    bool is_synchronized() const;
+    std::chrono::steady_clock::time_point to_host(const int64_t tick) const;
+    int64_t to_camera(const std::chrono::steady_clock::time_point time) const;
+    CHDKClockReport get_report() const;
+};
+
+}
+
+#endif /* LIBEASYPTP_CHDKCLOCKSYNC_H_ */
@@ -0,0 +1,138 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_CHDKMESSAGESTREAM_H_
+#define LIBEASYPTP_CHDKMESSAGESTREAM_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libeasyptp/PTPContainer.hpp"
+
+namespace EasyPTP
+{
+
+class CHDKCamera;
+
+/**
+ * @brief What a \c CHDKMessageStream has sent
+ */
+struct CHDKStreamStats
+{
+    uint64_t messages; // Accepted by the script
+    uint64_t bytes;
+    uint32_t queue_full; // Sends the camera refused with PTP_CHDK_S_MSGSTATUS_QFULL, and which were retried
+    double seconds; // From the first message queued to the last accepted
+    double mean_latency_us; // From being queued to being accepted
+    double max_latency_us;
+
+    CHDKStreamStats() : messages(0), bytes(0), queue_full(0), seconds(0), mean_latency_us(0), max_latency_us(0)
+    {
+    }
+
+    double messages_per_s() const
+    {
+        return (this->seconds > 0) ? this->messages / this->seconds : 0;
+    }
+};
+
+/**
+ * @class CHDKMessageStream
+ * @brief Sends a stream of script messages from a thread of its own
+ *
+ * \c CHDKCamera::write_script_message builds a command and a data container
+ * and copies the message for every call, and the caller waits out the
+ * whole transaction.  A stream is a queue in front of the camera instead:
+ * messages are copied into a ring of containers allocated once, so
+ * \c CHDKMessageStream::send costs a copy into memory which is already
+ * there, and a sender thread takes them off the ring one transaction at a
+ * time.  The producer doesn't wait for the camera unless the ring is full.
+ *
+ * A PTP session carries one transaction at a time, so messages are never
+ * on the wire together, and each still costs a full round trip.
+ *
+ * When the script's inbox is full (\c PTP_CHDK_S_MSGSTATUS_QFULL) the
+ * message is retried with backoff, and the ring fills, so
+ * \c CHDKMessageStream::send blocks: the camera's pace is passed back to the
+ * producer rather than messages being lost.  If the script stops, or
+ * refuses one message for longer than the stream's stall timeout, the
+ * stream fails, and drops whatever was queued.
+ */
+class CHDKMessageStream
+{
+private:
+    struct Slot
+    {
+        PTPContainer data;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    CHDKCamera * camera;
+    uint32_t script_id;
+    int stall_timeout; // Milliseconds
+    std::vector<Slot> slots;
+    size_t head; // Next to send
+    size_t count; // Queued, including the one being sent
+    bool stopping;
+    bool failed;
+    uint32_t status; // What the camera said when the stream failed
+    CHDKStreamStats stats;
+    double total_latency_us;
+    std::chrono::steady_clock::time_point started;
+
+    mutable std::mutex mutex;
+    std::condition_variable queued; // Something to send, or stopping
+    std::condition_variable sent; // Room in the ring, or nothing left to send
+
+    // Only touched by the sender thread
+    PTPContainer cmd;
+    PTPContainer resp;
+    PTPContainer out_data;
+
+    std::thread thread;
+
+    void run();
+
+    CHDKMessageStream(const CHDKMessageStream&);
+    CHDKMessageStream& operator=(const CHDKMessageStream&);
+public:
+    static const size_t default_depth = 64;
+    static const uint32_t default_message_size = 256; // Bytes reserved in each slot up front
+    static const int default_stall_timeout = 5000; // Milliseconds one message may go unaccepted before the stream fails
+
+    CHDKMessageStream(CHDKCamera * camera, const uint32_t script_id, const size_t depth = default_depth, const int stall_timeout = default_stall_timeout);
+    ~CHDKMessageStream();
+    bool send(const char * message, const uint32_t length, const int timeout = 0);
+    bool send(const std::string& message, const int timeout = 0);
+    bool flush(const int timeout = 0);
+    void stop();
+    bool is_failed() const;
+    uint32_t get_status() const;
+    CHDKStreamStats get_stats() const;
+};
+
+}
+
+#endif /* LIBEASYPTP_CHDKMESSAGESTREAM_H_ */
@@ -0,0 +1,84 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ *
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_CHDKOFFLOAD_H_
+#define LIBEASYPTP_CHDKOFFLOAD_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+
+#include "libeasyptp/CHDKCamera.hpp"
+
+namespace EasyPTP
+{
+
+/**
+ * @brief How far one camera's offload has got
+ */
+struct CHDKOffloadProgress
+{
+    uint32_t files_done;
+    uint32_t files_total;
+    uint64_t bytes_done; // Including the file being downloaded now
+    bool finished;
+};
+
+/**
+ * @class CHDKOffload
+ * @brief Copies files off many cameras at once
+ *
+ * Each camera gets its own thread, so USB transfers run in parallel across
+ * the rig, and each thread writes its files through its own
+ * \c PTPUringFileSink, so received chunks go to disk through io_uring in
+ * large aligned writes without the receiving thread waiting on them.
+ *
+ * Progress can be read from any thread while the offload runs.
+ */
+class CHDKOffload
+{
+private:
+    struct Camera;
+
+    std::vector<Camera *> cameras;
+    bool direct_io;
+    bool preallocate;
+    std::chrono::steady_clock::time_point started;
+
+    void run_camera(Camera * camera, const int timeout);
+
+    CHDKOffload(const CHDKOffload&);
+    CHDKOffload& operator=(const CHDKOffload&);
+public:
+    CHDKOffload(const bool direct_io = false, const bool preallocate = true);
+    ~CHDKOffload();
+    int add_camera(CHDKCamera * camera, const std::vector<CHDKDownload>& files);
+    int get_camera_count() const;
+    void start(const int timeout = 0);
+    void wait();
+    void run(const int timeout = 0);
+    CHDKOffloadProgress get_progress(const int camera) const;
+    std::vector<CHDKTransferResult> get_results(const int camera) const;
+    CHDKBatchStats get_stats() const;
+};
+
+}
+
+#endif /* LIBEASYPTP_CHDKOFFLOAD_H_ */
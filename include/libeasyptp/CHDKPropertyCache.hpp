@@ -0,0 +1,109 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_CHDKPROPERTYCACHE_H_
+#define LIBEASYPTP_CHDKPROPERTYCACHE_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "libeasyptp/CHDKCamera.hpp"
+#include "libeasyptp/CHDKTable.hpp"
+
+namespace EasyPTP
+{
+
+/**
+ * @brief Counts of what \c CHDKPropertyCache::query had to fetch
+ */
+struct CHDKPropertyStats
+{
+    uint32_t queries;
+    uint32_t scripts; // Queries which had to go to the camera
+    uint32_t hits; // Properties served from the cache
+    uint32_t misses; // Properties fetched from the camera
+
+    CHDKPropertyStats() : queries(0), scripts(0), hits(0), misses(0)
+    {
+    }
+};
+
+/**
+ * @class CHDKPropertyCache
+ * @brief Reads many camera properties in one script, and caches them
+ *
+ * Each property is a Lua expression, such as <tt>get_tv96()</tt>.
+ * \c CHDKPropertyCache::query puts every property it hasn't got a fresh
+ * value for into one script, which returns them all in one table, so a
+ * dashboard of thirty values costs one round trip rather than thirty.
+ * Values are kept for the cache's time to live, and served from there
+ * without touching USB.
+ *
+ * Properties are named; the common ones are defined already (see
+ * \c CHDKPropertyCache::builtin_properties), more can be added with
+ * \c CHDKPropertyCache::define, and any other name is taken to be a Lua
+ * expression itself.  Each property is evaluated under \c pcall, so one
+ * that fails comes back nil without spoiling the rest.
+ *
+ * Use one cache per camera.
+ */
+class CHDKPropertyCache
+{
+private:
+    struct Entry
+    {
+        CHDKScriptValue value;
+        std::chrono::steady_clock::time_point fetched;
+    };
+
+    CHDKCamera * camera;
+    int ttl_ms;
+    std::map<std::string, std::string> expressions;
+    std::map<std::string, Entry> entries;
+    CHDKPropertyStats stats;
+
+    // Reused from query to query
+    std::vector<std::string> missing;
+    std::vector<std::string> wanted;
+    std::string script;
+    CHDKTable table;
+
+    CHDKPropertyCache(const CHDKPropertyCache&);
+    CHDKPropertyCache& operator=(const CHDKPropertyCache&);
+public:
+    static const char * const builtin_properties[][2];
+
+    CHDKPropertyCache(CHDKCamera * camera, const int ttl_ms = 1000);
+    void define(const std::string& name, const std::string& expression);
+    void set_ttl(const int ttl_ms);
+    bool query(const std::vector<std::string>& names, std::map<std::string, CHDKScriptValue>& out, const int timeout = 0);
+    bool get(const std::string& name, CHDKScriptValue& out, const int timeout = 0);
+    void invalidate();
+    void invalidate(const std::string& name);
+    CHDKPropertyStats get_stats() const;
+    static void build_script(const std::vector<std::string>& expressions, std::string& out);
+};
+
+}
+
+#endif /* LIBEASYPTP_CHDKPROPERTYCACHE_H_ */
@@ -0,0 +1,96 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_CHDKRIGTRIGGER_H_
+#define LIBEASYPTP_CHDKRIGTRIGGER_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+namespace EasyPTP
+{
+
+class CHDKCamera;
+
+/**
+ * @brief How one camera's shutter release went
+ */
+struct CHDKTriggerResult
+{
+    bool armed;
+    bool fired;
+    double send_us; // From the release to the camera acknowledging it
+    double skew_us; // send_us, less that of the quickest camera
+    int64_t camera_tick; // The camera's get_tick_count() as it pressed the shutter
+
+    CHDKTriggerResult() : armed(false), fired(false), send_us(0), skew_us(0), camera_tick(0)
+    {
+    }
+};
+
+/**
+ * @class CHDKRigTrigger
+ * @brief Releases the shutters of many cameras at once
+ *
+ * Starting a script on each camera in turn staggers the shutters by the
+ * round trip of every camera before. Instead, \c CHDKRigTrigger::arm starts
+ * a script on every camera which half-presses and then waits for a script
+ * message, and leaves one thread per camera spinning, pinned to a CPU
+ * (shared round-robin when there are more cameras than CPUs), with
+ * nothing left to do but send that message.  \c CHDKRigTrigger::fire then lets every thread go at once.
+ */
+class CHDKRigTrigger
+{
+private:
+    struct Camera;
+
+    std::vector<Camera *> cameras;
+    bool pin_threads;
+    std::atomic<bool> go;
+    std::atomic<bool> cancel;
+    std::chrono::steady_clock::time_point released;
+    int fire_timeout; // Milliseconds the camera threads wait for their shots, once released
+    bool armed;
+
+    void run_camera(Camera * camera, const int cpu, const int timeout);
+    void join();
+
+    CHDKRigTrigger(const CHDKRigTrigger&);
+    CHDKRigTrigger& operator=(const CHDKRigTrigger&);
+public:
+    static const char * const arm_script;
+    static const int cancel_timeout = 1000; // Milliseconds a script told "cancel" gets to end
+
+
+    CHDKRigTrigger(const bool pin_threads = true);
+    ~CHDKRigTrigger();
+    int add_camera(CHDKCamera * camera);
+    bool arm(const int timeout = 0);
+    bool fire(const int timeout = 0);
+    void disarm();
+    std::vector<CHDKTriggerResult> get_results() const;
+    double get_spread_us() const;
+};
+
+}
+
+#endif /* LIBEASYPTP_CHDKRIGTRIGGER_H_ */
@@ -0,0 +1,87 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ *
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_CHDKRPC_H_
+#define LIBEASYPTP_CHDKRPC_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "libeasyptp/PTPContainer.hpp"
+
+namespace EasyPTP
+{
+
+class CHDKCamera;
+class PTPDeadline;
+
+/**
+ * @class CHDKRpc
+ * @brief Calls into a Lua agent left running on the camera
+ *
+ * \c CHDKCamera::execute_lua sends a whole script for every command, which
+ * the camera has to compile and start before it can run.  \c CHDKRpc starts
+ * one dispatcher script instead (\c CHDKRpc::start), and then sends it short
+ * requests through script messages.  Functions can be compiled on the
+ * camera once with \c CHDKRpc::define and then called by name as often as
+ * needed.
+ *
+ * Requests are a tab separated id, function name and arguments; replies are
+ * the id, "ok" or "err", and the function's result converted to a string.
+ * Arguments arrive in Lua as strings.
+ */
+class CHDKRpc
+{
+private:
+    CHDKCamera * camera;
+    uint32_t script_id;
+    bool running;
+    uint32_t next_id;
+    std::string error;
+
+    // Reused from call to call
+    std::string request;
+    PTPContainer resp;
+    PTPContainer data;
+
+    bool send_request(const PTPDeadline& deadline);
+    bool wait_reply(const uint32_t id, std::string * result, const PTPDeadline& deadline);
+    void append_field(const std::string& field);
+
+    CHDKRpc(const CHDKRpc&);
+    CHDKRpc& operator=(const CHDKRpc&);
+public:
+    static const char * const dispatcher_script;
+
+    CHDKRpc(CHDKCamera * camera);
+    ~CHDKRpc();
+    bool start(const int timeout = 0);
+    bool stop(const int timeout = 0);
+    bool is_running() const;
+    bool define(const std::string& name, const std::string& body, const int timeout = 0);
+    bool call(const std::string& name, const std::vector<std::string>& args, std::string * result, const int timeout = 0);
+    bool exec(const std::string& chunk, std::string * result, const int timeout = 0);
+    std::string get_error() const;
+};
+
+}
+
+#endif /* LIBEASYPTP_CHDKRPC_H_ */
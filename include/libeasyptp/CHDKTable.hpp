@@ -0,0 +1,77 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_CHDKTABLE_H_
+#define LIBEASYPTP_CHDKTABLE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace EasyPTP
+{
+
+class PTPContainer;
+struct CHDKScriptValue;
+
+/**
+ * @class CHDKTable
+ * @brief A table returned by a script, parsed in place
+ *
+ * CHDK sends tables as "key\tvalue\n" lines.  \c CHDKScriptValue::table
+ * splits these into a \c std::map, which costs several allocations an
+ * entry; for directory listings and property dumps of thousands of entries
+ * that is most of the time spent.  \c CHDKTable instead copies the text
+ * into one buffer, turns the separators into NULs, and keeps a flat array
+ * of offsets into it, so keys and values are C strings read straight out
+ * of the buffer.  Once a table has held a message as large, parsing
+ * another allocates nothing.
+ *
+ * Entries keep the order the camera sent them in.
+ */
+class CHDKTable
+{
+private:
+    struct Entry
+    {
+        uint32_t key;
+        uint32_t key_length;
+        uint32_t value;
+        uint32_t value_length;
+    };
+
+    std::vector<char> text;
+    std::vector<Entry> entries;
+public:
+    void parse(const char * data, const size_t length);
+    bool read(const PTPContainer& resp, const PTPContainer& data);
+    void clear();
+    size_t size() const;
+    const char * get_key(const size_t index, uint32_t * length = NULL) const;
+    const char * get_value(const size_t index, uint32_t * length = NULL) const;
+    long find(const char * key) const;
+    bool get_integer(const size_t index, int32_t& out) const;
+    void get_string(const size_t index, std::string& out) const;
+    void get_script_value(const size_t index, CHDKScriptValue& out) const;
+};
+
+}
+
+#endif /* LIBEASYPTP_CHDKTABLE_H_ */
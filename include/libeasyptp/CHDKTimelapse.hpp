@@ -0,0 +1,111 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_CHDKTIMELAPSE_H_
+#define LIBEASYPTP_CHDKTIMELAPSE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "libeasyptp/CHDKCamera.hpp"
+
+namespace EasyPTP
+{
+
+/**
+ * @brief How a timelapse went
+ */
+struct CHDKTimelapseStats
+{
+    uint32_t shots_taken;
+    uint32_t shots_dropped_busy; // The camera was still taking the last shot
+    uint32_t shots_dropped_backlog; // Too many shots were waiting to be downloaded
+    uint32_t shots_dropped_late; // The tick was missed by more than half an interval
+    uint32_t shots_failed; // The camera reported an error instead of a file
+    uint32_t files_downloaded;
+    uint32_t downloads_failed;
+    double mean_lateness_ms; // How long after its tick a shot was started, on average
+    double max_lateness_ms;
+    uint64_t bytes;
+    double seconds;
+
+    CHDKTimelapseStats() : shots_taken(0), shots_dropped_busy(0), shots_dropped_backlog(0), shots_dropped_late(0), shots_failed(0),
+    files_downloaded(0), downloads_failed(0), mean_lateness_ms(0), max_lateness_ms(0), bytes(0), seconds(0)
+    {
+    }
+};
+
+/**
+ * @class CHDKTimelapse
+ * @brief Takes shots on a fixed interval, downloading each while the next is taken
+ *
+ * Shots are started with a non-blocking script, so the camera exposes and
+ * saves shot N+1 while the host downloads shot N.  Ticks are kept against a
+ * steady clock from the start of the run, so lateness never accumulates.
+ *
+ * Starting a shot can't share the session with a download, so a download
+ * only begins when it is expected (from the ones before it) to end before
+ * the next tick, or when the backlog is full.  A tick which finds the
+ * camera still busy, or the backlog full, or which was missed by more than
+ * half an interval, drops its shot rather than letting the schedule slip;
+ * each is counted.
+ */
+class CHDKTimelapse
+{
+private:
+    struct Shot
+    {
+        uint32_t number;
+        std::string remote_filename;
+    };
+
+    CHDKCamera * camera;
+    std::chrono::milliseconds interval;
+    std::string local_pattern;
+    size_t max_backlog;
+
+    std::atomic<bool> stopping;
+    std::deque<Shot> backlog;
+    std::vector<CHDKTransferResult> results;
+    CHDKTimelapseStats stats;
+
+    bool poll_shot(uint32_t script_id, std::string& remote_filename);
+    void download(const Shot& shot, std::chrono::duration<double>& estimate);
+
+    CHDKTimelapse(const CHDKTimelapse&);
+    CHDKTimelapse& operator=(const CHDKTimelapse&);
+public:
+    static const char * const shoot_script;
+
+    CHDKTimelapse(CHDKCamera * camera, const int interval_ms, const std::string local_pattern);
+    void set_max_backlog(const int shots);
+    bool run(const int shots, const int timeout = 0);
+    void stop();
+    CHDKTimelapseStats get_stats() const;
+    std::vector<CHDKTransferResult> get_results() const;
+};
+
+}
+
+#endif /* LIBEASYPTP_CHDKTIMELAPSE_H_ */
@@ -0,0 +1,97 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_CRC32C_H_
+#define LIBEASYPTP_CRC32C_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "libeasyptp/PTPDataSink.hpp"
+
+namespace EasyPTP
+{
+
+/**
+ * @class CRC32C
+ * @brief A CRC-32C (Castagnoli) checksum, computed incrementally
+ *
+ * CRC-32C is the polynomial the SSE4.2 \c crc32 instruction computes, so
+ * where the CPU has it the checksum is taken eight bytes an instruction;
+ * elsewhere it is taken eight bytes a step from tables.  Both give the same
+ * result.
+ */
+class CRC32C
+{
+public:
+    enum Kernel
+    {
+        KERNEL_AUTO = 0, // The fastest one this CPU supports
+        KERNEL_TABLE,
+        KERNEL_SSE42,
+    };
+
+private:
+    uint32_t state;
+    Kernel kernel;
+
+public:
+    CRC32C(const Kernel kernel = KERNEL_AUTO);
+    void update(const void * data, const size_t length);
+    uint32_t get_value() const;
+    void reset();
+
+    static uint32_t compute(const void * data, const size_t length, const Kernel kernel = KERNEL_AUTO);
+    static bool is_supported(const Kernel kernel);
+    static Kernel get_best_kernel();
+};
+
+/**
+ * @class CRC32CSink
+ * @brief Checksums a data phase on its way into another sink
+ *
+ * Chunks arrive in order, so each is added to the checksum as it lands,
+ * while it is still in cache, and a download can be verified without
+ * reading the file back.
+ */
+class CRC32CSink : public IPTPDataSink
+{
+private:
+    IPTPDataSink& sink;
+    CRC32C crc;
+    unsigned char * pending; // Where the last chunk offered by direct_buffer went
+    uint64_t received;
+
+    CRC32CSink(const CRC32CSink&);
+    CRC32CSink& operator=(const CRC32CSink&);
+public:
+    CRC32CSink(IPTPDataSink& sink);
+    uint32_t get_value() const;
+    uint64_t get_size() const;
+    virtual bool begin(const uint64_t total_size);
+    virtual unsigned char * direct_buffer(const uint64_t offset, const uint32_t length);
+    virtual void commit(const uint64_t offset, const uint32_t length);
+    virtual bool write(const uint64_t offset, const unsigned char * data, const uint32_t length);
+    virtual bool end(const bool success);
+};
+
+}
+
+#endif /* LIBEASYPTP_CRC32C_H_ */
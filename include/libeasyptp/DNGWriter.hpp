@@ -0,0 +1,95 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_DNGWRITER_H_
+#define LIBEASYPTP_DNGWRITER_H_
+
+#include <stdint.h>
+#include <string>
+
+#include "libeasyptp/PTPDataSink.hpp"
+
+namespace EasyPTP
+{
+
+class CHDKCamera;
+
+/**
+ * @brief What a DNG records about the camera and the shot
+ *
+ * Rationals are kept as doubles here and converted when written.
+ */
+struct DNGMetadata
+{
+    std::string make;
+    std::string model;
+    std::string unique_model; // Defaults to "make model"
+    std::string software;
+    std::string date_time; // "YYYY:MM:DD HH:MM:SS"; defaults to now
+    uint8_t cfa_pattern[4]; // 0 red, 1 green, 2 blue: top left, top right, bottom left, bottom right
+    uint32_t black_level;
+    uint32_t white_level; // 0 for the largest value of the bit depth
+    double color_matrix[9]; // XYZ to camera space, under D65
+    double as_shot_neutral[3];
+    double exposure_time; // Seconds; 0 to leave out
+    double f_number; // 0 to leave out
+    uint16_t iso; // 0 to leave out
+    uint16_t orientation; // TIFF orientation; 1 is the right way up
+
+    DNGMetadata();
+};
+
+/**
+ * @class DNGWriter
+ * @brief Writes CHDK raw frames out as DNG files
+ *
+ * The file is a single TIFF/EP image directory holding the CFA data in
+ * strips.  Every offset in the file is known before anything is written, so
+ * the header and tags are written first and the strips are then prepared
+ * by a pool of threads, each writing its strips into place with \c pwrite
+ * as soon as they're ready.
+ *
+ * By default the strips keep the camera's bit depth, which only needs the
+ * bytes of each 16-bit word swapping; with \c DNGWriter::set_unpacked they
+ * are unpacked to 16 bits per sample with \c RawData instead.
+ */
+class DNGWriter
+{
+private:
+    static const uint32_t strip_target = 1024 * 1024; // Bytes per strip, roughly
+    static const uint32_t data_alignment = 4096; // Where the first strip starts
+
+    int threads;
+    bool unpacked;
+
+public:
+    static const char * const metadata_script;
+
+    DNGWriter(const int threads = 0);
+    void set_unpacked(const bool unpacked);
+    bool write(const int fd, const uint8_t * packed, const uint32_t packed_size, const int width, const int height, const int bpp, const DNGMetadata& metadata, PTPTransferStats * stats = NULL) const;
+    bool write(const std::string filename, const uint8_t * packed, const uint32_t packed_size, const int width, const int height, const int bpp, const DNGMetadata& metadata, PTPTransferStats * stats = NULL) const;
+
+    static bool get_metadata(CHDKCamera& camera, DNGMetadata& out, const int timeout = 0);
+};
+
+}
+
+#endif /* LIBEASYPTP_DNGWRITER_H_ */
@@ -21,6 +21,8 @@
 #ifndef LIBEASYPTP_IPTPCOMM_H_
 #define LIBEASYPTP_IPTPCOMM_H_
 
+#include <stdint.h>
+
 namespace EasyPTP
 {
 
@@ -63,7 +65,8 @@ public:
      * 
      * _bulk_write handles writing data to the protocol.  The first 
      * parameter is the data that needs to be written, followed by the 
-     * length of that data, and optionally a timeout parameter.  
+     * length of that data, and optionally a timeout parameter (in
+     * milliseconds, 0 meaning no timeout).  
      * 
      * @return true if the data was successfully written, or false
      * if there was a problem
@@ -85,6 +88,23 @@ public:
      * @todo Common exceptions
      */
     virtual bool _bulk_read(unsigned char * data_out, const int size, int * transferred, const int timeout = 0) = 0;
+    /**
+     * @brief Cancel a transaction which is in progress
+     * 
+     * Called when a transaction runs past its deadline.  Implementations
+     * should tell the device to abandon \a transaction_id (for USB, the PTP
+     * Cancel class request) and throw away anything still in flight, so that
+     * the next transaction starts cleanly.  \a timeout is in milliseconds.
+     * 
+     * The default implementation can't cancel anything.
+     * 
+     * @return true if the transaction was cancelled and the connection is
+     * usable again, false otherwise
+     */
+    virtual bool _cancel(const uint32_t transaction_id, const int timeout = 0)
+    {
+        return false;
+    }
 };
 
 }
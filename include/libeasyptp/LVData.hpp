@@ -21,20 +21,26 @@
 #ifndef LIBEASYPTP_LVDATA_H_
 #define LIBEASYPTP_LVDATA_H_
 
+#include <stdint.h>
+#include "libeasyptp/PTPContainer.hpp"
+
 namespace EasyPTP
 {
 #include "libeasyptp/chdk/live_view.h"
 
-class PTPContainer; // Forward delcaration for this is enough
+class CHDKCamera;
 
 class LVData
 {
 private:
     lv_data_header * vp_head;
     lv_framebuffer_desc * fb_desc;
-    uint8_t * payload;
+    PTPContainer container; // Holds the live view payload; reused from frame to frame
     static uint8_t clip(const int v);
     static void yuv_to_rgb(uint8_t **dest, const uint8_t y, const int8_t u, const int8_t v);
+    void parse();
+
+    friend class CHDKCamera; // So frames can be received straight into container
 
 public:
     LVData();
@@ -43,6 +49,8 @@ public:
     void read(const uint8_t * payload, const unsigned int payload_size);
     void read(const PTPContainer& container); // Could this make life easier?
     uint8_t * get_rgb(int * out_size, int * out_width, int * out_height, const bool skip = false) const; // Some cameras don't require skip
+    int get_rgb_size(const bool skip = false) const;
+    void get_rgb(uint8_t * out, const int out_size, int * out_width, int * out_height, const bool skip = false) const;
     float get_lv_version() const;
 };
 
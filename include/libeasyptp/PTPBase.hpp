@@ -22,21 +22,36 @@
 #define LIBEASYPTP_PTPBASE_H_
 
 #include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "libeasyptp/PTPDataSink.hpp"
 
 namespace EasyPTP
 {
 
 class PTPContainer;
+class PTPDeadline;
 class IPTPComm;
+class IPTPDataSource;
 
 class PTPBase
 {
 private:
     IPTPComm * protocol;
-    uint32_t _transaction_id;
+    std::atomic<uint32_t> _transaction_id;
+    std::recursive_mutex _session_mutex;
+    std::vector<unsigned char> _tx_buffer; // Reused for messages too big for the stack
+    std::vector<unsigned char> _rx_buffer; // Reused for streamed chunks a sink can't take directly
 
 protected:
+    static const int cancel_timeout = 1000; // Milliseconds allowed for cancelling a transaction
+    static const uint32_t stream_chunk_size = 1024 * 1024; // Bytes per read when streaming; a multiple of 512
+
     int get_and_increment_transaction_id(); // What a beautiful name for a function
+    std::recursive_mutex& session_mutex();
+    bool abort_transaction(const uint32_t transaction_id);
 
 public:
     PTPBase();
@@ -45,8 +60,15 @@ public:
     void set_protocol(IPTPComm * protocol);
     bool reopen();
     int send_ptp_message(const PTPContainer& cmd, const int timeout = 0);
+    int send_ptp_message(const PTPContainer& cmd, const PTPDeadline& deadline);
     void recv_ptp_message(PTPContainer& out, const int timeout = 0);
+    void recv_ptp_message(PTPContainer& out, const PTPDeadline& deadline);
     void ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const int timeout = 0);
+    void ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const PTPDeadline& deadline);
+    bool recv_ptp_data(IPTPDataSink& sink, PTPContainer& out_resp, const PTPDeadline& deadline, const PTPProgressCallback& progress = PTPProgressCallback());
+    bool ptp_transaction(PTPContainer& cmd, PTPContainer& data, IPTPDataSink& sink, PTPContainer& out_resp, const PTPDeadline& deadline, const PTPProgressCallback& progress = PTPProgressCallback());
+    void send_ptp_data(const PTPContainer& header, IPTPDataSource& source, const PTPDeadline& deadline, const PTPProgressCallback& progress = PTPProgressCallback());
+    void ptp_transaction(PTPContainer& cmd, PTPContainer& header, IPTPDataSource& source, PTPContainer& out_resp, const PTPDeadline& deadline, const PTPProgressCallback& progress = PTPProgressCallback());
 };
 }
 
@@ -21,6 +21,8 @@
 #ifndef LIBEASYPTP_PTPCONTAINER_H_
 #define LIBEASYPTP_PTPCONTAINER_H_
 
+#include <stdint.h>
+
 namespace EasyPTP
 {
 
@@ -28,8 +30,13 @@ class PTPContainer
 {
 private:
     static const uint32_t default_length = sizeof (uint32_t) + sizeof (uint32_t) + sizeof (uint16_t) + sizeof (uint16_t);
+    static const uint32_t inline_capacity = 5 * sizeof (uint32_t); // Enough for any command or response
     uint32_t length;
+    uint32_t capacity;
+    bool has_payload;
     unsigned char * payload; // We'll deal with this completely internally
+    unsigned char inline_payload[inline_capacity]; // payload points here until it outgrows it
+    void reserve(const uint32_t size, const bool preserve);
 public:
 
     enum CONTAINER_TYPE
@@ -46,11 +53,18 @@ public:
     PTPContainer();
     PTPContainer(const uint16_t type, const uint16_t op_code);
     PTPContainer(const unsigned char * data);
+    PTPContainer(const PTPContainer& other);
     ~PTPContainer();
+    PTPContainer& operator=(const PTPContainer& other);
+    void reset(const uint16_t type, const uint16_t op_code);
+    void swap(PTPContainer& other);
     void add_param(const uint32_t param);
     void set_payload(const void * payload, const int payload_length);
+    unsigned char * resize_payload(const uint32_t payload_length);
     unsigned char * pack() const;
+    void pack_into(unsigned char * out) const;
     unsigned char * get_payload(int * size_out) const; // This might end up being useful...
+    const unsigned char * get_payload_ptr(int * size_out) const;
     uint32_t get_length() const; // So we can get, but not set
     void unpack(const unsigned char * data);
     uint32_t get_param_n(const uint32_t n) const;
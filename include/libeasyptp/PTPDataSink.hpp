@@ -0,0 +1,208 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ *
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_PTPDATASINK_H_
+#define LIBEASYPTP_PTPDATASINK_H_
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+
+namespace EasyPTP
+{
+
+/**
+ * Called as a transfer makes progress, with the number of bytes moved so far
+ * and the total size of the transfer.
+ */
+typedef std::function<void(uint64_t done, uint64_t total)> PTPProgressCallback;
+
+/**
+ * @brief How long a transfer took
+ */
+struct PTPTransferStats
+{
+    uint64_t bytes;
+    double seconds;
+
+    PTPTransferStats() : bytes(0), seconds(0)
+    {
+    }
+
+    /**
+     * @brief Throughput of the transfer, in megabytes (10^6 bytes) per second
+     */
+    double mb_per_s() const
+    {
+        return (this->seconds > 0) ? (this->bytes / 1e6) / this->seconds : 0;
+    }
+};
+
+/**
+ * @class IPTPDataSink
+ * @brief Somewhere for the data phase of a transaction to go as it arrives
+ *
+ * \c PTPBase hands a sink the data phase in chunks, in order, instead of
+ * collecting the whole thing in a \c PTPContainer first.  A sink which can
+ * offer memory for a chunk through \c IPTPDataSink::direct_buffer has the
+ * data read from USB straight into it; otherwise the chunk is read into a
+ * reused buffer and passed to \c IPTPDataSink::write.
+ */
+class IPTPDataSink
+{
+public:
+
+    virtual ~IPTPDataSink()
+    {
+    }
+    /**
+     * @brief Called once, before any data, with the size of the data phase
+     *
+     * @return false to refuse the data
+     */
+    virtual bool begin(const uint64_t total_size) = 0;
+    /**
+     * @brief Offer memory for the chunk at \a offset to be read into
+     *
+     * If this returns non-NULL, \a length bytes are read straight into it
+     * and \c IPTPDataSink::commit is called instead of \c IPTPDataSink::write.
+     *
+     * @return Memory for at least \a length bytes, or NULL
+     */
+    virtual unsigned char * direct_buffer(const uint64_t offset, const uint32_t length)
+    {
+        return NULL;
+    }
+    /**
+     * @brief A chunk read through \c IPTPDataSink::direct_buffer has arrived
+     */
+    virtual void commit(const uint64_t offset, const uint32_t length)
+    {
+    }
+    /**
+     * @brief Take a copy of the chunk at \a offset
+     *
+     * @return false to abandon the transfer
+     */
+    virtual bool write(const uint64_t offset, const unsigned char * data, const uint32_t length) = 0;
+    /**
+     * @brief Called once the data phase is over, or has failed
+     *
+     * @return false if the data could not be kept
+     */
+    virtual bool end(const bool success) = 0;
+};
+
+/**
+ * @class PTPFileSink
+ * @brief Writes a data phase into a local file through a shared mapping
+ *
+ * The file is created at its final size when the transfer begins and mapped
+ * into memory, so data is read from USB straight into the page cache and is
+ * never held on the heap.
+ */
+class PTPFileSink : public IPTPDataSink
+{
+private:
+    std::string filename;
+    int fd;
+    unsigned char * map;
+    uint64_t size;
+
+    PTPFileSink(const PTPFileSink&);
+    PTPFileSink& operator=(const PTPFileSink&);
+public:
+    PTPFileSink(const std::string filename);
+    ~PTPFileSink();
+    virtual bool begin(const uint64_t total_size);
+    virtual unsigned char * direct_buffer(const uint64_t offset, const uint32_t length);
+    virtual bool write(const uint64_t offset, const unsigned char * data, const uint32_t length);
+    virtual bool end(const bool success);
+};
+
+class PTPUring;
+
+/**
+ * @class PTPUringFileSink
+ * @brief Writes a data phase into a local file through io_uring
+ *
+ * Data is read from USB straight into a small set of aligned staging
+ * buffers.  Each full buffer is queued as one write through a \c PTPUring
+ * while the next fills, so the disk is written in large, aligned pieces and
+ * the thread receiving from USB never waits on it unless every buffer is
+ * still being written.  The file can optionally be opened with \c O_DIRECT,
+ * to keep the page cache out of bulk offloads, and preallocated at its full
+ * size.  Where io_uring isn't available, buffers are written with
+ * \c pwrite instead.
+ *
+ * One sink can be reused for many files (see
+ * \c PTPUringFileSink::set_filename), keeping its ring and buffers.
+ */
+class PTPUringFileSink : public IPTPDataSink
+{
+private:
+    static const uint32_t buffer_size = 4 * 1024 * 1024; // Bytes per write to disk
+    static const uint32_t overflow_size = 1024 * 1024; // Room past a full buffer, so chunks are never split
+    static const uint32_t alignment = 4096; // For O_DIRECT
+    static const int buffer_count = 4;
+
+    struct Buffer
+    {
+        unsigned char * data;
+        bool busy; // Queued for writing
+        uint64_t offset;
+        uint32_t length;
+    };
+
+    std::string filename;
+    bool direct_io;
+    bool preallocate;
+    PTPUring * ring;
+    Buffer buffers[buffer_count];
+
+    int fd;
+    bool opened_direct;
+    bool failed;
+    uint64_t size;
+    uint64_t base; // File offset of the current buffer
+    uint32_t fill; // Bytes in the current buffer
+    int current;
+
+    bool submit(const int index, const uint32_t length);
+    bool reap();
+    void flush_full();
+
+    PTPUringFileSink(const PTPUringFileSink&);
+    PTPUringFileSink& operator=(const PTPUringFileSink&);
+public:
+    PTPUringFileSink(const std::string filename, const bool direct_io = false, const bool preallocate = true);
+    ~PTPUringFileSink();
+    void set_filename(const std::string filename);
+    bool is_uring() const;
+    virtual bool begin(const uint64_t total_size);
+    virtual unsigned char * direct_buffer(const uint64_t offset, const uint32_t length);
+    virtual void commit(const uint64_t offset, const uint32_t length);
+    virtual bool write(const uint64_t offset, const unsigned char * data, const uint32_t length);
+    virtual bool end(const bool success);
+};
+
+}
+
+#endif /* LIBEASYPTP_PTPDATASINK_H_ */
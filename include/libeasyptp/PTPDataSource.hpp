@@ -0,0 +1,115 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ *
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_PTPDATASOURCE_H_
+#define LIBEASYPTP_PTPDATASOURCE_H_
+
+#include <stdint.h>
+#include <string>
+
+namespace EasyPTP
+{
+
+/**
+ * @class IPTPDataSource
+ * @brief Where the data phase of a transaction comes from, a chunk at a time
+ *
+ * The counterpart of \c IPTPDataSink.  \c PTPBase asks a source for its data
+ * in order as it sends it, instead of packing the whole thing into a
+ * \c PTPContainer first.  A source which already has its data in memory can
+ * offer it through \c IPTPDataSource::direct_data, and it is written to USB
+ * from there; otherwise \c IPTPDataSource::read fills a reused buffer.
+ */
+class IPTPDataSource
+{
+public:
+
+    virtual ~IPTPDataSource()
+    {
+    }
+    /**
+     * @brief The number of bytes this source will provide
+     */
+    virtual uint64_t get_size() = 0;
+    /**
+     * @brief Offer the \a length bytes at \a offset where they already are
+     *
+     * @return A pointer to the data, or NULL to have it copied with
+     *         \c IPTPDataSource::read
+     */
+    virtual const unsigned char * direct_data(const uint64_t offset, const uint32_t length)
+    {
+        return NULL;
+    }
+    /**
+     * @brief Copy the \a length bytes at \a offset into \a out
+     *
+     * @return false to abandon the transfer
+     */
+    virtual bool read(const uint64_t offset, unsigned char * out, const uint32_t length) = 0;
+};
+
+/**
+ * @class PTPFileSource
+ * @brief Provides the contents of a local file
+ *
+ * The file is memory-mapped when possible, so chunks are written to USB
+ * straight from the page cache.  Files which can't be mapped are read with
+ * \c pread instead.
+ */
+class PTPFileSource : public IPTPDataSource
+{
+private:
+    int fd;
+    const unsigned char * map;
+    uint64_t size;
+
+    PTPFileSource(const PTPFileSource&);
+    PTPFileSource& operator=(const PTPFileSource&);
+public:
+    PTPFileSource(const std::string filename);
+    ~PTPFileSource();
+    bool is_open() const;
+    virtual uint64_t get_size();
+    virtual const unsigned char * direct_data(const uint64_t offset, const uint32_t length);
+    virtual bool read(const uint64_t offset, unsigned char * out, const uint32_t length);
+};
+
+/**
+ * @class PTPMemorySource
+ * @brief Provides bytes which are already in memory
+ *
+ * The memory is not copied, and has to outlive the source.
+ */
+class PTPMemorySource : public IPTPDataSource
+{
+private:
+    const unsigned char * data;
+    uint64_t size;
+public:
+    PTPMemorySource(const void * data, const uint64_t size);
+    virtual uint64_t get_size();
+    virtual const unsigned char * direct_data(const uint64_t offset, const uint32_t length);
+    virtual bool read(const uint64_t offset, unsigned char * out, const uint32_t length);
+};
+
+}
+
+#endif /* LIBEASYPTP_PTPDATASOURCE_H_ */
@@ -0,0 +1,53 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ *
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_PTPDEADLINE_H_
+#define LIBEASYPTP_PTPDEADLINE_H_
+
+#include <chrono>
+
+namespace EasyPTP
+{
+
+/**
+ * @class PTPDeadline
+ * @brief A point in time by which an operation has to be finished
+ *
+ * Transactions take one deadline and pass it down to every USB read and
+ * write they make, so the time limit applies to the transaction as a whole
+ * rather than to each transfer separately.
+ */
+class PTPDeadline
+{
+private:
+    std::chrono::steady_clock::time_point when;
+    bool infinite;
+public:
+    PTPDeadline();
+    PTPDeadline(const std::chrono::steady_clock::time_point when);
+    static PTPDeadline from_timeout(const int timeout);
+    bool is_infinite() const;
+    bool expired() const;
+    int remaining_ms() const;
+};
+
+}
+
+#endif /* LIBEASYPTP_PTPDEADLINE_H_ */
@@ -42,6 +42,21 @@ enum LIBPTP_PP_ERRORS
     ERR_PTPCONTAINER_INVALID_PARAM,
 
     ERR_LVDATA_NOT_ENOUGH_DATA,
+
+    ERR_RAWDATA_NOT_ENOUGH_DATA,
+    ERR_RAWDATA_INVALID_BPP,
+
+    ERR_DNGWRITER_INVALID_WIDTH,
+
+    ERR_PTPWORKER_DEADLINE_MISSED,
+    ERR_PTPWORKER_STOPPED,
+
+    ERR_DATASINK_FAILED,
+    ERR_DATASOURCE_FAILED,
+
+    ERR_CHDK_TOO_MANY_ARGUMENTS,
+
+    ERR_CLOCKSYNC_NOT_SYNCHRONIZED,
 };
 }
 
@@ -0,0 +1,93 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ *
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_PTPTRACE_H_
+#define LIBEASYPTP_PTPTRACE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <ostream>
+
+namespace EasyPTP
+{
+
+/**
+ * @class PTPTrace
+ * @brief Records where the time in a transaction goes
+ *
+ * The library wraps transactions, USB reads and writes, YUV conversion and
+ * the \c CHDKCamera calls in \c PTPTrace::Span objects.  While tracing is
+ * enabled, every span is recorded into a fixed-size ring buffer belonging to
+ * the thread it ran on, so recording never takes a lock.  While it is
+ * disabled, a span costs one relaxed atomic load.
+ *
+ * \c PTPTrace::export_chrome_json writes the recorded spans in the Chrome
+ * trace-event format, which can be opened in Perfetto or chrome://tracing.
+ */
+class PTPTrace
+{
+private:
+    static std::atomic<bool> enabled;
+    static uint64_t now_ns();
+    static void record(const char * name, const uint64_t start_ns, const uint64_t end_ns);
+public:
+    static const int buffer_size = 16384; // Spans kept per thread
+
+    static void enable(const bool on);
+    static bool is_enabled();
+    static void clear();
+    static void export_chrome_json(std::ostream& out);
+
+    /**
+     * @brief A scoped trace span
+     *
+     * Records \a name from construction to destruction.  \a name must be a
+     * string literal, or otherwise outlive the trace.
+     */
+    class Span
+    {
+    private:
+        const char * name;
+        uint64_t start_ns;
+        Span(const Span&);
+        Span& operator=(const Span&);
+    public:
+        Span(const char * name) : name(NULL), start_ns(0)
+        {
+            if (PTPTrace::enabled.load(std::memory_order_relaxed))
+            {
+                this->name = name;
+                this->start_ns = PTPTrace::now_ns();
+            }
+        }
+
+        ~Span()
+        {
+            if (this->name != NULL)
+            {
+                PTPTrace::record(this->name, this->start_ns, PTPTrace::now_ns());
+            }
+        }
+    };
+};
+
+}
+
+#endif /* LIBEASYPTP_PTPTRACE_H_ */
@@ -48,6 +48,12 @@ private:
 
 	static const int INTERFACE_CLASS_PTP = 6;
 
+	// Still Image Capture Device class requests, used to cancel transactions
+	static const uint8_t REQUEST_CANCEL = 0x64;
+	static const uint8_t REQUEST_GET_DEVICE_STATUS = 0x67;
+	static const uint16_t CANCEL_CODE = 0x4001;
+	static const uint16_t RESPONSE_OK = 0x2001;
+
     bool isPTPDevice(libusb_device *device);
     bool isPTPInterface(struct libusb_interface interface);
     void getPTPInterface(libusb_device *dev, struct libusb_interface_descriptor & intf, libusb_device_handle *& handle);
@@ -73,6 +79,7 @@ public:
     void connect_to_serial_no(std::string serial);
     virtual bool _bulk_write(const unsigned char * bytestr, const int length, const int timeout);
     virtual bool _bulk_read(unsigned char * data_out, const int size, int * transferred, const int timeout);
+    virtual bool _cancel(const uint32_t transaction_id, const int timeout);
     virtual bool is_open();
     void close();
 };
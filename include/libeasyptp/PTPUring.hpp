@@ -0,0 +1,79 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ *
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_PTPURING_H_
+#define LIBEASYPTP_PTPURING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace EasyPTP
+{
+
+/**
+ * @class PTPUring
+ * @brief A minimal io_uring, for queueing file writes
+ *
+ * Talks to the kernel through the raw system calls, so there is no
+ * dependency on liburing.  Only writes are supported.  A \c PTPUring is not
+ * thread safe; give each thread its own.
+ */
+class PTPUring
+{
+private:
+    int ring_fd;
+    unsigned pending; // Submitted, but not yet reaped
+
+    void * sq_ptr;
+    size_t sq_size;
+    void * cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe * sqes;
+    size_t sqes_size;
+
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_entries;
+    unsigned * sq_array;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    struct io_uring_cqe * cqes;
+
+    void teardown();
+
+    PTPUring(const PTPUring&);
+    PTPUring& operator=(const PTPUring&);
+public:
+    PTPUring(const unsigned entries);
+    ~PTPUring();
+    bool is_open() const;
+    unsigned get_pending() const;
+    bool write(const int fd, const void * data, const uint32_t length, const uint64_t offset, const uint64_t user_data);
+    bool wait(uint64_t * user_data, int32_t * result);
+};
+
+}
+
+#endif /* LIBEASYPTP_PTPURING_H_ */
@@ -0,0 +1,180 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ *
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_PTPWORKER_H_
+#define LIBEASYPTP_PTPWORKER_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+namespace EasyPTP
+{
+
+class PTPBase;
+class PTPContainer;
+
+/**
+ * @class PTPWorker
+ * @brief Runs transactions for one camera on a dedicated thread
+ *
+ * A \c PTPWorker owns the camera session while it is alive.  Any thread can
+ * hand it work through \c PTPWorker::submit (which returns a \c std::future)
+ * or \c PTPWorker::post (which calls back on completion).  Work is queued on
+ * lock-free multiple-producer, single-consumer queues, so producers never
+ * block on each other or on the transaction currently on the wire.
+ *
+ * Each piece of work has a priority class and, optionally, a deadline.  At
+ * every transaction boundary the worker takes the oldest job of the most
+ * urgent class, so a shutter command never waits behind more than the one
+ * live view frame already on the wire.  Jobs whose deadline has passed by
+ * the time they reach the front are dropped without being sent, and fail
+ * with \c ERR_PTPWORKER_DEADLINE_MISSED.  Jobs which are still queued once
+ * the worker has stopped fail with \c ERR_PTPWORKER_STOPPED.
+ *
+ * The worker does not stop other threads from calling the camera directly;
+ * \c PTPBase serializes those calls with its session lock.
+ */
+class PTPWorker
+{
+public:
+    typedef std::function<void(void)> Job;
+    typedef std::function<void(std::exception_ptr)> Callback;
+    typedef std::chrono::steady_clock Clock;
+
+    enum PRIORITY
+    {
+        PRIORITY_CRITICAL = 0, // Shutter, script and other time-critical commands
+        PRIORITY_NORMAL,
+        PRIORITY_BACKGROUND, // Live view, downloads, status polls
+        PRIORITY_COUNT
+    };
+
+    PTPWorker(PTPBase * camera);
+    ~PTPWorker();
+    void post(Job job, Callback on_complete = Callback(), const PRIORITY priority = PRIORITY_NORMAL, const Clock::time_point deadline = Clock::time_point::max());
+    template<typename F>
+    std::future<typename std::result_of<F()>::type> submit(F f, const PRIORITY priority = PRIORITY_NORMAL, const Clock::time_point deadline = Clock::time_point::max());
+    std::future<void> ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const int timeout = 0, const PRIORITY priority = PRIORITY_NORMAL, const Clock::time_point deadline = Clock::time_point::max());
+    uint64_t get_dropped_count() const;
+    void stop();
+
+private:
+    struct Node
+    {
+        std::atomic<Node *> next;
+        Job job;
+        Callback on_complete;
+        Clock::time_point deadline;
+    };
+
+    // An intrusive MPSC queue. Any thread may push, only the worker pops.
+    class Queue
+    {
+    private:
+        std::atomic<Node *> head; // Producers push here
+        Node * tail; // Only touched by the worker thread
+        Node stub;
+    public:
+        Queue();
+        void push(Node * node);
+        Node * pop();
+        bool empty() const;
+    };
+
+    PTPBase * camera;
+    Queue queues[PRIORITY_COUNT];
+    std::atomic<bool> waiting;
+    std::atomic<bool> stopping;
+    std::atomic<bool> stopped;
+    std::atomic<uint64_t> dropped;
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    std::mutex cancel_mutex; // Stands in for the worker thread once it has exited
+    std::thread thread;
+
+    PTPWorker(const PTPWorker&); // Not copyable
+    PTPWorker& operator=(const PTPWorker&);
+
+    Node * pop();
+    bool empty() const;
+    void run();
+    void cancel_queued();
+
+    template<typename R>
+    struct Result
+    {
+        template<typename F>
+        static void run(std::promise<R>& promise, F& f)
+        {
+            promise.set_value(f());
+        }
+    };
+};
+
+template<>
+struct PTPWorker::Result<void>
+{
+    template<typename F>
+    static void run(std::promise<void>& promise, F& f)
+    {
+        f();
+        promise.set_value();
+    }
+};
+
+/**
+ * @brief Queue \a f to run on the worker thread
+ *
+ * \a f is any callable taking no arguments.  Its return value, or anything it
+ * throws, is delivered through the returned future.  If \a deadline passes
+ * before \a f gets to run, it is dropped and the future holds
+ * \c ERR_PTPWORKER_DEADLINE_MISSED instead.
+ *
+ * @param[in] f The work to do on the camera.
+ * @param[in] priority (optional) The priority class of \a f.
+ * @param[in] deadline (optional) The latest time \a f may be started.
+ * @return A future for the result of \a f.
+ */
+template<typename F>
+std::future<typename std::result_of<F()>::type> PTPWorker::submit(F f, const PRIORITY priority, const Clock::time_point deadline)
+{
+    typedef typename std::result_of<F()>::type R;
+
+    std::shared_ptr<std::promise<R> > promise = std::make_shared<std::promise<R> >();
+    std::future<R> out = promise->get_future();
+    this->post([promise, f]() mutable { Result<R>::run(*promise, f); },
+               [promise](std::exception_ptr error) { if (error) promise->set_exception(error); },
+               priority, deadline);
+
+    return out;
+}
+
+}
+
+#endif /* LIBEASYPTP_PTPWORKER_H_ */
@@ -0,0 +1,72 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_RAWDATA_H_
+#define LIBEASYPTP_RAWDATA_H_
+
+#include <stdint.h>
+#include <vector>
+
+namespace EasyPTP
+{
+
+/**
+ * @class RawData
+ * @brief Unpacks CHDK's bit-packed raw sensor data to 16 bits per pixel
+ *
+ * CHDK stores raw frames as 10, 12 or 14-bit pixels packed end to end,
+ * most significant bit first, into little-endian 16-bit words.  Unpacking
+ * is done with AVX2 or SSE4.1 kernels where the CPU has them, picked at
+ * runtime, and plain C++ otherwise; all of them give the same result.
+ */
+class RawData
+{
+public:
+    enum Kernel
+    {
+        KERNEL_AUTO = 0, // The fastest one this CPU supports
+        KERNEL_SCALAR,
+        KERNEL_SSE41,
+        KERNEL_AVX2,
+    };
+
+private:
+    int width;
+    int height;
+    int bpp;
+    std::vector<uint16_t> pixels; // Kept between frames
+
+public:
+    RawData();
+    void read(const uint8_t * packed, const uint32_t packed_size, const int width, const int height, const int bpp, const uint16_t black_level = 0);
+    const uint16_t * get_pixels() const;
+    int get_width() const;
+    int get_height() const;
+    int get_bpp() const;
+
+    static uint32_t get_packed_size(const uint32_t count, const int bpp);
+    static bool is_supported(const Kernel kernel);
+    static Kernel get_best_kernel();
+    static void unpack(const uint8_t * packed, const uint32_t packed_size, uint16_t * out, const uint32_t count, const int bpp, const uint16_t black_level = 0, const Kernel kernel = KERNEL_AUTO);
+};
+
+}
+
+#endif /* LIBEASYPTP_RAWDATA_H_ */
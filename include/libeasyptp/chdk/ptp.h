@@ -11,7 +11,7 @@
 // Do not add platform dependent stuff in here (#ifdef/#endif compile options or camera dependent values)
 
 #define PTP_CHDK_VERSION_MAJOR 2  // increase only with backwards incompatible changes (and reset minor)
-#define PTP_CHDK_VERSION_MINOR 4  // increase with extensions of functionality
+#define PTP_CHDK_VERSION_MINOR 5  // increase with extensions of functionality
 
 /*
 protocol version history
@@ -23,6 +23,7 @@ protocol version history
 2.2 - live view (work in progress)
 2.3 - live view - released in 1.1
 2.4 - live view protocol 2.1
+2.5 - remote capture
 */
 
 #define PTP_OC_CHDK 0x9999
@@ -78,6 +79,19 @@ enum ptp_chdk_command {
                             //  return data is protocol information, frame buffer descriptions and selected display data
                             //  Currently a data phase is always returned. Future versions may define other behavior 
                             //  for values in currently unused parameters.
+  PTP_CHDK_RemoteCaptureIsReady, // Check if data is available
+                            // return param1 is status
+                            //   0 = not ready
+                            //   0x10000000 = remote capture not initialized
+                            //   otherwise bitmask of PTP_CHDK_CAPTURE_* datatypes
+                            // return param2 is image number
+  PTP_CHDK_RemoteCaptureGetData, // retrieve data
+                            // param2 is bit indicating data type to get
+                            // return param1 is length
+                            // return param2 more chunks available?
+                            //   0 = no more chunks of selected format
+                            // return param3 seek required to pos (-1 = no seek)
+                            // return data is the chunk
 };
 
 // data types as used by ReadScriptMessage
@@ -99,6 +113,12 @@ enum ptp_chdk_script_data_type {
                                    // without DOWNLOAD this means no uploading,
                                    // just clear
 
+// Remote capture data types
+#define PTP_CHDK_CAPTURE_JPG    0x1
+#define PTP_CHDK_CAPTURE_RAW    0x2
+#define PTP_CHDK_CAPTURE_DNGHDR 0x4 // Header for a DNG, which the RAW data follows
+#define PTP_CHDK_CAPTURE_NOTSET 0x10000000 // Remote capture not initialized
+
 // Script Languages - for execution only lua is supported for now
 #define PTP_CHDK_SL_LUA    0
 #define PTP_CHDK_SL_UBASIC 1
@@ -28,26 +28,429 @@
  * functions that make communicating with CHDK simple.
  */
 
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
-// Needed for usleep() in script wait
+#include <set>
+#include <string>
+#include <thread>
 #include <unistd.h>
 #include <stdint.h>
-#include <sys/time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "libeasyptp/PTPErrors.hpp"
 #include "libeasyptp/CHDKCamera.hpp"
+#include "libeasyptp/CHDKTable.hpp"
+#include "libeasyptp/CRC32C.hpp"
 #include "libeasyptp/PTPContainer.hpp"
 #include "libeasyptp/LVData.hpp"
+#include "libeasyptp/PTPTrace.hpp"
+#include "libeasyptp/PTPDeadline.hpp"
+#include "libeasyptp/PTPDataSink.hpp"
+#include "libeasyptp/PTPDataSource.hpp"
 #include "libeasyptp/chdk/ptp.h"
+#include "PTPFileIO.hpp"
 
 namespace EasyPTP
 {
 
+namespace
+{
+
+/**
+ * A file read into memory for uploading.
+ */
+struct ReadAhead
+{
+    bool ok; // The file could be read
+    bool streamed; // Too big to read ahead; stream it from disk when its turn comes
+    std::vector<unsigned char> contents; // Reused from file to file
+};
+
+void load_file(const std::string& filename, ReadAhead& out, const uint64_t limit)
+{
+    out.ok = false;
+    out.streamed = false;
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        ::close(fd);
+        return;
+    }
+
+    if ((uint64_t) st.st_size > limit)
+    {
+        ::close(fd);
+        out.ok = true;
+        out.streamed = true;
+        return;
+    }
+
+    out.contents.resize(st.st_size);
+    size_t done = 0;
+    while (done < out.contents.size())
+    {
+        ssize_t got = ::read(fd, out.contents.data() + done, out.contents.size() - done);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            break;
+        }
+        done += got;
+    }
+    ::close(fd);
+
+    out.ok = (done == out.contents.size());
+}
+
+/**
+ * Receives a GetMemory data phase into the caller's buffer, dropping the
+ * first \a skip bytes (see \c CHDKCamera::read_memory for why).
+ */
+class MemorySink : public IPTPDataSink
+{
+private:
+    unsigned char * out;
+    uint32_t size;
+    uint32_t skip;
+public:
+    uint64_t received;
+
+    MemorySink(unsigned char * out, const uint32_t size, const uint32_t skip) :
+    out(out), size(size), skip(skip), received(0)
+    {
+    }
+
+    virtual bool begin(const uint64_t total_size)
+    {
+        return total_size == (uint64_t) this->size + this->skip;
+    }
+
+    virtual unsigned char * direct_buffer(const uint64_t offset, const uint32_t length)
+    {
+        return (offset >= this->skip) ? this->out + offset - this->skip : NULL;
+    }
+
+    virtual void commit(const uint64_t offset, const uint32_t length)
+    {
+        this->received = offset + length;
+    }
+
+    virtual bool write(const uint64_t offset, const unsigned char * data, const uint32_t length)
+    {
+        uint64_t from = offset;
+        if (from < this->skip)
+        {
+            uint32_t dropped = (this->skip - from < length) ? this->skip - from : length;
+            data += dropped;
+            from += dropped;
+        }
+        std::memcpy(this->out + from - this->skip, data, offset + length - from);
+        this->received = offset + length;
+        return true;
+    }
+
+    virtual bool end(const bool success)
+    {
+        return success;
+    }
+};
+
+/**
+ * Receives a remote capture chunk into a buffer which is kept between
+ * chunks.  Where a chunk goes is only known from the response which
+ * follows it, so it can't be written out as it arrives.
+ */
+class ChunkSink : public IPTPDataSink
+{
+private:
+    std::vector<unsigned char>& buffer;
+public:
+    ChunkSink(std::vector<unsigned char>& buffer) : buffer(buffer)
+    {
+    }
+
+    virtual bool begin(const uint64_t total_size)
+    {
+        this->buffer.resize(total_size);
+        return true;
+    }
+
+    virtual unsigned char * direct_buffer(const uint64_t offset, const uint32_t length)
+    {
+        return this->buffer.data() + offset;
+    }
+
+    virtual bool write(const uint64_t offset, const unsigned char * data, const uint32_t length)
+    {
+        std::memcpy(this->buffer.data() + offset, data, length);
+        return true;
+    }
+
+    virtual bool end(const bool success)
+    {
+        return success;
+    }
+};
+
+/**
+ * Writes each remote capture chunk to its place in a file.  The file is
+ * created when the shot begins, and closed when it ends or the sink goes;
+ * \c discard also removes it.
+ */
+class CaptureFileSink : public IPTPDataSink
+{
+private:
+    std::string filename;
+    int fd;
+    bool created;
+
+    CaptureFileSink(const CaptureFileSink&);
+    CaptureFileSink& operator=(const CaptureFileSink&);
+public:
+    CaptureFileSink(const std::string& filename) : filename(filename), fd(-1), created(false)
+    {
+    }
+
+    ~CaptureFileSink()
+    {
+        this->end(false);
+    }
+
+    virtual bool begin(const uint64_t total_size)
+    {
+        this->fd = ::open(this->filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        this->created = (this->fd >= 0);
+        return this->created;
+    }
+
+    virtual bool write(const uint64_t offset, const unsigned char * data, const uint32_t length)
+    {
+        return pwrite_all(this->fd, data, length, offset);
+    }
+
+    virtual bool end(const bool success)
+    {
+        bool ok = success;
+        if (this->fd >= 0)
+        {
+            ok = (::close(this->fd) == 0) && ok;
+            this->fd = -1;
+        }
+        return ok;
+    }
+
+    // Close and remove the file, if it was created
+    void discard()
+    {
+        this->end(false);
+        if (this->created)
+        {
+            unlink(this->filename.c_str());
+            this->created = false;
+        }
+    }
+};
+
+/**
+ * What the sync index remembers of a file: enough to tell that it changed.
+ */
+struct SyncEntry
+{
+    uint64_t size;
+    uint64_t mtime;
+};
+
+/**
+ * \a text as a Lua string literal.
+ */
+std::string lua_string(const std::string& text)
+{
+    std::string out = "'";
+    for (size_t i = 0; i < text.length(); i++)
+    {
+        switch (text[i])
+        {
+        case '\\': out += "\\\\"; break;
+        case '\'': out += "\\'"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\0': out += "\\0"; break;
+        default: out += text[i]; break;
+        }
+    }
+    return out + "'";
+}
+
+/**
+ * Create the directories \a path is in, as needed.
+ */
+void make_parent_directories(const std::string& path)
+{
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+    {
+        mkdir(path.substr(0, slash).c_str(), 0755); // Most will be there already
+    }
+}
+
+/**
+ * Whether \a name, as the camera listed it, stays inside the directory it
+ * is joined to: not empty, not absolute, and with no ".." component.
+ */
+bool is_contained_path(const std::string& name)
+{
+    if (name.empty() || name[0] == '/')
+    {
+        return false;
+    }
+    for (size_t start = 0; start <= name.size();)
+    {
+        size_t slash = name.find('/', start);
+        if (slash == std::string::npos)
+        {
+            slash = name.size();
+        }
+        if (name.compare(start, slash - start, "..") == 0)
+        {
+            return false;
+        }
+        start = slash + 1;
+    }
+    return true;
+}
+
+/**
+ * Read an index of "path\tsize\tmtime" lines.  A missing index is an empty one.
+ */
+void load_sync_index(const std::string& filename, std::map<std::string, SyncEntry>& out)
+{
+    std::ifstream in(filename.c_str());
+    std::string line;
+    while (std::getline(in, line))
+    {
+        size_t tab = line.find('\t');
+        if (tab == std::string::npos || tab == 0)
+        {
+            continue;
+        }
+        char * end = NULL;
+        SyncEntry entry;
+        entry.size = std::strtoull(line.c_str() + tab + 1, &end, 10);
+        if (*end != '\t')
+        {
+            continue;
+        }
+        entry.mtime = std::strtoull(end + 1, NULL, 10);
+        out[line.substr(0, tab)] = entry;
+    }
+}
+
+/**
+ * Write the index to a temporary file and rename it into place, so an
+ * interrupted sync leaves the old index rather than half a new one.
+ */
+bool save_sync_index(const std::string& filename, const std::map<std::string, SyncEntry>& index)
+{
+    const std::string temporary = filename + ".tmp";
+    {
+        std::ofstream out(temporary.c_str(), std::ios::trunc);
+        for (std::map<std::string, SyncEntry>::const_iterator it = index.begin(); it != index.end(); ++it)
+        {
+            out << it->first << '\t' << it->second.size << '\t' << it->second.mtime << '\n';
+        }
+        if (!out.flush())
+        {
+            return false;
+        }
+    }
+    return std::rename(temporary.c_str(), filename.c_str()) == 0;
+}
+
+}
+
+/**
+ * The response and data of a coalesced transaction, shared by every caller
+ * which asked for it while it was on the wire.
+ */
+struct CHDKCamera::CoalescedResult
+{
+    PTPContainer resp;
+    PTPContainer data;
+};
+
+const char * const CHDKCamera::sync_index_name = ".chdk-sync-index";
+
+/**
+ * Lists every file under the directory \c root as a table of
+ * "path\tsize,mtime" lines, with paths relative to \c root.  Building the
+ * lines is left to CHDK, which does it in C.
+ */
+const char * const CHDKCamera::sync_manifest_script =
+    "local files = {}\n"
+    "local function walk(dir, prefix)\n"
+    "  local names = os.listdir(dir)\n"
+    "  if not names then return end\n"
+    "  for _, name in ipairs(names) do\n"
+    "    local st = os.stat(dir .. '/' .. name)\n"
+    "    if st and st.is_dir then\n"
+    "      walk(dir .. '/' .. name, prefix .. name .. '/')\n"
+    "    elseif st then\n"
+    "      files[prefix .. name] = st.size .. ',' .. st.mtime\n"
+    "    end\n"
+    "  end\n"
+    "end\n"
+    "walk(root, '')\n"
+    "return files\n";
+
+/**
+ * CRC-32C of the file \c path, a byte at a time from a table, as
+ * \c CRC32C computes it.  CHDK's Lua numbers are 32-bit integers, so the
+ * polynomial and all ones are written as the negative numbers they wrap
+ * to, and shifts must be logical (\c bitshru).  Returns a table of
+ * \c crc and \c size, or false if the file can't be opened.
+ */
+const char * const CHDKCamera::crc32c_script =
+    "local t = {}\n"
+    "for i = 0, 255 do\n"
+    "  local c = i\n"
+    "  for _ = 1, 8 do\n"
+    "    if bitand(c, 1) ~= 0 then c = bitxor(bitshru(c, 1), -2097792136) else c = bitshru(c, 1) end\n"
+    "  end\n"
+    "  t[i] = c\n"
+    "end\n"
+    "local f = io.open(path, 'rb')\n"
+    "if not f then return false end\n"
+    "local crc, size, byte = -1, 0, string.byte\n"
+    "while true do\n"
+    "  local block = f:read(16384)\n"
+    "  if not block then break end\n"
+    "  for i = 1, #block do\n"
+    "    crc = bitxor(t[bitand(bitxor(crc, byte(block, i)), 255)], bitshru(crc, 8))\n"
+    "  end\n"
+    "  size = size + #block\n"
+    "end\n"
+    "f:close()\n"
+    "return {crc = bitxor(crc, -1), size = size}\n";
+
 /**
  * Creates an empty \c CHDKCamera, without connecting to a camera.
  */
-CHDKCamera::CHDKCamera() : PTPBase()
+CHDKCamera::CHDKCamera() : CHDKCamera(NULL)
 {
 
 }
@@ -58,9 +461,107 @@ CHDKCamera::CHDKCamera() : PTPBase()
  * @param[in] dev The \c libusb_device to connect to.
  * @see PTPBase::PTPBase(libusb_device * dev)
  */
-CHDKCamera::CHDKCamera(IPTPComm * protocol) : PTPBase(protocol)
+CHDKCamera::CHDKCamera(IPTPComm * protocol) : PTPBase(protocol),
+coalescing(false), freshness(std::chrono::steady_clock::duration::zero())
+{
+
+}
+
+/**
+ * @brief Merge identical read-only requests made at the same time
+ *
+ * When enabled, \c CHDKCamera::check_script_status and
+ * \c CHDKCamera::get_live_view_data calls which find an identical request
+ * already on the wire wait for it and share its result, instead of making
+ * their own round trip.
+ *
+ * With a non-zero \a freshness_ms, a result also keeps being served for that
+ * long after it arrives.  Be careful with this: a stale script status can
+ * make a caller think a script is still running.
+ *
+ * @param[in] enabled True to coalesce requests, false to send every request.
+ * @param[in] freshness_ms (optional) How long, in milliseconds, a finished
+ *                         result may be reused.
+ */
+void CHDKCamera::set_coalescing(const bool enabled, const int freshness_ms)
+{
+    std::lock_guard<std::mutex> lock(this->flights_mutex);
+    this->coalescing = enabled;
+    this->freshness = std::chrono::milliseconds(freshness_ms);
+    this->flights.clear();
+}
+
+/**
+ * @brief Run a read-only, receiving transaction, sharing it with identical callers
+ *
+ * Requests are identical when their command containers carry the same
+ * operation code and parameters.  The first caller for a given request sends
+ * it; everybody who asks while it is on the wire (or within the freshness
+ * window) gets the same result, or the same exception.
+ *
+ * @param[in] cmd The command to send.  Must not have a data phase.
+ * @return The shared response and data of the transaction.
+ * @see CHDKCamera::set_coalescing
+ */
+std::shared_ptr<const CHDKCamera::CoalescedResult> CHDKCamera::_coalesced_transaction(PTPContainer& cmd)
 {
+    int key_size;
+    const unsigned char * key_data = cmd.get_payload_ptr(&key_size);
+    std::string key((const char *) &cmd.code, sizeof cmd.code);
+    key.append((const char *) key_data, key_size);
+
+    std::promise<std::shared_ptr<const CoalescedResult> > promise;
+    {
+        std::unique_lock<std::mutex> lock(this->flights_mutex);
+        std::map<std::string, Flight>::iterator it = this->flights.find(key);
+        if (it != this->flights.end())
+        {
+            Flight& flight = it->second;
+            if (!flight.done || std::chrono::steady_clock::now() - flight.completed_at <= this->freshness)
+            {
+                CoalescedFlight result = flight.result;
+                lock.unlock();
+                return result.get();
+            }
+            this->flights.erase(it);
+        }
+
+        Flight& flight = this->flights[key];
+        flight.result = promise.get_future().share();
+        flight.done = false;
+    }
+
+    std::shared_ptr<CoalescedResult> result = std::make_shared<CoalescedResult>();
+    try
+    {
+        PTPContainer data;
+        this->ptp_transaction(cmd, data, true, result->resp, result->data);
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(this->flights_mutex);
+        promise.set_exception(std::current_exception());
+        this->flights.erase(key);
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lock(this->flights_mutex);
+    promise.set_value(result);
+    std::map<std::string, Flight>::iterator it = this->flights.find(key);
+    if (it != this->flights.end())
+    {
+        if (this->freshness > std::chrono::steady_clock::duration::zero())
+        {
+            it->second.done = true;
+            it->second.completed_at = std::chrono::steady_clock::now();
+        }
+        else
+        {
+            this->flights.erase(it);
+        }
+    }
 
+    return result;
 }
 
 /**
@@ -71,6 +572,8 @@ CHDKCamera::CHDKCamera(IPTPComm * protocol) : PTPBase(protocol)
  */
 float CHDKCamera::get_chdk_version(void)
 {
+    PTPTrace::Span span("CHDKCamera::get_chdk_version");
+
     PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
     cmd.add_param(PTP_CHDK_Version);
 
@@ -79,16 +582,15 @@ float CHDKCamera::get_chdk_version(void)
     // param 1 is four bytes of major version
     // param 2 is four bytes of minor version
     float out;
-    unsigned char * payload;
+    const unsigned char * payload;
     int payload_size;
     uint32_t major = 0, minor = 0;
-    payload = out_resp.get_payload(&payload_size);
+    payload = out_resp.get_payload_ptr(&payload_size);
     if (payload_size >= 8)
     { // Need at least 8 bytes in the payload
         std::memcpy(&major, payload, 4); // Copy first four bytes into major
         std::memcpy(&minor, payload + 4, 4); // Copy next four bytes into minor
     }
-    delete[] payload;
 
     out = major + minor / 10.0; // This assumes that the minor version is one digit long
     return out;
@@ -97,13 +599,22 @@ float CHDKCamera::get_chdk_version(void)
 /**
  * Checks the status of the currently running script.
  *
+ * @note Shares the result of an identical request already on the wire if
+ *       coalescing is enabled.
  * @return The current script status, a member of CHDK_SCRIPT_STATUS
  */
 uint32_t CHDKCamera::check_script_status(void)
 {
+    PTPTrace::Span span("CHDKCamera::check_script_status");
+
     PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
     cmd.add_param(PTP_CHDK_ScriptStatus);
 
+    if (this->coalescing)
+    {
+        return this->_coalesced_transaction(cmd)->resp.get_param_n(0);
+    }
+
     PTPContainer out_resp, data, out_data;
     this->ptp_transaction(cmd, data, true, out_resp, out_data);
 
@@ -114,13 +625,18 @@ uint32_t CHDKCamera::check_script_status(void)
  * Asks CHDK to execute the lua script given by \c script.
  *
  * @param[in] script The LUA script to execute.
- * @param[out] script_error The error code returned by the script, if blocking.
+ * @param[out] script_error The startup status of the script, a member of \c ptp_chdk_script_error_type.
  * @param[in] block Whether or not to block execution until the script has returned.
- * @return The first parameter in the PTP response (?)
- * @todo Finish blocking code, allow timeout input
+ *                  Waits up to \c CHDKCamera::block_timeout milliseconds, and
+ *                  discards the script's messages; see \c CHDKCamera::run_lua
+ *                  to keep them.
+ * @return The ID of the script.
+ * @exception PTP::ERR_TIMEOUT if blocking and the script doesn't finish in time.
  */
 uint32_t CHDKCamera::execute_lua(const std::string script, uint32_t * script_error, const bool block)
 {
+    PTPTrace::Span span("CHDKCamera::execute_lua");
+
     PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
     cmd.add_param(PTP_CHDK_ExecuteScript);
     cmd.add_param(PTP_CHDK_SL_LUA);
@@ -132,81 +648,369 @@ uint32_t CHDKCamera::execute_lua(const std::string script, uint32_t * script_err
     this->ptp_transaction(cmd, data, false, out_resp, out_data);
 
     uint32_t out = -1;
-    unsigned char * payload;
+    uint32_t status = PTP_CHDK_S_ERRTYPE_NONE;
+    const unsigned char * payload;
     int payload_size;
-    payload = out_resp.get_payload(&payload_size);
+    payload = out_resp.get_payload_ptr(&payload_size);
 
-    if (block)
+    if (payload_size >= 8)
+    { // Need at least 8 bytes in the payload
+        std::memcpy(&out, payload, 4);
+        std::memcpy(&status, payload + 4, 4);
+    }
+    if (script_error != NULL)
     {
-        //printf("TODO: Blocking code");
-        this->_wait_for_script_return(5);
+        *script_error = status;
     }
-    else
+
+    if (block && status == PTP_CHDK_S_ERRTYPE_NONE)
     {
-        if (payload_size >= 8)
-        { // Need at least 8 bytes in the payload
-            std::memcpy(&out, payload, 4);
-            if (script_error != NULL)
-            {
-                std::memcpy(script_error, payload + 4, 4);
-            }
-        }
+        this->_wait_for_script_return(CHDKCamera::block_timeout, out);
     }
-    delete[] payload;
 
     return out;
 }
 
 /**
- * @brief Read the current script message from CHDK
- *
- * Simply returns the \c PTPContainer for handling by the caller.
+ * @brief Run a Lua script and wait for it to finish
  *
- * @param[out] out_resp \c PTPContainer containing the response from the PTP transaction.
- * @param[out] out_data \c PTPContainer containing the data from the PTP transaction.
- * 
- * @todo Convert to a string and return actual message?
+ * @param[in]  script   The Lua script to run.
+ * @param[out] result   (optional) What the script returned, or for a script
+ *                      which failed, a string describing the error.
+ * @param[out] messages (optional) Messages the script sent while it ran,
+ *                      with \c write_usb_msg, are appended here.
+ * @param[in]  timeout  (optional) Milliseconds to wait for the script, or 0 to wait forever.
+ * @return true if the script ran to the end; false if it failed to compile or raised an error.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes before the script finishes.
+ * @see CHDKCamera::_wait_for_script_return
  */
-void CHDKCamera::read_script_message(PTPContainer& out_resp, PTPContainer& out_data)
+bool CHDKCamera::run_lua(const std::string script, CHDKScriptValue * result, std::vector<CHDKScriptMessage> * messages, const int timeout)
 {
-    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
-    cmd.add_param(PTP_CHDK_ReadScriptMsg);
-    cmd.add_param(PTP_CHDK_SL_LUA);
+    PTPTrace::Span span("CHDKCamera::run_lua");
 
-    PTPContainer data;
-    this->ptp_transaction(cmd, data, true, out_resp, out_data);
-    // We'll just let the caller deal with the data
+    uint32_t status = PTP_CHDK_S_ERRTYPE_NONE;
+    uint32_t script_id = this->execute_lua(script, &status);
+
+    // A script which failed to compile still queues its error message
+    std::vector<CHDKScriptMessage> received = this->_wait_for_script_return(timeout, script_id);
+
+    bool ok = false;
+    for (size_t i = 0; i < received.size(); i++)
+    {
+        CHDKScriptMessage& msg = received[i];
+        if (msg.type == PTP_CHDK_S_MSGTYPE_USER)
+        {
+            if (messages != NULL)
+            {
+                messages->push_back(msg);
+            }
+        }
+        else
+        {
+            ok = (msg.type == PTP_CHDK_S_MSGTYPE_RET);
+            if (result != NULL)
+            {
+                *result = msg.value;
+            }
+        }
+    }
+
+    return ok;
 }
 
 /**
- * @brief Write a message to the script running on CHDK
+ * @brief Run a Lua script which returns a table, and parse it in place
  *
- * @param[in] message The message to send to the script.
- * @param[in] script_id (optional) The ID of the script to send the message to.
- * @return The first parameter from the PTP response.
+ * Quicker than \c CHDKCamera::run_lua(const std::string script, CHDKScriptValue * result, std::vector<CHDKScriptMessage> * messages, const int timeout)
+ * for large tables, since no map is built; see \c CHDKTable.  Messages the
+ * script sends are discarded; other scripts' are kept for them.
+ *
+ * @param[in]  script  The Lua script to run.
+ * @param[out] result  The table the script returned.
+ * @param[in]  timeout (optional) Milliseconds to wait for the script, or 0 to wait forever.
+ * @return true if the script returned a table; false if it failed, or returned anything else.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes before the script finishes.
  */
-uint32_t CHDKCamera::write_script_message(const std::string message, const uint32_t script_id)
+bool CHDKCamera::run_lua(const std::string script, CHDKTable& result, const int timeout)
 {
-    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
-    cmd.add_param(PTP_CHDK_WriteScriptMsg);
-    cmd.add_param(script_id);
+    PTPTrace::Span span("CHDKCamera::run_lua");
 
-    PTPContainer data(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
-    data.set_payload(message.c_str(), message.length());
-
-    PTPContainer out_resp, out_data;
-    this->ptp_transaction(cmd, data, false, out_resp, out_data);
+    const PTPDeadline deadline = PTPDeadline::from_timeout(timeout);
+    uint32_t status = PTP_CHDK_S_ERRTYPE_NONE;
+    uint32_t script_id = this->execute_lua(script, &status);
 
-    uint32_t out = -1;
-    unsigned char * payload;
-    int payload_size;
-    payload = out_resp.get_payload(&payload_size);
+    PTPContainer resp, data;
+    std::chrono::microseconds backoff(100);
+    for (;;)
+    {
+        this->read_script_message(resp, data, script_id);
+        uint32_t type = resp.get_param_n(0);
+
+        if (type == PTP_CHDK_S_MSGTYPE_NONE)
+        {
+            if (deadline.expired())
+            {
+                throw ERR_TIMEOUT;
+            }
+            std::this_thread::sleep_for(backoff);
+            if (backoff < std::chrono::milliseconds(10))
+            {
+                backoff *= 2;
+            }
+            continue;
+        }
+
+        if (type == PTP_CHDK_S_MSGTYPE_USER)
+        {
+            continue; // Not the result
+        }
+
+        // An error, including failing to compile, or the result
+        if (type != PTP_CHDK_S_MSGTYPE_RET)
+        {
+            result.clear();
+            return false;
+        }
+        return result.read(resp, data);
+    }
+}
+
+/**
+ * @brief Read the current script message from CHDK
+ *
+ * Simply returns the \c PTPContainer for handling by the caller.
+ *
+ * CHDK has one message queue for every script.  With \a script_id set,
+ * messages from other scripts which are read along the way are kept, and
+ * handed to whoever asks for them later, rather than lost.  Those are
+ * always handed out before anything new is read from the camera.
+ *
+ * @param[out] out_resp  \c PTPContainer containing the response from the PTP transaction.
+ *                       Its first parameter is \c PTP_CHDK_S_MSGTYPE_NONE if there was no message.
+ * @param[out] out_data  \c PTPContainer containing the data from the PTP transaction.
+ * @param[in]  script_id (optional) Only read messages from this script, or 0 for any script.
+ */
+void CHDKCamera::read_script_message(PTPContainer& out_resp, PTPContainer& out_data, const uint32_t script_id)
+{
+    PTPTrace::Span span("CHDKCamera::read_script_message");
+
+    std::lock_guard<std::recursive_mutex> lock(this->session_mutex());
+
+    if (this->_take_stashed_message(script_id, out_resp, out_data))
+    {
+        return;
+    }
+
+    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    cmd.add_param(PTP_CHDK_ReadScriptMsg);
+    cmd.add_param(PTP_CHDK_SL_LUA);
+
+    PTPContainer data;
+    for (;;)
+    {
+        this->ptp_transaction(cmd, data, true, out_resp, out_data);
+        uint32_t type = out_resp.get_param_n(0);
+        if (type == PTP_CHDK_S_MSGTYPE_NONE || script_id == 0 || out_resp.get_param_n(2) == script_id)
+        {
+            return;
+        }
+
+        // Somebody else's: keep it for them
+        StashedMessage msg;
+        msg.type = type;
+        msg.subtype = out_resp.get_param_n(1);
+        msg.script_id = out_resp.get_param_n(2);
+        msg.length = out_resp.get_param_n(3);
+        int size = 0;
+        const unsigned char * payload = out_data.get_payload_ptr(&size);
+        if (payload != NULL)
+        {
+            msg.data.assign((const char *) payload, size);
+        }
+
+        if (this->stashed_messages.size() >= CHDKCamera::stashed_message_limit)
+        {
+            this->stashed_messages.pop_front();
+        }
+        this->stashed_messages.push_back(msg);
+    }
+}
+
+/**
+ * @brief Read the next script message from CHDK, and decode it
+ *
+ * @param[out] out       The message.  Its value is decoded according to its
+ *                       \c PTP_CHDK_TYPE_*; errors are decoded as strings.
+ * @param[in]  script_id (optional) Only read messages from this script, or 0 for any script.
+ * @return false if there was no message waiting.
+ * @see CHDKCamera::read_script_message(PTPContainer& out_resp, PTPContainer& out_data, const uint32_t script_id), CHDKCamera::decode_script_value
+ */
+bool CHDKCamera::read_script_message(CHDKScriptMessage& out, const uint32_t script_id)
+{
+    PTPContainer resp, data;
+    this->read_script_message(resp, data, script_id);
+    return CHDKCamera::_decode_script_message(resp, data, out);
+}
+
+/**
+ * @brief Hand out the oldest kept message from \a script_id (or any script, for 0)
+ *
+ * @return false if none was kept.  The caller holds the session lock.
+ */
+bool CHDKCamera::_take_stashed_message(const uint32_t script_id, PTPContainer& out_resp, PTPContainer& out_data)
+{
+    for (std::deque<StashedMessage>::iterator it = this->stashed_messages.begin(); it != this->stashed_messages.end(); ++it)
+    {
+        if (script_id != 0 && it->script_id != script_id)
+        {
+            continue;
+        }
+
+        out_resp.reset(PTPContainer::CONTAINER_TYPE_RESPONSE, CHDK_PTP_RC_OK);
+        out_resp.add_param(it->type);
+        out_resp.add_param(it->subtype);
+        out_resp.add_param(it->script_id);
+        out_resp.add_param(it->length);
+        out_data.reset(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+        out_data.set_payload(it->data.data(), it->data.size());
+
+        this->stashed_messages.erase(it);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Decode a script message read with \c CHDKCamera::read_script_message
+ *
+ * @return false if \a resp says there was no message.
+ */
+bool CHDKCamera::_decode_script_message(const PTPContainer& resp, const PTPContainer& data, CHDKScriptMessage& out)
+{
+    out.type = resp.get_param_n(0);
+    if (out.type == PTP_CHDK_S_MSGTYPE_NONE)
+    {
+        return false;
+    }
+
+    uint32_t subtype = resp.get_param_n(1);
+    out.script_id = resp.get_param_n(2);
+    uint32_t length = resp.get_param_n(3);
+
+    int size = 0;
+    const unsigned char * payload = data.get_payload_ptr(&size);
+    if (payload == NULL)
+    {
+        length = 0;
+    }
+    else if (length > (uint32_t) size)
+    {
+        length = size;
+    }
+
+    if (out.type == PTP_CHDK_S_MSGTYPE_ERR)
+    {
+        out.error_type = subtype;
+        CHDKCamera::decode_script_value(PTP_CHDK_TYPE_STRING, payload, length, out.value);
+    }
+    else
+    {
+        out.error_type = PTP_CHDK_S_ERRTYPE_NONE;
+        CHDKCamera::decode_script_value(subtype, payload, length, out.value);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Decode the data of a script message of type \a type
+ *
+ * Booleans and integers are four bytes; strings, tables and the names of
+ * unsupported types are text.  Tables come as "key\tvalue\n" lines, which
+ * are also split into \c CHDKScriptValue::table.
+ *
+ * @param[in]  type   The message's \c PTP_CHDK_TYPE_*.
+ * @param[in]  data   The message's data.
+ * @param[in]  length The length of the message's data.
+ * @param[out] out    The decoded value.
+ * @see CHDKTable, to parse large tables without building a map
+ */
+void CHDKCamera::decode_script_value(const uint32_t type, const unsigned char * data, const uint32_t length, CHDKScriptValue& out)
+{
+    out.type = type;
+    out.boolean = false;
+    out.integer = 0;
+    out.string.clear();
+    out.table.clear();
+
+    switch (type)
+    {
+    case PTP_CHDK_TYPE_NIL:
+        break;
+    case PTP_CHDK_TYPE_BOOLEAN:
+    case PTP_CHDK_TYPE_INTEGER:
+        if (length >= 4)
+        {
+            std::memcpy(&out.integer, data, 4);
+        }
+        out.boolean = (out.integer != 0);
+        break;
+    case PTP_CHDK_TYPE_TABLE:
+        out.string.assign((const char *) data, length);
+        for (size_t line = 0; line < out.string.length();)
+        {
+            size_t end = out.string.find('\n', line);
+            if (end == std::string::npos)
+            {
+                end = out.string.length();
+            }
+            size_t tab = out.string.find('\t', line);
+            if (tab != std::string::npos && tab < end)
+            {
+                out.table[out.string.substr(line, tab - line)] = out.string.substr(tab + 1, end - tab - 1);
+            }
+            line = end + 1;
+        }
+        break;
+    case PTP_CHDK_TYPE_STRING:
+    case PTP_CHDK_TYPE_UNSUPPORTED:
+    default:
+        out.string.assign((const char *) data, length);
+        break;
+    }
+}
+
+/**
+ * @brief Write a message to the script running on CHDK
+ *
+ * @param[in] message The message to send to the script.
+ * @param[in] script_id (optional) The ID of the script to send the message to.
+ * @return The first parameter from the PTP response.
+ */
+uint32_t CHDKCamera::write_script_message(const std::string message, const uint32_t script_id)
+{
+    PTPTrace::Span span("CHDKCamera::write_script_message");
+
+    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    cmd.add_param(PTP_CHDK_WriteScriptMsg);
+    cmd.add_param(script_id);
+
+    PTPContainer data(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+    data.set_payload(message.c_str(), message.length());
+
+    PTPContainer out_resp, out_data;
+    this->ptp_transaction(cmd, data, false, out_resp, out_data);
+
+    uint32_t out = -1;
+    const unsigned char * payload;
+    int payload_size;
+    payload = out_resp.get_payload_ptr(&payload_size);
 
     if (payload_size >= 4)
     { // Need four bytes of uint32_t response
         std::memcpy(&out, payload, 4);
     }
-    delete[] payload;
 
     return out;
 }
@@ -222,10 +1026,14 @@ uint32_t CHDKCamera::write_script_message(const std::string message, const uint3
  * @param[in]  liveview True to return the live view frame buffer
  * @param[in]  overlay  True to return the overlay frame buffer
  * @param[in]  palette  True to return the palette for the overlay
- * @see LVData, http://chdk.wikia.com/wiki/Frame_buffers
+ * @note Shares the frame of an identical request already on the wire if
+ *       coalescing is enabled.
+ * @see CHDKCamera::set_coalescing, LVData, http://chdk.wikia.com/wiki/Frame_buffers
  */
 void CHDKCamera::get_live_view_data(LVData& data_out, const bool liveview, const bool overlay, const bool palette)
 {
+    PTPTrace::Span span("CHDKCamera::get_live_view_data");
+
     uint32_t flags = 0;
     if (liveview) flags |= LV_TFR_VIEWPORT;
     if (overlay) flags |= LV_TFR_BITMAP;
@@ -235,146 +1043,1243 @@ void CHDKCamera::get_live_view_data(LVData& data_out, const bool liveview, const
     cmd.add_param(PTP_CHDK_GetDisplayData);
     cmd.add_param(flags);
 
-    PTPContainer data, out_resp, out_data;
-    this->ptp_transaction(cmd, data, true, out_resp, out_data);
+    if (this->coalescing)
+    {
+        data_out.read(this->_coalesced_transaction(cmd)->data);
+        return;
+    }
 
-    int payload_size;
-    unsigned char * payload = out_data.get_payload(&payload_size);
+    // Receive the frame straight into data_out, so nothing is copied and,
+    //  once data_out has held a frame, nothing is allocated
+    PTPContainer data, out_resp;
+    this->ptp_transaction(cmd, data, true, out_resp, data_out.container);
+
+    data_out.parse(); // The LVData class will completely handle the LV data
+}
+
+/**
+ * @brief Block until all scripts have finished, collecting their messages as text
+ *
+ * @param[in] timeout The maximum number of milliseconds to wait, or 0 to wait forever.
+ * @return Every message read, in order, as text.  Booleans are "true" or
+ *         "false", integers are in decimal, tables are as CHDK sent them and
+ *         nil is empty.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes while a script is still running.
+ * @exception PTP::ERR_INVALID_RESPONSE if the camera reports a status we don't understand.
+ * @see CHDKCamera::_wait_for_script_return(const int timeout, const uint32_t script_id)
+ */
+std::vector<std::string> CHDKCamera::_wait_for_script_return(const int timeout)
+{
+    std::vector<CHDKScriptMessage> received = this->_wait_for_script_return(timeout, 0);
 
-    data_out.read(payload, payload_size); // The LVData class will completely handle the LV data
+    std::vector<std::string> msgs;
+    for (size_t i = 0; i < received.size(); i++)
+    {
+        const CHDKScriptValue& value = received[i].value;
+        switch (value.type)
+        {
+        case PTP_CHDK_TYPE_NIL:
+            msgs.push_back(std::string());
+            break;
+        case PTP_CHDK_TYPE_BOOLEAN:
+            msgs.push_back(value.boolean ? "true" : "false");
+            break;
+        case PTP_CHDK_TYPE_INTEGER:
+            msgs.push_back(std::to_string(value.integer));
+            break;
+        default:
+            msgs.push_back(value.string);
+            break;
+        }
+    }
 
-    delete[] payload;
+    return msgs;
 }
 
 /**
- * @brief Block until the currently running script returns a value
+ * @brief Block until all scripts have finished, collecting their messages
  *
- * This function will poll the camera every 50 ms for script messages.  If a
- * script is currently still running, it will continue to poll until all scripts
- * are done running.  All read messages are returned when all scripts are done
- * running.
+ * Polls the script status, reading every message that is waiting whenever
+ * there are any.  The first poll is immediate, and the wait between polls
+ * starts at 100 microseconds and doubles up to 10 milliseconds, so short
+ * scripts are seen to finish almost as soon as the USB round trip allows
+ * while long ones don't keep the bus busy.  CHDK has no event for a script
+ * finishing, so polling is all there is.
  *
- * @todo Determine a method for returning the messages
+ * With \a script_id set, only that script's messages are collected; those
+ * of other scripts are kept for them (see
+ * \c CHDKCamera::read_script_message).
  *
- * @param[in] timeout The maximum amount of time to let this function run for
- * @return All read script messages.
+ * @param[in] timeout   The maximum number of milliseconds to wait, or 0 to wait forever.
+ * @param[in] script_id The script whose messages to collect, or 0 for every script's.
+ * @return Every message read, in order, decoded.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes while a script is still running.
+ * @exception PTP::ERR_INVALID_RESPONSE if the camera reports a status we don't understand.
  */
-std::vector<std::string> CHDKCamera::_wait_for_script_return(const int timeout)
+std::vector<CHDKScriptMessage> CHDKCamera::_wait_for_script_return(const int timeout, const uint32_t script_id)
 {
-    //int msg_count = 1;
-    std::vector<std::string> msgs;
-    struct timeval time;
-    long t_start;
-    long t_end;
-    uint32_t status;
+    PTPTrace::Span span("CHDKCamera::_wait_for_script_return");
 
-    gettimeofday(&time, NULL);
-    t_start = (time.tv_sec * 1000) + (time.tv_usec / 1000);
+    const PTPDeadline deadline = PTPDeadline::from_timeout(timeout);
+    std::chrono::microseconds backoff(100);
+    std::vector<CHDKScriptMessage> msgs;
+    CHDKScriptMessage msg;
 
     while (1)
     {
-        status = this->check_script_status();
+        uint32_t status = this->check_script_status();
 
-        if (status & PTP_CHDK_SCRIPT_STATUS_RUN)
-        { // If a script is running
-            // Sleep for 50 ms
-            usleep(50 * 1000);
-            gettimeofday(&time, NULL);
-            t_end = (time.tv_sec * 1000) + (time.tv_usec / 1000);
-            if (timeout > 0 && timeout > (t_end - t_start))
-            {
-                throw ERR_TIMEOUT;
-            }
+        if (status & ~(PTP_CHDK_SCRIPT_STATUS_RUN | PTP_CHDK_SCRIPT_STATUS_MSG))
+        {
+            throw ERR_INVALID_RESPONSE;
         }
         else if (status & PTP_CHDK_SCRIPT_STATUS_MSG)
         {
-            // TODO: Read script message, determine how to return
+            // Drain everything that's queued, then look again straight away
+            while (this->read_script_message(msg, script_id))
+            {
+                msgs.push_back(msg);
+            }
+            backoff = std::chrono::microseconds(100);
         }
-        else if (status == 0)
-        {
-            break;
+        else if (status & PTP_CHDK_SCRIPT_STATUS_RUN)
+        { // If a script is running
+            if (deadline.expired())
+            {
+                throw ERR_TIMEOUT;
+            }
+            std::this_thread::sleep_for(backoff);
+            if (backoff < std::chrono::milliseconds(10))
+            {
+                backoff *= 2;
+            }
         }
         else
         {
-            throw ERR_INVALID_RESPONSE;
+            break; // Nothing running, nothing waiting
         }
     }
 
+    // Anything somebody else read on our behalf, without asking the camera again
+    PTPContainer resp, data;
+    std::lock_guard<std::recursive_mutex> lock(this->session_mutex());
+    while (this->_take_stashed_message(script_id, resp, data))
+    {
+        CHDKCamera::_decode_script_message(resp, data, msg);
+        msgs.push_back(msg);
+    }
+
     return msgs;
 }
 
 /**
- * @brief Reads in a file and packs data for uploading.
- * 
+ * @brief Public method to upload a local file to the camera.
+ *
  * From CHDK source code, the correct format for the uploaded file is:
  *  -# Four bytes of length of filename
  *  -# Filename
  *  -# Contents of file
- * 
- * @warning The caller is responsible for free()ing the memory allocated by this
- *          function.
- * 
- * @param[out] out_size The size of the resulting data structure
- * @param[in] local_filename The path and name of the local file to be read
- * @param[in] remote_filename The path and name of the location on the camera to place the file
- * @return A pointer to the first byte of the resulting data
- * @see CHDKCamera::upload_file
+ *
+ * The length and filename are sent as the start of the data container, and
+ * the contents are then streamed from the file behind them (see
+ * \c PTPBase::send_ptp_data), so memory use stays the same however big the
+ * file is.
+ *
+ * @param[in]  local_filename  The local path and filename to send
+ * @param[in]  remote_filename The path and filename to store the file on the camera
+ * @param[in]  timeout         (optional) The timeout for the whole transfer, in milliseconds, or 0 to wait forever
+ * @param[in]  progress        (optional) Called as the file is sent, with the bytes sent so far and the file size
+ * @param[out] stats           (optional) Filled in with the size of the file and how long the upload took
+ * @return True on success
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes; the upload is cancelled.
+ * @exception PTP::ERR_DATASOURCE_FAILED if the file can't be read; the upload is cancelled.
  */
-uint8_t * CHDKCamera::_pack_file_for_upload(uint32_t * out_size, const std::string local_filename, const std::string remote_filename)
+bool CHDKCamera::upload_file(const std::string local_filename, const std::string remote_filename, const int timeout, const PTPProgressCallback& progress, PTPTransferStats * stats)
 {
-    uint32_t file_size;
-    uint8_t * out;
-    int name_length;
+    PTPTrace::Span span("CHDKCamera::upload_file");
+
+    PTPFileSource source(local_filename);
+    if (!source.is_open())
+    {
+        return false;
+    }
 
-    name_length = remote_filename.length();
+    return this->upload_file(source, remote_filename, timeout, progress, stats);
+}
 
-    std::ifstream stream_local(local_filename.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
-    // Open file for reading, binary type of file, place pointer at end of file
+/**
+ * @brief Upload the contents of \a source to the camera as \a remote_filename
+ *
+ * @param[in]  source          Where the file's contents come from
+ * @param[in]  remote_filename The path and filename to store the file on the camera
+ * @param[in]  timeout         (optional) The timeout for the whole transfer, in milliseconds, or 0 to wait forever
+ * @param[in]  progress        (optional) Called as the file is sent, with the bytes sent so far and the file size
+ * @param[out] stats           (optional) Filled in with the size of the file and how long the upload took
+ * @return True on success
+ * @see CHDKCamera::upload_file(const std::string local_filename, const std::string remote_filename, const int timeout, const PTPProgressCallback& progress, PTPTransferStats * stats)
+ */
+bool CHDKCamera::upload_file(IPTPDataSource& source, const std::string remote_filename, const int timeout, const PTPProgressCallback& progress, PTPTransferStats * stats)
+{
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-    file_size = stream_local.tellg(); // Retrives the position of the input stream
-    // Since we asked to open the file at the end, this is the length of the file
-    stream_local.seekg(0, std::ios::beg);
+    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    PTPContainer header(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+    PTPContainer resp;
 
-    out = new uint8_t[4 + name_length + file_size]; // Allocate memory for the packed file
+    cmd.add_param(PTP_CHDK_UploadFile);
 
-    std::memcpy(out, &file_size, 4); // Copy four bytes of file size to output
-    const char * r_filename = remote_filename.data();
-    std::memcpy(out + 4, r_filename, name_length); // Copy the file name in
-    stream_local.read((char *) (out + 4 + name_length), file_size); // Copy the file contents in
+    // The file's contents follow this on the wire
+    uint32_t name_length = remote_filename.length();
+    unsigned char * prefix = header.resize_payload(4 + name_length);
+    std::memcpy(prefix, &name_length, 4);
+    std::memcpy(prefix + 4, remote_filename.data(), name_length);
 
-    stream_local.close(); // Close the opened file stream
+    this->ptp_transaction(cmd, header, source, resp, PTPDeadline::from_timeout(timeout), progress);
 
-    *out_size = 4 + name_length + file_size; // Output the size of the result
+    if (stats != NULL)
+    {
+        stats->bytes = source.get_size();
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
 
-    return out; // Return the packed file. Caller is responsible for free()ing this
+    return (resp.code == CHDK_PTP_RC_OK);
 }
 
 /**
- * @brief Public method to upload a local file to the camera.
- * 
- * @param[in] local_filename The local path and filename to send
- * @param[in] remote_filename The path and filename to store the file on the camera
- * @param[in] timeout (optional) The timeout for each PTP call
- * @return True on success
+ * @brief Upload a batch of files
+ *
+ * Each file is read into a buffer which is reused from file to file, then
+ * sent.  Files bigger than \c CHDKCamera::read_ahead_limit are streamed from
+ * disk instead, as \c CHDKCamera::upload_file would.
+ *
+ * With \a read_ahead set, a thread loads up to
+ * \c CHDKCamera::read_ahead_depth files into memory ahead of the one on the
+ * wire, so disk reads and USB transfers overlap instead of taking turns.
+ * That only pays for the hand-off between threads when reading a file takes
+ * a good fraction of the time it takes to send it -- a cold cache, slow
+ * storage -- so it is off by default.
+ *
+ * A file which fails doesn't stop the batch; its result says what happened.
+ *
+ * @param[in]  files      The files to send, in order
+ * @param[in]  timeout    (optional) The timeout for each file, in milliseconds, or 0 to wait forever
+ * @param[out] stats      (optional) Filled in with the files and bytes sent successfully, and how long the batch took
+ * @param[in]  read_ahead (optional) Read files on a separate thread while earlier ones are sent
+ * @return One result per entry in \a files, in the same order.  A file which
+ *         couldn't be read locally has \c ERR_DATASOURCE_FAILED as its error.
+ * @see CHDKCamera::upload_file
  */
-bool CHDKCamera::upload_file(const std::string local_filename, const std::string remote_filename, const int timeout)
+std::vector<CHDKTransferResult> CHDKCamera::upload_files(const std::vector<CHDKUpload>& files, const int timeout, CHDKBatchStats * stats, const bool read_ahead)
 {
-    uint8_t * packed;
-    uint32_t packed_size;
-    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
-    PTPContainer data(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
-    PTPContainer resp, out_data;
+    PTPTrace::Span span("CHDKCamera::upload_files");
 
-    packed = CHDKCamera::_pack_file_for_upload(&packed_size, local_filename, remote_filename);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const size_t slot_count = read_ahead ? read_ahead_depth + 1 : 1; // Those read ahead, plus the one being sent
 
-    cmd.add_param(PTP_CHDK_UploadFile);
-    data.set_payload(packed, packed_size);
+    std::vector<CHDKTransferResult> results(files.size());
+    std::vector<ReadAhead> slots(slot_count);
+    uint32_t ok_files = 0;
+    uint64_t ok_bytes = 0;
+
+    // Sends file i, which has been read into slot
+    auto send = [&](const size_t i, const ReadAhead& slot)
+    {
+        CHDKTransferResult& result = results[i];
+        try
+        {
+            if (!slot.ok)
+            {
+                result.error = ERR_DATASOURCE_FAILED;
+            }
+            else if (slot.streamed)
+            {
+                result.ok = this->upload_file(files[i].local_filename, files[i].remote_filename, timeout, PTPProgressCallback(), &result.stats);
+            }
+            else
+            {
+                PTPMemorySource source(slot.contents.data(), slot.contents.size());
+                result.ok = this->upload_file(source, files[i].remote_filename, timeout, PTPProgressCallback(), &result.stats);
+            }
+        }
+        catch (LIBPTP_PP_ERRORS e)
+        {
+            result.error = e;
+        }
+
+        if (result.ok)
+        {
+            ok_files++;
+            ok_bytes += result.stats.bytes;
+        }
+    };
+
+    if (!read_ahead || files.size() < 2)
+    {
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            load_file(files[i].local_filename, slots[0], read_ahead_limit);
+            send(i, slots[0]);
+        }
+    }
+    else
+    {
+        std::mutex mutex;
+        std::condition_variable cond;
+        size_t prepared = 0, sent = 0;
+        bool stop = false;
+
+        std::thread reader([&]()
+        {
+            for (size_t i = 0; i < files.size(); i++)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cond.wait(lock, [&]() { return stop || i < sent + slot_count; });
+                    if (stop)
+                    {
+                        return;
+                    }
+                }
+
+                {
+                    PTPTrace::Span read_span("read ahead");
+                    load_file(files[i].local_filename, slots[i % slot_count], read_ahead_limit);
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                prepared = i + 1;
+                cond.notify_all();
+            }
+        });
+
+        try
+        {
+            for (size_t i = 0; i < files.size(); i++)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cond.wait(lock, [&]() { return prepared > i; });
+                }
+
+                send(i, slots[i % slot_count]);
+
+                std::lock_guard<std::mutex> lock(mutex);
+                sent = i + 1;
+                cond.notify_all();
+            }
+        }
+        catch (...)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+                cond.notify_all();
+            }
+            reader.join();
+            throw;
+        }
+
+        reader.join();
+    }
 
-    this->ptp_transaction(cmd, data, false, resp, out_data);
+    if (stats != NULL)
+    {
+        stats->files = ok_files;
+        stats->bytes = ok_bytes;
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    return results;
+}
 
-    delete[] packed;
+/**
+ * @brief Read \a size bytes of camera memory at \a address into \a out
+ *
+ * Large ranges are split into \c CHDKCamera::memory_chunk_size transactions,
+ * each received straight into \a out, and the session is held for the whole
+ * read.
+ *
+ * @param[in]  address Where in the camera's address space to start.
+ * @param[out] out     At least \a size bytes to read into.
+ * @param[in]  size    How many bytes to read.
+ * @param[in]  timeout (optional) The timeout for the whole read, in milliseconds, or 0 to wait forever.
+ * @param[out] stats   (optional) Filled in with the bytes read and how long it took.
+ * @return true if the whole range was read.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes; the read in progress is cancelled.
+ */
+bool CHDKCamera::read_memory(const uint32_t address, void * out, const uint32_t size, const int timeout, PTPTransferStats * stats)
+{
+    CHDKMemoryRegion region;
+    region.address = address;
+    region.size = size;
+    region.out = out;
+    region.ok = false;
+
+    std::vector<CHDKMemoryRegion> regions(1, region);
+    return this->read_memory(regions, timeout, stats);
+}
+
+/**
+ * @brief Read several ranges of camera memory in one go
+ *
+ * All of the regions are read under one hold of the session and one
+ * deadline, back to back.  A region which fails doesn't stop the rest.
+ *
+ * @param[in,out] regions The ranges to read; each one's \c ok is set.
+ * @param[in]     timeout (optional) The timeout for the whole batch, in milliseconds, or 0 to wait forever.
+ * @param[out]    stats   (optional) Filled in with the bytes read and how long it took.
+ * @return true if every region was read.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes; the read in progress is cancelled.
+ */
+bool CHDKCamera::read_memory(std::vector<CHDKMemoryRegion>& regions, const int timeout, PTPTransferStats * stats)
+{
+    PTPTrace::Span span("CHDKCamera::read_memory");
+
+    const PTPDeadline deadline = PTPDeadline::from_timeout(timeout);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::lock_guard<std::recursive_mutex> lock(this->session_mutex());
+
+    bool all_ok = true;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < regions.size(); i++)
+    {
+        CHDKMemoryRegion& region = regions[i];
+        unsigned char * out = (unsigned char *) region.out;
+
+        region.ok = true;
+        for (uint32_t done = 0; done < region.size && region.ok;)
+        {
+            uint32_t length = (region.size - done < memory_chunk_size) ? region.size - done : memory_chunk_size;
+            region.ok = this->_read_memory(region.address + done, out + done, length, deadline);
+            if (region.ok)
+            {
+                done += length;
+                bytes += length;
+            }
+        }
+        all_ok = all_ok && region.ok;
+    }
+
+    if (stats != NULL)
+    {
+        stats->bytes = bytes;
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    return all_ok;
+}
+
+/**
+ * One GetMemory transaction.  CHDK won't read from address 0, so that is
+ * asked for as one byte from 0xFFFFFFFF, which wraps around, and the extra
+ * byte is dropped.
+ */
+bool CHDKCamera::_read_memory(const uint32_t address, unsigned char * out, const uint32_t size, const PTPDeadline& deadline)
+{
+    const uint32_t skip = (address == 0) ? 1 : 0;
+
+    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    cmd.add_param(PTP_CHDK_GetMemory);
+    cmd.add_param(address - skip);
+    cmd.add_param(size + skip);
+
+    PTPContainer data, resp;
+    MemorySink sink(out, size, skip);
+    bool received = this->ptp_transaction(cmd, data, sink, resp, deadline);
+
+    return received && sink.received == (uint64_t) size + skip && resp.code == CHDK_PTP_RC_OK;
+}
+
+/**
+ * @brief Write \a size bytes from \a data into camera memory at \a address
+ *
+ * Large ranges are split into \c CHDKCamera::memory_chunk_size transactions,
+ * each sent straight from \a data, and the session is held for the whole
+ * write.
+ *
+ * @warning This writes anywhere in the camera's memory.  Writing to the
+ *          wrong place will crash the camera.
+ *
+ * @param[in]  address Where in the camera's address space to start.
+ * @param[in]  data    The bytes to write.
+ * @param[in]  size    How many bytes to write.
+ * @param[in]  timeout (optional) The timeout for the whole write, in milliseconds, or 0 to wait forever.
+ * @param[out] stats   (optional) Filled in with the bytes written and how long it took.
+ * @return true if the whole range was written.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes; the write in progress is cancelled.
+ */
+bool CHDKCamera::write_memory(const uint32_t address, const void * data, const uint32_t size, const int timeout, PTPTransferStats * stats)
+{
+    PTPTrace::Span span("CHDKCamera::write_memory");
+
+    const PTPDeadline deadline = PTPDeadline::from_timeout(timeout);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const unsigned char * in = (const unsigned char *) data;
+
+    std::lock_guard<std::recursive_mutex> lock(this->session_mutex());
+
+    PTPContainer cmd, header, resp;
+    uint32_t done = 0;
+    bool ok = true;
+    while (done < size && ok)
+    {
+        uint32_t length = (size - done < memory_chunk_size) ? size - done : memory_chunk_size;
+
+        cmd.reset(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+        cmd.add_param(PTP_CHDK_SetMemory);
+        cmd.add_param(address + done);
+        cmd.add_param(length);
+        header.reset(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+
+        PTPMemorySource source(in + done, length);
+        this->ptp_transaction(cmd, header, source, resp, deadline);
+
+        ok = (resp.code == CHDK_PTP_RC_OK);
+        if (ok)
+        {
+            done += length;
+        }
+    }
+
+    if (stats != NULL)
+    {
+        stats->bytes = done;
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    return ok;
+}
+
+/**
+ * @brief Call a function in the camera's firmware
+ *
+ * The call is made in one transaction, with no script to compile or poll.
+ *
+ * @warning The function is called with whatever arguments are given.
+ *          Calling the wrong address will crash the camera.
+ *
+ * @param[in] function The address of the function in the camera.
+ * @param[in] args     Up to \c CHDKFunctionCall::max_args arguments to pass.
+ * @param[in] timeout  (optional) The timeout for the call, in milliseconds, or 0 to wait forever.
+ * @return What the function returned.
+ * @exception PTP::ERR_CHDK_TOO_MANY_ARGUMENTS if more than \c CHDKFunctionCall::max_args arguments are given.
+ * @exception PTP::ERR_INVALID_RESPONSE if the camera refused the call.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes.
+ */
+int32_t CHDKCamera::call_function(const uint32_t function, const std::vector<int32_t>& args, const int timeout)
+{
+    PTPTrace::Span span("CHDKCamera::call_function");
+
+    if (args.size() > (size_t) CHDKFunctionCall::max_args)
+    {
+        throw ERR_CHDK_TOO_MANY_ARGUMENTS;
+    }
+
+    CHDKFunctionCall call;
+    call.function = function;
+    call.arg_count = args.size();
+    std::copy(args.begin(), args.end(), call.args);
+
+    PTPContainer cmd, data, resp;
+    if (!this->_call_function(call, cmd, data, resp, PTPDeadline::from_timeout(timeout)))
+    {
+        throw ERR_INVALID_RESPONSE;
+    }
+
+    return call.result;
+}
+
+/**
+ * @brief Make several firmware function calls back to back
+ *
+ * The session is held for the whole batch, so no other transaction gets in
+ * between the calls, and the same containers are reused for every call.
+ * Made for control loops which need a string of calls with as little
+ * latency between them as possible.
+ *
+ * @param[in,out] calls   The calls to make, in order; each one's \c result and \c ok are set.
+ * @param[in]     timeout (optional) The timeout for the whole batch, in milliseconds, or 0 to wait forever.
+ * @return true if every call was made.
+ * @exception PTP::ERR_CHDK_TOO_MANY_ARGUMENTS if a call has more than \c CHDKFunctionCall::max_args arguments.  No calls are made.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes.
+ */
+bool CHDKCamera::call_functions(std::vector<CHDKFunctionCall>& calls, const int timeout)
+{
+    PTPTrace::Span span("CHDKCamera::call_functions");
+
+    for (size_t i = 0; i < calls.size(); i++)
+    {
+        if (calls[i].arg_count < 0 || calls[i].arg_count > CHDKFunctionCall::max_args)
+        {
+            throw ERR_CHDK_TOO_MANY_ARGUMENTS;
+        }
+        calls[i].ok = false;
+    }
+
+    const PTPDeadline deadline = PTPDeadline::from_timeout(timeout);
+    std::lock_guard<std::recursive_mutex> lock(this->session_mutex());
+
+    PTPContainer cmd, data, resp;
+    bool all_ok = true;
+    for (size_t i = 0; i < calls.size(); i++)
+    {
+        all_ok = this->_call_function(calls[i], cmd, data, resp, deadline) && all_ok;
+    }
+
+    return all_ok;
+}
+
+/**
+ * One CallFunction transaction, built in the containers given so a batch
+ * can reuse them.
+ */
+bool CHDKCamera::_call_function(CHDKFunctionCall& call, PTPContainer& cmd, PTPContainer& data, PTPContainer& resp, const PTPDeadline& deadline)
+{
+    cmd.reset(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    cmd.add_param(PTP_CHDK_CallFunction);
+
+    // The function pointer, then its arguments
+    data.reset(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+    unsigned char * payload = data.resize_payload((call.arg_count + 1) * sizeof (uint32_t));
+    std::memcpy(payload, &call.function, sizeof (uint32_t));
+    std::memcpy(payload + sizeof (uint32_t), call.args, call.arg_count * sizeof (int32_t));
+
+    PTPContainer out_data;
+    this->ptp_transaction(cmd, data, false, resp, out_data, deadline);
+
+    call.ok = (resp.code == CHDK_PTP_RC_OK);
+    call.result = call.ok ? (int32_t) resp.get_param_n(0) : 0;
+    return call.ok;
+}
+
+/**
+ * @brief Check whether remote capture data is waiting
+ *
+ * @param[out] image_number (optional) The number of the image the data is for.
+ * @return 0 if nothing is ready yet, \c PTP_CHDK_CAPTURE_NOTSET if remote
+ *         capture hasn't been set up, or else a mask of the
+ *         \c PTP_CHDK_CAPTURE_* formats which are ready.
+ */
+uint32_t CHDKCamera::remote_capture_is_ready(uint32_t * image_number)
+{
+    PTPTrace::Span span("CHDKCamera::remote_capture_is_ready");
+
+    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    cmd.add_param(PTP_CHDK_RemoteCaptureIsReady);
+
+    PTPContainer data, out_resp, out_data;
+    this->ptp_transaction(cmd, data, false, out_resp, out_data);
+
+    if (image_number != NULL)
+    {
+        *image_number = out_resp.get_param_n(1);
+    }
+
+    return out_resp.get_param_n(0);
+}
+
+/**
+ * @brief Receive the next remote capture chunk of \a format into \a sink
+ *
+ * The sink is given the chunk as one data phase.  Where in the file the
+ * chunk belongs is only known once it has arrived, from \a out.
+ *
+ * @param[in]  format  One \c PTP_CHDK_CAPTURE_* format which is ready.
+ * @param[in]  sink    Where the chunk goes.
+ * @param[out] out     The chunk's length and position.
+ * @param[in]  timeout (optional) The timeout for the transfer, in milliseconds, or 0 to wait forever.
+ * @return true if the whole chunk was received.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes; the transfer is cancelled.
+ * @see CHDKCamera::remote_capture_is_ready
+ */
+bool CHDKCamera::remote_capture_get_chunk(const uint32_t format, IPTPDataSink& sink, CHDKCaptureChunk& out, const int timeout)
+{
+    PTPTrace::Span span("CHDKCamera::remote_capture_get_chunk");
+
+    return this->_remote_capture_get_chunk(format, sink, out, PTPDeadline::from_timeout(timeout));
+}
+
+bool CHDKCamera::_remote_capture_get_chunk(const uint32_t format, IPTPDataSink& sink, CHDKCaptureChunk& out, const PTPDeadline& deadline)
+{
+    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    cmd.add_param(PTP_CHDK_RemoteCaptureGetData);
+    cmd.add_param(format);
+
+    PTPContainer data, resp;
+    bool received = this->ptp_transaction(cmd, data, sink, resp, deadline);
+
+    out.length = resp.get_param_n(0);
+    out.more = (resp.get_param_n(1) != 0);
+    uint32_t position = resp.get_param_n(2);
+    out.position = (position == 0xFFFFFFFF) ? -1 : (int64_t) position;
+
+    return received && resp.code == CHDK_PTP_RC_OK;
+}
+
+/**
+ * @brief Take a picture and stream it straight to the host
+ *
+ * The shot is never written to the SD card: as each chunk becomes ready it
+ * is received straight into \a basename.jpg for \c PTP_CHDK_CAPTURE_JPG,
+ * and \a basename.raw for \c PTP_CHDK_CAPTURE_RAW, or \a basename.dng with
+ * \c PTP_CHDK_CAPTURE_DNGHDR as well.  If the shot isn't received whole,
+ * the files are removed.
+ *
+ * @param[in]  formats  A mask of \c PTP_CHDK_CAPTURE_* formats to capture.
+ * @param[in]  basename The path to write the files to, without an extension.
+ * @param[in]  timeout  (optional) The timeout for the whole shot, in milliseconds, or 0 to wait forever.
+ * @param[out] stats    (optional) Filled in with how long the shot took to reach the host.
+ * @return true if every format requested was received.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes.
+ * @see CHDKCamera::remote_shoot(const uint32_t, IPTPDataSink&, IPTPDataSink&, const int, CHDKCaptureStats *)
+ */
+bool CHDKCamera::remote_shoot(const uint32_t formats, const std::string basename, const int timeout, CHDKCaptureStats * stats)
+{
+    PTPTrace::Span span("CHDKCamera::remote_shoot");
+
+    const bool dng = (formats & PTP_CHDK_CAPTURE_DNGHDR) != 0;
+    CaptureFileSink jpg(basename + ".jpg");
+    CaptureFileSink raw(basename + (dng ? ".dng" : ".raw"));
+
+    bool ok = false;
+    try
+    {
+        ok = this->remote_shoot(formats, jpg, raw, timeout, stats);
+    }
+    catch (...)
+    {
+        jpg.discard();
+        raw.discard();
+        throw;
+    }
+    if (!ok)
+    {
+        jpg.discard();
+        raw.discard();
+    }
+
+    return ok;
+}
+
+/**
+ * @brief Take a picture and stream each format into a sink of its own
+ *
+ * The shot is never written to the SD card: as each chunk becomes ready it
+ * is received into one reused buffer, and handed to the format's sink with
+ * \c IPTPDataSink::write at its place in the file.  Where a chunk goes is
+ * only known once it has arrived, and a file's size only once its last
+ * chunk has, so each sink's \c IPTPDataSink::begin is called with 0 before
+ * the shot is taken, and \c IPTPDataSink::end once it is over, either way.
+ * A DNG header comes first in \a raw_sink, and the RAW data follows it.
+ * Readiness is polled with the same adaptive backoff as
+ * \c CHDKCamera::_wait_for_script_return.
+ *
+ * If the shot can't be finished, because of a timeout, a chunk which
+ * fails, or anything thrown, the capture script is killed and remote
+ * capture turned off before returning, so the camera isn't left waiting
+ * for the rest to be collected.
+ *
+ * @param[in]  formats  A mask of \c PTP_CHDK_CAPTURE_* formats to capture.
+ * @param[in]  jpg_sink Where \c PTP_CHDK_CAPTURE_JPG goes; unused without it.
+ * @param[in]  raw_sink Where \c PTP_CHDK_CAPTURE_DNGHDR and \c PTP_CHDK_CAPTURE_RAW go; unused without them.
+ * @param[in]  timeout  (optional) The timeout for the whole shot, in milliseconds, or 0 to wait forever.
+ * @param[out] stats    (optional) Filled in with how long the shot took to reach the host.
+ * @return true if every format requested was received.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes.
+ */
+bool CHDKCamera::remote_shoot(const uint32_t formats, IPTPDataSink& jpg_sink, IPTPDataSink& raw_sink, const int timeout, CHDKCaptureStats * stats)
+{
+    PTPTrace::Span span("CHDKCamera::remote_shoot");
+
+    const PTPDeadline deadline = PTPDeadline::from_timeout(timeout);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point first_ready = start;
+
+    // The DNG header comes first, and the RAW data follows it in the same file
+    const uint32_t order[] = { PTP_CHDK_CAPTURE_DNGHDR, PTP_CHDK_CAPTURE_RAW, PTP_CHDK_CAPTURE_JPG };
+    const bool dng = (formats & PTP_CHDK_CAPTURE_DNGHDR) != 0;
+    const bool jpg_begun = (formats & PTP_CHDK_CAPTURE_JPG) && jpg_sink.begin(0);
+    const bool raw_begun = (formats & (PTP_CHDK_CAPTURE_RAW | PTP_CHDK_CAPTURE_DNGHDR)) && raw_sink.begin(0);
+
+    bool ok = (jpg_begun == ((formats & PTP_CHDK_CAPTURE_JPG) != 0))
+        && (raw_begun == ((formats & (PTP_CHDK_CAPTURE_RAW | PTP_CHDK_CAPTURE_DNGHDR)) != 0));
+
+    char script[128];
+    snprintf(script, sizeof script, "init_usb_capture(%u) shoot() init_usb_capture(0)", (unsigned int) formats);
+    uint32_t status = PTP_CHDK_S_ERRTYPE_NONE;
+    uint32_t script_id = 0;
+    bool started = false;
+    uint32_t remaining = 0;
+    uint64_t positions[3] = { 0, 0, 0 };
+    uint64_t dng_header_size = 0;
+    uint64_t bytes = 0;
+    std::vector<unsigned char> buffer;
+    uint32_t image_number = 0;
+    bool seen_ready = false;
+    std::chrono::microseconds backoff(100);
+
+    try
+    {
+        if (ok)
+        {
+            script_id = this->execute_lua(script, &status);
+            ok = started = (status == PTP_CHDK_S_ERRTYPE_NONE);
+        }
+        remaining = ok ? formats : 0;
+
+        while (ok && remaining != 0)
+        {
+            uint32_t ready = this->remote_capture_is_ready(&image_number);
+            if (ready == 0 || (ready & PTP_CHDK_CAPTURE_NOTSET) || (ready & remaining) == 0)
+            {
+                // Not shot yet, or the script hasn't set capture up yet
+                if (deadline.expired())
+                {
+                    throw ERR_TIMEOUT;
+                }
+                std::this_thread::sleep_for(backoff);
+                if (backoff < std::chrono::milliseconds(10))
+                {
+                    backoff *= 2;
+                }
+                continue;
+            }
+            if (!seen_ready)
+            {
+                first_ready = std::chrono::steady_clock::now();
+                seen_ready = true;
+            }
+            backoff = std::chrono::microseconds(100);
+
+            for (int i = 0; i < 3 && ok; i++)
+            {
+                const uint32_t format = order[i];
+                if (!(ready & remaining & format) || (format == PTP_CHDK_CAPTURE_RAW && dng && (remaining & PTP_CHDK_CAPTURE_DNGHDR)))
+                {
+                    continue;
+                }
+
+                // Take every chunk of this format that's ready
+                IPTPDataSink& sink = (format == PTP_CHDK_CAPTURE_JPG) ? jpg_sink : raw_sink;
+                const uint64_t base = (format == PTP_CHDK_CAPTURE_RAW) ? dng_header_size : 0;
+                CHDKCaptureChunk chunk;
+                chunk.more = true;
+                while (ok && chunk.more)
+                {
+                    ChunkSink received(buffer);
+                    ok = this->_remote_capture_get_chunk(format, received, chunk, deadline)
+                        && chunk.length == buffer.size();
+                    if (ok)
+                    {
+                        if (chunk.position >= 0)
+                        {
+                            positions[i] = chunk.position;
+                        }
+                        ok = sink.write(base + positions[i], buffer.data(), chunk.length);
+                        positions[i] += chunk.length;
+                        bytes += chunk.length;
+                    }
+                }
+                if (ok)
+                {
+                    remaining &= ~format;
+                    if (format == PTP_CHDK_CAPTURE_DNGHDR)
+                    {
+                        dng_header_size = positions[i];
+                    }
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+        if (jpg_begun)
+        {
+            jpg_sink.end(false);
+        }
+        if (raw_begun)
+        {
+            raw_sink.end(false);
+        }
+        if (started)
+        {
+            this->_abandon_capture(script_id);
+        }
+        throw;
+    }
+
+    if (jpg_begun)
+    {
+        ok = jpg_sink.end(ok) && ok;
+    }
+    if (raw_begun)
+    {
+        ok = raw_sink.end(ok) && ok;
+    }
+
+    if (started && remaining == 0)
+    {
+        // Collect the script's return, so it isn't left for the next one
+        this->_wait_for_script_return(capture_linger, script_id);
+    }
+    else if (started)
+    {
+        this->_abandon_capture(script_id);
+    }
+
+    if (stats != NULL)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        stats->bytes = bytes;
+        stats->image_number = image_number;
+        stats->ready_ms = std::chrono::duration<double, std::milli>(first_ready - start).count();
+        stats->transfer_ms = std::chrono::duration<double, std::milli>(now - first_ready).count();
+        stats->total_ms = std::chrono::duration<double, std::milli>(now - start).count();
+    }
+
+    return ok;
+}
+
+/**
+ * @brief Stop a remote capture which won't be finished
+ *
+ * A capture script whose chunks are never collected holds the camera in
+ * \c shoot() until CHDK gives up on it.  Starting another script kills it,
+ * and that script turns remote capture off, so the camera is ready for the
+ * next shot straight away.  Whatever the killed script left behind is read
+ * and thrown away.  Nothing here throws; the camera may already be gone.
+ *
+ * @param[in] script_id The capture script.
+ */
+void CHDKCamera::_abandon_capture(const uint32_t script_id)
+{
+    PTPTrace::Span span("CHDKCamera::_abandon_capture");
+
+    try
+    {
+        uint32_t status = PTP_CHDK_S_ERRTYPE_NONE;
+        uint32_t id = this->execute_lua("init_usb_capture(0)", &status);
+        if (status == PTP_CHDK_S_ERRTYPE_NONE)
+        {
+            this->_wait_for_script_return(capture_linger, id);
+        }
+
+        CHDKScriptMessage msg;
+        while (this->read_script_message(msg, script_id))
+        {
+        }
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+    }
+}
+
+/**
+ * @brief Download a file from the camera into \a sink
+ *
+ * CHDK downloads take two transactions: \c PTP_CHDK_TempData hands the camera
+ * the name of the file, then \c PTP_CHDK_DownloadFile sends it back as the
+ * data phase.  Both run under the session lock, so nothing can slip in
+ * between them.  The data phase is streamed into \a sink as it arrives (see
+ * \c PTPBase::recv_ptp_data), so the file is never held in memory as a whole.
+ *
+ * @param[in]  remote_filename The path and name of the file on the camera
+ * @param[out] sink            Where the file's contents go
+ * @param[in]  timeout         (optional) The timeout for the whole download, in milliseconds, or 0 to wait forever
+ * @param[in]  progress        (optional) Called as the file arrives, with the bytes received so far and the file size
+ * @param[out] stats           (optional) Filled in with the size of the file and how long the download took
+ * @return True if the camera sent the file and \a sink kept it
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes; the download is cancelled.
+ * @exception PTP::ERR_DATASINK_FAILED if \a sink refuses the data; the download is cancelled.
+ * @see PTPBase::ptp_transaction(PTPContainer& cmd, PTPContainer& data, IPTPDataSink& sink, PTPContainer& out_resp, const PTPDeadline& deadline, const PTPProgressCallback& progress)
+ */
+bool CHDKCamera::download_file(const std::string remote_filename, IPTPDataSink& sink, const int timeout, const PTPProgressCallback& progress, PTPTransferStats * stats)
+{
+    PTPTrace::Span span("CHDKCamera::download_file");
+
+    const PTPDeadline deadline = PTPDeadline::from_timeout(timeout);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    PTPContainer data(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+    PTPContainer resp, out_data;
+
+    std::lock_guard<std::recursive_mutex> lock(this->session_mutex());
+
+    // Tell the camera which file we want
+    cmd.add_param(PTP_CHDK_TempData);
+    cmd.add_param(PTP_CHDK_TD_DOWNLOAD);
+    data.set_payload(remote_filename.data(), remote_filename.length());
+
+    this->ptp_transaction(cmd, data, false, resp, out_data, deadline);
+    if (resp.code != CHDK_PTP_RC_OK)
+    {
+        return false;
+    }
+
+    // And ask for it
+    cmd.reset(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    cmd.add_param(PTP_CHDK_DownloadFile);
+    data.reset(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+
+    uint64_t received = 0;
+    PTPProgressCallback counting = [&received, &progress](uint64_t done, uint64_t total)
+    {
+        received = done;
+        if (progress)
+        {
+            progress(done, total);
+        }
+    };
+
+    bool got_file = this->ptp_transaction(cmd, data, sink, resp, deadline, counting);
+
+    if (stats != NULL)
+    {
+        stats->bytes = received;
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    return got_file && resp.code == CHDK_PTP_RC_OK;
+}
+
+/**
+ * @brief Download a file from the camera straight into a local file
+ *
+ * The local file is created at its full size and memory-mapped (see
+ * \c PTPFileSink), so USB reads land directly in the page cache.
+ *
+ * @param[in]  remote_filename The path and name of the file on the camera
+ * @param[in]  local_filename  The path and name of the local file to create
+ * @param[in]  timeout         (optional) The timeout for the whole download, in milliseconds, or 0 to wait forever
+ * @param[in]  progress        (optional) Called as the file arrives, with the bytes received so far and the file size
+ * @param[out] stats           (optional) Filled in with the size of the file and how long the download took
+ * @return True on success
+ * @see CHDKCamera::download_file(const std::string remote_filename, IPTPDataSink& sink, const int timeout, const PTPProgressCallback& progress, PTPTransferStats * stats)
+ */
+bool CHDKCamera::download_file(const std::string remote_filename, const std::string local_filename, const int timeout, const PTPProgressCallback& progress, PTPTransferStats * stats)
+{
+    PTPFileSink sink(local_filename);
+    return this->download_file(remote_filename, sink, timeout, progress, stats);
+}
+
+/**
+ * @brief Checksum a file on the camera, without downloading it
+ *
+ * The camera reads the file and computes its CRC-32C in Lua (see
+ * \c CHDKCamera::crc32c_script), which is slow, but costs the bus nothing.
+ *
+ * @param[in]  remote_filename The path and name of the file on the camera.
+ * @param[out] crc             The file's CRC-32C.
+ * @param[out] size            (optional) The file's size.
+ * @param[in]  timeout         (optional) Milliseconds to wait for the camera, or 0 to wait forever.
+ * @return false if the file couldn't be read.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes.
+ * @see CRC32C
+ */
+bool CHDKCamera::get_file_crc32c(const std::string remote_filename, uint32_t& crc, uint64_t * size, const int timeout)
+{
+    PTPTrace::Span span("CHDKCamera::get_file_crc32c");
+
+    CHDKTable result;
+    if (!this->run_lua("local path = " + lua_string(remote_filename) + "\n" + CHDKCamera::crc32c_script, result, timeout))
+    {
+        return false;
+    }
+
+    int32_t value = 0;
+    long index = result.find("crc");
+    if (index < 0 || !result.get_integer(index, value))
+    {
+        return false;
+    }
+    crc = (uint32_t) value;
+
+    if (size != NULL)
+    {
+        index = result.find("size");
+        *size = (index >= 0 && result.get_integer(index, value)) ? (uint32_t) value : 0;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Download a file, and check it against a checksum taken on the camera
+ *
+ * The CRC-32C of the download is computed as it streams in, and compared
+ * with the one \c CHDKCamera::get_file_crc32c has the camera compute, so
+ * the transfer is verified without being read twice.
+ *
+ * @param[in]  remote_filename The path and name of the file on the camera.
+ * @param[in]  local_filename  The path and name of the local file to create.
+ * @param[in]  timeout         (optional) Milliseconds for the download and the checksum, or 0 to wait forever.
+ * @param[in]  progress        (optional) Called as the file arrives, with the bytes received so far and the file size.
+ * @param[out] stats           (optional) Filled in with the size of the file and how long the download took.
+ * @param[out] crc             (optional) The file's CRC-32C, as downloaded.
+ * @return true if the file downloaded and the checksums match.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes.
+ */
+bool CHDKCamera::download_file_verified(const std::string remote_filename, const std::string local_filename, const int timeout, const PTPProgressCallback& progress, PTPTransferStats * stats, uint32_t * crc)
+{
+    PTPTrace::Span span("CHDKCamera::download_file_verified");
+
+    const PTPDeadline deadline = PTPDeadline::from_timeout(timeout);
+
+    PTPFileSink file(local_filename);
+    CRC32CSink sink(file);
+    if (!this->download_file(remote_filename, sink, deadline.remaining_ms(), progress, stats))
+    {
+        return false;
+    }
+    if (crc != NULL)
+    {
+        *crc = sink.get_value();
+    }
+
+    uint32_t remote_crc = 0;
+    uint64_t remote_size = 0;
+    if (!this->get_file_crc32c(remote_filename, remote_crc, &remote_size, deadline.remaining_ms()))
+    {
+        return false;
+    }
+
+    return remote_crc == sink.get_value() && remote_size == sink.get_size();
+}
+
+/**
+ * @brief Mirror a directory on the camera, fetching only what is new or changed
+ *
+ * One script lists every file under \a remote_directory with its size and
+ * modification time.  That manifest is compared with an index kept in
+ * \a local_directory (see \c CHDKCamera::sync_index_name) from the last
+ * sync, and only files which aren't in it, have changed, or are missing
+ * locally are downloaded, each streamed straight to disk.  So re-syncing a
+ * full card costs one listing and the new shots.
+ *
+ * Each file is downloaded to a ".part" file next to it, which replaces the
+ * local copy only once all of it has arrived; a failed download leaves the
+ * old copy alone.  Names which would leave \a local_directory (absolute,
+ * or with a ".." component) aren't fetched, and count as failures.
+ *
+ * Files deleted from the camera are left in \a local_directory.  The index
+ * is saved even if the sync is interrupted, so files already fetched
+ * aren't fetched again.
+ *
+ * @param[in]  remote_directory The directory on the camera, such as "A/DCIM".
+ * @param[in]  local_directory  The directory to mirror it to.  It must exist;
+ *                              subdirectories are created as needed.
+ * @param[in]  timeout          (optional) Milliseconds for the whole sync, or 0 to wait forever.
+ * @param[out] stats            (optional) What was found and fetched.
+ * @return true if every file is now mirrored.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes.
+ */
+bool CHDKCamera::sync_directory(const std::string remote_directory, const std::string local_directory, const int timeout, CHDKSyncStats * stats)
+{
+    PTPTrace::Span span("CHDKCamera::sync_directory");
+
+    const PTPDeadline deadline = PTPDeadline::from_timeout(timeout);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    CHDKSyncStats unused;
+    CHDKSyncStats& out = (stats != NULL) ? *stats : unused;
+    out = CHDKSyncStats();
+
+    CHDKTable manifest;
+    if (!this->run_lua("local root = " + lua_string(remote_directory) + "\n" + CHDKCamera::sync_manifest_script, manifest, deadline.remaining_ms()))
+    {
+        return false;
+    }
+    out.manifest_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const std::string index_name = local_directory + "/" + CHDKCamera::sync_index_name;
+    std::map<std::string, SyncEntry> index;
+    load_sync_index(index_name, index);
+
+    std::set<std::string> listed;
+    std::string partial; // A download in progress, removed if it doesn't finish
+    bool ok = true;
+    try
+    {
+        for (size_t i = 0; i < manifest.size(); i++)
+        {
+            const std::string name = manifest.get_key(i);
+            char * comma = NULL;
+            SyncEntry entry;
+            entry.size = std::strtoull(manifest.get_value(i), &comma, 10);
+            entry.mtime = (*comma == ',') ? std::strtoull(comma + 1, NULL, 10) : 0;
+            listed.insert(name);
+            out.files++;
+
+            if (!is_contained_path(name))
+            {
+                // Never written outside local_directory, whatever the camera says
+                out.files_failed++;
+                ok = false;
+                continue;
+            }
+
+            const std::string local_filename = local_directory + "/" + name;
+            std::map<std::string, SyncEntry>::const_iterator known = index.find(name);
+            struct stat st;
+            if (known != index.end() && known->second.size == entry.size && known->second.mtime == entry.mtime &&
+                stat(local_filename.c_str(), &st) == 0 && (uint64_t) st.st_size == entry.size)
+            {
+                out.files_unchanged++;
+                continue;
+            }
+
+            // The index only vouches for the camera's new copy once it has
+            //  arrived, so if the download fails, the next sync tries again
+            index.erase(name);
+
+            // Downloaded alongside, so a failure leaves the old copy as it was
+            make_parent_directories(local_filename);
+            partial = local_filename + ".part";
+            PTPTransferStats transfer;
+            if (this->download_file(remote_directory + "/" + name, partial, deadline.remaining_ms(), PTPProgressCallback(), &transfer) &&
+                transfer.bytes == entry.size && rename(partial.c_str(), local_filename.c_str()) == 0)
+            {
+                index[name] = entry;
+                out.files_downloaded++;
+                out.bytes += transfer.bytes;
+            }
+            else
+            {
+                unlink(partial.c_str());
+                out.files_failed++;
+                ok = false;
+            }
+            partial.clear();
+        }
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+        if (!partial.empty())
+        {
+            unlink(partial.c_str());
+        }
+        save_sync_index(index_name, index);
+        out.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        throw;
+    }
+
+    // Forget what is no longer on the camera
+    for (std::map<std::string, SyncEntry>::iterator it = index.begin(); it != index.end();)
+    {
+        if (listed.count(it->first) == 0)
+        {
+            index.erase(it++);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    ok = save_sync_index(index_name, index) && ok;
+    out.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    return (resp.get_param_n(0) == CHDK_PTP_RC_OK);
+    return ok;
 }
 
 } /* namespace PTP */
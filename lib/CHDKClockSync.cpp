@@ -0,0 +1,271 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file CHDKClockSync.cpp
+ *
+ * @brief Estimates the offset and drift between a camera's clock and the host's
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#include "libeasyptp/PTPErrors.hpp"
+#include "libeasyptp/CHDKClockSync.hpp"
+#include "libeasyptp/PTPDeadline.hpp"
+#include "libeasyptp/PTPTrace.hpp"
+
+namespace EasyPTP
+{
+
+namespace
+{
+
+double now_us()
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}
+
+/**
+ * @brief Create an estimator for \a camera, without sampling it yet
+ *
+ * @param[in] camera     The camera.
+ * @param[in] max_points (optional) How many bursts to fit the drift over;
+ *                       older ones are forgotten, so the estimate follows
+ *                       the drift as it changes with temperature.
+ */
+CHDKClockSync::CHDKClockSync(CHDKCamera * camera, const size_t max_points) :
+rpc(camera), max_points(max_points < 1 ? 1 : max_points), samples(0),
+last_raw_tick(0), last_tick(0), offset(0), slope(0), tick_mean(0), residual_us(0)
+{
+}
+
+/**
+ * @brief Make a burst of round trips, and refit the clock with the quickest
+ *
+ * Starts the agent the first time it is called.
+ *
+ * @param[in] burst   (optional) How many round trips to choose the quickest from.
+ * @param[in] timeout (optional) Milliseconds to wait for the whole burst, or 0 to wait forever.
+ * @return true if a point was added; false if the agent couldn't be started.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes.
+ */
+bool CHDKClockSync::sample(const int burst, const int timeout)
+{
+    PTPTrace::Span span("CHDKClockSync::sample");
+
+    const PTPDeadline deadline = PTPDeadline::from_timeout(timeout);
+    if (!this->rpc.is_running())
+    {
+        if (!this->rpc.start(deadline.remaining_ms()) || !this->rpc.define("tick", "return get_tick_count()", deadline.remaining_ms()))
+        {
+            return false;
+        }
+    }
+
+    const std::vector<std::string> no_args;
+    std::string result;
+    Point best = { 0, 0, 0 };
+    for (int i = 0; i < burst || best.rtt_us == 0; i++)
+    {
+        double sent = now_us();
+        if (!this->rpc.call("tick", no_args, &result, deadline.remaining_ms()))
+        {
+            return false;
+        }
+        double received = now_us();
+
+        uint32_t raw = (uint32_t) std::strtoll(result.c_str(), NULL, 10);
+        if (this->samples++ == 0)
+        {
+            this->last_raw_tick = raw;
+            this->last_tick = raw;
+        }
+        int64_t tick = this->unwrap(raw);
+        this->last_raw_tick = raw;
+        this->last_tick = tick;
+
+        double rtt = received - sent;
+        if (best.rtt_us == 0 || rtt < best.rtt_us)
+        {
+            // The camera's time is somewhere in the tick it read; take the middle
+            best.host_us = (sent + received) / 2;
+            best.tick_us = (double) tick * CHDKClockSync::tick_us + CHDKClockSync::tick_us / 2.0;
+            best.rtt_us = (rtt > 0) ? rtt : 1e-3;
+        }
+    }
+
+    this->points.push_back(best);
+    while (this->points.size() > this->max_points)
+    {
+        this->points.pop_front();
+    }
+    this->fit();
+
+    return true;
+}
+
+/**
+ * @brief Stop the agent, freeing the camera's script system
+ *
+ * The estimate is kept, and the agent started again by the next
+ * \c CHDKClockSync::sample.
+ *
+ * @param[in] timeout (optional) Milliseconds to wait for the agent to exit, or 0 to wait forever.
+ * @return true if the agent acknowledged.
+ */
+bool CHDKClockSync::stop(const int timeout)
+{
+    return this->rpc.stop(timeout);
+}
+
+/**
+ * @brief Whether there has been a sample to convert with
+ */
+bool CHDKClockSync::is_synchronized() const
+{
+    return !this->points.empty();
+}
+
+/**
+ * @brief When, on the host's steady clock, the camera's tick count read \a tick
+ *
+ * That is, the middle of the millisecond the tick count spent at \a tick.
+ *
+ * @param[in] tick A value of \c get_tick_count() on the camera.  It is
+ *                 unwrapped against the last sample, so must be within 24
+ *                 days of it.
+ * @exception PTP::ERR_CLOCKSYNC_NOT_SYNCHRONIZED if there has been no sample yet.
+ */
+std::chrono::steady_clock::time_point CHDKClockSync::to_host(const int64_t tick) const
+{
+    if (this->points.empty())
+    {
+        throw ERR_CLOCKSYNC_NOT_SYNCHRONIZED;
+    }
+
+    // The middle of the tick, as for the samples
+    double tick_us = (double) this->unwrap((uint32_t) tick) * CHDKClockSync::tick_us + CHDKClockSync::tick_us / 2.0;
+    double host_us = tick_us + this->offset + this->slope * (tick_us - this->tick_mean);
+
+    return std::chrono::steady_clock::time_point(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::micro>(host_us)));
+}
+
+/**
+ * @brief What the camera's tick count read, or will read, at \a time
+ *
+ * @param[in] time A time on the host's steady clock.
+ * @return The tick count, unwrapped; it may be more than 32 bits.
+ * @exception PTP::ERR_CLOCKSYNC_NOT_SYNCHRONIZED if there has been no sample yet.
+ */
+int64_t CHDKClockSync::to_camera(const std::chrono::steady_clock::time_point time) const
+{
+    if (this->points.empty())
+    {
+        throw ERR_CLOCKSYNC_NOT_SYNCHRONIZED;
+    }
+
+    double host_us = std::chrono::duration<double, std::micro>(time.time_since_epoch()).count();
+    double tick_us = (host_us - this->offset + this->slope * this->tick_mean) / (1 + this->slope);
+
+    return (int64_t) std::floor(tick_us / CHDKClockSync::tick_us);
+}
+
+/**
+ * @brief How well the camera's clock is known
+ */
+CHDKClockReport CHDKClockSync::get_report() const
+{
+    CHDKClockReport report;
+    report.samples = this->samples;
+    report.points = this->points.size();
+    if (this->points.empty())
+    {
+        return report;
+    }
+
+    const Point& last = this->points.back();
+    report.best_rtt_us = this->points[0].rtt_us;
+    for (size_t i = 1; i < this->points.size(); i++)
+    {
+        if (this->points[i].rtt_us < report.best_rtt_us)
+        {
+            report.best_rtt_us = this->points[i].rtt_us;
+        }
+    }
+    report.offset_us = this->offset + this->slope * (last.tick_us - this->tick_mean);
+    report.drift_ppm = this->slope * 1e6;
+    report.residual_us = this->residual_us;
+    report.accuracy_us = report.best_rtt_us / 2 + CHDKClockSync::tick_us / 2.0 + this->residual_us;
+
+    return report;
+}
+
+/**
+ * Unwrap a 32 bit tick count against the last one seen.
+ */
+int64_t CHDKClockSync::unwrap(const uint32_t raw) const
+{
+    return this->last_tick + (int32_t) (raw - this->last_raw_tick);
+}
+
+/**
+ * Fit host - camera time against camera time, by least squares.
+ */
+void CHDKClockSync::fit()
+{
+    const size_t n = this->points.size();
+
+    double tick_sum = 0;
+    double offset_sum = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        tick_sum += this->points[i].tick_us;
+        offset_sum += this->points[i].host_us - this->points[i].tick_us;
+    }
+    this->tick_mean = tick_sum / n;
+    this->offset = offset_sum / n;
+
+    double sxy = 0;
+    double sxx = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        double dx = this->points[i].tick_us - this->tick_mean;
+        double dy = this->points[i].host_us - this->points[i].tick_us - this->offset;
+        sxy += dx * dy;
+        sxx += dx * dx;
+    }
+    this->slope = (sxx > 0) ? sxy / sxx : 0;
+
+    double squares = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        double dx = this->points[i].tick_us - this->tick_mean;
+        double dy = this->points[i].host_us - this->points[i].tick_us - this->offset;
+        squares += (dy - this->slope * dx) * (dy - this->slope * dx);
+    }
+    this->residual_us = std::sqrt(squares / n);
+}
+
+} /* namespace PTP */
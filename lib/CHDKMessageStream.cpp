@@ -0,0 +1,305 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file CHDKMessageStream.cpp
+ *
+ * @brief A queued, backpressured stream of script messages
+ */
+
+#include "libeasyptp/PTPErrors.hpp"
+#include "libeasyptp/CHDKMessageStream.hpp"
+#include "libeasyptp/CHDKCamera.hpp"
+#include "libeasyptp/PTPTrace.hpp"
+#include "libeasyptp/PTPDeadline.hpp"
+#include "libeasyptp/chdk/ptp.h"
+
+namespace EasyPTP
+{
+
+/**
+ * @brief Start a stream to script \a script_id
+ *
+ * @param[in] camera    The camera the script runs on.
+ * @param[in] script_id The script, as returned by \c CHDKCamera::execute_lua; 0 for whichever is running.
+ * @param[in] depth     (optional) How many messages may be queued before \c CHDKMessageStream::send blocks.
+ * @param[in] stall_timeout (optional) Milliseconds one message may be refused with \c PTP_CHDK_S_MSGSTATUS_QFULL
+ *                      before the stream fails; 0 to wait forever.
+ */
+CHDKMessageStream::CHDKMessageStream(CHDKCamera * camera, const uint32_t script_id, const size_t depth, const int stall_timeout) :
+camera(camera), script_id(script_id), stall_timeout(stall_timeout), slots(depth < 1 ? 1 : depth), head(0), count(0), stopping(false), failed(false),
+status(PTP_CHDK_S_MSGSTATUS_OK), total_latency_us(0)
+{
+    for (size_t i = 0; i < this->slots.size(); i++)
+    {
+        this->slots[i].data.reset(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+        this->slots[i].data.resize_payload(CHDKMessageStream::default_message_size);
+    }
+    this->cmd.resize_payload(3 * sizeof (uint32_t));
+
+    this->thread = std::thread(&CHDKMessageStream::run, this);
+}
+
+/**
+ * @brief Sends what is queued, then stops
+ */
+CHDKMessageStream::~CHDKMessageStream()
+{
+    this->stop();
+}
+
+/**
+ * @brief Queue a message
+ *
+ * @param[in] message The message.
+ * @param[in] length  Its length.
+ * @param[in] timeout (optional) Milliseconds to wait for room in the queue, or 0 to wait forever.
+ * @return false if the stream has failed or stopped, or \a timeout passed.
+ */
+bool CHDKMessageStream::send(const char * message, const uint32_t length, const int timeout)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    const std::chrono::steady_clock::time_point until = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    while (this->count == this->slots.size() && !this->failed && !this->stopping)
+    {
+        if (timeout == 0)
+        {
+            this->sent.wait(lock);
+        }
+        else if (this->sent.wait_until(lock, until) == std::cv_status::timeout && this->count == this->slots.size())
+        {
+            return false;
+        }
+    }
+    if (this->failed || this->stopping)
+    {
+        return false;
+    }
+
+    // Copied into the slot's own payload, which keeps its size between messages
+    Slot& slot = this->slots[(this->head + this->count) % this->slots.size()];
+    slot.data.reset(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+    slot.data.set_payload(message, length);
+    slot.queued = std::chrono::steady_clock::now();
+    if (this->started == std::chrono::steady_clock::time_point())
+    {
+        this->started = slot.queued;
+    }
+    this->count++;
+
+    // The sender only waits when there was nothing to send
+    if (this->count == 1)
+    {
+        this->queued.notify_one();
+    }
+    return true;
+}
+
+/**
+ * @brief Queue a message
+ *
+ * @see CHDKMessageStream::send(const char * message, const uint32_t length, const int timeout)
+ */
+bool CHDKMessageStream::send(const std::string& message, const int timeout)
+{
+    return this->send(message.data(), message.length(), timeout);
+}
+
+/**
+ * @brief Wait until every queued message has been accepted
+ *
+ * @param[in] timeout (optional) Milliseconds to wait, or 0 to wait forever.
+ * @return false if the stream failed, or \a timeout passed.
+ */
+bool CHDKMessageStream::flush(const int timeout)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    const std::chrono::steady_clock::time_point until = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    while (this->count > 0 && !this->failed)
+    {
+        if (timeout == 0)
+        {
+            this->sent.wait(lock);
+        }
+        else if (this->sent.wait_until(lock, until) == std::cv_status::timeout && this->count > 0)
+        {
+            return false;
+        }
+    }
+
+    return !this->failed;
+}
+
+/**
+ * @brief Send what is queued, and stop the sender thread
+ *
+ * No more messages can be queued afterwards.  If the script has stopped
+ * taking messages, this returns once the message being sent has been
+ * refused for the stall timeout, and the rest are dropped.
+ */
+void CHDKMessageStream::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->queued.notify_one();
+    this->sent.notify_all();
+
+    if (this->thread.joinable())
+    {
+        this->thread.join();
+    }
+}
+
+/**
+ * @brief Whether the script stopped taking messages
+ *
+ * @see CHDKMessageStream::get_status
+ */
+bool CHDKMessageStream::is_failed() const
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->failed;
+}
+
+/**
+ * @brief Why the stream failed
+ *
+ * @return The \c ptp_chdk_script_msg_status the camera refused a message
+ *         with; \c PTP_CHDK_S_MSGSTATUS_NOTRUN if the transaction itself
+ *         failed; or \c PTP_CHDK_S_MSGSTATUS_OK if the stream hasn't failed.
+ */
+uint32_t CHDKMessageStream::get_status() const
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->status;
+}
+
+/**
+ * @brief What has been sent so far
+ */
+CHDKStreamStats CHDKMessageStream::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->stats;
+}
+
+/**
+ * The sender thread: sends the message at the head of the ring until the
+ * camera takes it, then frees its slot.  A message which isn't taken within
+ * the stall timeout fails the stream, so neither this thread nor
+ * \c CHDKMessageStream::stop can wait forever on a script which has stopped
+ * reading.
+ */
+void CHDKMessageStream::run()
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    for (;;)
+    {
+        while (this->count == 0 && !this->stopping)
+        {
+            this->queued.wait(lock);
+        }
+        if (this->count == 0)
+        {
+            return; // Stopping, with nothing left to send
+        }
+
+        // Producers only write past the queued messages, so the head slot is
+        //  ours until it is released
+        Slot& slot = this->slots[this->head];
+        lock.unlock();
+
+        PTPTrace::Span span("CHDKMessageStream::send");
+        const PTPDeadline deadline = PTPDeadline::from_timeout(this->stall_timeout);
+        uint32_t result = PTP_CHDK_S_MSGSTATUS_OK;
+        uint32_t queue_full = 0;
+        std::chrono::microseconds backoff(100);
+        try
+        {
+            for (;;)
+            {
+                this->cmd.reset(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+                this->cmd.add_param(PTP_CHDK_WriteScriptMsg);
+                this->cmd.add_param(this->script_id);
+                this->camera->ptp_transaction(this->cmd, slot.data, false, this->resp, this->out_data);
+
+                result = this->resp.get_param_n(0);
+                if (result != PTP_CHDK_S_MSGSTATUS_QFULL || deadline.expired())
+                {
+                    break; // Taken, refused for good, or stalled for too long
+                }
+
+                // The script hasn't caught up; wait for it rather than fail
+                queue_full++;
+                std::this_thread::sleep_for(backoff);
+                if (backoff < std::chrono::milliseconds(5))
+                {
+                    backoff *= 2;
+                }
+            }
+        }
+        catch (LIBPTP_PP_ERRORS e)
+        {
+            result = PTP_CHDK_S_MSGSTATUS_NOTRUN;
+        }
+        const std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+
+        lock.lock();
+        this->stats.queue_full += queue_full;
+        if (result != PTP_CHDK_S_MSGSTATUS_OK)
+        {
+            // The script is gone; nothing queued can be delivered
+            this->failed = true;
+            this->status = result;
+            this->count = 0;
+            this->sent.notify_all();
+            return;
+        }
+
+        int size = 0;
+        slot.data.get_payload_ptr(&size);
+        double latency_us = std::chrono::duration<double, std::micro>(done - slot.queued).count();
+        this->stats.messages++;
+        this->stats.bytes += size;
+        this->total_latency_us += latency_us;
+        this->stats.mean_latency_us = this->total_latency_us / this->stats.messages;
+        if (latency_us > this->stats.max_latency_us)
+        {
+            this->stats.max_latency_us = latency_us;
+        }
+        this->stats.seconds = std::chrono::duration<double>(done - this->started).count();
+
+        this->head = (this->head + 1) % this->slots.size();
+        this->count--;
+
+        // Wake a blocked producer once half the ring is free, not for every
+        //  message, so it refills in batches; and flush once it's empty
+        if (this->count == 0 || this->count == this->slots.size() / 2)
+        {
+            this->sent.notify_all();
+        }
+    }
+}
+
+} /* namespace PTP */
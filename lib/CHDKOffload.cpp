@@ -0,0 +1,281 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ *
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file CHDKOffload.cpp
+ *
+ * @brief Parallel offload of files from a rig of cameras
+ */
+
+#include <atomic>
+#include <thread>
+
+#include "libeasyptp/PTPErrors.hpp"
+#include "libeasyptp/CHDKOffload.hpp"
+#include "libeasyptp/PTPDataSink.hpp"
+#include "libeasyptp/PTPTrace.hpp"
+
+namespace EasyPTP
+{
+
+/**
+ * One camera's share of the offload.  Only its own thread writes to it
+ * while it runs; the atomics are what other threads may read.
+ */
+struct CHDKOffload::Camera
+{
+    CHDKCamera * camera;
+    std::vector<CHDKDownload> files;
+    std::vector<CHDKTransferResult> results;
+    std::thread thread;
+
+    std::atomic<uint32_t> files_done;
+    std::atomic<uint32_t> files_ok;
+    std::atomic<uint64_t> bytes_done;
+    std::atomic<bool> finished;
+    std::chrono::steady_clock::time_point finished_at; // Valid once finished is set
+};
+
+/**
+ * @brief Create an empty offload
+ *
+ * @param[in] direct_io   (optional) Write files with \c O_DIRECT, keeping them out of the page cache.
+ * @param[in] preallocate (optional) Reserve each file's full size on disk before writing it.
+ * @see PTPUringFileSink
+ */
+CHDKOffload::CHDKOffload(const bool direct_io, const bool preallocate) :
+direct_io(direct_io), preallocate(preallocate)
+{
+}
+
+/**
+ * @brief Waits for a running offload to finish
+ */
+CHDKOffload::~CHDKOffload()
+{
+    this->wait();
+
+    for (size_t i = 0; i < this->cameras.size(); i++)
+    {
+        delete this->cameras[i];
+    }
+}
+
+/**
+ * @brief Add a camera, and the files to copy off it
+ *
+ * @param[in] camera The camera to download from.  Nothing else should use it while the offload runs.
+ * @param[in] files  The files to download, in order.
+ * @return The index of the camera, for \c CHDKOffload::get_progress and \c CHDKOffload::get_results.
+ */
+int CHDKOffload::add_camera(CHDKCamera * camera, const std::vector<CHDKDownload>& files)
+{
+    Camera * entry = new Camera;
+    entry->camera = camera;
+    entry->files = files;
+    entry->results.resize(files.size());
+    entry->files_done.store(0);
+    entry->files_ok.store(0);
+    entry->bytes_done.store(0);
+    entry->finished.store(false);
+
+    this->cameras.push_back(entry);
+    return this->cameras.size() - 1;
+}
+
+/**
+ * @brief The number of cameras added
+ */
+int CHDKOffload::get_camera_count() const
+{
+    return this->cameras.size();
+}
+
+/**
+ * @brief Start copying, one thread per camera, and return straight away
+ *
+ * If the offload has already been started, this waits for that run to
+ * finish, then copies everything again from the start.
+ *
+ * @param[in] timeout (optional) The timeout for each file, in milliseconds, or 0 to wait forever.
+ * @see CHDKOffload::wait
+ */
+void CHDKOffload::start(const int timeout)
+{
+    this->wait();
+    this->started = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < this->cameras.size(); i++)
+    {
+        Camera * camera = this->cameras[i];
+        camera->results.assign(camera->files.size(), CHDKTransferResult());
+        camera->files_done.store(0);
+        camera->files_ok.store(0);
+        camera->bytes_done.store(0);
+        camera->finished.store(false);
+        camera->thread = std::thread(&CHDKOffload::run_camera, this, camera, timeout);
+    }
+}
+
+/**
+ * @brief Wait for every camera to finish
+ */
+void CHDKOffload::wait()
+{
+    for (size_t i = 0; i < this->cameras.size(); i++)
+    {
+        if (this->cameras[i]->thread.joinable())
+        {
+            this->cameras[i]->thread.join();
+        }
+    }
+}
+
+/**
+ * @brief Copy everything, and return once it's done
+ *
+ * @param[in] timeout (optional) The timeout for each file, in milliseconds, or 0 to wait forever.
+ */
+void CHDKOffload::run(const int timeout)
+{
+    this->start(timeout);
+    this->wait();
+}
+
+/**
+ * @brief How far camera \a camera has got
+ *
+ * Safe to call while the offload runs.
+ */
+CHDKOffloadProgress CHDKOffload::get_progress(const int camera) const
+{
+    const Camera * entry = this->cameras.at(camera);
+
+    CHDKOffloadProgress out;
+    out.files_done = entry->files_done.load();
+    out.files_total = entry->files.size();
+    out.bytes_done = entry->bytes_done.load();
+    out.finished = entry->finished.load();
+    return out;
+}
+
+/**
+ * @brief What happened to each of camera \a camera's files
+ *
+ * @warning Only call this once the offload has finished.
+ */
+std::vector<CHDKTransferResult> CHDKOffload::get_results(const int camera) const
+{
+    return this->cameras.at(camera)->results;
+}
+
+/**
+ * @brief Totals across the rig
+ *
+ * Counts the files downloaded successfully, and their bytes plus those of
+ * the files being downloaded now, over the time since the offload started
+ * (or until it finished).  Safe to call while the offload runs.
+ */
+CHDKBatchStats CHDKOffload::get_stats() const
+{
+    CHDKBatchStats out;
+    bool all_finished = true;
+    std::chrono::steady_clock::time_point last = this->started;
+
+    for (size_t i = 0; i < this->cameras.size(); i++)
+    {
+        const Camera * entry = this->cameras[i];
+        out.files += entry->files_ok.load();
+        out.bytes += entry->bytes_done.load();
+
+        if (entry->finished.load())
+        {
+            if (entry->finished_at > last)
+            {
+                last = entry->finished_at;
+            }
+        }
+        else
+        {
+            all_finished = false;
+        }
+    }
+
+    if (!all_finished)
+    {
+        last = std::chrono::steady_clock::now();
+    }
+    out.seconds = std::chrono::duration<double>(last - this->started).count();
+
+    return out;
+}
+
+/**
+ * Download each of \a camera's files in turn, reusing one sink (and so one
+ * ring and one set of buffers) for all of them.
+ */
+void CHDKOffload::run_camera(Camera * camera, const int timeout)
+{
+    PTPTrace::Span span("CHDKOffload::run_camera");
+
+    PTPUringFileSink sink(std::string(), this->direct_io, this->preallocate);
+    uint64_t completed = 0;
+
+    for (size_t i = 0; i < camera->files.size(); i++)
+    {
+        const CHDKDownload& file = camera->files[i];
+        CHDKTransferResult& result = camera->results[i];
+
+        PTPProgressCallback progress = [camera, completed](uint64_t done, uint64_t total)
+        {
+            camera->bytes_done.store(completed + done, std::memory_order_relaxed);
+        };
+
+        // Nothing may escape this thread, or the whole process goes with it
+        try
+        {
+            sink.set_filename(file.local_filename);
+            result.ok = camera->camera->download_file(file.remote_filename, sink, timeout, progress, &result.stats);
+        }
+        catch (LIBPTP_PP_ERRORS e)
+        {
+            result.error = e;
+        }
+        catch (...)
+        {
+            result.ok = false;
+            result.exception = std::current_exception();
+        }
+
+        // Only count what was kept
+        if (result.ok)
+        {
+            completed += result.stats.bytes;
+            camera->files_ok.fetch_add(1);
+        }
+        camera->bytes_done.store(completed);
+        camera->files_done.fetch_add(1);
+    }
+
+    camera->finished_at = std::chrono::steady_clock::now();
+    camera->finished.store(true);
+}
+
+} /* namespace PTP */
@@ -0,0 +1,243 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file CHDKPropertyCache.cpp
+ *
+ * @brief Batched, cached reads of camera properties
+ */
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "libeasyptp/PTPErrors.hpp"
+#include "libeasyptp/CHDKPropertyCache.hpp"
+#include "libeasyptp/PTPTrace.hpp"
+#include "libeasyptp/chdk/ptp.h"
+
+namespace EasyPTP
+{
+
+/**
+ * The properties every cache knows, by name, as Lua expressions.  Ends
+ * with a pair of NULLs.
+ */
+const char * const CHDKPropertyCache::builtin_properties[][2] = {
+    { "tv96", "get_tv96()" },
+    { "av96", "get_av96()" },
+    { "sv96", "get_sv96()" },
+    { "bv96", "get_bv96()" },
+    { "iso_mode", "get_iso_mode()" },
+    { "iso_real", "get_iso_real()" },
+    { "battery_mv", "get_vbatt()" },
+    { "temperature_optical", "get_temperature(0)" },
+    { "temperature_ccd", "get_temperature(1)" },
+    { "temperature_battery", "get_temperature(2)" },
+    { "free_space_kb", "get_free_disk_space()" },
+    { "disk_size_kb", "get_disk_size()" },
+    { "focus", "get_focus()" },
+    { "zoom", "get_zoom()" },
+    { "flash_mode", "get_flash_mode()" },
+    { "shooting", "get_shooting()" },
+    { "exposure_count", "get_exp_count()" },
+    { "recording", "get_mode()" },
+    { "tick", "get_tick_count()" },
+    { NULL, NULL }
+};
+
+/**
+ * @brief Create an empty cache for \a camera
+ *
+ * @param[in] camera The camera to query.
+ * @param[in] ttl_ms (optional) How long, in milliseconds, a value is served from the cache.
+ */
+CHDKPropertyCache::CHDKPropertyCache(CHDKCamera * camera, const int ttl_ms) :
+camera(camera), ttl_ms(ttl_ms)
+{
+    for (int i = 0; CHDKPropertyCache::builtin_properties[i][0] != NULL; i++)
+    {
+        this->expressions[CHDKPropertyCache::builtin_properties[i][0]] = CHDKPropertyCache::builtin_properties[i][1];
+    }
+}
+
+/**
+ * @brief Name a property, or change what a name reads
+ *
+ * @param[in] name       The property's name.
+ * @param[in] expression The Lua expression which reads it, such as <tt>get_prop(221)</tt>.
+ */
+void CHDKPropertyCache::define(const std::string& name, const std::string& expression)
+{
+    this->expressions[name] = expression;
+    this->entries.erase(name);
+}
+
+/**
+ * @brief Change how long values are served from the cache
+ *
+ * @param[in] ttl_ms Milliseconds; 0 to always go to the camera.
+ */
+void CHDKPropertyCache::set_ttl(const int ttl_ms)
+{
+    this->ttl_ms = ttl_ms;
+}
+
+/**
+ * @brief Read properties, from the cache where it is fresh and otherwise in one script
+ *
+ * @param[in]  names   The properties to read.
+ * @param[out] out     Their values, by name.  A property which failed, or
+ *                     which is nil, is \c PTP_CHDK_TYPE_NIL.
+ * @param[in]  timeout (optional) Milliseconds to wait for the script, or 0 to wait forever.
+ * @return true if every value is in \a out; false if the script failed, in
+ *         which case the properties it should have read are left out.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes.
+ */
+bool CHDKPropertyCache::query(const std::vector<std::string>& names, std::map<std::string, CHDKScriptValue>& out, const int timeout)
+{
+    PTPTrace::Span span("CHDKPropertyCache::query");
+
+    this->stats.queries++;
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    const std::chrono::milliseconds ttl(this->ttl_ms);
+
+    this->missing.clear();
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        std::map<std::string, Entry>::const_iterator it = this->entries.find(names[i]);
+        if (it != this->entries.end() && now - it->second.fetched < ttl)
+        {
+            out[names[i]] = it->second.value;
+            this->stats.hits++;
+        }
+        else if (std::find(this->missing.begin(), this->missing.end(), names[i]) == this->missing.end())
+        {
+            this->missing.push_back(names[i]);
+        }
+    }
+
+    if (this->missing.empty())
+    {
+        return true;
+    }
+
+    this->wanted.clear();
+    for (size_t i = 0; i < this->missing.size(); i++)
+    {
+        std::map<std::string, std::string>::const_iterator it = this->expressions.find(this->missing[i]);
+        this->wanted.push_back(it == this->expressions.end() ? this->missing[i] : it->second);
+    }
+    CHDKPropertyCache::build_script(this->wanted, this->script);
+
+    this->stats.scripts++;
+    if (!this->camera->run_lua(this->script, this->table, timeout))
+    {
+        return false;
+    }
+
+    // The table is keyed by each property's place in the script; anything
+    //  missing from it was nil, or failed
+    const std::chrono::steady_clock::time_point fetched = std::chrono::steady_clock::now();
+    std::vector<Entry *> fetching(this->missing.size(), (Entry *) NULL);
+    for (size_t i = 0; i < this->missing.size(); i++)
+    {
+        fetching[i] = &this->entries[this->missing[i]];
+        fetching[i]->value = CHDKScriptValue();
+        fetching[i]->fetched = fetched;
+    }
+    for (size_t i = 0; i < this->table.size(); i++)
+    {
+        size_t place = std::strtoul(this->table.get_key(i), NULL, 10);
+        if (place >= 1 && place <= fetching.size())
+        {
+            this->table.get_script_value(i, fetching[place - 1]->value);
+        }
+    }
+    for (size_t i = 0; i < this->missing.size(); i++)
+    {
+        out[this->missing[i]] = fetching[i]->value;
+        this->stats.misses++;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Read one property
+ *
+ * @see CHDKPropertyCache::query
+ */
+bool CHDKPropertyCache::get(const std::string& name, CHDKScriptValue& out, const int timeout)
+{
+    std::vector<std::string> names(1, name);
+    std::map<std::string, CHDKScriptValue> values;
+    if (!this->query(names, values, timeout))
+    {
+        return false;
+    }
+    out = values[name];
+    return true;
+}
+
+/**
+ * @brief Forget every cached value, such as after changing the camera's settings
+ */
+void CHDKPropertyCache::invalidate()
+{
+    this->entries.clear();
+}
+
+/**
+ * @brief Forget the cached value of \a name
+ */
+void CHDKPropertyCache::invalidate(const std::string& name)
+{
+    this->entries.erase(name);
+}
+
+/**
+ * @brief What the queries so far have had to fetch
+ */
+CHDKPropertyStats CHDKPropertyCache::get_stats() const
+{
+    return this->stats;
+}
+
+/**
+ * @brief Write a script returning a table of \a expressions, keyed 1, 2, ...
+ *
+ * Each expression is evaluated under \c pcall; one which fails, or is nil,
+ * is missing from the table.
+ *
+ * @param[in]  expressions Lua expressions.
+ * @param[out] out         The script.
+ */
+void CHDKPropertyCache::build_script(const std::vector<std::string>& expressions, std::string& out)
+{
+    out = "local r = {}\n"
+          "local function get(i, f) local ok, v = pcall(f) if ok then r[i] = v end end\n";
+    for (size_t i = 0; i < expressions.size(); i++)
+    {
+        out += "get(" + std::to_string(i + 1) + ", function() return " + expressions[i] + " end)\n";
+    }
+    out += "return r\n";
+}
+
+} /* namespace PTP */
@@ -0,0 +1,376 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file CHDKRigTrigger.cpp
+ *
+ * @brief Synchronized shutter release across a rig of cameras
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+
+#include "libeasyptp/PTPErrors.hpp"
+#include "libeasyptp/CHDKRigTrigger.hpp"
+#include "libeasyptp/CHDKCamera.hpp"
+#include "libeasyptp/PTPDeadline.hpp"
+#include "libeasyptp/PTPTrace.hpp"
+#include "libeasyptp/chdk/ptp.h"
+
+namespace EasyPTP
+{
+
+/**
+ * Half-presses, says it's ready, and then waits for "fire" (or "cancel")
+ * without yielding, so the shutter follows the message as closely as the
+ * camera allows.  Returns the tick count it pressed the shutter at.
+ */
+const char * const CHDKRigTrigger::arm_script =
+    "press('shoot_half')\n"
+    "repeat sleep(10) until get_shooting()\n"
+    "set_yield(-1, -1)\n"
+    "write_usb_msg('armed')\n"
+    "local msg\n"
+    "repeat msg = read_usb_msg() until msg == 'fire' or msg == 'cancel'\n"
+    "if msg == 'cancel' then\n"
+    "  release('shoot_half')\n"
+    "  return false\n"
+    "end\n"
+    "local tick = get_tick_count()\n"
+    "press('shoot_full_only')\n"
+    "sleep(100)\n"
+    "release('shoot_full')\n"
+    "return tick\n";
+
+/**
+ * One camera's thread, and what it found.  The atomics are what the
+ * controlling thread watches while it runs.
+ */
+struct CHDKRigTrigger::Camera
+{
+    CHDKCamera * camera;
+    std::thread thread;
+    CHDKTriggerResult result;
+    std::chrono::steady_clock::time_point acked;
+
+    std::atomic<bool> armed;
+    std::atomic<bool> done;
+};
+
+/**
+ * @brief Create a trigger with no cameras
+ *
+ * @param[in] pin_threads (optional) Pin each camera's thread to a CPU of its own.
+ */
+CHDKRigTrigger::CHDKRigTrigger(const bool pin_threads) :
+pin_threads(pin_threads), go(false), cancel(false), fire_timeout(0), armed(false)
+{
+}
+
+/**
+ * @brief Disarms the cameras, if they are still armed
+ */
+CHDKRigTrigger::~CHDKRigTrigger()
+{
+    this->disarm();
+    for (size_t i = 0; i < this->cameras.size(); i++)
+    {
+        delete this->cameras[i];
+    }
+}
+
+/**
+ * @brief Add a camera to the rig
+ *
+ * @param[in] camera The camera.  It must not be used by anything else while
+ *                   the trigger is armed.
+ * @return The camera's index in the results.
+ */
+int CHDKRigTrigger::add_camera(CHDKCamera * camera)
+{
+    Camera * c = new Camera;
+    c->camera = camera;
+    c->armed = false;
+    c->done = false;
+    this->cameras.push_back(c);
+
+    return this->cameras.size() - 1;
+}
+
+/**
+ * @brief Start the trigger script on every camera, in parallel
+ *
+ * Returns once every camera has half-pressed and is waiting, with its
+ * thread spinning ready to release it.
+ *
+ * @param[in] timeout (optional) Milliseconds to wait for every camera, or 0 to wait forever.
+ * @return true if every camera armed; if not, the rest are disarmed again.
+ */
+bool CHDKRigTrigger::arm(const int timeout)
+{
+    PTPTrace::Span span("CHDKRigTrigger::arm");
+
+    this->disarm();
+    this->go = false;
+    this->cancel = false;
+
+    const int cpus = std::thread::hardware_concurrency();
+    for (size_t i = 0; i < this->cameras.size(); i++)
+    {
+        Camera * c = this->cameras[i];
+        c->result = CHDKTriggerResult();
+        c->armed = false;
+        c->done = false;
+
+        // With more cameras than CPUs, they share round-robin
+        int cpu = (this->pin_threads && cpus > 0) ? (int) i % cpus : -1;
+        c->thread = std::thread(&CHDKRigTrigger::run_camera, this, c, cpu, timeout);
+    }
+    this->armed = true;
+
+    bool all_armed = false;
+    while (!all_armed)
+    {
+        all_armed = true;
+        bool any_failed = false;
+        for (size_t i = 0; i < this->cameras.size(); i++)
+        {
+            all_armed = all_armed && this->cameras[i]->armed;
+            any_failed = any_failed || (this->cameras[i]->done && !this->cameras[i]->armed);
+        }
+        if (any_failed)
+        {
+            this->disarm();
+            return false;
+        }
+        if (!all_armed)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Release every armed camera at once
+ *
+ * @param[in] timeout (optional) Milliseconds to wait for the shots to finish, or 0 to wait forever.
+ * @return true if every camera fired.
+ * @see CHDKRigTrigger::get_results
+ */
+bool CHDKRigTrigger::fire(const int timeout)
+{
+    PTPTrace::Span span("CHDKRigTrigger::fire");
+
+    if (!this->armed)
+    {
+        return false;
+    }
+
+    this->fire_timeout = timeout;
+    this->released = std::chrono::steady_clock::now();
+    this->go = true;
+    this->join();
+
+    // Skew is only measured among the cameras which fired
+    bool all_fired = true;
+    bool any_fired = false;
+    double quickest = 0;
+    for (size_t i = 0; i < this->cameras.size(); i++)
+    {
+        CHDKTriggerResult& result = this->cameras[i]->result;
+        all_fired = all_fired && result.fired;
+        if (!result.fired)
+        {
+            continue;
+        }
+        result.send_us = std::chrono::duration<double, std::micro>(this->cameras[i]->acked - this->released).count();
+        if (!any_fired || result.send_us < quickest)
+        {
+            quickest = result.send_us;
+        }
+        any_fired = true;
+    }
+    for (size_t i = 0; i < this->cameras.size(); i++)
+    {
+        if (this->cameras[i]->result.fired)
+        {
+            this->cameras[i]->result.skew_us = this->cameras[i]->result.send_us - quickest;
+        }
+    }
+
+    return all_fired;
+}
+
+/**
+ * @brief Let the cameras go without taking a shot
+ */
+void CHDKRigTrigger::disarm()
+{
+    if (this->armed)
+    {
+        this->cancel = true;
+        this->join();
+    }
+}
+
+/**
+ * @brief How each camera's release went, in the order they were added
+ */
+std::vector<CHDKTriggerResult> CHDKRigTrigger::get_results() const
+{
+    std::vector<CHDKTriggerResult> results;
+    for (size_t i = 0; i < this->cameras.size(); i++)
+    {
+        results.push_back(this->cameras[i]->result);
+    }
+    return results;
+}
+
+/**
+ * @brief The skew of the slowest camera, in microseconds
+ */
+double CHDKRigTrigger::get_spread_us() const
+{
+    double spread = 0;
+    for (size_t i = 0; i < this->cameras.size(); i++)
+    {
+        if (this->cameras[i]->result.skew_us > spread)
+        {
+            spread = this->cameras[i]->result.skew_us;
+        }
+    }
+    return spread;
+}
+
+void CHDKRigTrigger::join()
+{
+    for (size_t i = 0; i < this->cameras.size(); i++)
+    {
+        if (this->cameras[i]->thread.joinable())
+        {
+            this->cameras[i]->thread.join();
+        }
+    }
+    this->armed = false;
+}
+
+/**
+ * One camera's thread: arm it, spin until released (or cancelled), send
+ * the message, and wait for the shot.  Once the script has started it is
+ * always sent something, even if it never said it was armed, so no camera
+ * is left half-pressed and waiting for a message.
+ */
+void CHDKRigTrigger::run_camera(Camera * c, const int cpu, const int timeout)
+{
+    PTPTrace::Span span("CHDKRigTrigger::run_camera");
+
+    if (cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    }
+
+    const PTPDeadline deadline = PTPDeadline::from_timeout(timeout);
+    uint32_t script_id = 0;
+    bool started = false;
+    try
+    {
+        uint32_t status = PTP_CHDK_S_ERRTYPE_NONE;
+        script_id = c->camera->execute_lua(CHDKRigTrigger::arm_script, &status);
+        started = (status == PTP_CHDK_S_ERRTYPE_NONE);
+
+        // Wait for the script to say it's ready
+        std::chrono::microseconds backoff(100);
+        while (status == PTP_CHDK_S_ERRTYPE_NONE && !c->armed && !this->cancel)
+        {
+            CHDKScriptMessage msg;
+            if (c->camera->read_script_message(msg, script_id))
+            {
+                if (msg.type != PTP_CHDK_S_MSGTYPE_USER || msg.value.string != "armed")
+                {
+                    break; // It failed, or ended
+                }
+                c->armed = true;
+            }
+            else if (deadline.expired())
+            {
+                break;
+            }
+            else
+            {
+                std::this_thread::sleep_for(backoff);
+                if (backoff < std::chrono::milliseconds(10))
+                {
+                    backoff *= 2;
+                }
+            }
+        }
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+    }
+    c->result.armed = c->armed;
+
+    // Spin, rather than sleep, so nothing stands between the release and the send
+    const bool shared = this->cameras.size() > std::thread::hardware_concurrency();
+    while (c->armed && !this->go && !this->cancel)
+    {
+        if (shared)
+        {
+            std::this_thread::yield(); // More threads than CPUs; spinning would starve the others
+        }
+    }
+
+    if (started)
+    {
+        try
+        {
+            // A camera which didn't arm in time is cancelled, whatever the rest do
+            bool firing = c->armed && this->go;
+            uint32_t status = c->camera->write_script_message(firing ? "fire" : "cancel", script_id);
+            c->acked = std::chrono::steady_clock::now();
+
+            if (status == PTP_CHDK_S_MSGSTATUS_OK)
+            {
+                std::vector<CHDKScriptMessage> msgs = c->camera->_wait_for_script_return(
+                    firing ? this->fire_timeout : CHDKRigTrigger::cancel_timeout, script_id);
+                for (size_t i = 0; firing && i < msgs.size(); i++)
+                {
+                    if (msgs[i].type == PTP_CHDK_S_MSGTYPE_RET && msgs[i].value.type == PTP_CHDK_TYPE_INTEGER)
+                    {
+                        c->result.fired = true;
+                        c->result.camera_tick = msgs[i].value.integer;
+                    }
+                }
+            }
+        }
+        catch (LIBPTP_PP_ERRORS e)
+        {
+        }
+    }
+    c->done = true;
+}
+
+} /* namespace PTP */
@@ -0,0 +1,399 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ *
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file CHDKRpc.cpp
+ *
+ * @brief Requests to a resident Lua dispatcher on the camera
+ */
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include "libeasyptp/PTPErrors.hpp"
+#include "libeasyptp/CHDKRpc.hpp"
+#include "libeasyptp/CHDKCamera.hpp"
+#include "libeasyptp/PTPDeadline.hpp"
+#include "libeasyptp/PTPTrace.hpp"
+#include "libeasyptp/chdk/ptp.h"
+
+namespace EasyPTP
+{
+
+/**
+ * The agent.  Waits for requests with read_usb_msg, runs the named handler
+ * under pcall, and answers with write_usb_msg.  "def" compiles a new
+ * handler, "exec" compiles and runs a chunk once, and "quit" ends the
+ * script.  Fields are escaped with backslashes so they can hold tabs and
+ * newlines.
+ */
+const char * const CHDKRpc::dispatcher_script =
+    "local handlers = {}\n"
+    "local function unescape(s)\n"
+    "  return (string.gsub(s, '\\\\(.)', {t = '\\t', n = '\\n', ['\\\\'] = '\\\\'}))\n"
+    "end\n"
+    "handlers.ping = function() return 'pong' end\n"
+    "handlers.exec = function(chunk)\n"
+    "  local f, err = loadstring(chunk)\n"
+    "  if not f then error(err, 0) end\n"
+    "  return f()\n"
+    "end\n"
+    "handlers.def = function(name, body)\n"
+    "  local f, err = loadstring('return function(...) ' .. body .. ' end')\n"
+    "  if not f then error(err, 0) end\n"
+    "  handlers[name] = f()\n"
+    "  return true\n"
+    "end\n"
+    "while true do\n"
+    "  local msg = read_usb_msg(1000)\n"
+    "  if msg then\n"
+    "    local fields = {}\n"
+    "    for field in string.gmatch(msg .. '\\t', '([^\\t]*)\\t') do\n"
+    "      fields[#fields + 1] = unescape(field)\n"
+    "    end\n"
+    "    local id, name = fields[1], fields[2]\n"
+    "    if name == 'quit' then\n"
+    "      write_usb_msg(id .. '\\tok\\t')\n"
+    "      return\n"
+    "    end\n"
+    "    local ok, result\n"
+    "    if handlers[name] then\n"
+    "      ok, result = pcall(handlers[name], unpack(fields, 3))\n"
+    "    else\n"
+    "      ok, result = false, 'no such function: ' .. tostring(name)\n"
+    "    end\n"
+    "    if result == nil then result = '' end\n"
+    "    write_usb_msg(id .. '\\t' .. (ok and 'ok' or 'err') .. '\\t' .. tostring(result))\n"
+    "  end\n"
+    "end\n";
+
+/**
+ * @brief Create an agent for \a camera, without starting it
+ *
+ * @param[in] camera The camera to run the agent on.
+ */
+CHDKRpc::CHDKRpc(CHDKCamera * camera) :
+camera(camera), script_id(0), running(false), next_id(1)
+{
+}
+
+/**
+ * @brief Stops the agent, if it is running
+ */
+CHDKRpc::~CHDKRpc()
+{
+    try
+    {
+        this->stop(1000);
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+        // The camera may well be gone by now
+    }
+}
+
+/**
+ * @brief Start the dispatcher script on the camera
+ *
+ * Waits for the dispatcher to answer a ping before returning, so it is
+ * ready for requests.
+ *
+ * @param[in] timeout (optional) Milliseconds to wait for the dispatcher to answer, or 0 to wait forever.
+ * @return true once the dispatcher is answering.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes.
+ */
+bool CHDKRpc::start(const int timeout)
+{
+    PTPTrace::Span span("CHDKRpc::start");
+
+    if (this->running)
+    {
+        return true;
+    }
+
+    uint32_t status = PTP_CHDK_S_ERRTYPE_NONE;
+    this->script_id = this->camera->execute_lua(CHDKRpc::dispatcher_script, &status);
+    if (status != PTP_CHDK_S_ERRTYPE_NONE)
+    {
+        this->error = "dispatcher failed to start";
+        return false;
+    }
+
+    this->running = true;
+
+    std::string pong;
+    if (!this->call("ping", std::vector<std::string>(), &pong, timeout) || pong != "pong")
+    {
+        this->running = false;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Ask the dispatcher to exit
+ *
+ * @param[in] timeout (optional) Milliseconds to wait for the dispatcher to answer, or 0 to wait forever.
+ * @return true if the dispatcher acknowledged.
+ */
+bool CHDKRpc::stop(const int timeout)
+{
+    if (!this->running)
+    {
+        return true;
+    }
+
+    bool ok = this->call("quit", std::vector<std::string>(), NULL, timeout);
+    this->running = false;
+    return ok;
+}
+
+/**
+ * @brief Whether the dispatcher is running, as far as we know
+ */
+bool CHDKRpc::is_running() const
+{
+    return this->running;
+}
+
+/**
+ * @brief Compile a function on the camera, to be called by \a name later
+ *
+ * \a body becomes the body of <tt>function(...)</tt>, so the arguments of
+ * a call are in <tt>...</tt>.  For example, a body of
+ * <tt>local a, b = ... return a + b</tt>.
+ *
+ * @param[in] name    The name to call the function by.
+ * @param[in] body    The Lua source of the function's body.
+ * @param[in] timeout (optional) Milliseconds to wait for the answer, or 0 to wait forever.
+ * @return true if the function compiled; otherwise see \c CHDKRpc::get_error.
+ */
+bool CHDKRpc::define(const std::string& name, const std::string& body, const int timeout)
+{
+    std::vector<std::string> args;
+    args.push_back(name);
+    args.push_back(body);
+    return this->call("def", args, NULL, timeout);
+}
+
+/**
+ * @brief Call the function \a name on the camera
+ *
+ * @param[in]  name    The function to call: one given to \c CHDKRpc::define.
+ * @param[in]  args    The arguments, which arrive as strings.
+ * @param[out] result  (optional) The function's result, converted to a string.
+ * @param[in]  timeout (optional) Milliseconds to wait for the answer, or 0 to wait forever.
+ * @return true if the function ran; otherwise see \c CHDKRpc::get_error.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes.  The reply, if it comes
+ *            later, is ignored.
+ */
+bool CHDKRpc::call(const std::string& name, const std::vector<std::string>& args, std::string * result, const int timeout)
+{
+    PTPTrace::Span span("CHDKRpc::call");
+
+    if (!this->running)
+    {
+        this->error = "agent is not running";
+        return false;
+    }
+
+    const PTPDeadline deadline = PTPDeadline::from_timeout(timeout);
+    const uint32_t id = this->next_id++;
+
+    this->request = std::to_string(id);
+    this->append_field(name);
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        this->append_field(args[i]);
+    }
+
+    if (!this->send_request(deadline))
+    {
+        return false;
+    }
+
+    return this->wait_reply(id, result, deadline);
+}
+
+/**
+ * @brief Compile and run \a chunk once
+ *
+ * Cheaper than \c CHDKCamera::execute_lua, since no new script has to be
+ * started, but the chunk is still compiled every time; use
+ * \c CHDKRpc::define for anything called repeatedly.
+ *
+ * @param[in]  chunk   Lua source.  Its return value is the result.
+ * @param[out] result  (optional) The chunk's result, converted to a string.
+ * @param[in]  timeout (optional) Milliseconds to wait for the answer, or 0 to wait forever.
+ * @return true if the chunk ran; otherwise see \c CHDKRpc::get_error.
+ */
+bool CHDKRpc::exec(const std::string& chunk, std::string * result, const int timeout)
+{
+    std::vector<std::string> args;
+    args.push_back(chunk);
+    return this->call("exec", args, result, timeout);
+}
+
+/**
+ * @brief Why the last request failed
+ */
+std::string CHDKRpc::get_error() const
+{
+    return this->error;
+}
+
+/**
+ * Append \a field to the request, escaping what would break it up.
+ */
+void CHDKRpc::append_field(const std::string& field)
+{
+    this->request += '\t';
+    for (size_t i = 0; i < field.length(); i++)
+    {
+        switch (field[i])
+        {
+        case '\t': this->request += "\\t"; break;
+        case '\n': this->request += "\\n"; break;
+        case '\\': this->request += "\\\\"; break;
+        default: this->request += field[i]; break;
+        }
+    }
+}
+
+/**
+ * Hand the request to the dispatcher, backing off while its queue is full.
+ */
+bool CHDKRpc::send_request(const PTPDeadline& deadline)
+{
+    std::chrono::microseconds backoff(100);
+    for (;;)
+    {
+        uint32_t status = this->camera->write_script_message(this->request, this->script_id);
+        if (status == PTP_CHDK_S_MSGSTATUS_OK)
+        {
+            return true;
+        }
+        if (status != PTP_CHDK_S_MSGSTATUS_QFULL)
+        {
+            this->running = false;
+            this->error = "agent is not running";
+            return false;
+        }
+
+        if (deadline.expired())
+        {
+            throw ERR_TIMEOUT;
+        }
+        std::this_thread::sleep_for(backoff);
+        if (backoff < std::chrono::milliseconds(5))
+        {
+            backoff *= 2;
+        }
+    }
+}
+
+/**
+ * Read script messages until the reply to request \a id arrives.  Replies
+ * to earlier requests which timed out are skipped; messages from other
+ * scripts are left for them.
+ */
+bool CHDKRpc::wait_reply(const uint32_t id, std::string * result, const PTPDeadline& deadline)
+{
+    std::chrono::microseconds backoff(100);
+    for (;;)
+    {
+        this->camera->read_script_message(this->resp, this->data, this->script_id);
+        uint32_t type = this->resp.get_param_n(0);
+
+        if (type == PTP_CHDK_S_MSGTYPE_NONE)
+        {
+            if (deadline.expired())
+            {
+                throw ERR_TIMEOUT;
+            }
+            std::this_thread::sleep_for(backoff);
+            if (backoff < std::chrono::milliseconds(2))
+            {
+                backoff *= 2;
+            }
+            continue;
+        }
+        backoff = std::chrono::microseconds(100);
+
+        int size = 0;
+        const char * text = (const char *) this->data.get_payload_ptr(&size);
+        uint32_t length = this->resp.get_param_n(3);
+        if (text == NULL)
+        {
+            length = 0;
+        }
+        else if (length > (uint32_t) size)
+        {
+            length = size;
+        }
+
+        if (type != PTP_CHDK_S_MSGTYPE_USER)
+        {
+            // An error, or the script's return value: either way, it has stopped
+            this->running = false;
+            this->error.assign(text ? text : "", length);
+            if (this->error.empty())
+            {
+                this->error = "agent exited";
+            }
+            return false;
+        }
+
+        // "<id>\t<ok|err>\t<result>"
+        uint32_t reply_id = 0;
+        uint32_t pos = 0;
+        while (pos < length && text[pos] >= '0' && text[pos] <= '9')
+        {
+            reply_id = reply_id * 10 + (text[pos] - '0');
+            pos++;
+        }
+        if (pos == 0 || pos >= length || text[pos] != '\t' || reply_id != id)
+        {
+            continue; // A late reply, or not a reply at all
+        }
+        pos++;
+
+        bool ok = (length - pos >= 3 && std::memcmp(text + pos, "ok\t", 3) == 0);
+        uint32_t status_length = ok ? 3 : 4; // "ok\t" or "err\t"
+        const char * value = text + pos + status_length;
+        uint32_t value_length = (length > pos + status_length) ? length - pos - status_length : 0;
+
+        if (ok)
+        {
+            if (result != NULL)
+            {
+                result->assign(value, value_length);
+            }
+            return true;
+        }
+
+        this->error.assign(value, value_length);
+        return false;
+    }
+}
+
+} /* namespace PTP */
@@ -0,0 +1,284 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file CHDKTable.cpp
+ *
+ * @brief Parsing of table results without allocating
+ */
+
+#include <cstring>
+
+#include "libeasyptp/PTPErrors.hpp"
+#include "libeasyptp/CHDKTable.hpp"
+#include "libeasyptp/CHDKCamera.hpp"
+#include "libeasyptp/PTPContainer.hpp"
+#include "libeasyptp/chdk/ptp.h"
+
+namespace EasyPTP
+{
+
+/**
+ * @brief Parse "key\tvalue\n" lines
+ *
+ * Lines without a tab are skipped; the last line needn't end with a newline.
+ *
+ * @param[in] data   The table's text.
+ * @param[in] length The length of \a data.
+ */
+void CHDKTable::parse(const char * data, const size_t length)
+{
+    // One more for the NUL ending the last line
+    this->text.resize(length + 1);
+    if (length > 0)
+    {
+        std::memcpy(this->text.data(), data, length);
+    }
+    this->text[length] = '\0';
+    this->entries.clear();
+
+    // memchr is vectorised, so the lines are found a word or more at a time
+    char * base = this->text.data();
+    char * end = base + length;
+    for (char * line = base; line < end;)
+    {
+        char * newline = (char *) std::memchr(line, '\n', end - line);
+        if (newline == NULL)
+        {
+            newline = end;
+        }
+        *newline = '\0';
+
+        char * tab = (char *) std::memchr(line, '\t', newline - line);
+        if (tab != NULL)
+        {
+            *tab = '\0';
+            Entry entry;
+            entry.key = line - base;
+            entry.key_length = tab - line;
+            entry.value = tab + 1 - base;
+            entry.value_length = newline - tab - 1;
+            this->entries.push_back(entry);
+        }
+        line = newline + 1;
+    }
+}
+
+/**
+ * @brief Parse the table in a script message
+ *
+ * @param[in] resp The response from \c CHDKCamera::read_script_message.
+ * @param[in] data The data from \c CHDKCamera::read_script_message.
+ * @return false, leaving the table empty, if the message isn't a table.
+ */
+bool CHDKTable::read(const PTPContainer& resp, const PTPContainer& data)
+{
+    uint32_t type = resp.get_param_n(0);
+    if ((type != PTP_CHDK_S_MSGTYPE_RET && type != PTP_CHDK_S_MSGTYPE_USER) || resp.get_param_n(1) != PTP_CHDK_TYPE_TABLE)
+    {
+        this->clear();
+        return false;
+    }
+
+    int size = 0;
+    const char * payload = (const char *) data.get_payload_ptr(&size);
+    uint32_t length = resp.get_param_n(3);
+    if (payload == NULL)
+    {
+        length = 0;
+    }
+    else if (length > (uint32_t) size)
+    {
+        length = size;
+    }
+
+    this->parse(payload, length);
+    return true;
+}
+
+/**
+ * @brief Empty the table, keeping its buffers for the next
+ */
+void CHDKTable::clear()
+{
+    this->text.clear();
+    this->entries.clear();
+}
+
+/**
+ * @brief The number of entries
+ */
+size_t CHDKTable::size() const
+{
+    return this->entries.size();
+}
+
+/**
+ * @brief The key of entry \a index
+ *
+ * @param[in]  index  Which entry; less than \c CHDKTable::size.
+ * @param[out] length (optional) The key's length.
+ * @return The key, NUL terminated.  It lasts until the table is next parsed.
+ */
+const char * CHDKTable::get_key(const size_t index, uint32_t * length) const
+{
+    const Entry& entry = this->entries[index];
+    if (length != NULL)
+    {
+        *length = entry.key_length;
+    }
+    return this->text.data() + entry.key;
+}
+
+/**
+ * @brief The value of entry \a index, as text
+ *
+ * @param[in]  index  Which entry; less than \c CHDKTable::size.
+ * @param[out] length (optional) The value's length.
+ * @return The value, NUL terminated.  It lasts until the table is next parsed.
+ */
+const char * CHDKTable::get_value(const size_t index, uint32_t * length) const
+{
+    const Entry& entry = this->entries[index];
+    if (length != NULL)
+    {
+        *length = entry.value_length;
+    }
+    return this->text.data() + entry.value;
+}
+
+/**
+ * @brief Find the entry with key \a key
+ *
+ * A linear search: the entries are contiguous, so this is quick for the
+ * sizes tables come in, and parsing doesn't pay to build an index.
+ *
+ * @param[in] key The key, NUL terminated.
+ * @return The entry's index, or -1 if there is none.
+ */
+long CHDKTable::find(const char * key) const
+{
+    const size_t key_length = std::strlen(key);
+    const char * base = this->text.data();
+    for (size_t i = 0; i < this->entries.size(); i++)
+    {
+        const Entry& entry = this->entries[i];
+        if (entry.key_length == key_length && std::memcmp(base + entry.key, key, key_length) == 0)
+        {
+            return (long) i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief The value of entry \a index, as an integer
+ *
+ * @param[in]  index Which entry; less than \c CHDKTable::size.
+ * @param[out] out   The value, if it is one.
+ * @return false if the value isn't a decimal integer which fits 32 bits.
+ */
+bool CHDKTable::get_integer(const size_t index, int32_t& out) const
+{
+    const Entry& entry = this->entries[index];
+    const char * p = this->text.data() + entry.value;
+    const char * end = p + entry.value_length;
+
+    bool negative = (p < end && *p == '-');
+    if (negative)
+    {
+        p++;
+    }
+    if (p == end)
+    {
+        return false;
+    }
+
+    int64_t value = 0;
+    for (; p < end; p++)
+    {
+        if (*p < '0' || *p > '9')
+        {
+            return false;
+        }
+        value = value * 10 + (*p - '0');
+        if (value > (int64_t) INT32_MAX + 1)
+        {
+            return false;
+        }
+    }
+    if (negative)
+    {
+        value = -value;
+    }
+    if (value > INT32_MAX)
+    {
+        return false;
+    }
+
+    out = (int32_t) value;
+    return true;
+}
+
+/**
+ * @brief The value of entry \a index, copied into \a out
+ *
+ * Assigning to a string which already has the capacity doesn't allocate.
+ */
+void CHDKTable::get_string(const size_t index, std::string& out) const
+{
+    const Entry& entry = this->entries[index];
+    out.assign(this->text.data() + entry.value, entry.value_length);
+}
+
+/**
+ * @brief The value of entry \a index, with the type it had in Lua
+ *
+ * CHDK sends every value as text, so "true" and "false" are taken to be
+ * booleans, decimal integers to be integers, and anything else a string.
+ */
+void CHDKTable::get_script_value(const size_t index, CHDKScriptValue& out) const
+{
+    out.table.clear();
+    out.string.clear();
+    out.boolean = false;
+    out.integer = 0;
+
+    uint32_t length = 0;
+    const char * value = this->get_value(index, &length);
+    if ((length == 4 && std::memcmp(value, "true", 4) == 0) || (length == 5 && std::memcmp(value, "false", 5) == 0))
+    {
+        out.type = PTP_CHDK_TYPE_BOOLEAN;
+        out.boolean = (value[0] == 't');
+        out.integer = out.boolean ? 1 : 0;
+    }
+    else if (this->get_integer(index, out.integer))
+    {
+        out.type = PTP_CHDK_TYPE_INTEGER;
+        out.boolean = (out.integer != 0);
+    }
+    else
+    {
+        out.type = PTP_CHDK_TYPE_STRING;
+        out.string.assign(value, length);
+    }
+}
+
+} /* namespace PTP */
@@ -0,0 +1,288 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file CHDKTimelapse.cpp
+ *
+ * @brief Fixed-interval shooting with downloads overlapped
+ */
+
+#include <cstdio>
+#include <thread>
+
+#include "libeasyptp/PTPErrors.hpp"
+#include "libeasyptp/CHDKTimelapse.hpp"
+#include "libeasyptp/PTPDeadline.hpp"
+#include "libeasyptp/PTPTrace.hpp"
+#include "libeasyptp/chdk/ptp.h"
+
+namespace EasyPTP
+{
+
+/**
+ * Takes one shot, and returns where the camera saved it.
+ */
+const char * const CHDKTimelapse::shoot_script =
+    "shoot() return string.format('%s/IMG_%04d.JPG', get_image_dir(), get_exp_count())";
+
+/**
+ * @brief Set up a timelapse on \a camera
+ *
+ * @param[in] camera        The camera to shoot with.
+ * @param[in] interval_ms   Milliseconds from the start of one shot to the next.
+ * @param[in] local_pattern A \c printf pattern for where each shot is saved,
+ *                          given the shot's number (from 0), e.g.
+ *                          "/tmp/shot_%05u.jpg".
+ */
+CHDKTimelapse::CHDKTimelapse(CHDKCamera * camera, const int interval_ms, const std::string local_pattern) :
+camera(camera), interval(interval_ms), local_pattern(local_pattern), max_backlog(2), stopping(false)
+{
+}
+
+/**
+ * @brief How many shots may wait to be downloaded before ticks are dropped
+ *
+ * A bigger backlog rides out a slow disk or USB link for longer, at the
+ * cost of the download falling further behind the shooting.
+ */
+void CHDKTimelapse::set_max_backlog(const int shots)
+{
+    this->max_backlog = (shots > 0) ? shots : 1;
+}
+
+/**
+ * @brief Take \a shots shots, downloading each one
+ *
+ * Returns once every shot taken has been downloaded (or has failed to).
+ *
+ * @param[in] shots   How many ticks to run for.  Dropped ticks count.
+ * @param[in] timeout (optional) Milliseconds to run for at most, or 0 for no limit.
+ * @return true if every tick's shot was taken and downloaded.
+ */
+bool CHDKTimelapse::run(const int shots, const int timeout)
+{
+    PTPTrace::Span span("CHDKTimelapse::run");
+
+    typedef std::chrono::steady_clock clock;
+
+    const PTPDeadline deadline = PTPDeadline::from_timeout(timeout);
+    const clock::time_point start = clock::now();
+    clock::time_point next_tick = start;
+
+    this->stopping = false;
+    this->backlog.clear();
+    this->results.clear();
+    this->stats = CHDKTimelapseStats();
+
+    int ticks = 0;
+    bool in_flight = false;
+    uint32_t script_id = 0;
+    uint32_t next_number = 0;
+    double total_lateness_ms = 0;
+    std::chrono::duration<double> download_estimate(0);
+    bool timed_out = false;
+
+    while (!this->stopping && (ticks < shots || in_flight || !this->backlog.empty()))
+    {
+        if (deadline.expired())
+        {
+            timed_out = true;
+            break;
+        }
+
+        // See whether the last shot has finished before deciding on this tick
+        if (in_flight)
+        {
+            std::string remote_filename;
+            if (this->poll_shot(script_id, remote_filename))
+            {
+                in_flight = false;
+                if (remote_filename.empty())
+                {
+                    this->stats.shots_failed++;
+                }
+                else
+                {
+                    Shot shot = { next_number++, remote_filename };
+                    this->backlog.push_back(shot);
+                }
+            }
+        }
+
+        clock::time_point now = clock::now();
+        if (ticks < shots && now >= next_tick)
+        {
+            if (now - next_tick > this->interval / 2)
+            {
+                this->stats.shots_dropped_late++;
+            }
+            else if (in_flight)
+            {
+                this->stats.shots_dropped_busy++;
+            }
+            else if (this->backlog.size() >= this->max_backlog)
+            {
+                this->stats.shots_dropped_backlog++;
+            }
+            else
+            {
+                uint32_t status = PTP_CHDK_S_ERRTYPE_NONE;
+                script_id = this->camera->execute_lua(CHDKTimelapse::shoot_script, &status);
+                double lateness_ms = std::chrono::duration<double, std::milli>(clock::now() - next_tick).count();
+                total_lateness_ms += lateness_ms;
+                if (lateness_ms > this->stats.max_lateness_ms)
+                {
+                    this->stats.max_lateness_ms = lateness_ms;
+                }
+
+                this->stats.shots_taken++;
+                in_flight = (status == PTP_CHDK_S_ERRTYPE_NONE);
+                if (!in_flight)
+                {
+                    this->stats.shots_failed++;
+                }
+            }
+            ticks++;
+            next_tick += this->interval; // On the grid, however late this one was
+            continue;
+        }
+
+        // Only start a download which should be over before the next tick
+        now = clock::now();
+        bool ticks_left = (ticks < shots);
+        if (!this->backlog.empty() && (!ticks_left || this->backlog.size() >= this->max_backlog
+                || now + std::chrono::duration_cast<clock::duration>(download_estimate * 1.25) < next_tick))
+        {
+            Shot shot = this->backlog.front();
+            this->backlog.pop_front();
+            this->download(shot, download_estimate);
+            continue;
+        }
+
+        // Nothing to do until the next tick, or the next look at the shot
+        clock::time_point wake = ticks_left ? next_tick : now + std::chrono::milliseconds(5);
+        if (in_flight && wake > now + std::chrono::milliseconds(2))
+        {
+            wake = now + std::chrono::milliseconds(2);
+        }
+        std::this_thread::sleep_until(wake);
+    }
+
+    if (this->stats.shots_taken > 0)
+    {
+        this->stats.mean_lateness_ms = total_lateness_ms / this->stats.shots_taken;
+    }
+    this->stats.seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+    return !timed_out && !this->stopping
+        && this->stats.files_downloaded == (uint32_t) shots;
+}
+
+/**
+ * @brief Stop a run from another thread
+ *
+ * The run returns after whatever it is doing now; shots still waiting are
+ * not downloaded.
+ */
+void CHDKTimelapse::stop()
+{
+    this->stopping = true;
+}
+
+/**
+ * @brief How the last run went
+ */
+CHDKTimelapseStats CHDKTimelapse::get_stats() const
+{
+    return this->stats;
+}
+
+/**
+ * @brief One result per download of the last run, in order
+ */
+std::vector<CHDKTransferResult> CHDKTimelapse::get_results() const
+{
+    return this->results;
+}
+
+/**
+ * Check on the shot being taken.
+ *
+ * @return true once it has finished, with \a remote_filename set to the
+ *         file it made, or left empty if it failed.
+ */
+bool CHDKTimelapse::poll_shot(uint32_t script_id, std::string& remote_filename)
+{
+    uint32_t status = this->camera->check_script_status();
+    if ((status & PTP_CHDK_SCRIPT_STATUS_RUN) && !(status & PTP_CHDK_SCRIPT_STATUS_MSG))
+    {
+        return false; // Still shooting
+    }
+
+    // Once the camera is idle, the return may already have been read by
+    //  someone waiting on another script, and kept for us
+    CHDKScriptMessage msg;
+    if (this->camera->read_script_message(msg, script_id))
+    {
+        if (msg.type == PTP_CHDK_S_MSGTYPE_RET && msg.value.type == PTP_CHDK_TYPE_STRING)
+        {
+            remote_filename = msg.value.string;
+        }
+        return true; // A return or an error; either way it's over
+    }
+
+    return !(status & PTP_CHDK_SCRIPT_STATUS_RUN);
+}
+
+/**
+ * Download one shot, and fold how long it took into \a estimate.
+ */
+void CHDKTimelapse::download(const Shot& shot, std::chrono::duration<double>& estimate)
+{
+    char local_filename[4096];
+    snprintf(local_filename, sizeof local_filename, this->local_pattern.c_str(), (unsigned int) shot.number);
+
+    CHDKTransferResult result;
+    try
+    {
+        result.ok = this->camera->download_file(shot.remote_filename, std::string(local_filename), 0, PTPProgressCallback(), &result.stats);
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+        result.error = e;
+    }
+    this->results.push_back(result);
+
+    if (result.ok)
+    {
+        this->stats.files_downloaded++;
+        this->stats.bytes += result.stats.bytes;
+    }
+    else
+    {
+        this->stats.downloads_failed++;
+    }
+
+    // A moving average, so one slow file doesn't stall the rest
+    std::chrono::duration<double> took(result.stats.seconds);
+    estimate = (estimate.count() == 0) ? took : estimate * 0.75 + took * 0.25;
+}
+
+} /* namespace PTP */
@@ -0,0 +1,307 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file CRC32C.cpp
+ *
+ * @brief CRC-32C checksums, with SSE4.2 where the CPU has it
+ *
+ * The checksum is the reflected form, polynomial 0x82F63B78, starting from
+ * and finished with all ones: the one iSCSI and ext4 use, and which CHDK's
+ * Lua computes in \c CHDKCamera::crc32c_script.
+ */
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32C_X86
+#endif
+
+#include "libeasyptp/PTPErrors.hpp"
+#include "libeasyptp/CRC32C.hpp"
+
+namespace EasyPTP
+{
+
+namespace
+{
+
+const uint32_t polynomial = 0x82F63B78;
+
+/**
+ * Tables for taking eight bytes a step ("slicing by 8"): table[k][b] is
+ * the CRC of byte \c b followed by \c k zero bytes.
+ */
+struct Tables
+{
+    uint32_t table[8][256];
+
+    Tables()
+    {
+        for (uint32_t b = 0; b < 256; b++)
+        {
+            uint32_t crc = b;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = (crc & 1) ? (crc >> 1) ^ polynomial : crc >> 1;
+            }
+            this->table[0][b] = crc;
+        }
+        for (uint32_t b = 0; b < 256; b++)
+        {
+            for (int k = 1; k < 8; k++)
+            {
+                this->table[k][b] = (this->table[k - 1][b] >> 8) ^ this->table[0][this->table[k - 1][b] & 0xFF];
+            }
+        }
+    }
+};
+
+const Tables& get_tables()
+{
+    static const Tables tables;
+    return tables;
+}
+
+uint32_t update_table(uint32_t crc, const unsigned char * data, size_t length)
+{
+    const uint32_t (* t)[256] = get_tables().table;
+
+    while (length >= 8)
+    {
+        uint32_t lo, hi;
+        std::memcpy(&lo, data, 4);
+        std::memcpy(&hi, data + 4, 4);
+        lo ^= crc; // The tables are for little-endian words
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+        data += 8;
+        length -= 8;
+    }
+    while (length > 0)
+    {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xFF];
+        data++;
+        length--;
+    }
+
+    return crc;
+}
+
+#ifdef CRC32C_X86
+
+/**
+ * One crc32 instruction per eight bytes.  Each depends on the last, so
+ * this runs at the instruction's latency, some gigabytes a second: far
+ * beyond any USB transfer, so it isn't worth interleaving streams.
+ */
+__attribute__((target("sse4.2")))
+uint32_t update_sse42(uint32_t crc, const unsigned char * data, size_t length)
+{
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (length >= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t) crc64;
+#endif
+    while (length >= 4)
+    {
+        uint32_t word;
+        std::memcpy(&word, data, 4);
+        crc = _mm_crc32_u32(crc, word);
+        data += 4;
+        length -= 4;
+    }
+    while (length > 0)
+    {
+        crc = _mm_crc32_u8(crc, *data);
+        data++;
+        length--;
+    }
+
+    return crc;
+}
+
+#endif
+
+CRC32C::Kernel pick_kernel()
+{
+    if (CRC32C::is_supported(CRC32C::KERNEL_SSE42))
+    {
+        return CRC32C::KERNEL_SSE42;
+    }
+    return CRC32C::KERNEL_TABLE;
+}
+
+}
+
+/**
+ * @brief Start a checksum of no data
+ *
+ * @param[in] kernel (optional) Which implementation to use.
+ * @exception PTP::ERR_NOT_IMPLEMENTED if this CPU can't run \a kernel.
+ */
+CRC32C::CRC32C(const Kernel kernel) :
+state(0xFFFFFFFF), kernel(kernel == KERNEL_AUTO ? CRC32C::get_best_kernel() : kernel)
+{
+    if (!CRC32C::is_supported(this->kernel))
+    {
+        throw ERR_NOT_IMPLEMENTED;
+    }
+}
+
+/**
+ * @brief Add \a length bytes at \a data to the checksum
+ */
+void CRC32C::update(const void * data, const size_t length)
+{
+    const unsigned char * bytes = (const unsigned char *) data;
+#ifdef CRC32C_X86
+    if (this->kernel == KERNEL_SSE42)
+    {
+        this->state = update_sse42(this->state, bytes, length);
+        return;
+    }
+#endif
+    this->state = update_table(this->state, bytes, length);
+}
+
+/**
+ * @brief The checksum of the data so far
+ */
+uint32_t CRC32C::get_value() const
+{
+    return ~this->state;
+}
+
+/**
+ * @brief Start again, from no data
+ */
+void CRC32C::reset()
+{
+    this->state = 0xFFFFFFFF;
+}
+
+/**
+ * @brief The checksum of \a length bytes at \a data
+ *
+ * @exception PTP::ERR_NOT_IMPLEMENTED if this CPU can't run \a kernel.
+ */
+uint32_t CRC32C::compute(const void * data, const size_t length, const Kernel kernel)
+{
+    CRC32C crc(kernel);
+    crc.update(data, length);
+    return crc.get_value();
+}
+
+/**
+ * @brief Whether this CPU can run \a kernel
+ */
+bool CRC32C::is_supported(const Kernel kernel)
+{
+    switch (kernel)
+    {
+    case KERNEL_AUTO:
+    case KERNEL_TABLE:
+        return true;
+#ifdef CRC32C_X86
+    case KERNEL_SSE42:
+        return __builtin_cpu_supports("sse4.2");
+#endif
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief The fastest kernel this CPU can run
+ */
+CRC32C::Kernel CRC32C::get_best_kernel()
+{
+    static const Kernel best = pick_kernel();
+    return best;
+}
+
+/**
+ * @brief Checksum what passes into \a sink
+ *
+ * @param[in] sink Where the data goes.  It must outlive this sink.
+ */
+CRC32CSink::CRC32CSink(IPTPDataSink& sink) :
+sink(sink), pending(NULL), received(0)
+{
+}
+
+/**
+ * @brief The checksum of the data so far
+ */
+uint32_t CRC32CSink::get_value() const
+{
+    return this->crc.get_value();
+}
+
+/**
+ * @brief How many bytes have been checksummed
+ */
+uint64_t CRC32CSink::get_size() const
+{
+    return this->received;
+}
+
+bool CRC32CSink::begin(const uint64_t total_size)
+{
+    this->crc.reset();
+    this->received = 0;
+    return this->sink.begin(total_size);
+}
+
+unsigned char * CRC32CSink::direct_buffer(const uint64_t offset, const uint32_t length)
+{
+    this->pending = this->sink.direct_buffer(offset, length);
+    return this->pending;
+}
+
+void CRC32CSink::commit(const uint64_t offset, const uint32_t length)
+{
+    this->crc.update(this->pending, length);
+    this->received += length;
+    this->sink.commit(offset, length);
+}
+
+bool CRC32CSink::write(const uint64_t offset, const unsigned char * data, const uint32_t length)
+{
+    this->crc.update(data, length);
+    this->received += length;
+    return this->sink.write(offset, data, length);
+}
+
+bool CRC32CSink::end(const bool success)
+{
+    return this->sink.end(success);
+}
+
+} /* namespace PTP */
@@ -0,0 +1,523 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file DNGWriter.cpp
+ *
+ * @brief Writing raw frames as DNG files
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <map>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "libeasyptp/PTPErrors.hpp"
+#include "libeasyptp/DNGWriter.hpp"
+#include "libeasyptp/RawData.hpp"
+#include "libeasyptp/CHDKCamera.hpp"
+#include "libeasyptp/PTPTrace.hpp"
+#include "libeasyptp/chdk/ptp.h"
+#include "PTPFileIO.hpp"
+
+namespace EasyPTP
+{
+
+namespace
+{
+
+enum TIFFType
+{
+    TIFF_BYTE = 1,
+    TIFF_ASCII = 2,
+    TIFF_SHORT = 3,
+    TIFF_LONG = 4,
+    TIFF_RATIONAL = 5,
+    TIFF_SRATIONAL = 10,
+};
+
+/**
+ * The tags of one image directory, and the values which don't fit in
+ * their entries.
+ */
+class Directory
+{
+private:
+    struct Entry
+    {
+        uint16_t tag;
+        uint16_t type;
+        uint32_t count;
+        std::vector<uint8_t> value;
+
+        bool operator<(const Entry& other) const
+        {
+            return this->tag < other.tag;
+        }
+    };
+
+    std::vector<Entry> entries;
+
+public:
+    void add(const uint16_t tag, const uint16_t type, const uint32_t count, const void * value, const uint32_t size)
+    {
+        Entry entry;
+        entry.tag = tag;
+        entry.type = type;
+        entry.count = count;
+        entry.value.assign((const uint8_t *) value, (const uint8_t *) value + size);
+
+        // Replaces the tag if it's already there
+        for (size_t i = 0; i < this->entries.size(); i++)
+        {
+            if (this->entries[i].tag == tag)
+            {
+                this->entries[i] = entry;
+                return;
+            }
+        }
+        this->entries.push_back(entry);
+    }
+
+    void add_short(const uint16_t tag, const uint16_t value)
+    {
+        this->add(tag, TIFF_SHORT, 1, &value, sizeof value);
+    }
+
+    void add_long(const uint16_t tag, const uint32_t value)
+    {
+        this->add(tag, TIFF_LONG, 1, &value, sizeof value);
+    }
+
+    void add_longs(const uint16_t tag, const std::vector<uint32_t>& values)
+    {
+        this->add(tag, TIFF_LONG, values.size(), values.data(), values.size() * sizeof (uint32_t));
+    }
+
+    void add_bytes(const uint16_t tag, const uint8_t * values, const uint32_t count)
+    {
+        this->add(tag, TIFF_BYTE, count, values, count);
+    }
+
+    void add_ascii(const uint16_t tag, const std::string& value)
+    {
+        this->add(tag, TIFF_ASCII, value.size() + 1, value.c_str(), value.size() + 1);
+    }
+
+    /**
+     * Signed or unsigned rationals, in ten-thousandths.
+     */
+    void add_rationals(const uint16_t tag, const bool is_signed, const double * values, const uint32_t count)
+    {
+        std::vector<int32_t> parts;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            parts.push_back((int32_t) std::lround(values[i] * 10000));
+            parts.push_back(10000);
+        }
+        this->add(tag, is_signed ? TIFF_SRATIONAL : TIFF_RATIONAL, count, parts.data(), parts.size() * sizeof (int32_t));
+    }
+
+    /**
+     * The bytes the directory will take, values included.
+     */
+    uint32_t get_size() const
+    {
+        uint32_t size = 2 + this->entries.size() * 12 + 4;
+        for (size_t i = 0; i < this->entries.size(); i++)
+        {
+            if (this->entries[i].value.size() > 4)
+            {
+                size += (this->entries[i].value.size() + 1) & ~1; // Values start on a word
+            }
+        }
+        return size;
+    }
+
+    /**
+     * Append the directory to \a out, which it must start at the end of.
+     */
+    void write(std::vector<uint8_t>& out)
+    {
+        std::sort(this->entries.begin(), this->entries.end()); // TIFF requires them in order
+
+        const uint32_t start = out.size();
+        uint32_t extra = start + 2 + this->entries.size() * 12 + 4;
+        out.resize(start + this->get_size(), 0);
+
+        uint8_t * p = out.data() + start;
+        uint16_t count = this->entries.size();
+        std::memcpy(p, &count, 2);
+        p += 2;
+        for (size_t i = 0; i < this->entries.size(); i++)
+        {
+            const Entry& entry = this->entries[i];
+            std::memcpy(p, &entry.tag, 2);
+            std::memcpy(p + 2, &entry.type, 2);
+            std::memcpy(p + 4, &entry.count, 4);
+            if (entry.value.size() <= 4)
+            {
+                std::memcpy(p + 8, entry.value.data(), entry.value.size());
+            }
+            else
+            {
+                std::memcpy(p + 8, &extra, 4);
+                std::memcpy(out.data() + extra, entry.value.data(), entry.value.size());
+                extra += (entry.value.size() + 1) & ~1;
+            }
+            p += 12;
+        }
+        // The next directory offset is left at 0: there isn't one
+    }
+};
+
+/**
+ * CHDK packs into little-endian words; a DNG wants the bits in order, which
+ * is the same words big-endian.
+ */
+void swap_words(const uint8_t * in, uint8_t * out, const uint32_t length)
+{
+    for (uint32_t i = 0; i < length; i += 2)
+    {
+        uint16_t word;
+        std::memcpy(&word, in + i, 2);
+        word = __builtin_bswap16(word);
+        std::memcpy(out + i, &word, 2);
+    }
+}
+
+}
+
+/**
+ * @brief Metadata with the defaults for anything a camera doesn't report
+ *
+ * The CFA pattern defaults to RGGB, and the colour matrix to the identity.
+ */
+DNGMetadata::DNGMetadata() : make("Canon"), black_level(0), white_level(0),
+exposure_time(0), f_number(0), iso(0), orientation(1)
+{
+    const uint8_t rggb[4] = { 0, 1, 1, 2 };
+    std::memcpy(this->cfa_pattern, rggb, 4);
+    for (int i = 0; i < 9; i++)
+    {
+        this->color_matrix[i] = (i % 4 == 0) ? 1 : 0;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        this->as_shot_neutral[i] = 1;
+    }
+}
+
+/**
+ * @brief Create a writer
+ *
+ * @param[in] threads (optional) How many threads prepare and write strips;
+ *                    0 for one per CPU.
+ */
+DNGWriter::DNGWriter(const int threads) : threads(threads), unpacked(false)
+{
+    if (this->threads <= 0)
+    {
+        this->threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+/**
+ * @brief Write 16 bits per sample, rather than the camera's bit depth
+ *
+ * The files are bigger, but readable by software which doesn't handle
+ * packed samples.
+ */
+void DNGWriter::set_unpacked(const bool unpacked)
+{
+    this->unpacked = unpacked;
+}
+
+/**
+ * @brief Write a raw frame as a DNG to \a fd
+ *
+ * The file is written from offset 0 with \c pwrite; \a fd's own offset is
+ * left alone.
+ *
+ * @param[in]  fd          The file to write to.
+ * @param[in]  packed      The frame as CHDK packs it, rows one after another.
+ * @param[in]  packed_size The number of bytes in \a packed.
+ * @param[in]  width       The width of the frame, in pixels.
+ * @param[in]  height      The height of the frame, in pixels.
+ * @param[in]  bpp         Bits per pixel: 10, 12 or 14.
+ * @param[in]  metadata    What to record about the camera and the shot.
+ * @param[out] stats       (optional) Filled in with the bytes written and how long it took.
+ * @return true if the whole file was written.
+ * @exception PTP::ERR_RAWDATA_INVALID_BPP if \a bpp isn't 10, 12 or 14.
+ * @exception PTP::ERR_DNGWRITER_INVALID_WIDTH if a row doesn't end on a 16-bit word.
+ * @exception PTP::ERR_RAWDATA_NOT_ENOUGH_DATA if \a packed is too short for the frame.
+ */
+bool DNGWriter::write(const int fd, const uint8_t * packed, const uint32_t packed_size, const int width, const int height, const int bpp, const DNGMetadata& metadata, PTPTransferStats * stats) const
+{
+    PTPTrace::Span span("DNGWriter::write");
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    if (bpp != 10 && bpp != 12 && bpp != 14)
+    {
+        throw ERR_RAWDATA_INVALID_BPP;
+    }
+    if (width <= 0 || height <= 0 || (width * bpp) % 16 != 0)
+    {
+        throw ERR_DNGWRITER_INVALID_WIDTH; // Strips couldn't start on a word
+    }
+    const uint32_t packed_row = width * bpp / 8;
+    if (packed_size < (uint64_t) packed_row * height)
+    {
+        throw ERR_RAWDATA_NOT_ENOUGH_DATA;
+    }
+
+    const uint32_t out_row = this->unpacked ? width * 2 : packed_row;
+    const uint32_t rows_per_strip = std::max(1u, std::min((uint32_t) height, strip_target / out_row));
+    const uint32_t strips = (height + rows_per_strip - 1) / rows_per_strip;
+
+    Directory ifd;
+    ifd.add_long(254, 0); // NewSubFileType: the main image
+    ifd.add_long(256, width);
+    ifd.add_long(257, height);
+    ifd.add_short(258, this->unpacked ? 16 : bpp); // BitsPerSample
+    ifd.add_short(259, 1); // Compression: none
+    ifd.add_short(262, 32803); // PhotometricInterpretation: CFA
+    ifd.add_ascii(271, metadata.make);
+    ifd.add_ascii(272, metadata.model);
+    ifd.add_short(274, metadata.orientation);
+    ifd.add_short(277, 1); // SamplesPerPixel
+    ifd.add_long(278, rows_per_strip);
+    ifd.add_short(284, 1); // PlanarConfiguration: chunky
+    if (!metadata.software.empty())
+    {
+        ifd.add_ascii(305, metadata.software);
+    }
+
+    std::string date_time = metadata.date_time;
+    if (date_time.empty())
+    {
+        char now[20];
+        time_t t = time(NULL);
+        struct tm local;
+        strftime(now, sizeof now, "%Y:%m:%d %H:%M:%S", localtime_r(&t, &local));
+        date_time = now;
+    }
+    ifd.add_ascii(306, date_time);
+
+    const uint16_t cfa_dim[2] = { 2, 2 };
+    ifd.add(33421, TIFF_SHORT, 2, cfa_dim, sizeof cfa_dim); // CFARepeatPatternDim
+    ifd.add_bytes(33422, metadata.cfa_pattern, 4);
+    if (metadata.exposure_time >= 1)
+    {
+        ifd.add_rationals(33434, false, &metadata.exposure_time, 1);
+    }
+    else if (metadata.exposure_time > 0)
+    {
+        // Fractions of a second read better as 1/n
+        const uint32_t fraction[2] = { 1, (uint32_t) std::lround(1 / metadata.exposure_time) };
+        ifd.add(33434, TIFF_RATIONAL, 1, fraction, sizeof fraction);
+    }
+    if (metadata.f_number > 0)
+    {
+        ifd.add_rationals(33437, false, &metadata.f_number, 1);
+    }
+    if (metadata.iso > 0)
+    {
+        ifd.add_short(34855, metadata.iso); // ISOSpeedRatings
+    }
+
+    const uint8_t dng_version[4] = { 1, 3, 0, 0 };
+    const uint8_t dng_backward[4] = { 1, 1, 0, 0 };
+    const uint8_t plane_color[3] = { 0, 1, 2 };
+    ifd.add_bytes(50706, dng_version, 4);
+    ifd.add_bytes(50707, dng_backward, 4);
+    ifd.add_ascii(50708, metadata.unique_model.empty() ? metadata.make + " " + metadata.model : metadata.unique_model);
+    ifd.add_bytes(50710, plane_color, 3); // CFAPlaneColor
+    ifd.add_short(50711, 1); // CFALayout: rectangular
+    ifd.add_long(50714, metadata.black_level);
+    ifd.add_long(50717, metadata.white_level ? metadata.white_level : (1u << bpp) - 1);
+    ifd.add_rationals(50721, true, metadata.color_matrix, 9); // ColorMatrix1
+    ifd.add_rationals(50728, false, metadata.as_shot_neutral, 3);
+    ifd.add_short(50778, 21); // CalibrationIlluminant1: D65
+
+    // The offsets don't change the directory's size, so it can be sized first
+    std::vector<uint32_t> offsets(strips), counts(strips);
+    ifd.add_longs(273, offsets);
+    ifd.add_longs(279, counts);
+    const uint32_t data_start = (8 + ifd.get_size() + data_alignment - 1) & ~(data_alignment - 1);
+    for (uint32_t s = 0; s < strips; s++)
+    {
+        uint32_t rows = std::min(rows_per_strip, height - s * rows_per_strip);
+        offsets[s] = data_start + s * rows_per_strip * out_row;
+        counts[s] = rows * out_row;
+    }
+    ifd.add_longs(273, offsets);
+    ifd.add_longs(279, counts);
+
+    std::vector<uint8_t> header(8);
+    const uint8_t tiff_header[8] = { 'I', 'I', 42, 0, 8, 0, 0, 0 };
+    std::memcpy(header.data(), tiff_header, 8);
+    ifd.write(header);
+    header.resize(data_start, 0);
+
+    std::atomic<bool> failed(!pwrite_all(fd, header.data(), header.size(), 0));
+
+    // Strips go to whichever thread is free next
+    std::atomic<uint32_t> next(0);
+    const bool unpack = this->unpacked;
+    auto worker = [&]()
+    {
+        std::vector<uint8_t> buffer((uint64_t) rows_per_strip * out_row);
+        for (uint32_t s = next++; s < strips && !failed; s = next++)
+        {
+            const uint32_t rows = std::min(rows_per_strip, height - s * rows_per_strip);
+            const uint8_t * in = packed + (uint64_t) s * rows_per_strip * packed_row;
+            if (unpack)
+            {
+                RawData::unpack(in, rows * packed_row, (uint16_t *) buffer.data(), rows * width, bpp);
+            }
+            else
+            {
+                swap_words(in, buffer.data(), rows * packed_row);
+            }
+            if (!pwrite_all(fd, buffer.data(), counts[s], offsets[s]))
+            {
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int i = 1; i < this->threads && (uint32_t) i < strips; i++)
+    {
+        pool.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < pool.size(); i++)
+    {
+        pool[i].join();
+    }
+
+    if (stats != NULL)
+    {
+        stats->bytes = data_start + (uint64_t) out_row * height;
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    return !failed;
+}
+
+/**
+ * @brief Write a raw frame as a DNG to the file \a filename
+ *
+ * @see DNGWriter::write(const int, const uint8_t *, const uint32_t, const int, const int, const int, const DNGMetadata&, PTPTransferStats *) const
+ */
+bool DNGWriter::write(const std::string filename, const uint8_t * packed, const uint32_t packed_size, const int width, const int height, const int bpp, const DNGMetadata& metadata, PTPTransferStats * stats) const
+{
+    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    bool ok;
+    try
+    {
+        ok = this->write(fd, packed, packed_size, width, height, bpp, metadata, stats);
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+        ::close(fd);
+        throw;
+    }
+
+    return (::close(fd) == 0) && ok;
+}
+
+/**
+ * What the camera is asked for: its build, the last shot's APEX values and,
+ * where the build has \c rawop, the sensor's CFA pattern and levels.
+ */
+const char * const DNGWriter::metadata_script =
+    "local b = get_buildinfo() "
+    "local t = { platform = b.platform, build = b.build_number, date = os.date('%Y:%m:%d %H:%M:%S'), "
+    "tv96 = get_tv96(), av96 = get_av96(), sv96 = get_sv96() } "
+    "if rawop then t.cfa = rawop.get_cfa() t.black = rawop.get_black_level() t.white = rawop.get_white_level() end "
+    "return t";
+
+/**
+ * @brief Fill in \a out from what \a camera reports about its last shot
+ *
+ * Exposure comes from the camera's APEX values.  The sensor's CFA pattern
+ * and levels come from the \c rawop module, where the build has it;
+ * without it they're left at their defaults.
+ *
+ * @param[in]  camera  The camera to ask.
+ * @param[out] out     Where to put what it reports.
+ * @param[in]  timeout (optional) Milliseconds to wait for the camera, or 0 to wait forever.
+ * @return true if the camera answered.
+ */
+bool DNGWriter::get_metadata(CHDKCamera& camera, DNGMetadata& out, const int timeout)
+{
+    PTPTrace::Span span("DNGWriter::get_metadata");
+
+    CHDKScriptValue value;
+    if (!camera.run_lua(DNGWriter::metadata_script, &value, NULL, timeout) || value.type != PTP_CHDK_TYPE_TABLE)
+    {
+        return false;
+    }
+
+    std::map<std::string, std::string>& t = value.table;
+    out.make = "Canon";
+    out.model = t["platform"];
+    out.unique_model = out.make + " " + out.model;
+    out.software = "CHDK " + t["build"];
+    out.date_time = t["date"];
+
+    // APEX, in 96ths of a stop
+    out.exposure_time = std::pow(2.0, -std::atof(t["tv96"].c_str()) / 96);
+    out.f_number = std::pow(2.0, std::atof(t["av96"].c_str()) / 192);
+    out.iso = (uint16_t) std::lround(3.125 * std::pow(2.0, std::atof(t["sv96"].c_str()) / 96));
+
+    if (t.count("cfa"))
+    {
+        uint32_t cfa = std::strtoul(t["cfa"].c_str(), NULL, 10);
+        for (int i = 0; i < 4; i++)
+        {
+            out.cfa_pattern[i] = (cfa >> (8 * i)) & 0xFF;
+        }
+        out.black_level = std::strtoul(t["black"].c_str(), NULL, 10);
+        out.white_level = std::strtoul(t["white"].c_str(), NULL, 10);
+    }
+
+    return true;
+}
+
+} /* namespace PTP */
@@ -34,6 +34,7 @@
 #include "libeasyptp/PTPErrors.hpp"
 #include "libeasyptp/LVData.hpp"
 #include "libeasyptp/PTPContainer.hpp"
+#include "libeasyptp/PTPTrace.hpp"
 
 namespace EasyPTP
 {
@@ -54,7 +55,7 @@ LVData::LVData() : LVData(NULL, 0)
  * @see LVData::read
  */
 LVData::LVData(const uint8_t * payload, const int payload_size) :
-vp_head(new lv_data_header), fb_desc(new lv_framebuffer_desc), payload(NULL)
+vp_head(new lv_data_header), fb_desc(new lv_framebuffer_desc)
 {
     if (payload != NULL)
     {
@@ -69,7 +70,6 @@ LVData::~LVData()
 {
     delete this->vp_head;
     delete this->fb_desc;
-    delete this->payload;
 }
 
 /**
@@ -80,11 +80,13 @@ LVData::~LVData()
  * for later use in retrieving data.  This way, we only spend CPU time on the
  * data retrieval we NEED to make.
  *
+ * The storage for the copy is kept between calls, so reading frames of the
+ * same size over and over does not allocate.
+ *
  * @param[in] payload The address of the first byte of a PTP payload
  * @param[in] payload_size The number of bytes in the payload
  * @exception LVDATA_NOT_ENOUGH_DATA If payload_size given cannot possibly be large
  *              enough to actually contain live view data.
- * @todo The casting here is pretty bad. How can I clean this up?
  */
 void LVData::read(const uint8_t * payload, const unsigned int payload_size)
 {
@@ -93,42 +95,51 @@ void LVData::read(const uint8_t * payload, const unsigned int payload_size)
         throw ERR_LVDATA_NOT_ENOUGH_DATA;
     }
 
-    if (this->payload != NULL)
-    {
-        delete[] this->payload; // Free up the payload if we're overwriting this object
-        this->payload = NULL;
-    }
-
-    this->payload = new uint8_t[payload_size];
-
-    std::memcpy(this->payload, payload, payload_size); // Copy the payload we're reading in into OUR payload
-
-    // Parse the payload data into vp_head and fb_desc
-    std::memcpy(this->vp_head, this->payload, sizeof (lv_data_header));
-    std::memcpy(this->fb_desc, this->payload + this->vp_head->vp_desc_start, sizeof (lv_framebuffer_desc));
+    this->container.set_payload(payload, payload_size); // Copy the payload we're reading in into OUR payload
+    this->parse();
 }
 
 /**
  * @brief Read live view data directly from a \c PTPContainer
  *
  * This function exists so that we can hide the actual payload data from
- * calling functions, and just pass \c PTPContainer s around.  In a
- * perfect data-hiding world, \c PTPContainer and \c LVData might be friend
- * classes, so that methods to access the payload could be kept protected.
+ * calling functions, and just pass \c PTPContainer s around.
  *
  * @param[in] container The \c PTPContainer to read live view data from
  * @see LVData::read(uint8_t * payload, int payload_size)
  */
 void LVData::read(const PTPContainer& container)
 {
-    int payload_size;
-    unsigned char * payload;
+    this->container = container;
+    this->parse();
+}
 
-    payload = container.get_payload(&payload_size);
+/**
+ * @brief Parse the headers out of the payload in \c container
+ *
+ * \c CHDKCamera receives frames straight into \c container and then calls
+ * this, so a frame is never copied on its way into an \c LVData.
+ *
+ * @exception LVDATA_NOT_ENOUGH_DATA If the payload is too short for the
+ *              headers it claims to have.
+ */
+void LVData::parse()
+{
+    int payload_size;
+    const uint8_t * payload = this->container.get_payload_ptr(&payload_size);
 
-    this->read(payload, payload_size);
+    if (payload == NULL || payload_size < (int) (sizeof (lv_data_header) + sizeof (lv_framebuffer_desc)))
+    {
+        throw ERR_LVDATA_NOT_ENOUGH_DATA;
+    }
 
-    delete[] payload;
+    // Parse the payload data into vp_head and fb_desc
+    std::memcpy(this->vp_head, payload, sizeof (lv_data_header));
+    if (this->vp_head->vp_desc_start < 0 || this->vp_head->vp_desc_start + (int) sizeof (lv_framebuffer_desc) > payload_size)
+    {
+        throw ERR_LVDATA_NOT_ENOUGH_DATA;
+    }
+    std::memcpy(this->fb_desc, payload + this->vp_head->vp_desc_start, sizeof (lv_framebuffer_desc));
 }
 
 /**
@@ -141,6 +152,8 @@ void LVData::read(const PTPContainer& container)
  * are calculated from properties of the live view data, to hide the underlying structure.
  *
  * @warning This function malloc()s space for the resulting data. Be sure to free() it!
+ *          For a loop which does not allocate, use the overload which takes an
+ *          output buffer.
  *
  * @param[out] out_size The size of the resulting RGB data
  * @param[out] out_width The width of the resulting RGB image
@@ -151,44 +164,83 @@ void LVData::read(const PTPContainer& container)
  */
 uint8_t * LVData::get_rgb(int * out_size, int * out_width, int * out_height, const bool skip) const
 {
-    uint8_t * vp_data;
-    int vp_size;
-    vp_size = (this->fb_desc->buffer_width * this->fb_desc->visible_height * 12) / 8; // 12 bpp
-    vp_data = new uint8_t[vp_size]; // Allocate memory for YUV data 
-    std::memcpy(vp_data, this->payload + this->fb_desc->data_start, vp_size); // Copy YUV data into vp_data
+    *out_size = this->get_rgb_size(skip);
 
+    uint8_t * out = new uint8_t[*out_size]; // Allocate space for RGB output
+
+    this->get_rgb(out, *out_size, out_width, out_height, skip);
+
+    return out; // It's up to the caller to free() this when done
+}
+
+/**
+ * @brief The number of bytes \c LVData::get_rgb will produce
+ *
+ * @param[in] skip If true, skips two pixels of every four (required on some cameras)
+ * @return The size of the RGB image, in bytes
+ */
+int LVData::get_rgb_size(const bool skip) const
+{
     int par = skip ? 2 : 1; // If skip, par = 2 ; else, par = 1
 
-    *out_width = this->fb_desc->visible_width / par; // Vertical width of output
-    unsigned int dispsize = *out_width * (this->fb_desc->visible_height); // Size of output
-    *out_size = dispsize * 3; // RGB output size
+    return (this->fb_desc->visible_width / par) * this->fb_desc->visible_height * 3;
+}
 
-    uint8_t * out = new uint8_t[*out_size]; // Allocate space for RGB output
+/**
+ * @brief Get live view data in RGB format, into a caller-supplied buffer
+ *
+ * The YUV data is converted straight out of the received payload, so this
+ * does not allocate at all.
+ *
+ * @param[out] out Where to place the RGB image
+ * @param[in]  out_size The size of \a out.  Must be at least \c LVData::get_rgb_size.
+ * @param[out] out_width The width of the resulting RGB image
+ * @param[out] out_height The height of the resulting RGB image
+ * @param[in]  skip If true, skips two pixels of every four (required on some cameras)
+ * @exception LVDATA_NOT_ENOUGH_DATA If the payload does not hold the whole
+ *              frame, or \a out is too small.
+ * @see LVData::get_rgb_size
+ */
+void LVData::get_rgb(uint8_t * out, const int out_size, int * out_width, int * out_height, const bool skip) const
+{
+    PTPTrace::Span span("LVData::get_rgb");
 
-    uint8_t * prgb_data = out; // Pointer we can manipulate to transverse RGB output memory
-    uint8_t * p_yuv = vp_data; // Pointer we can manipulate to transverse YUV input memory
+    int payload_size;
+    const uint8_t * payload = this->container.get_payload_ptr(&payload_size);
 
-    int i;
-    // Transverse input and output. For each four RGB pixels, we increment 6 YUV bytes
-    //  See: http://chdk.wikia.com/wiki/Frame_buffers#Viewport
-    // This magical code borrowed from http://trac.assembla.com/chdk/browser/trunk/tools/yuvconvert.c
-    for (i = 0; i < (this->fb_desc->buffer_width * this->fb_desc->visible_height); i += 4, p_yuv += 6)
+    int vp_size = (this->fb_desc->buffer_width * this->fb_desc->visible_height * 12) / 8; // 12 bpp
+    if (payload == NULL || this->fb_desc->data_start < 0 || this->fb_desc->data_start + vp_size > payload_size
+        || out_size < this->get_rgb_size(skip))
     {
-        this->yuv_to_rgb(&prgb_data, p_yuv[1], p_yuv[0], p_yuv[2]);
-        this->yuv_to_rgb(&prgb_data, p_yuv[3], p_yuv[0], p_yuv[2]);
+        throw ERR_LVDATA_NOT_ENOUGH_DATA;
+    }
 
-        if (skip) continue; // If we skip two, go to the next iteration
+    const uint8_t * vp_data = payload + this->fb_desc->data_start; // YUV data, straight out of the payload
 
-        this->yuv_to_rgb(&prgb_data, p_yuv[4], p_yuv[0], p_yuv[2]);
-        this->yuv_to_rgb(&prgb_data, p_yuv[5], p_yuv[0], p_yuv[2]);
-    }
+    int par = skip ? 2 : 1; // If skip, par = 2 ; else, par = 1
 
+    *out_width = this->fb_desc->visible_width / par; // Vertical width of output
     *out_height = this->fb_desc->visible_height;
 
-    delete[] vp_data;
-    ; // We don't need this anymore
-
-    return out; // It's up to the caller to free() this when done
+    // Transverse input and output. For each four RGB pixels, we increment 6 YUV bytes
+    //  See: http://chdk.wikia.com/wiki/Frame_buffers#Viewport
+    // This magical code borrowed from http://trac.assembla.com/chdk/browser/trunk/tools/yuvconvert.c
+    // Rows are walked separately so that any padding past visible_width is skipped.
+    for (int row = 0; row < this->fb_desc->visible_height; row++)
+    {
+        uint8_t * prgb_data = out + row * (*out_width) * 3; // Pointer we can manipulate to transverse RGB output memory
+        const uint8_t * p_yuv = vp_data + (row * this->fb_desc->buffer_width * 12) / 8; // And the same for YUV input memory
+        for (int i = 0; i + 4 <= this->fb_desc->visible_width; i += 4, p_yuv += 6)
+        {
+            this->yuv_to_rgb(&prgb_data, p_yuv[1], p_yuv[0], p_yuv[2]);
+            this->yuv_to_rgb(&prgb_data, p_yuv[3], p_yuv[0], p_yuv[2]);
+
+            if (skip) continue; // If we skip two, go to the next iteration
+
+            this->yuv_to_rgb(&prgb_data, p_yuv[4], p_yuv[0], p_yuv[2]);
+            this->yuv_to_rgb(&prgb_data, p_yuv[5], p_yuv[0], p_yuv[2]);
+        }
+    }
 }
 
 /**
@@ -236,7 +288,7 @@ void LVData::yuv_to_rgb(uint8_t **dest, const uint8_t y, const int8_t u, const i
  */
 float LVData::get_lv_version() const
 {
-    if (this->vp_head == NULL) return -1;
+    if (this->container.is_empty()) return -1;
 
     return this->vp_head->version_major + this->vp_head->version_minor / 10.0;
 }
@@ -31,11 +31,15 @@
 
 #include <cstring>
 #include <stdint.h>
+#include <mutex>
 
 #include "libeasyptp/PTPErrors.hpp"
 #include "libeasyptp/PTPBase.hpp"
 #include "libeasyptp/PTPContainer.hpp"
 #include "libeasyptp/IPTPComm.hpp"
+#include "libeasyptp/PTPTrace.hpp"
+#include "libeasyptp/PTPDeadline.hpp"
+#include "libeasyptp/PTPDataSource.hpp"
 
 namespace EasyPTP
 {
@@ -78,23 +82,82 @@ void PTPBase::set_protocol(IPTPComm * protocol)
  * Send the data contained in \a cmd to the connected camera.
  *
  * @param[in] cmd The \c PTPContainer containing the command/data to send.
- * @param[in] timeout The maximum number of seconds to attempt to send for.
- * @return 0 on success, libusb error code otherwise.
+ * @param[in] timeout The maximum number of milliseconds to attempt to send for, or 0 to wait forever.
+ * @return 0.  Failures are thrown.
+ * @exception PTP::ERR_TIMEOUT if \a timeout passes before the message is sent.
+ * @exception PTP::ERR_USB_ERROR if the write fails for any other reason.
  * @see PTPBase::_bulk_write, PTPBase::recv_ptp_message
  */
 int PTPBase::send_ptp_message(const PTPContainer& cmd, const int timeout)
 {
+    return this->send_ptp_message(cmd, PTPDeadline::from_timeout(timeout));
+}
+
+/**
+ * Send the data contained in \a cmd to the connected camera, giving up at
+ * \a deadline.
+ *
+ * Nothing is cancelled here if the write fails; that is up to the caller,
+ * as \c PTPBase::ptp_transaction does.
+ *
+ * @param[in] cmd The \c PTPContainer containing the command/data to send.
+ * @param[in] deadline When to give up.
+ * @return 0.  Failures are thrown.
+ * @exception PTP::ERR_TIMEOUT if \a deadline passes before the message is sent.
+ * @exception PTP::ERR_USB_ERROR if the write fails for any other reason.
+ * @see PTPBase::_bulk_write, PTPBase::recv_ptp_message
+ */
+int PTPBase::send_ptp_message(const PTPContainer& cmd, const PTPDeadline& deadline)
+{
+    PTPTrace::Span span("PTPBase::send_ptp_message");
+
     if (this->protocol == NULL || this->protocol->is_open() == false)
     {
         throw ERR_NOT_OPEN;
         return -1;
     }
 
-    unsigned char * packed = cmd.pack();
-    int ret = this->protocol->_bulk_write(packed, cmd.get_length(), timeout);
-    delete[] packed;
+    std::lock_guard<std::recursive_mutex> lock(this->_session_mutex);
 
-    return ret;
+    if (deadline.expired())
+    {
+        throw ERR_TIMEOUT;
+    }
+
+    // Commands and small data phases are packed on the stack; anything bigger
+    //  goes in a buffer which is kept around for the next message
+    unsigned char small[512];
+    unsigned char * packed = small;
+    uint32_t length = cmd.get_length();
+    if (length > sizeof small)
+    {
+        if (this->_tx_buffer.size() < length)
+        {
+            this->_tx_buffer.resize(length);
+        }
+        packed = this->_tx_buffer.data();
+    }
+
+    cmd.pack_into(packed);
+    PTPTrace::Span write_span("usb write");
+    if (!this->protocol->_bulk_write(packed, length, deadline.remaining_ms()))
+    {
+        throw deadline.expired() ? ERR_TIMEOUT : ERR_USB_ERROR;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Recives a \c PTPContainer from the camera and returns it.
+ *
+ * @param[out] out A pointer to a PTPContainer that will store the read PTP message.
+ * @param[in]  timeout The maximum number of milliseconds to wait for the whole message, or 0 to wait forever.
+ * @see PTPBase::recv_ptp_message(PTPContainer& out, const PTPDeadline& deadline)
+ */
+void PTPBase::recv_ptp_message(PTPContainer& out, const int timeout)
+{
+    this->recv_ptp_message(out, PTPDeadline::from_timeout(timeout));
 }
 
 /**
@@ -102,55 +165,103 @@ int PTPBase::send_ptp_message(const PTPContainer& cmd, const int timeout)
  *
  * This function works by first reading in a buffer of 512 bytes from the camera
  * to determine the length of the PTP message it will receive.  If necessary, it
- * then makes another \c PTPBase::_bulk_read call to read in the rest of the
- * data.  Finally, \c PTPContainer::unpack is called to place the data in \a out.
+ * then makes more \c PTPBase::_bulk_read calls to read the rest of the data
+ * straight into the payload of \a out.  The payload storage of \a out is
+ * reused, so receiving into the same container again does not allocate.
  *
- * @warning \a timeout is passed to each call to \c PTPBase::_bulk_read.  Therefore,
- *          this function could take up to 2 * \a timeout seconds to return.
+ * Every read is given only the time left before \a deadline, so the whole
+ * message has to arrive by then.
  *
  * @param[out] out A pointer to a PTPContainer that will store the read PTP message.
- * @param[in]  timeout The maximum number of seconds to wait to read each time.
+ * @param[in]  deadline When to give up.
+ * @exception PTP::ERR_TIMEOUT if \a deadline passes before the whole message is read.
+ * @exception PTP::ERR_CANNOT_RECV if a read fails for any other reason.
  * @see PTPBase::_bulk_read, PTPBase::send_ptp_message
  */
-void PTPBase::recv_ptp_message(PTPContainer& out, const int timeout)
+void PTPBase::recv_ptp_message(PTPContainer& out, const PTPDeadline& deadline)
 {
+    PTPTrace::Span span("PTPBase::recv_ptp_message");
+
     if (this->protocol == NULL || this->protocol->is_open() == false)
     {
         throw ERR_NOT_OPEN;
         return;
     }
 
+    std::lock_guard<std::recursive_mutex> lock(this->_session_mutex);
+
+    if (deadline.expired())
+    {
+        throw ERR_TIMEOUT;
+    }
+
     // Determine size we need to read
-    unsigned char * buffer = new unsigned char[512];
+    unsigned char buffer[512];
     int read = 0;
-    this->protocol->_bulk_read(buffer, 512, &read, timeout); // TODO: Error checking on response
+    bool ok;
+    {
+        // Includes the time spent waiting for the camera to answer
+        PTPTrace::Span read_span("usb read (first packet)");
+        ok = this->protocol->_bulk_read(buffer, 512, &read, deadline.remaining_ms());
+    }
     uint32_t size = 0;
-    if (read < 4)
+    if (read < 12)
     {
-        // If we actually read less than four bytes, we can't copy four bytes out of the buffer.
+        if (!ok && deadline.expired())
+        {
+            throw ERR_TIMEOUT;
+        }
+        // If we actually read less than a header, we can't parse anything out of the buffer.
         // Also, something went very, very wrong
         throw ERR_CANNOT_RECV;
         return;
     }
     std::memcpy(&size, buffer, 4); // The first four bytes of the buffer are the size
-
-    // Copy our first part into the output buffer -- so we can reuse buffer
-    unsigned char * out_buf = new unsigned char[size];
-    if (size < 512)
+    if (size < 12)
     {
-        std::memcpy(out_buf, buffer, size);
+        throw ERR_INVALID_RESPONSE;
     }
-    else
+
+    std::memcpy(&out.type, buffer + 4, 2);
+    std::memcpy(&out.code, buffer + 6, 2);
+    std::memcpy(&out.transaction_id, buffer + 8, 4);
+
+    // Copy our first part straight into the container's payload, then read
+    //  the rest of the message in behind it
+    unsigned char * payload = out.resize_payload(size - 12);
+    uint32_t received = ((uint32_t) read < size) ? read : size;
+    std::memcpy(payload, buffer + 12, received - 12);
+
+    PTPTrace::Span read_span("usb read (bulk)");
+    while (received < size)
     {
-        std::memcpy(out_buf, buffer, 512);
-        // We've already read 512 bytes... read the rest!
-        this->protocol->_bulk_read(&out_buf[512], size - 512, &read, timeout);
+        if (deadline.expired())
+        {
+            throw ERR_TIMEOUT;
+        }
+        read = 0;
+        ok = this->protocol->_bulk_read(payload + received - 12, size - received, &read, deadline.remaining_ms());
+        if (read > 0)
+        {
+            received += read; // A timed out transfer may still have delivered part of the data
+        }
+        if (!ok || read <= 0)
+        {
+            throw deadline.expired() ? ERR_TIMEOUT : ERR_CANNOT_RECV;
+        }
     }
+}
 
-    out.unpack(out_buf);
-
-    delete[] out_buf;
-    delete[] buffer;
+/**
+ * @brief Perform a complete write, and optionally read, PTP transaction.
+ *
+ * @param[in]  timeout   The maximum number of milliseconds the whole transaction
+ *                       may take, or 0 to wait forever.
+ * @see PTPBase::ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const PTPDeadline& deadline)
+ */
+void PTPBase::ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const int timeout)
+{
+    this->ptp_transaction(cmd, data, receiving, out_resp, out_data, PTPDeadline::from_timeout(timeout));
 }
 
 /**
@@ -168,63 +279,475 @@ void PTPBase::recv_ptp_message(PTPContainer& out, const int timeout)
  * If provided, \a out_resp will be populated with the command response, even if
  * \a receiving is false.
  *
- * @warning \c PTPBase::_bulk_read and \c PTPBase::_bulk_write are called multiple
- *          times during the execution of this function, and \a timeout is passed to each
- *          of them individually.  Therefore, this function could take much more than
- *          \a timeout seconds to return.
+ * \a deadline applies to the transaction as a whole: every read and write is
+ * only given the time that is left.  If it passes, or a write fails, the
+ * transaction is cancelled with the PTP Cancel request (see
+ * \c PTPBase::abort_transaction), so the session can be used again, and the
+ * error is thrown.  Cancelling has its own timeout of
+ * \c PTPBase::cancel_timeout, so a timed out call can return up to that much
+ * later than \a deadline.
  *
  * @param[in]  cmd       A \c PTPContainer containing the command to send to the camera.
  * @param[in]  data      (optional) A \c PTPContainer containing the data to be sent with the command.
  * @param[in]  receiving Whether or not to receive data in addition to a response from the camera.
  * @param[out] out_resp  (optional) A \c PTPContainer where the camera's response will be placed.
  * @param[out] out_data  (optional) A \c PTPContainer where the camera's data response will be placed.
- * @param[in]  timeout   The maximum number of seconds each \c PTPBase::_bulk_read or \c PTPBase::_bulk_write
- *                       should attempt to communicate for.
+ * @param[in]  deadline  When the whole transaction has to be finished by.
+ * @exception PTP::ERR_TIMEOUT if \a deadline passes.
+ * @exception PTP::ERR_USB_ERROR if a write fails.
+ * @note The whole transaction runs under the session lock, so it is safe to
+ *       call this from several threads at once.  Transactions are serialized
+ *       on the wire; see \c PTPWorker for an asynchronous interface.
+ *
  * @see PTPBase::send_ptp_message, PTPBase::recv_ptp_message
  */
-void PTPBase::ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const int timeout)
+void PTPBase::ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const PTPDeadline& deadline)
 {
+    std::lock_guard<std::recursive_mutex> lock(this->_session_mutex);
+    PTPTrace::Span span("PTPBase::ptp_transaction");
+
 	// TODO: Use received data
 //    bool received_data = false;
     bool received_resp = false;
 
     cmd.transaction_id = this->get_and_increment_transaction_id();
-    this->send_ptp_message(cmd, timeout);
+    try
+    {
+        this->send_ptp_message(cmd, deadline);
+
+        if (!data.is_empty())
+        {
+            // Only send data if it doesn't have an empty payload
+            data.transaction_id = cmd.transaction_id;
+            this->send_ptp_message(data, deadline);
+        }
 
-    if (!data.is_empty())
+        if (receiving)
+        {
+            // Receive straight into out_data; if the camera skipped the data
+            //  phase, what we got is really the response
+            this->recv_ptp_message(out_data, deadline);
+            if (out_data.type == PTPContainer::CONTAINER_TYPE_RESPONSE)
+            {
+                received_resp = true;
+                out_resp.swap(out_data);
+                out_data.reset(0, 0);
+            }
+        }
+
+        if (!received_resp)
+        {
+            // Read it anyway!
+            // TODO: We should return response AND data...
+            this->recv_ptp_message(out_resp, deadline);
+        }
+    }
+    catch (LIBPTP_PP_ERRORS e)
     {
-        // Only send data if it doesn't have an empty payload
-        data.transaction_id = cmd.transaction_id;
-        this->send_ptp_message(data, timeout);
+        if (e == ERR_TIMEOUT || e == ERR_USB_ERROR)
+        {
+            this->abort_transaction(cmd.transaction_id);
+        }
+        throw;
+    }
+}
+
+/**
+ * @brief Receive a data phase into \a sink, in chunks, as it arrives
+ *
+ * Like \c PTPBase::recv_ptp_message, this starts by reading 512 bytes to
+ * find out what is coming.  If it is a data container, the payload is handed
+ * to \a sink \c PTPBase::stream_chunk_size bytes at a time, read straight
+ * into \c IPTPDataSink::direct_buffer where the sink offers it, so the data
+ * phase is never held in memory as a whole.  If the camera skipped the data
+ * phase, what arrived was the response, and it is placed in \a out_resp.
+ *
+ * @param[out] sink     Where the data phase goes.
+ * @param[out] out_resp Where the response goes, if the camera sent no data.
+ * @param[in]  deadline When to give up.
+ * @param[in]  progress (optional) Called after each chunk with the bytes received so far.
+ * @return true if a data phase was received, false if \a out_resp was filled instead.
+ * @exception PTP::ERR_TIMEOUT if \a deadline passes before the whole data phase is read.
+ * @exception PTP::ERR_CANNOT_RECV if a read fails for any other reason.
+ * @exception PTP::ERR_DATASINK_FAILED if \a sink refuses the data.
+ * @note \c IPTPDataSink::end is always called once \c IPTPDataSink::begin has been.
+ * @see PTPBase::ptp_transaction(PTPContainer& cmd, PTPContainer& data, IPTPDataSink& sink, PTPContainer& out_resp, const PTPDeadline& deadline, const PTPProgressCallback& progress)
+ */
+bool PTPBase::recv_ptp_data(IPTPDataSink& sink, PTPContainer& out_resp, const PTPDeadline& deadline, const PTPProgressCallback& progress)
+{
+    PTPTrace::Span span("PTPBase::recv_ptp_data");
+
+    if (this->protocol == NULL || this->protocol->is_open() == false)
+    {
+        throw ERR_NOT_OPEN;
+        return false;
     }
 
-    if (receiving)
+    std::lock_guard<std::recursive_mutex> lock(this->_session_mutex);
+
+    if (deadline.expired())
     {
-        PTPContainer out;
-        this->recv_ptp_message(out, timeout);
-        if (out.type == PTPContainer::CONTAINER_TYPE_DATA)
+        throw ERR_TIMEOUT;
+    }
+
+    unsigned char buffer[512];
+    int read = 0;
+    bool ok;
+    {
+        PTPTrace::Span read_span("usb read (first packet)");
+        ok = this->protocol->_bulk_read(buffer, 512, &read, deadline.remaining_ms());
+    }
+    if (read < 12)
+    {
+        if (!ok && deadline.expired())
         {
-//            received_data = true;
-            // TODO: It occurs to me that pack() and unpack() might be inefficient. Let's try to find a better way to do this.
-            unsigned char * packed = out.pack();
-            out_data.unpack(packed);
-            delete[] packed;
+            throw ERR_TIMEOUT;
         }
-        else if (out.type == PTPContainer::CONTAINER_TYPE_RESPONSE)
+        throw ERR_CANNOT_RECV;
+    }
+
+    uint32_t size = 0;
+    uint16_t type = 0;
+    std::memcpy(&size, buffer, 4);
+    std::memcpy(&type, buffer + 4, 2);
+    if (size < 12)
+    {
+        throw ERR_INVALID_RESPONSE;
+    }
+
+    uint32_t received = ((uint32_t) read < size) ? read : size;
+
+    if (type != PTPContainer::CONTAINER_TYPE_DATA)
+    {
+        // No data phase -- this is the response, which always fits in one packet
+        if (received < size)
         {
-            received_resp = true;
-            unsigned char * packed = out.pack();
-            out_resp.unpack(packed);
-            delete[] packed;
+            throw ERR_INVALID_RESPONSE;
         }
+        out_resp.type = type;
+        std::memcpy(&out_resp.code, buffer + 6, 2);
+        std::memcpy(&out_resp.transaction_id, buffer + 8, 4);
+        std::memcpy(out_resp.resize_payload(size - 12), buffer + 12, size - 12);
+        return false;
     }
 
-    if (!received_resp)
+    const uint64_t total = size - 12;
+    if (!sink.begin(total))
     {
-        // Read it anyway!
-        // TODO: We should return response AND data...
-        this->recv_ptp_message(out_resp, timeout);
+        sink.end(false);
+        throw ERR_DATASINK_FAILED;
     }
+
+    try
+    {
+        uint64_t done = received - 12;
+        if (done > 0 && !sink.write(0, buffer + 12, done))
+        {
+            throw ERR_DATASINK_FAILED;
+        }
+        if (progress)
+        {
+            progress(done, total);
+        }
+
+        PTPTrace::Span read_span("usb read (stream)");
+        while (done < total)
+        {
+            uint32_t want = (total - done < stream_chunk_size) ? (uint32_t) (total - done) : stream_chunk_size;
+
+            unsigned char * dest = sink.direct_buffer(done, want);
+            const bool direct = (dest != NULL);
+            if (!direct)
+            {
+                if (this->_rx_buffer.size() < stream_chunk_size)
+                {
+                    this->_rx_buffer.resize(stream_chunk_size);
+                }
+                dest = this->_rx_buffer.data();
+            }
+
+            uint32_t got = 0;
+            while (got < want)
+            {
+                if (deadline.expired())
+                {
+                    throw ERR_TIMEOUT;
+                }
+                read = 0;
+                ok = this->protocol->_bulk_read(dest + got, want - got, &read, deadline.remaining_ms());
+                if (read > 0)
+                {
+                    got += read;
+                }
+                if (!ok || read <= 0)
+                {
+                    throw deadline.expired() ? ERR_TIMEOUT : ERR_CANNOT_RECV;
+                }
+            }
+
+            if (direct)
+            {
+                sink.commit(done, want);
+            }
+            else if (!sink.write(done, dest, want))
+            {
+                throw ERR_DATASINK_FAILED;
+            }
+
+            done += want;
+            if (progress)
+            {
+                progress(done, total);
+            }
+        }
+    }
+    catch (...)
+    {
+        sink.end(false);
+        throw;
+    }
+
+    if (!sink.end(true))
+    {
+        throw ERR_DATASINK_FAILED;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Perform a PTP transaction whose data phase is streamed into \a sink
+ *
+ * Works like \c PTPBase::ptp_transaction with \a receiving set, except that
+ * the data phase goes to \a sink as it arrives (see
+ * \c PTPBase::recv_ptp_data) instead of into a \c PTPContainer.  If the
+ * deadline passes or the sink gives up part way through, the transaction is
+ * cancelled so the session can be used again; cancelling can take up to
+ * \c PTPBase::cancel_timeout past the deadline.
+ *
+ * @param[in]  cmd      A \c PTPContainer containing the command to send to the camera.
+ * @param[in]  data     (optional) A \c PTPContainer containing the data to be sent with the command.
+ * @param[out] sink     Where the data phase goes.
+ * @param[out] out_resp A \c PTPContainer where the camera's response will be placed.
+ * @param[in]  deadline When the whole transaction has to be finished by.
+ * @param[in]  progress (optional) Called after each chunk with the bytes received so far.
+ * @return true if the camera sent a data phase.
+ * @exception PTP::ERR_TIMEOUT if \a deadline passes.
+ * @exception PTP::ERR_DATASINK_FAILED if \a sink refuses the data.
+ * @see PTPBase::recv_ptp_data
+ */
+bool PTPBase::ptp_transaction(PTPContainer& cmd, PTPContainer& data, IPTPDataSink& sink, PTPContainer& out_resp, const PTPDeadline& deadline, const PTPProgressCallback& progress)
+{
+    std::lock_guard<std::recursive_mutex> lock(this->_session_mutex);
+    PTPTrace::Span span("PTPBase::ptp_transaction (stream)");
+
+    bool received_data = false;
+
+    cmd.transaction_id = this->get_and_increment_transaction_id();
+    try
+    {
+        this->send_ptp_message(cmd, deadline);
+
+        if (!data.is_empty())
+        {
+            data.transaction_id = cmd.transaction_id;
+            this->send_ptp_message(data, deadline);
+        }
+
+        received_data = this->recv_ptp_data(sink, out_resp, deadline, progress);
+        if (received_data)
+        {
+            this->recv_ptp_message(out_resp, deadline);
+        }
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+        if (e == ERR_TIMEOUT || e == ERR_DATASINK_FAILED || e == ERR_USB_ERROR)
+        {
+            this->abort_transaction(cmd.transaction_id);
+        }
+        throw;
+    }
+
+    return received_data;
+}
+
+/**
+ * @brief Send a data phase from \a source, in chunks, without packing it
+ *
+ * \a header gives the data container's type, code and transaction ID, and
+ * its payload (if any) goes out ahead of the data from \a source -- CHDK
+ * puts the destination filename there, for example.  The container's
+ * length is set to cover both.
+ *
+ * The first write is the header plus as much data as fills
+ * \c PTPBase::stream_chunk_size; after that each chunk is written straight
+ * from \c IPTPDataSource::direct_data where the source offers it, or from
+ * one reused buffer.  Every write but the last is a multiple of 512 bytes,
+ * so the camera sees one continuous transfer.
+ *
+ * @param[in] header   A data \c PTPContainer whose payload is sent before \a source.
+ * @param[in] source   Where the rest of the data phase comes from.
+ * @param[in] deadline When to give up.
+ * @param[in] progress (optional) Called after each chunk with the bytes of \a source sent so far.
+ * @exception PTP::ERR_TIMEOUT if \a deadline passes before everything is sent.
+ * @exception PTP::ERR_USB_ERROR if a write fails for any other reason.
+ * @exception PTP::ERR_DATASOURCE_FAILED if \a source can't provide its data,
+ *            or there is more than a PTP container can describe.
+ * @see PTPBase::ptp_transaction(PTPContainer& cmd, PTPContainer& header, IPTPDataSource& source, PTPContainer& out_resp, const PTPDeadline& deadline, const PTPProgressCallback& progress)
+ */
+void PTPBase::send_ptp_data(const PTPContainer& header, IPTPDataSource& source, const PTPDeadline& deadline, const PTPProgressCallback& progress)
+{
+    PTPTrace::Span span("PTPBase::send_ptp_data");
+
+    if (this->protocol == NULL || this->protocol->is_open() == false)
+    {
+        throw ERR_NOT_OPEN;
+        return;
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(this->_session_mutex);
+
+    if (deadline.expired())
+    {
+        throw ERR_TIMEOUT;
+    }
+
+    const uint64_t total = source.get_size();
+    const uint32_t head_length = header.get_length();
+    if (head_length > stream_chunk_size || head_length + total > 0xFFFFFFFFULL)
+    {
+        throw ERR_DATASOURCE_FAILED;
+    }
+
+    if (this->_tx_buffer.size() < stream_chunk_size)
+    {
+        this->_tx_buffer.resize(stream_chunk_size);
+    }
+    unsigned char * buffer = this->_tx_buffer.data();
+
+    // The header, with a length that covers the data we're about to stream,
+    //  and as much data as fits behind it
+    const uint32_t length = head_length + total;
+    header.pack_into(buffer);
+    std::memcpy(buffer, &length, 4);
+
+    uint32_t first = (total < stream_chunk_size - head_length) ? (uint32_t) total : stream_chunk_size - head_length;
+    if (first > 0 && !source.read(0, buffer + head_length, first))
+    {
+        throw ERR_DATASOURCE_FAILED;
+    }
+
+    PTPTrace::Span write_span("usb write (stream)");
+    if (!this->protocol->_bulk_write(buffer, head_length + first, deadline.remaining_ms()))
+    {
+        throw deadline.expired() ? ERR_TIMEOUT : ERR_USB_ERROR;
+    }
+
+    uint64_t done = first;
+    if (progress)
+    {
+        progress(done, total);
+    }
+
+    while (done < total)
+    {
+        if (deadline.expired())
+        {
+            throw ERR_TIMEOUT;
+        }
+
+        uint32_t want = (total - done < stream_chunk_size) ? (uint32_t) (total - done) : stream_chunk_size;
+
+        const unsigned char * chunk = source.direct_data(done, want);
+        if (chunk == NULL)
+        {
+            if (!source.read(done, buffer, want))
+            {
+                throw ERR_DATASOURCE_FAILED;
+            }
+            chunk = buffer;
+        }
+
+        if (!this->protocol->_bulk_write(chunk, want, deadline.remaining_ms()))
+        {
+            throw deadline.expired() ? ERR_TIMEOUT : ERR_USB_ERROR;
+        }
+
+        done += want;
+        if (progress)
+        {
+            progress(done, total);
+        }
+    }
+}
+
+/**
+ * @brief Perform a PTP transaction whose data phase is streamed from \a source
+ *
+ * Works like \c PTPBase::ptp_transaction with a data container, except that
+ * the data is sent from \a source as it is read (see
+ * \c PTPBase::send_ptp_data) instead of being packed up front, so memory use
+ * doesn't grow with the size of the data.  If the deadline passes or the
+ * source fails part way through, the transaction is cancelled so the session
+ * can be used again; cancelling can take up to \c PTPBase::cancel_timeout
+ * past the deadline.
+ *
+ * @param[in]  cmd      A \c PTPContainer containing the command to send to the camera.
+ * @param[in]  header   A data \c PTPContainer whose payload is sent before \a source.
+ * @param[in]  source   Where the rest of the data phase comes from.
+ * @param[out] out_resp A \c PTPContainer where the camera's response will be placed.
+ * @param[in]  deadline When the whole transaction has to be finished by.
+ * @param[in]  progress (optional) Called after each chunk with the bytes of \a source sent so far.
+ * @exception PTP::ERR_TIMEOUT if \a deadline passes.
+ * @exception PTP::ERR_DATASOURCE_FAILED if \a source can't provide its data.
+ * @see PTPBase::send_ptp_data
+ */
+void PTPBase::ptp_transaction(PTPContainer& cmd, PTPContainer& header, IPTPDataSource& source, PTPContainer& out_resp, const PTPDeadline& deadline, const PTPProgressCallback& progress)
+{
+    std::lock_guard<std::recursive_mutex> lock(this->_session_mutex);
+    PTPTrace::Span span("PTPBase::ptp_transaction (stream)");
+
+    cmd.transaction_id = this->get_and_increment_transaction_id();
+    header.transaction_id = cmd.transaction_id;
+    try
+    {
+        this->send_ptp_message(cmd, deadline);
+        this->send_ptp_data(header, source, deadline, progress);
+        this->recv_ptp_message(out_resp, deadline);
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+        if (e == ERR_TIMEOUT || e == ERR_DATASOURCE_FAILED || e == ERR_USB_ERROR)
+        {
+            this->abort_transaction(cmd.transaction_id);
+        }
+        throw;
+    }
+}
+
+/**
+ * @brief Cancel the transaction \a transaction_id and get the session back
+ *
+ * Asks the communication protocol to send the PTP Cancel request and to
+ * drain anything the camera still had queued, so the next transaction
+ * starts from a clean state.  Protocols which can't cancel do nothing.
+ *
+ * @param[in] transaction_id The transaction to cancel.
+ * @return True if the protocol cancelled the transaction.
+ * @see IPTPComm::_cancel
+ */
+bool PTPBase::abort_transaction(const uint32_t transaction_id)
+{
+    PTPTrace::Span span("PTPBase::abort_transaction");
+
+    if (this->protocol == NULL || this->protocol->is_open() == false)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(this->_session_mutex);
+    return this->protocol->_cancel(transaction_id, PTPBase::cancel_timeout);
 }
 
 /**
@@ -235,9 +758,23 @@ void PTPBase::ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool
  */
 int PTPBase::get_and_increment_transaction_id()
 {
-    uint32_t ret = this->_transaction_id;
-    this->_transaction_id = this->_transaction_id + 1;
-    return ret;
+    return this->_transaction_id.fetch_add(1);
+}
+
+/**
+ * @brief The lock which serializes access to the camera session
+ *
+ * \c PTPBase::ptp_transaction takes this lock for every transaction.
+ * Subclasses which need several transactions to happen back to back (for
+ * example, a TempData followed by a DownloadFile) should hold it for the
+ * whole sequence.  It is recursive, so \c ptp_transaction can still be
+ * called while it is held.
+ *
+ * @return The session lock for this camera
+ */
+std::recursive_mutex& PTPBase::session_mutex()
+{
+    return this->_session_mutex;
 }
 
 } /* namespace PTP */
@@ -28,6 +28,7 @@
  * functions for extacting this data in a few different ways.
  */
 
+#include <algorithm>
 #include <cstring>
 #include <stdint.h>
 
@@ -53,8 +54,8 @@ PTPContainer::PTPContainer() : PTPContainer(0, 0)
  * @param[in] op_code The operation for this \c PTPContainer
  */
 PTPContainer::PTPContainer(uint16_t type, uint16_t op_code) :
-length(default_length), payload(NULL), type(type), code(op_code),
-transaction_id(0)
+length(default_length), capacity(inline_capacity), has_payload(false),
+payload(inline_payload), type(type), code(op_code), transaction_id(0)
 {
     // No further initialization needed
 }
@@ -65,22 +66,145 @@ transaction_id(0)
  * @param[in] data A received PTP message
  * @see PTPContainer::unpack
  */
-PTPContainer::PTPContainer(const unsigned char * data)
+PTPContainer::PTPContainer(const unsigned char * data) : PTPContainer(0, 0)
 {
     // This is essentially lv_framebuffer_desc .unpack() function, in the form of a constructor
     this->unpack(data);
 }
 
+/**
+ * @brief Create a copy of \a other, including its payload
+ *
+ * @param[in] other The \c PTPContainer to copy
+ */
+PTPContainer::PTPContainer(const PTPContainer& other) : PTPContainer(0, 0)
+{
+    *this = other;
+}
+
 /**
  * @brief Frees up memory malloc()ed by \c PTPContainer
  */
 PTPContainer::~PTPContainer()
 {
-    if (this->payload != NULL)
+    if (this->payload != this->inline_payload)
     {
         delete[] this->payload; // Be sure to free up this memory
-        this->payload = NULL;
     }
+    this->payload = NULL;
+}
+
+/**
+ * @brief Replace the contents of this \c PTPContainer with a copy of \a other
+ *
+ * The payload storage of this container is reused if it is big enough.
+ *
+ * @param[in] other The \c PTPContainer to copy
+ * @return This \c PTPContainer
+ */
+PTPContainer& PTPContainer::operator=(const PTPContainer& other)
+{
+    if (this == &other)
+    {
+        return *this;
+    }
+
+    uint32_t payload_length = other.length - default_length;
+    this->reserve(payload_length, false);
+    if (payload_length > 0)
+    {
+        std::memcpy(this->payload, other.payload, payload_length);
+    }
+
+    this->length = other.length;
+    this->has_payload = other.has_payload;
+    this->type = other.type;
+    this->code = other.code;
+    this->transaction_id = other.transaction_id;
+
+    return *this;
+}
+
+/**
+ * @brief Make sure the payload storage can hold \a size bytes
+ *
+ * Storage only ever grows, so a container which is reused for messages of
+ * a similar size stops allocating after the first one.
+ *
+ * @param[in] size The number of payload bytes needed
+ * @param[in] preserve Whether the current payload must be kept
+ */
+void PTPContainer::reserve(const uint32_t size, const bool preserve)
+{
+    if (size <= this->capacity)
+    {
+        return;
+    }
+
+    uint32_t new_capacity = 2 * this->capacity;
+    if (new_capacity < size)
+    {
+        new_capacity = size;
+    }
+
+    unsigned char * new_payload = new unsigned char[new_capacity];
+    if (preserve)
+    {
+        std::memcpy(new_payload, this->payload, this->length - default_length);
+    }
+    if (this->payload != this->inline_payload)
+    {
+        delete[] this->payload;
+    }
+
+    this->payload = new_payload;
+    this->capacity = new_capacity;
+}
+
+/**
+ * @brief Empty this \c PTPContainer so it can be used for a new message
+ *
+ * Unlike assigning a fresh \c PTPContainer, this keeps the payload storage,
+ * so no memory is allocated when the container is filled again.
+ *
+ * @param[in] type A \c PTP_CONTAINER_TYPE for this \c PTPContainer
+ * @param[in] op_code The operation for this \c PTPContainer
+ */
+void PTPContainer::reset(const uint16_t type, const uint16_t op_code)
+{
+    this->length = default_length;
+    this->has_payload = false;
+    this->type = type;
+    this->code = op_code;
+    this->transaction_id = 0;
+}
+
+/**
+ * @brief Exchange the contents (and storage) of two containers
+ *
+ * @param[in,out] other The \c PTPContainer to swap with
+ */
+void PTPContainer::swap(PTPContainer& other)
+{
+    bool this_inline = (this->payload == this->inline_payload);
+    bool other_inline = (other.payload == other.inline_payload);
+    unsigned char * this_heap = this->payload;
+    unsigned char * other_heap = other.payload;
+
+    unsigned char tmp[inline_capacity];
+    std::memcpy(tmp, this->inline_payload, inline_capacity);
+    std::memcpy(this->inline_payload, other.inline_payload, inline_capacity);
+    std::memcpy(other.inline_payload, tmp, inline_capacity);
+
+    this->payload = other_inline ? this->inline_payload : other_heap;
+    other.payload = this_inline ? other.inline_payload : this_heap;
+
+    std::swap(this->length, other.length);
+    std::swap(this->capacity, other.capacity);
+    std::swap(this->has_payload, other.has_payload);
+    std::swap(this->type, other.type);
+    std::swap(this->code, other.code);
+    std::swap(this->transaction_id, other.transaction_id);
 }
 
 /**
@@ -95,21 +219,15 @@ PTPContainer::~PTPContainer()
  */
 void PTPContainer::add_param(const uint32_t param)
 {
-    // Allocate new memory for the payload
     uint32_t old_length = (this->length)-(this->default_length);
-    uint32_t new_length = this->length + sizeof (uint32_t);
-    unsigned char * new_payload = new unsigned char[new_length];
-
-    // Copy old payload into new payload
-    std::memcpy(new_payload, this->payload, old_length);
-    // Copy new data into new payload
-    std::memcpy(new_payload + old_length, &param, sizeof (uint32_t));
-    // Free up old payload memory
-    delete[] this->payload;
-    // Change payload pointer to new payload
-    this->payload = new_payload;
+
+    // Make room for the new parameter, keeping the old ones
+    this->reserve(old_length + sizeof (uint32_t), true);
+    // Copy new data into payload
+    std::memcpy(this->payload + old_length, &param, sizeof (uint32_t));
     // Update length
-    this->length = new_length;
+    this->length = this->length + sizeof (uint32_t);
+    this->has_payload = true;
 }
 
 /**
@@ -125,19 +243,32 @@ void PTPContainer::add_param(const uint32_t param)
  */
 void PTPContainer::set_payload(const void * payload, int payload_length)
 {
-    // Allocate new memory to copy the payload into
-    // This way, we can ensure that we always want to free() the memory
-    uint32_t new_length = this->default_length + payload_length;
-    unsigned char * new_payload = new unsigned char[payload_length];
+    unsigned char * dest = this->resize_payload(payload_length);
 
     // Copy the payload over
-    std::memcpy(new_payload, payload, payload_length);
-    // Free up the old payload
-    delete[] this->payload;
-    // Change payload pointer to new payload
-    this->payload = new_payload;
-    // Update length
-    this->length = new_length;
+    if (payload_length > 0)
+    {
+        std::memcpy(dest, payload, payload_length);
+    }
+}
+
+/**
+ * @brief Set the payload size and return the payload for the caller to fill
+ *
+ * This lets data be read straight into a \c PTPContainer, instead of into a
+ * temporary buffer which is then copied with \c PTPContainer::set_payload.
+ * The contents of the returned payload are undefined until written.
+ *
+ * @param[in] payload_length The new size of the payload
+ * @return The address of the first byte of the payload
+ */
+unsigned char * PTPContainer::resize_payload(const uint32_t payload_length)
+{
+    this->reserve(payload_length, false);
+    this->length = this->default_length + payload_length;
+    this->has_payload = true;
+
+    return this->payload;
 }
 
 /**
@@ -151,23 +282,38 @@ void PTPContainer::set_payload(const void * payload, int payload_length)
  *          must make sure to avoid memory leaks by free()ing this data.
  * @return A pointer to the first unsigned character which makes up the data
  *         in the container.
- * @see PTPContainer::get_length
+ * @see PTPContainer::get_length, PTPContainer::pack_into
  */
 unsigned char * PTPContainer::pack() const
 {
     unsigned char * packed = new unsigned char[this->length];
 
-    uint32_t header_size = (sizeof this->length)+(sizeof this->type)+(sizeof this->code)+(sizeof this->transaction_id);
-
-    std::memcpy(packed, &(this->length), sizeof this->length); // Copy length
-    std::memcpy(packed + 4, &(this->type), sizeof this->type); // Type
-    std::memcpy(packed + 6, &(this->code), sizeof this->code); // Two bytes of code
-    std::memcpy(packed + 8, &(this->transaction_id), sizeof this->transaction_id); // Four bytes of transaction ID
-    std::memcpy(packed + 12, this->payload, this->length - header_size); // The rest of payload
+    this->pack_into(packed);
 
     return packed;
 }
 
+/**
+ * @brief Pack \c PTPContainer data into a caller-supplied buffer
+ *
+ * @param[out] out Where to place the packed container. Must be at least
+ *                 \c PTPContainer::get_length bytes long.
+ * @see PTPContainer::pack
+ */
+void PTPContainer::pack_into(unsigned char * out) const
+{
+    uint32_t header_size = (sizeof this->length)+(sizeof this->type)+(sizeof this->code)+(sizeof this->transaction_id);
+
+    std::memcpy(out, &(this->length), sizeof this->length); // Copy length
+    std::memcpy(out + 4, &(this->type), sizeof this->type); // Type
+    std::memcpy(out + 6, &(this->code), sizeof this->code); // Two bytes of code
+    std::memcpy(out + 8, &(this->transaction_id), sizeof this->transaction_id); // Four bytes of transaction ID
+    if (this->length > header_size)
+    {
+        std::memcpy(out + 12, this->payload, this->length - header_size); // The rest of payload
+    }
+}
+
 /**
  * @brief Retrieve the payload stored in this \c PTPContainer
  *
@@ -181,11 +327,28 @@ unsigned char * PTPContainer::get_payload(int * size_out) const
     *size_out = this->length - this->default_length;
 
     out = new unsigned char[*size_out];
-    std::memcpy(out, this->payload, *size_out);
+    if (*size_out > 0)
+    {
+        std::memcpy(out, this->payload, *size_out);
+    }
 
     return out;
 }
 
+/**
+ * @brief Look at the payload stored in this \c PTPContainer without copying it
+ *
+ * @param[out] size_out The size of the payload
+ * @return The payload, which stays valid until this \c PTPContainer is next
+ *         modified, or NULL if there is no payload.
+ */
+const unsigned char * PTPContainer::get_payload_ptr(int * size_out) const
+{
+    *size_out = this->length - this->default_length;
+
+    return this->has_payload ? this->payload : NULL;
+}
+
 /**
  * @brief Retrieve the size of all data stored in the payload
  *
@@ -210,15 +373,19 @@ uint32_t PTPContainer::get_length() const
  * @param[in] data The address of the first unsigned character of
  *                 the new container data.  Must be at least 12 bytes
  *                 in length.
+ * @exception PTP::ERR_INVALID_RESPONSE If the length in \a data is too short
+ *            to be a PTP message.
  */
 void PTPContainer::unpack(const unsigned char * data)
 {
-    // Free up our current payload
-    delete[] this->payload;
-    this->payload = NULL;
+    uint32_t new_length;
 
     // First four bytes are the length
-    std::memcpy(&this->length, data, 4);
+    std::memcpy(&new_length, data, 4);
+    if (new_length < default_length)
+    {
+        throw ERR_INVALID_RESPONSE;
+    }
     // Next, container type
     std::memcpy(&this->type, data + 4, 2);
     // Copy over code
@@ -227,8 +394,7 @@ void PTPContainer::unpack(const unsigned char * data)
     std::memcpy(&this->transaction_id, data + 8, 4);
 
     // Finally, copy over the payload
-    this->payload = new unsigned char[this->length - 12];
-    std::memcpy(this->payload, data + 12, this->length - 12);
+    this->set_payload(data + 12, new_length - 12);
 
     // Since we copied all of this data, the data passed in can be free()d
 }
@@ -246,7 +412,7 @@ uint32_t PTPContainer::get_param_n(const uint32_t n) const
     uint32_t out;
     uint32_t first_byte;
 
-    if (this->payload == NULL)
+    if (!this->has_payload)
     {
         throw ERR_PTPCONTAINER_NO_PAYLOAD;
         return 0;
@@ -271,11 +437,11 @@ uint32_t PTPContainer::get_param_n(const uint32_t n) const
 /**
  * @brief Determines if this PTPContainer contains data
  * 
- * @return True if payload is a null pointer
+ * @return True if no payload has been set
  */
 bool PTPContainer::is_empty() const
 {
-    return (this->payload == NULL);
+    return !this->has_payload;
 }
 
 } /* namespace PTP */
@@ -0,0 +1,467 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ *
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file PTPDataSink.cpp
+ *
+ * @brief Destinations for streamed data phases
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libeasyptp/PTPDataSink.hpp"
+#include "libeasyptp/PTPUring.hpp"
+#include "PTPFileIO.hpp"
+
+namespace EasyPTP
+{
+
+/**
+ * @brief Create a sink which will write to \a filename
+ *
+ * Nothing is opened until the transfer begins.
+ *
+ * @param[in] filename The path of the local file to create (or replace).
+ */
+PTPFileSink::PTPFileSink(const std::string filename) :
+filename(filename), fd(-1), map(NULL), size(0)
+{
+}
+
+/**
+ * @brief Unmaps and closes the file, if a transfer was left unfinished
+ */
+PTPFileSink::~PTPFileSink()
+{
+    this->end(false);
+}
+
+/**
+ * @brief Create the file at \a total_size bytes and map it
+ *
+ * The blocks are allocated before the file is mapped: writing to a hole in
+ * a mapping when the disk (or quota) is full raises \c SIGBUS, where a
+ * failed allocation here is just a failed transfer.
+ *
+ * @param[in] total_size The size of the data phase.
+ * @return false if the file could not be created, allocated or mapped.
+ */
+bool PTPFileSink::begin(const uint64_t total_size)
+{
+    this->end(false);
+
+    this->fd = ::open(this->filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (this->fd < 0)
+    {
+        return false;
+    }
+
+    this->size = total_size;
+    if (total_size == 0)
+    {
+        return true; // Nothing to map
+    }
+
+    int error = posix_fallocate(this->fd, 0, total_size);
+    if (error == EOPNOTSUPP || error == EINVAL)
+    {
+        // The filesystem can't reserve blocks; a sparse file is all there is
+        error = (ftruncate(this->fd, total_size) == 0) ? 0 : errno;
+    }
+    if (error != 0)
+    {
+        return false;
+    }
+
+    void * map = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return false;
+    }
+    this->map = (unsigned char *) map;
+
+    // We'll be writing front to back, exactly once
+    madvise(this->map, total_size, MADV_SEQUENTIAL);
+
+    return true;
+}
+
+/**
+ * @brief Hand out the mapped file itself
+ */
+unsigned char * PTPFileSink::direct_buffer(const uint64_t offset, const uint32_t length)
+{
+    if (this->map == NULL || offset + length > this->size)
+    {
+        return NULL;
+    }
+
+    return this->map + offset;
+}
+
+/**
+ * @brief Copy a chunk into the mapped file
+ */
+bool PTPFileSink::write(const uint64_t offset, const unsigned char * data, const uint32_t length)
+{
+    if (this->map == NULL || offset + length > this->size)
+    {
+        return false;
+    }
+
+    std::memcpy(this->map + offset, data, length);
+    return true;
+}
+
+/**
+ * @brief Unmap and close the file
+ *
+ * @param[in] success Whether the whole data phase arrived.  The file is kept
+ *                    either way.
+ * @return true if the file was written and closed cleanly.
+ */
+bool PTPFileSink::end(const bool success)
+{
+    bool ok = success;
+
+    if (this->map != NULL)
+    {
+        ok = (munmap(this->map, this->size) == 0) && ok;
+        this->map = NULL;
+    }
+
+    if (this->fd >= 0)
+    {
+        ok = (::close(this->fd) == 0) && ok;
+        this->fd = -1;
+    }
+
+    return ok;
+}
+
+/**
+ * @brief Create a sink which will write to \a filename
+ *
+ * The staging buffers and the ring are set up here, once; nothing is opened
+ * until a transfer begins.
+ *
+ * @param[in] filename    The path of the local file to create (or replace).
+ * @param[in] direct_io   (optional) Open the file with \c O_DIRECT, bypassing the page cache.
+ *                        Filesystems which don't support it are written normally.
+ * @param[in] preallocate (optional) Reserve the file's full size on disk before writing.
+ */
+PTPUringFileSink::PTPUringFileSink(const std::string filename, const bool direct_io, const bool preallocate) :
+filename(filename), direct_io(direct_io), preallocate(preallocate), ring(NULL),
+fd(-1), opened_direct(false), failed(false), size(0), base(0), fill(0), current(0)
+{
+    this->ring = new PTPUring(buffer_count);
+
+    for (int i = 0; i < buffer_count; i++)
+    {
+        void * data = NULL;
+        if (posix_memalign(&data, alignment, buffer_size + overflow_size) != 0)
+        {
+            data = NULL;
+        }
+        this->buffers[i].data = (unsigned char *) data;
+        this->buffers[i].busy = false;
+        this->buffers[i].offset = 0;
+        this->buffers[i].length = 0;
+    }
+}
+
+/**
+ * @brief Finishes any writes in flight, then frees the buffers
+ */
+PTPUringFileSink::~PTPUringFileSink()
+{
+    this->end(false);
+
+    for (int i = 0; i < buffer_count; i++)
+    {
+        free(this->buffers[i].data);
+    }
+    delete this->ring;
+}
+
+/**
+ * @brief Write the next transfer to \a filename instead
+ *
+ * @param[in] filename The path of the local file to create (or replace).
+ */
+void PTPUringFileSink::set_filename(const std::string filename)
+{
+    this->end(false);
+    this->filename = filename;
+}
+
+/**
+ * @brief Whether writes are going through io_uring, rather than \c pwrite
+ */
+bool PTPUringFileSink::is_uring() const
+{
+    return this->ring->is_open();
+}
+
+/**
+ * @brief Create the file, and reserve \a total_size bytes for it if asked to
+ *
+ * @param[in] total_size The size of the data phase.
+ * @return false if the file could not be created.
+ */
+bool PTPUringFileSink::begin(const uint64_t total_size)
+{
+    this->end(false);
+
+    for (int i = 0; i < buffer_count; i++)
+    {
+        if (this->buffers[i].data == NULL)
+        {
+            return false; // Couldn't allocate buffers
+        }
+    }
+
+    this->opened_direct = false;
+    if (this->direct_io)
+    {
+        this->fd = ::open(this->filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        this->opened_direct = (this->fd >= 0);
+    }
+    if (this->fd < 0)
+    {
+        this->fd = ::open(this->filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (this->fd < 0)
+    {
+        return false;
+    }
+
+    if (this->preallocate && total_size > 0)
+    {
+        // Only a hint; filesystems without it are just written normally
+        fallocate(this->fd, 0, 0, total_size);
+    }
+
+    this->failed = false;
+    this->size = total_size;
+    this->base = 0;
+    this->fill = 0;
+    this->current = 0;
+
+    return true;
+}
+
+/**
+ * @brief Hand out the rest of the current staging buffer
+ *
+ * Every buffer has \c PTPUringFileSink::overflow_size bytes of room past its
+ * nominal size, so a chunk which runs over the end still lands in one piece;
+ * the overflow is moved to the next buffer when this one is queued.
+ */
+unsigned char * PTPUringFileSink::direct_buffer(const uint64_t offset, const uint32_t length)
+{
+    if (this->fd < 0 || this->failed || offset != this->base + this->fill || this->fill + length > buffer_size + overflow_size)
+    {
+        return NULL;
+    }
+
+    return this->buffers[this->current].data + this->fill;
+}
+
+/**
+ * @brief A chunk has been read into the current buffer; queue it if it's full
+ */
+void PTPUringFileSink::commit(const uint64_t offset, const uint32_t length)
+{
+    this->fill += length;
+    if (this->fill >= buffer_size)
+    {
+        this->flush_full();
+    }
+}
+
+/**
+ * @brief Copy a chunk into the staging buffers, queueing any that fill up
+ */
+bool PTPUringFileSink::write(const uint64_t offset, const unsigned char * data, const uint32_t length)
+{
+    if (this->fd < 0 || this->failed || offset != this->base + this->fill)
+    {
+        return false;
+    }
+
+    uint32_t done = 0;
+    while (done < length && !this->failed)
+    {
+        uint32_t room = buffer_size - this->fill;
+        uint32_t count = (length - done < room) ? length - done : room;
+        std::memcpy(this->buffers[this->current].data + this->fill, data + done, count);
+        this->fill += count;
+        done += count;
+
+        if (this->fill >= buffer_size)
+        {
+            this->flush_full();
+        }
+    }
+
+    return !this->failed;
+}
+
+/**
+ * @brief Queue the rest of the file, wait for every write, and close it
+ *
+ * With \c O_DIRECT, the last write is padded out to the alignment and the
+ * file is then truncated back to its real size.
+ *
+ * @param[in] success Whether the whole data phase arrived.  Data that did
+ *                    arrive is kept either way.
+ * @return true if the file was written and closed cleanly.
+ */
+bool PTPUringFileSink::end(const bool success)
+{
+    if (this->fd < 0)
+    {
+        return success;
+    }
+
+    if (this->fill > 0 && !this->failed)
+    {
+        uint32_t length = this->fill;
+        if (this->opened_direct)
+        {
+            length = (length + alignment - 1) & ~(alignment - 1);
+            std::memset(this->buffers[this->current].data + this->fill, 0, length - this->fill);
+        }
+        if (!this->submit(this->current, length))
+        {
+            this->failed = true;
+        }
+        this->fill = 0;
+    }
+
+    // The kernel may still be reading from our buffers
+    while (this->ring->get_pending() > 0)
+    {
+        if (!this->reap())
+        {
+            this->failed = true;
+            break;
+        }
+    }
+    for (int i = 0; i < buffer_count; i++)
+    {
+        this->buffers[i].busy = false;
+    }
+
+    bool ok = success && !this->failed;
+    if (ok && ftruncate(this->fd, this->size) != 0)
+    {
+        ok = false; // Drops any O_DIRECT padding, and any preallocation past the end
+    }
+
+    ok = (::close(this->fd) == 0) && ok;
+    this->fd = -1;
+
+    return ok;
+}
+
+/**
+ * Queue the first \a length bytes of buffer \a index for writing at the
+ * file offset it was filled from.
+ */
+bool PTPUringFileSink::submit(const int index, const uint32_t length)
+{
+    Buffer& buffer = this->buffers[index];
+    buffer.offset = this->base;
+    buffer.length = length;
+
+    if (this->ring->write(this->fd, buffer.data, length, buffer.offset, index))
+    {
+        buffer.busy = true;
+        return true;
+    }
+
+    return pwrite_all(this->fd, buffer.data, length, buffer.offset);
+}
+
+/**
+ * Wait for one queued write, and finish it with \c pwrite if it came up short.
+ */
+bool PTPUringFileSink::reap()
+{
+    uint64_t index = 0;
+    int32_t result = 0;
+    if (!this->ring->wait(&index, &result) || index >= (uint64_t) buffer_count)
+    {
+        return false;
+    }
+
+    Buffer& buffer = this->buffers[index];
+    buffer.busy = false;
+    if (result < 0)
+    {
+        return false;
+    }
+    if ((uint32_t) result < buffer.length)
+    {
+        return pwrite_all(this->fd, buffer.data + result, buffer.length - result, buffer.offset + result);
+    }
+
+    return true;
+}
+
+/**
+ * Queue the current buffer, then move to the next one, carrying over
+ * anything that ran past the end.
+ */
+void PTPUringFileSink::flush_full()
+{
+    Buffer& full = this->buffers[this->current];
+    int next = (this->current + 1) % buffer_count;
+
+    while (this->buffers[next].busy)
+    {
+        if (!this->reap())
+        {
+            this->failed = true;
+            return;
+        }
+    }
+
+    if (!this->submit(this->current, buffer_size))
+    {
+        this->failed = true;
+        return;
+    }
+
+    // The kernel only reads the first buffer_size bytes, so the overflow can be moved now
+    std::memcpy(this->buffers[next].data, full.data + buffer_size, this->fill - buffer_size);
+    this->fill -= buffer_size;
+    this->base += buffer_size;
+    this->current = next;
+}
+
+} /* namespace PTP */
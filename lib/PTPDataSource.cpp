@@ -0,0 +1,191 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ *
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file PTPDataSource.cpp
+ *
+ * @brief Origins for streamed data phases
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libeasyptp/PTPDataSource.hpp"
+
+namespace EasyPTP
+{
+
+/**
+ * @brief Open \a filename and map it, if possible
+ *
+ * Check \c PTPFileSource::is_open to see whether the file could be opened.
+ *
+ * @param[in] filename The path of the local file to read.
+ */
+PTPFileSource::PTPFileSource(const std::string filename) :
+fd(-1), map(NULL), size(0)
+{
+    this->fd = ::open(filename.c_str(), O_RDONLY);
+    if (this->fd < 0)
+    {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(this->fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        ::close(this->fd);
+        this->fd = -1;
+        return;
+    }
+    this->size = st.st_size;
+
+    if (this->size > 0)
+    {
+        void * map = mmap(NULL, this->size, PROT_READ, MAP_PRIVATE, this->fd, 0);
+        if (map != MAP_FAILED)
+        {
+            this->map = (const unsigned char *) map;
+            madvise(map, this->size, MADV_SEQUENTIAL);
+        }
+        // Otherwise fall back to pread()
+    }
+}
+
+/**
+ * @brief Unmaps and closes the file
+ */
+PTPFileSource::~PTPFileSource()
+{
+    if (this->map != NULL)
+    {
+        munmap((void *) this->map, this->size);
+    }
+    if (this->fd >= 0)
+    {
+        ::close(this->fd);
+    }
+}
+
+/**
+ * @brief Whether the file was opened
+ */
+bool PTPFileSource::is_open() const
+{
+    return this->fd >= 0;
+}
+
+/**
+ * @brief The size of the file when it was opened
+ */
+uint64_t PTPFileSource::get_size()
+{
+    return this->size;
+}
+
+/**
+ * @brief Hand out the mapped file itself
+ */
+const unsigned char * PTPFileSource::direct_data(const uint64_t offset, const uint32_t length)
+{
+    if (this->map == NULL || offset + length > this->size)
+    {
+        return NULL;
+    }
+
+    return this->map + offset;
+}
+
+/**
+ * @brief Copy part of the file into \a out
+ */
+bool PTPFileSource::read(const uint64_t offset, unsigned char * out, const uint32_t length)
+{
+    if (this->fd < 0 || offset + length > this->size)
+    {
+        return false;
+    }
+
+    uint32_t done = 0;
+    while (done < length)
+    {
+        ssize_t got = pread(this->fd, out + done, length - done, offset + done);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            return false; // Includes the file having shrunk under us
+        }
+        done += got;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Provide the \a size bytes at \a data
+ *
+ * @param[in] data Where the bytes are.  Not copied.
+ * @param[in] size How many bytes there are.
+ */
+PTPMemorySource::PTPMemorySource(const void * data, const uint64_t size) :
+data((const unsigned char *) data), size(size)
+{
+}
+
+uint64_t PTPMemorySource::get_size()
+{
+    return this->size;
+}
+
+/**
+ * @brief Hand out the memory itself
+ */
+const unsigned char * PTPMemorySource::direct_data(const uint64_t offset, const uint32_t length)
+{
+    if (offset + length > this->size)
+    {
+        return NULL;
+    }
+
+    return this->data + offset;
+}
+
+/**
+ * @brief Copy part of the memory into \a out
+ */
+bool PTPMemorySource::read(const uint64_t offset, unsigned char * out, const uint32_t length)
+{
+    if (offset + length > this->size)
+    {
+        return false;
+    }
+
+    std::memcpy(out, this->data + offset, length);
+    return true;
+}
+
+} /* namespace PTP */
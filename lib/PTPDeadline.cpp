@@ -0,0 +1,105 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ *
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file PTPDeadline.cpp
+ *
+ * @brief Absolute deadlines for transactions
+ *
+ * Timeouts throughout the library are in milliseconds, with 0 meaning "wait
+ * forever", to match libusb.
+ */
+
+#include "libeasyptp/PTPDeadline.hpp"
+
+namespace EasyPTP
+{
+
+/**
+ * @brief A deadline which never expires
+ */
+PTPDeadline::PTPDeadline() :
+when(std::chrono::steady_clock::time_point::max()), infinite(true)
+{
+}
+
+/**
+ * @brief A deadline at \a when
+ *
+ * @param[in] when The time at which the deadline expires.
+ */
+PTPDeadline::PTPDeadline(const std::chrono::steady_clock::time_point when) :
+when(when), infinite(false)
+{
+}
+
+/**
+ * @brief A deadline \a timeout milliseconds from now
+ *
+ * @param[in] timeout Milliseconds from now, or 0 for no deadline.
+ * @return The new deadline.
+ */
+PTPDeadline PTPDeadline::from_timeout(const int timeout)
+{
+    if (timeout <= 0)
+    {
+        return PTPDeadline();
+    }
+
+    return PTPDeadline(std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout));
+}
+
+/**
+ * @brief Whether this deadline never expires
+ */
+bool PTPDeadline::is_infinite() const
+{
+    return this->infinite;
+}
+
+/**
+ * @brief Whether this deadline has passed
+ */
+bool PTPDeadline::expired() const
+{
+    return !this->infinite && std::chrono::steady_clock::now() >= this->when;
+}
+
+/**
+ * @brief The time left, as a timeout for a single transfer
+ *
+ * @return 0 if the deadline is infinite (0 means "no timeout" to libusb),
+ *         otherwise the milliseconds left, rounded up and never less than 1.
+ *         Check \c PTPDeadline::expired before starting a transfer.
+ */
+int PTPDeadline::remaining_ms() const
+{
+    if (this->infinite)
+    {
+        return 0;
+    }
+
+    std::chrono::steady_clock::duration left = this->when - std::chrono::steady_clock::now();
+    long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(left + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1)).count();
+
+    return (ms < 1) ? 1 : (int) ms;
+}
+
+} /* namespace PTP */
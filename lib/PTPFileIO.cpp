@@ -0,0 +1,72 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file PTPFileIO.cpp
+ *
+ * @brief Helpers for the library's own file writing
+ */
+
+#include <cerrno>
+#include <unistd.h>
+
+#include "PTPFileIO.hpp"
+
+namespace EasyPTP
+{
+
+/**
+ * @brief Write all of \a data at \a offset in \a fd
+ *
+ * Carries on after short writes and \c EINTR.  Very large writes are split,
+ * so that no single \c pwrite is asked for more than \c ssize_t can report.
+ *
+ * @param[in] fd     The file to write to.
+ * @param[in] data   What to write.
+ * @param[in] length How many bytes to write.
+ * @param[in] offset Where in the file to write them.
+ * @return false if a write failed; \c errno says why.
+ */
+bool pwrite_all(const int fd, const void * data, uint64_t length, uint64_t offset)
+{
+    const uint64_t max_write = 1 << 30;
+    const unsigned char * p = (const unsigned char *) data;
+
+    while (length > 0)
+    {
+        ssize_t done = pwrite(fd, p, (size_t) (length < max_write ? length : max_write), (off_t) offset);
+        if (done < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (done <= 0)
+        {
+            return false;
+        }
+        p += done;
+        length -= done;
+        offset += done;
+    }
+
+    return true;
+}
+
+} /* namespace PTP */
@@ -0,0 +1,38 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBEASYPTP_PTPFILEIO_H_
+#define LIBEASYPTP_PTPFILEIO_H_
+
+#include <stdint.h>
+
+/*
+ * Helpers for the library's own file writing.  Not installed; include it
+ * from lib/ only.
+ */
+
+namespace EasyPTP
+{
+
+bool pwrite_all(const int fd, const void * data, uint64_t length, uint64_t offset);
+
+}
+
+#endif /* LIBEASYPTP_PTPFILEIO_H_ */
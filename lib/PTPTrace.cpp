@@ -0,0 +1,266 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ *
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file PTPTrace.cpp
+ *
+ * @brief Per-thread span recording and Chrome trace-event export
+ *
+ * Each thread that records a span gets its own ring buffer the first time it
+ * does so.  Buffers are registered in a global list (the only place a lock
+ * is taken).  When a thread exits its buffer stays registered, so its spans
+ * can still be exported, and once they have been exported or cleared the
+ * buffer goes on a free list for the next new thread.  At most
+ * \c max_retired exited threads' buffers are kept waiting; past that, the
+ * oldest one's spans are dropped and it is reused.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+#include "libeasyptp/PTPTrace.hpp"
+
+namespace EasyPTP
+{
+
+namespace
+{
+
+struct TraceEvent
+{
+    const char * name;
+    uint64_t start_ns;
+    uint64_t end_ns;
+};
+
+struct ThreadBuffer
+{
+    uint32_t tid;
+    std::atomic<uint64_t> count; // Total spans ever recorded; the ring holds the newest
+    TraceEvent events[PTPTrace::buffer_size];
+};
+
+const size_t max_retired = 64; // Exited threads' buffers kept for export
+
+std::mutex registry_mutex;
+std::vector<ThreadBuffer *> registry;
+std::deque<ThreadBuffer *> retired; // Registered, but their threads have exited; oldest first
+std::vector<ThreadBuffer *> free_buffers;
+std::atomic<uint32_t> next_tid(1);
+
+/**
+ * Take the buffers of exited threads out of the registry, for reuse.  Call
+ * with \c registry_mutex held.
+ */
+void release_retired()
+{
+    for (size_t i = 0; i < retired.size(); i++)
+    {
+        registry.erase(std::find(registry.begin(), registry.end(), retired[i]));
+        free_buffers.push_back(retired[i]);
+    }
+    retired.clear();
+}
+
+/**
+ * Hands the thread's buffer back when the thread exits.
+ */
+struct LocalBuffer
+{
+    ThreadBuffer * buffer;
+
+    ~LocalBuffer()
+    {
+        if (this->buffer != NULL)
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            if (this->buffer->count.load() == 0)
+            {
+                // Nothing to export
+                registry.erase(std::find(registry.begin(), registry.end(), this->buffer));
+                free_buffers.push_back(this->buffer);
+            }
+            else
+            {
+                retired.push_back(this->buffer);
+            }
+        }
+    }
+};
+
+thread_local LocalBuffer local_buffer = { NULL };
+
+ThreadBuffer * get_local_buffer()
+{
+    if (local_buffer.buffer == NULL)
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+
+        ThreadBuffer * buffer;
+        if (free_buffers.empty() && retired.size() >= max_retired)
+        {
+            // Too many waiting to be exported; drop the oldest
+            buffer = retired.front();
+            retired.pop_front();
+        }
+        else
+        {
+            if (free_buffers.empty())
+            {
+                free_buffers.push_back(new ThreadBuffer);
+            }
+            buffer = free_buffers.back();
+            free_buffers.pop_back();
+            registry.push_back(buffer);
+        }
+        buffer->tid = next_tid.fetch_add(1);
+        buffer->count.store(0);
+        local_buffer.buffer = buffer;
+    }
+
+    return local_buffer.buffer;
+}
+
+/**
+ * Write \a str as a JSON string.  Span names are our own literals, so only
+ * the characters JSON insists on are escaped.
+ */
+void write_json_string(std::ostream& out, const char * str)
+{
+    out << '"';
+    for (; *str != '\0'; str++)
+    {
+        if (*str == '"' || *str == '\\')
+        {
+            out << '\\';
+        }
+        out << *str;
+    }
+    out << '"';
+}
+
+}
+
+std::atomic<bool> PTPTrace::enabled(false);
+
+/**
+ * @brief Turn span recording on or off
+ *
+ * @param[in] on True to start recording, false to stop.
+ */
+void PTPTrace::enable(const bool on)
+{
+    PTPTrace::enabled.store(on);
+}
+
+/**
+ * @brief Whether spans are currently being recorded
+ */
+bool PTPTrace::is_enabled()
+{
+    return PTPTrace::enabled.load();
+}
+
+/**
+ * @brief Forget every recorded span
+ *
+ * The buffers of threads which have exited are kept for new threads.
+ *
+ * @warning Only call this while no spans are being recorded.
+ */
+void PTPTrace::clear()
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (size_t i = 0; i < registry.size(); i++)
+    {
+        registry[i]->count.store(0);
+    }
+    release_retired();
+}
+
+/**
+ * @brief Write all recorded spans as a Chrome trace-event JSON document
+ *
+ * Each span becomes a complete ("X") event, with timestamps in microseconds
+ * from the steady clock.  Each thread keeps its newest
+ * \c PTPTrace::buffer_size spans.  The spans of threads which have exited
+ * are only exported once.
+ *
+ * @warning Spans recorded while this runs may come out garbled; stop tracing
+ *          (or let the camera go quiet) before exporting.
+ *
+ * @param[out] out The stream to write the document to.
+ */
+void PTPTrace::export_chrome_json(std::ostream& out)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (size_t i = 0; i < registry.size(); i++)
+    {
+        ThreadBuffer * buffer = registry[i];
+        uint64_t count = buffer->count.load(std::memory_order_acquire);
+        uint64_t begin = (count > (uint64_t) buffer_size) ? count - buffer_size : 0;
+
+        for (uint64_t n = begin; n < count; n++)
+        {
+            const TraceEvent& event = buffer->events[n % buffer_size];
+
+            if (!first) out << ",";
+            first = false;
+
+            out << "\n{\"name\":";
+            write_json_string(out, event.name);
+            out << ",\"cat\":\"libeasyptp\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+                << ",\"ts\":" << (event.start_ns / 1000) << "." << ((event.start_ns / 100) % 10)
+                << ",\"dur\":" << ((event.end_ns - event.start_ns) / 1000) << "." << (((event.end_ns - event.start_ns) / 100) % 10)
+                << "}";
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    // Exited threads' spans have been written; their buffers can be reused
+    release_retired();
+}
+
+uint64_t PTPTrace::now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void PTPTrace::record(const char * name, const uint64_t start_ns, const uint64_t end_ns)
+{
+    ThreadBuffer * buffer = get_local_buffer();
+    uint64_t n = buffer->count.load(std::memory_order_relaxed);
+
+    TraceEvent& event = buffer->events[n % buffer_size];
+    event.name = name;
+    event.start_ns = start_ns;
+    event.end_ns = end_ns;
+
+    buffer->count.store(n + 1, std::memory_order_release);
+}
+
+} /* namespace PTP */
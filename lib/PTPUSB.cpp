@@ -18,7 +18,10 @@
  *  <http://www.gnu.org/licenses/>.
  */
 
+#include <chrono>
+#include <cstring>
 #include <string>
+#include <thread>
 #include <vector>
 #ifdef __FreeBSD__
 #include <libusb.h>
@@ -224,7 +227,7 @@ void PTPUSB::getPTPInterface(libusb_device *dev, struct libusb_interface_descrip
  * @warning Make sure \a bytestr is at least \a length bytes in length.
  * @param[in] bytestr Bytes to write through USB.
  * @param[in] length  Number of bytes to read from \a bytestr.
- * @param[in] timeout The maximum number of seconds to attempt to send for.
+ * @param[in] timeout The maximum number of milliseconds to attempt to send for.
  * @return 0 on success, libusb error code otherwise.
  * @exception PTP::ERR_NOT_OPEN if not connected to a camera.
  * @see PTPUSB::_bulk_read
@@ -236,12 +239,11 @@ bool PTPUSB::_bulk_write(const unsigned char * bytestr, const int length, const
     if (!is_open())
         throw EasyPTP::ERR_NOT_OPEN;
 
-    std::vector<unsigned char> write_data;
-    write_data.resize(length);
-    std::copy(bytestr, bytestr + length, write_data.data());
+    // libusb only reads from the buffer on an OUT transfer, it just isn't declared const
+    unsigned char * write_data = const_cast<unsigned char *>(bytestr);
 
     // TODO: Return the amount of data transferred? Check it here? What should we do if not enough was sent?
-    bool ret = (libusb_bulk_transfer(this->handle, this->ep_out, write_data.data(), length, &transferred, timeout) == 0);
+    bool ret = (libusb_bulk_transfer(this->handle, this->ep_out, write_data, length, &transferred, timeout) == 0);
 
     return ret;
 }
@@ -253,7 +255,7 @@ bool PTPUSB::_bulk_write(const unsigned char * bytestr, const int length, const
  * @param[out] data_out    The data read from the camera.
  * @param[in]  size        The number of bytes to attempt to read.
  * @param[out] transferred The number of bytes actually read.
- * @param[in]  timeout     The maximum number of seconds to attempt to read for.
+ * @param[in]  timeout     The maximum number of milliseconds to attempt to read for.
  * @return 0 on success, libusb error code otherwise.
  * @exception PTP::ERR_NOT_OPEN if not connected to a camera.
  * @see PTPUSB::_bulk_read
@@ -267,6 +269,74 @@ bool PTPUSB::_bulk_read(unsigned char * data_out, const int size, int * transfer
     return libusb_bulk_transfer(this->handle, this->ep_in, data_out, size, transferred, timeout) == 0;
 }
 
+/**
+ * Cancel the transaction \a transaction_id, and get the endpoints back into
+ * a usable state.
+ *
+ * Follows the USB Still Image Capture Device cancellation sequence: send the
+ * Cancel class request, throw away whatever the camera still has queued on
+ * the "in" endpoint, then poll Get Device Status until the camera says it is
+ * ready again, clearing any endpoint it reports as stalled.
+ *
+ * @param[in] transaction_id The transaction to cancel.
+ * @param[in] timeout The maximum number of milliseconds to spend cancelling.
+ * @return true if the camera reported it was ready again.
+ * @exception PTP::ERR_NOT_OPEN if not connected to a camera.
+ */
+bool PTPUSB::_cancel(const uint32_t transaction_id, const int timeout)
+{
+    if (!is_open())
+        throw ERR_NOT_OPEN;
+
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+    unsigned char cancel[6];
+    uint16_t cancel_code = CANCEL_CODE;
+    std::memcpy(cancel, &cancel_code, 2);
+    std::memcpy(cancel + 2, &transaction_id, 4);
+    if (libusb_control_transfer(this->handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+                                REQUEST_CANCEL, 0, this->intf.bInterfaceNumber, cancel, sizeof cancel, timeout) < 0)
+    {
+        return false;
+    }
+
+    // Drain: read until the camera has nothing more to say
+    unsigned char drain[512];
+    int transferred;
+    while (std::chrono::steady_clock::now() < deadline
+           && libusb_bulk_transfer(this->handle, this->ep_in, drain, sizeof drain, &transferred, 20) == 0)
+    {
+    }
+
+    while (std::chrono::steady_clock::now() < deadline)
+    {
+        // wLength, Code, then up to two endpoint addresses which need clearing
+        unsigned char status[12];
+        int len = libusb_control_transfer(this->handle, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+                                          REQUEST_GET_DEVICE_STATUS, 0, this->intf.bInterfaceNumber, status, sizeof status, timeout);
+        if (len < 4)
+        {
+            return false;
+        }
+
+        uint16_t code;
+        std::memcpy(&code, status + 2, 2);
+        if (code == RESPONSE_OK)
+        {
+            return true;
+        }
+
+        for (int i = 4; i + 4 <= len; i += 4)
+        {
+            libusb_clear_halt(this->handle, status[i]);
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    return false;
+}
+
 /**
  * @brief Returns true if we can _bulk_read and _bulk_write
  */
@@ -0,0 +1,311 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ *
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file PTPUring.cpp
+ *
+ * @brief Queued file writes through io_uring
+ *
+ * The submission and completion rings are shared with the kernel.  We are
+ * the only producer of submissions and the only consumer of completions, so
+ * the tails we write and the heads we read need no more than acquire and
+ * release ordering against the kernel's side.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "libeasyptp/PTPUring.hpp"
+
+namespace EasyPTP
+{
+
+namespace
+{
+
+int io_uring_setup(const unsigned entries, struct io_uring_params * params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(const int fd, const unsigned to_submit, const unsigned min_complete, const unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int io_uring_register(const int fd, const unsigned opcode, void * arg, const unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Whether the kernel behind \a ring_fd knows \a opcode.  Kernels too old to
+ * answer (before 5.6) don't have \c IORING_OP_WRITE either.
+ */
+bool supports_op(const int ring_fd, const unsigned opcode)
+{
+    const unsigned op_count = 256;
+    std::vector<unsigned char> buffer(sizeof (struct io_uring_probe) + op_count * sizeof (struct io_uring_probe_op), 0);
+    struct io_uring_probe * probe = (struct io_uring_probe *) buffer.data();
+
+    if (io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, op_count) < 0)
+    {
+        return false;
+    }
+
+    return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+}
+
+}
+
+/**
+ * @brief Set up a ring with room for \a entries writes in flight
+ *
+ * Check \c PTPUring::is_open to see whether the kernel allowed it; io_uring
+ * may be missing, disabled by policy, or too old to support
+ * \c IORING_OP_WRITE (which needs Linux 5.6).
+ *
+ * @param[in] entries How many writes can be in flight at once.
+ */
+PTPUring::PTPUring(const unsigned entries) :
+ring_fd(-1), pending(0), sq_ptr(MAP_FAILED), sq_size(0), cq_ptr(MAP_FAILED), cq_size(0),
+sqes((struct io_uring_sqe *) MAP_FAILED), sqes_size(0)
+{
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof params);
+
+    this->ring_fd = io_uring_setup(entries, &params);
+    if (this->ring_fd < 0)
+    {
+        this->ring_fd = -1;
+        return;
+    }
+
+    if (!supports_op(this->ring_fd, IORING_OP_WRITE))
+    {
+        this->teardown();
+        return;
+    }
+
+    this->sq_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+    this->cq_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (this->cq_size > this->sq_size)
+        {
+            this->sq_size = this->cq_size;
+        }
+        this->cq_size = this->sq_size;
+    }
+
+    this->sq_ptr = mmap(NULL, this->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ring_fd, IORING_OFF_SQ_RING);
+    if (this->sq_ptr == MAP_FAILED)
+    {
+        this->teardown();
+        return;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        this->cq_ptr = this->sq_ptr;
+    }
+    else
+    {
+        this->cq_ptr = mmap(NULL, this->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ring_fd, IORING_OFF_CQ_RING);
+        if (this->cq_ptr == MAP_FAILED)
+        {
+            this->teardown();
+            return;
+        }
+    }
+
+    this->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+    this->sqes = (struct io_uring_sqe *) mmap(NULL, this->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ring_fd, IORING_OFF_SQES);
+    if (this->sqes == MAP_FAILED)
+    {
+        this->teardown();
+        return;
+    }
+
+    unsigned char * sq = (unsigned char *) this->sq_ptr;
+    this->sq_head = (unsigned *) (sq + params.sq_off.head);
+    this->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    this->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    this->sq_entries = (unsigned *) (sq + params.sq_off.ring_entries);
+    this->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+    unsigned char * cq = (unsigned char *) this->cq_ptr;
+    this->cq_head = (unsigned *) (cq + params.cq_off.head);
+    this->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    this->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    this->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+}
+
+/**
+ * @brief Tears down the ring
+ *
+ * @warning Writes still in flight are not waited for; reap them with
+ *          \c PTPUring::wait first if their buffers are about to be freed.
+ */
+PTPUring::~PTPUring()
+{
+    this->teardown();
+}
+
+void PTPUring::teardown()
+{
+    if (this->sqes != MAP_FAILED)
+    {
+        munmap(this->sqes, this->sqes_size);
+        this->sqes = (struct io_uring_sqe *) MAP_FAILED;
+    }
+    if (this->cq_ptr != MAP_FAILED && this->cq_ptr != this->sq_ptr)
+    {
+        munmap(this->cq_ptr, this->cq_size);
+    }
+    this->cq_ptr = MAP_FAILED;
+    if (this->sq_ptr != MAP_FAILED)
+    {
+        munmap(this->sq_ptr, this->sq_size);
+        this->sq_ptr = MAP_FAILED;
+    }
+    if (this->ring_fd >= 0)
+    {
+        ::close(this->ring_fd);
+        this->ring_fd = -1;
+    }
+}
+
+/**
+ * @brief Whether the ring was set up
+ */
+bool PTPUring::is_open() const
+{
+    return this->ring_fd >= 0;
+}
+
+/**
+ * @brief The number of writes submitted but not yet reaped
+ */
+unsigned PTPUring::get_pending() const
+{
+    return this->pending;
+}
+
+/**
+ * @brief Queue a write of \a length bytes from \a data at \a offset in \a fd
+ *
+ * The write is submitted straight away.  \a data has to stay untouched until
+ * \c PTPUring::wait hands back \a user_data.
+ *
+ * @param[in] fd        The file to write to.
+ * @param[in] data      What to write.
+ * @param[in] length    How many bytes to write.
+ * @param[in] offset    Where in the file to write them.
+ * @param[in] user_data Handed back by \c PTPUring::wait when the write completes.
+ * @return false if the ring is full or the kernel refused the submission.
+ */
+bool PTPUring::write(const int fd, const void * data, const uint32_t length, const uint64_t offset, const uint64_t user_data)
+{
+    if (this->ring_fd < 0)
+    {
+        return false;
+    }
+
+    unsigned tail = *this->sq_tail;
+    unsigned head = __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= *this->sq_entries)
+    {
+        return false;
+    }
+
+    unsigned index = tail & *this->sq_mask;
+    struct io_uring_sqe * sqe = &this->sqes[index];
+    std::memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) data;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+
+    this->sq_array[index] = index;
+    __atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    int ret;
+    do
+    {
+        ret = io_uring_enter(this->ring_fd, 1, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 1 && __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE) == tail)
+    {
+        // The kernel never took it; take it back out, or it would go along
+        //  with the next submission behind our caller's back
+        __atomic_store_n(this->sq_tail, tail, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    // Taken, even if the call failed; its completion will say how it went
+    this->pending++;
+    return true;
+}
+
+/**
+ * @brief Wait for a write to complete
+ *
+ * @param[out] user_data The \a user_data the write was queued with.
+ * @param[out] result    Bytes written, or a negative errno.
+ * @return false if nothing is in flight or the kernel reported an error.
+ */
+bool PTPUring::wait(uint64_t * user_data, int32_t * result)
+{
+    if (this->ring_fd < 0 || this->pending == 0)
+    {
+        return false;
+    }
+
+    for (;;)
+    {
+        unsigned head = *this->cq_head;
+        unsigned tail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+        if (head != tail)
+        {
+            const struct io_uring_cqe& cqe = this->cqes[head & *this->cq_mask];
+            *user_data = cqe.user_data;
+            *result = cqe.res;
+            __atomic_store_n(this->cq_head, head + 1, __ATOMIC_RELEASE);
+            this->pending--;
+            return true;
+        }
+
+        if (io_uring_enter(this->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+        {
+            return false;
+        }
+    }
+}
+
+} /* namespace PTP */
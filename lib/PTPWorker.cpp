@@ -0,0 +1,327 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ *
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file PTPWorker.cpp
+ *
+ * @brief A per-camera thread which accepts transactions from any thread
+ *
+ * The queue is an intrusive multiple-producer, single-consumer list in the
+ * style of Dmitry Vyukov's: producers only ever do one atomic exchange, and
+ * the worker is the only one to walk the list.  The worker sleeps on a
+ * condition variable when there is nothing to do; producers only touch the
+ * mutex when the worker has said it is going to sleep.
+ *
+ * There is one queue per priority class.  The worker only looks at the
+ * queues between jobs, which is what lets background work yield to urgent
+ * work at transaction boundaries.
+ */
+
+#include <stdint.h>
+
+#include "libeasyptp/PTPErrors.hpp"
+#include "libeasyptp/PTPWorker.hpp"
+#include "libeasyptp/PTPBase.hpp"
+#include "libeasyptp/PTPContainer.hpp"
+
+namespace EasyPTP
+{
+
+/**
+ * @brief Start a worker thread for \a camera
+ *
+ * @param[in] camera The camera this worker sends transactions to.  It must
+ *                   outlive the worker.
+ */
+PTPWorker::PTPWorker(PTPBase * camera) :
+camera(camera), waiting(false), stopping(false), stopped(false), dropped(0)
+{
+    this->thread = std::thread(&PTPWorker::run, this);
+}
+
+/**
+ * @brief Finish all queued work, then stop the worker thread
+ */
+PTPWorker::~PTPWorker()
+{
+    this->stop();
+    this->cancel_queued();
+}
+
+/**
+ * @brief Queue \a job to run on the worker thread
+ *
+ * If given, \a on_complete is called on the worker thread once \a job has
+ * run.  It receives the exception thrown by \a job, or a null
+ * \c std::exception_ptr if \a job succeeded.  If \a deadline passes before
+ * \a job reaches the front of its queue, \a job is dropped and
+ * \a on_complete receives \c ERR_PTPWORKER_DEADLINE_MISSED.  If the worker
+ * has already stopped, \a job is never run and \a on_complete receives
+ * \c ERR_PTPWORKER_STOPPED on the calling thread.
+ *
+ * @param[in] job The work to do on the camera.
+ * @param[in] on_complete (optional) Called when \a job is done.
+ * @param[in] priority (optional) The priority class of \a job.
+ * @param[in] deadline (optional) The latest time \a job may be started.
+ */
+void PTPWorker::post(Job job, Callback on_complete, const PRIORITY priority, const Clock::time_point deadline)
+{
+    Node * node = new Node;
+    node->job = job;
+    node->on_complete = on_complete;
+    node->deadline = deadline;
+
+    this->queues[priority].push(node);
+
+    // Pairs with the fences in run() and stop(): either they see this node,
+    // or we see that the worker is asleep (or gone)
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (this->stopped.load())
+    {
+        this->cancel_queued();
+        return;
+    }
+
+    if (this->waiting.load())
+    {
+        std::lock_guard<std::mutex> lock(this->wake_mutex);
+        this->wake.notify_one();
+    }
+}
+
+/**
+ * @brief Queue a complete PTP transaction
+ *
+ * This is \c PTPBase::ptp_transaction, run on the worker thread.  All of the
+ * containers are used by reference, so they must stay alive until the
+ * returned future is ready.
+ *
+ * @return A future which becomes ready when the transaction has finished.
+ * @see PTPBase::ptp_transaction, PTPWorker::submit
+ */
+std::future<void> PTPWorker::ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const int timeout, const PRIORITY priority, const Clock::time_point deadline)
+{
+    PTPBase * camera = this->camera;
+    return this->submit([camera, &cmd, &data, receiving, &out_resp, &out_data, timeout]()
+    {
+        camera->ptp_transaction(cmd, data, receiving, out_resp, out_data, timeout);
+    }, priority, deadline);
+}
+
+/**
+ * @brief The number of jobs dropped because they missed their deadline
+ */
+uint64_t PTPWorker::get_dropped_count() const
+{
+    return this->dropped.load();
+}
+
+/**
+ * @brief Run everything that is already queued, then stop the worker thread
+ *
+ * Work posted after \c stop has been called may or may not run; if it does
+ * not, its completion callback receives \c ERR_PTPWORKER_STOPPED.
+ */
+void PTPWorker::stop()
+{
+    if (this->stopping.exchange(true))
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(this->wake_mutex);
+        this->wake.notify_one();
+    }
+
+    if (this->thread.joinable())
+    {
+        this->thread.join();
+    }
+
+    this->stopped.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    this->cancel_queued();
+}
+
+/**
+ * @brief Fail everything still queued with \c ERR_PTPWORKER_STOPPED
+ *
+ * Only called once the worker thread has exited.  The queues allow a single
+ * consumer, so \c cancel_mutex takes the worker's place.
+ */
+void PTPWorker::cancel_queued()
+{
+    std::lock_guard<std::mutex> lock(this->cancel_mutex);
+
+    Node * node;
+    while ((node = this->pop()) != NULL)
+    {
+        if (node->on_complete)
+        {
+            node->on_complete(std::make_exception_ptr(ERR_PTPWORKER_STOPPED));
+        }
+        delete node;
+    }
+}
+
+/**
+ * @brief Take the next job, most urgent priority class first
+ */
+PTPWorker::Node * PTPWorker::pop()
+{
+    for (int i = 0; i < PRIORITY_COUNT; i++)
+    {
+        Node * node = this->queues[i].pop();
+        if (node != NULL)
+        {
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+bool PTPWorker::empty() const
+{
+    for (int i = 0; i < PRIORITY_COUNT; i++)
+    {
+        if (!this->queues[i].empty())
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void PTPWorker::run()
+{
+    while (true)
+    {
+        Node * node = this->pop();
+        if (node != NULL)
+        {
+            std::exception_ptr error;
+            if (Clock::now() > node->deadline)
+            {
+                this->dropped++;
+                error = std::make_exception_ptr(ERR_PTPWORKER_DEADLINE_MISSED);
+            }
+            else
+            {
+                try
+                {
+                    node->job();
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+            }
+
+            if (node->on_complete)
+            {
+                node->on_complete(error);
+            }
+
+            delete node;
+            continue;
+        }
+
+        if (this->stopping.load() && this->empty())
+        {
+            break;
+        }
+
+        std::unique_lock<std::mutex> lock(this->wake_mutex);
+        this->waiting.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        this->wake.wait(lock, [this]() { return !this->empty() || this->stopping.load(); });
+        this->waiting.store(false);
+    }
+}
+
+PTPWorker::Queue::Queue() :
+head(&stub), tail(&stub)
+{
+    this->stub.next.store(NULL);
+}
+
+void PTPWorker::Queue::push(Node * node)
+{
+    node->next.store(NULL, std::memory_order_relaxed);
+    Node * prev = this->head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+}
+
+/**
+ * @brief Take the oldest node off the queue
+ *
+ * @return The oldest node, or NULL if the queue is empty (or a producer is
+ *         half way through a push; the worker will be woken when it is done).
+ */
+PTPWorker::Node * PTPWorker::Queue::pop()
+{
+    Node * tail = this->tail;
+    Node * next = tail->next.load(std::memory_order_acquire);
+
+    if (tail == &this->stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        this->tail = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next != NULL)
+    {
+        this->tail = next;
+        return tail;
+    }
+
+    if (tail != this->head.load(std::memory_order_acquire))
+    {
+        return NULL;
+    }
+
+    // tail is the last real node; put the stub behind it so it can be taken
+    this->push(&this->stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next != NULL)
+    {
+        this->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+bool PTPWorker::Queue::empty() const
+{
+    Node * tail = this->tail;
+    return (tail->next.load(std::memory_order_acquire) == NULL && this->head.load(std::memory_order_acquire) == tail);
+}
+
+} /* namespace PTP */
@@ -0,0 +1,391 @@
+/**
+ * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
+ * 
+ * This file is part of libEasyPTP.
+ *
+ *  libEasyPTP is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  libEasyPTP is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with libEasyPTP.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file RawData.cpp
+ *
+ * @brief Unpacking of CHDK's packed raw sensor data
+ *
+ * Pixels are packed most significant bit first into little-endian 16-bit
+ * words, so byte \c k of the bit stream is byte \c k^1 in memory.  Every 8
+ * pixels take exactly \c bpp bytes, which is one step of the SIMD kernels:
+ * a byte shuffle gathers the bytes each pixel lies in into a lane of its
+ * own, a per-lane shift drops the bits belonging to the pixel before, and a
+ * uniform shift drops the ones belonging to the pixel after.  10 and 12-bit
+ * pixels never span more than two bytes, so they are assembled in 16-bit
+ * lanes; 14-bit pixels can span three, and are assembled in 32-bit lanes
+ * and packed back down.
+ */
+
+#include <cstring>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RAWDATA_X86
+#endif
+
+#include "libeasyptp/PTPErrors.hpp"
+#include "libeasyptp/RawData.hpp"
+#include "libeasyptp/PTPTrace.hpp"
+
+namespace EasyPTP
+{
+
+namespace
+{
+
+/**
+ * Where each of the 8 pixels of a step is in its \c bpp bytes.
+ */
+struct Layout
+{
+    bool wide; // Pixels can span three bytes, so they're assembled in 32-bit lanes
+    uint8_t shuffle[2][16]; // Source byte for each byte of the lanes; 0x80 for zero
+    uint8_t shift[8]; // Bits of the pixel's first byte which belong to the pixel before
+};
+
+Layout make_layout(const int bpp)
+{
+    Layout layout;
+    layout.wide = (bpp > 12);
+    std::memset(layout.shuffle, 0x80, sizeof layout.shuffle);
+
+    for (int j = 0; j < 8; j++)
+    {
+        int bit = j * bpp;
+        int byte = bit / 8;
+        layout.shift[j] = bit % 8;
+
+        // Stream bytes most significant first, so the lane reads as a number
+        if (layout.wide)
+        {
+            uint8_t * lane = layout.shuffle[j / 4] + (j % 4) * 4;
+            lane[1] = (byte + 2) ^ 1;
+            lane[2] = (byte + 1) ^ 1;
+            lane[3] = byte ^ 1;
+        }
+        else
+        {
+            uint8_t * lane = layout.shuffle[0] + j * 2;
+            lane[0] = (byte + 1) ^ 1;
+            lane[1] = byte ^ 1;
+        }
+    }
+
+    return layout;
+}
+
+const Layout& get_layout(const int bpp)
+{
+    static const Layout layouts[3] = { make_layout(10), make_layout(12), make_layout(14) };
+    return layouts[(bpp - 10) / 2];
+}
+
+/**
+ * Unpacks with a bit accumulator, reading one word at a time.  Also used
+ * for whatever the SIMD kernels leave at the end.
+ */
+void unpack_scalar(const uint8_t * packed, uint16_t * out, const uint32_t count, const int bpp, const uint16_t black_level)
+{
+    const uint32_t mask = (1u << bpp) - 1;
+    uint32_t acc = 0;
+    int bits = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (bits < bpp)
+        {
+            acc = (acc << 16) | packed[0] | (packed[1] << 8);
+            packed += 2;
+            bits += 16;
+        }
+        bits -= bpp;
+        uint16_t value = (acc >> bits) & mask;
+        out[i] = (value > black_level) ? value - black_level : 0;
+    }
+}
+
+#ifdef RAWDATA_X86
+
+/**
+ * 8 pixels a step.  Reads 16 bytes a step, so stops while that many are
+ * left.
+ *
+ * @return The number of pixels unpacked
+ */
+__attribute__((target("sse4.1")))
+uint32_t unpack_sse41(const uint8_t * packed, const uint32_t packed_size, uint16_t * out, const uint32_t count, const int bpp, const uint16_t black_level)
+{
+    const Layout& layout = get_layout(bpp);
+    const __m128i black = _mm_set1_epi16(black_level);
+    const __m128i lo_shuffle = _mm_loadu_si128((const __m128i *) layout.shuffle[0]);
+    const __m128i hi_shuffle = _mm_loadu_si128((const __m128i *) layout.shuffle[1]);
+    const uint8_t * s = layout.shift;
+
+    uint32_t done = 0, in = 0;
+    if (!layout.wide)
+    {
+        const __m128i multiplier = _mm_setr_epi16(1 << s[0], 1 << s[1], 1 << s[2], 1 << s[3], 1 << s[4], 1 << s[5], 1 << s[6], 1 << s[7]);
+        const __m128i drop = _mm_cvtsi32_si128(16 - bpp);
+        for (; done + 8 <= count && in + 16 <= packed_size; done += 8, in += bpp)
+        {
+            __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (packed + in)), lo_shuffle);
+            v = _mm_srl_epi16(_mm_mullo_epi16(v, multiplier), drop);
+            _mm_storeu_si128((__m128i *) (out + done), _mm_subs_epu16(v, black));
+        }
+    }
+    else
+    {
+        const __m128i lo_multiplier = _mm_setr_epi32(1 << s[0], 1 << s[1], 1 << s[2], 1 << s[3]);
+        const __m128i hi_multiplier = _mm_setr_epi32(1 << s[4], 1 << s[5], 1 << s[6], 1 << s[7]);
+        const __m128i drop = _mm_cvtsi32_si128(32 - bpp);
+        for (; done + 8 <= count && in + 16 <= packed_size; done += 8, in += bpp)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *) (packed + in));
+            __m128i lo = _mm_srl_epi32(_mm_mullo_epi32(_mm_shuffle_epi8(v, lo_shuffle), lo_multiplier), drop);
+            __m128i hi = _mm_srl_epi32(_mm_mullo_epi32(_mm_shuffle_epi8(v, hi_shuffle), hi_multiplier), drop);
+            _mm_storeu_si128((__m128i *) (out + done), _mm_subs_epu16(_mm_packus_epi32(lo, hi), black));
+        }
+    }
+
+    return done;
+}
+
+/**
+ * 16 pixels a step, as two 8-pixel steps side by side in the two 128-bit
+ * halves.  Reads 16 bytes from the start of each, so stops while that many
+ * are left past the second.
+ *
+ * @return The number of pixels unpacked
+ */
+__attribute__((target("avx2")))
+uint32_t unpack_avx2(const uint8_t * packed, const uint32_t packed_size, uint16_t * out, const uint32_t count, const int bpp, const uint16_t black_level)
+{
+    const Layout& layout = get_layout(bpp);
+    const __m256i black = _mm256_set1_epi16(black_level);
+    const __m256i lo_shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) layout.shuffle[0]));
+    const __m256i hi_shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) layout.shuffle[1]));
+    const uint8_t * s = layout.shift;
+
+    uint32_t done = 0, in = 0;
+    if (!layout.wide)
+    {
+        const __m256i multiplier = _mm256_setr_epi16(1 << s[0], 1 << s[1], 1 << s[2], 1 << s[3], 1 << s[4], 1 << s[5], 1 << s[6], 1 << s[7],
+                                                     1 << s[0], 1 << s[1], 1 << s[2], 1 << s[3], 1 << s[4], 1 << s[5], 1 << s[6], 1 << s[7]);
+        const __m128i drop = _mm_cvtsi32_si128(16 - bpp);
+        for (; done + 16 <= count && in + bpp + 16 <= packed_size; done += 16, in += 2 * bpp)
+        {
+            __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (packed + in))),
+                                                _mm_loadu_si128((const __m128i *) (packed + in + bpp)), 1);
+            v = _mm256_srl_epi16(_mm256_mullo_epi16(_mm256_shuffle_epi8(v, lo_shuffle), multiplier), drop);
+            _mm256_storeu_si256((__m256i *) (out + done), _mm256_subs_epu16(v, black));
+        }
+    }
+    else
+    {
+        const __m256i lo_shift = _mm256_setr_epi32(s[0], s[1], s[2], s[3], s[0], s[1], s[2], s[3]);
+        const __m256i hi_shift = _mm256_setr_epi32(s[4], s[5], s[6], s[7], s[4], s[5], s[6], s[7]);
+        const __m128i drop = _mm_cvtsi32_si128(32 - bpp);
+        for (; done + 16 <= count && in + bpp + 16 <= packed_size; done += 16, in += 2 * bpp)
+        {
+            __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (packed + in))),
+                                                _mm_loadu_si128((const __m128i *) (packed + in + bpp)), 1);
+            __m256i lo = _mm256_srl_epi32(_mm256_sllv_epi32(_mm256_shuffle_epi8(v, lo_shuffle), lo_shift), drop);
+            __m256i hi = _mm256_srl_epi32(_mm256_sllv_epi32(_mm256_shuffle_epi8(v, hi_shuffle), hi_shift), drop);
+            // Packs within each half, which keeps the pixels in order
+            _mm256_storeu_si256((__m256i *) (out + done), _mm256_subs_epu16(_mm256_packus_epi32(lo, hi), black));
+        }
+    }
+
+    return done;
+}
+
+#endif
+
+RawData::Kernel pick_kernel()
+{
+    if (RawData::is_supported(RawData::KERNEL_AVX2))
+    {
+        return RawData::KERNEL_AVX2;
+    }
+    if (RawData::is_supported(RawData::KERNEL_SSE41))
+    {
+        return RawData::KERNEL_SSE41;
+    }
+    return RawData::KERNEL_SCALAR;
+}
+
+}
+
+/**
+ * @brief Initialize an empty raw frame
+ */
+RawData::RawData() : width(0), height(0), bpp(0)
+{
+
+}
+
+/**
+ * @brief Unpack a packed raw frame
+ *
+ * The storage for the pixels is kept between calls, so reading frames of
+ * the same size over and over does not allocate.
+ *
+ * @param[in] packed      The packed frame, rows one after another.
+ * @param[in] packed_size The number of bytes in \a packed.
+ * @param[in] width       The width of the frame, in pixels.
+ * @param[in] height      The height of the frame, in pixels.
+ * @param[in] bpp         Bits per pixel: 10, 12 or 14.
+ * @param[in] black_level (optional) Subtracted from every pixel, stopping at 0.
+ * @exception PTP::ERR_RAWDATA_INVALID_BPP if \a bpp isn't 10, 12 or 14.
+ * @exception PTP::ERR_RAWDATA_NOT_ENOUGH_DATA if \a packed is too short for the frame.
+ * @see RawData::unpack
+ */
+void RawData::read(const uint8_t * packed, const uint32_t packed_size, const int width, const int height, const int bpp, const uint16_t black_level)
+{
+    PTPTrace::Span span("RawData::read");
+
+    if (width < 0 || height < 0)
+    {
+        throw ERR_RAWDATA_NOT_ENOUGH_DATA;
+    }
+
+    const uint32_t count = (uint32_t) width * height;
+    this->pixels.resize(count);
+    RawData::unpack(packed, packed_size, this->pixels.data(), count, bpp, black_level);
+
+    this->width = width;
+    this->height = height;
+    this->bpp = bpp;
+}
+
+/**
+ * @brief The unpacked pixels, rows one after another
+ */
+const uint16_t * RawData::get_pixels() const
+{
+    return this->pixels.data();
+}
+
+int RawData::get_width() const
+{
+    return this->width;
+}
+
+int RawData::get_height() const
+{
+    return this->height;
+}
+
+int RawData::get_bpp() const
+{
+    return this->bpp;
+}
+
+/**
+ * @brief How many bytes \a count pixels take packed at \a bpp bits each
+ *
+ * Data is packed in whole 16-bit words.
+ */
+uint32_t RawData::get_packed_size(const uint32_t count, const int bpp)
+{
+    return ((uint64_t) count * bpp + 15) / 16 * 2;
+}
+
+/**
+ * @brief Whether this CPU can run \a kernel
+ */
+bool RawData::is_supported(const Kernel kernel)
+{
+    switch (kernel)
+    {
+    case KERNEL_AUTO:
+    case KERNEL_SCALAR:
+        return true;
+#ifdef RAWDATA_X86
+    case KERNEL_SSE41:
+        return __builtin_cpu_supports("sse4.1");
+    case KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief The fastest kernel this CPU can run
+ */
+RawData::Kernel RawData::get_best_kernel()
+{
+    static const Kernel best = pick_kernel();
+    return best;
+}
+
+/**
+ * @brief Unpack \a count pixels from \a packed into \a out
+ *
+ * @param[in]  packed      The packed pixels.
+ * @param[in]  packed_size The number of bytes in \a packed.
+ * @param[out] out         Room for \a count pixels.
+ * @param[in]  count       The number of pixels to unpack.
+ * @param[in]  bpp         Bits per pixel: 10, 12 or 14.
+ * @param[in]  black_level (optional) Subtracted from every pixel, stopping at 0.
+ * @param[in]  kernel      (optional) Which implementation to use; by default, the fastest.
+ * @exception PTP::ERR_RAWDATA_INVALID_BPP if \a bpp isn't 10, 12 or 14.
+ * @exception PTP::ERR_RAWDATA_NOT_ENOUGH_DATA if \a packed is too short for \a count pixels.
+ * @exception PTP::ERR_NOT_IMPLEMENTED if this CPU can't run \a kernel.
+ */
+void RawData::unpack(const uint8_t * packed, const uint32_t packed_size, uint16_t * out, const uint32_t count, const int bpp, const uint16_t black_level, const Kernel kernel)
+{
+    if (bpp != 10 && bpp != 12 && bpp != 14)
+    {
+        throw ERR_RAWDATA_INVALID_BPP;
+    }
+    if (packed_size < RawData::get_packed_size(count, bpp))
+    {
+        throw ERR_RAWDATA_NOT_ENOUGH_DATA;
+    }
+    if (!RawData::is_supported(kernel))
+    {
+        throw ERR_NOT_IMPLEMENTED;
+    }
+
+    uint32_t done = 0;
+#ifdef RAWDATA_X86
+    switch (kernel == KERNEL_AUTO ? RawData::get_best_kernel() : kernel)
+    {
+    case KERNEL_AVX2:
+        done = unpack_avx2(packed, packed_size, out, count, bpp, black_level);
+        break;
+    case KERNEL_SSE41:
+        done = unpack_sse41(packed, packed_size, out, count, bpp, black_level);
+        break;
+    default:
+        break;
+    }
+#endif
+
+    // Steps are 8 pixels, which always end on a word
+    unpack_scalar(packed + (uint64_t) done * bpp / 8, out + done, count - done, bpp, black_level);
+}
+
+} /* namespace PTP */
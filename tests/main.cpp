@@ -1,6 +1,6 @@
 /**
  * Copyright 2013 Bobby Graese <bobby.graese@gmail.com>
- * 
+ *
  * This file is part of libEasyPTP.
  *
  *  libEasyPTP is free software: you can redistribute it and/or modify
@@ -18,10 +18,2585 @@
  *  <http://www.gnu.org/licenses/>.
  */
 
-// This is currently a stub.  Real tests will come later.
+/**
+ * @file main.cpp
+ *
+ * @brief Tests which run against a stub \c IPTPComm instead of a camera
+ *
+ * Every heap allocation made by the process is counted, so tests can check
+ * that steady-state paths (polling the script status, pulling live view
+ * frames) do not allocate once they are warmed up.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <map>
+#include <new>
+#include <thread>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <stdint.h>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libeasyptp/PTPErrors.hpp"
+#include "libeasyptp/PTPContainer.hpp"
+#include "libeasyptp/IPTPComm.hpp"
+#include "libeasyptp/CHDKCamera.hpp"
+#include "libeasyptp/LVData.hpp"
+#include "libeasyptp/RawData.hpp"
+#include "libeasyptp/DNGWriter.hpp"
+#include "libeasyptp/PTPTrace.hpp"
+#include "libeasyptp/PTPWorker.hpp"
+#include "libeasyptp/PTPDataSink.hpp"
+#include "libeasyptp/CHDKOffload.hpp"
+#include "libeasyptp/CHDKRpc.hpp"
+#include "libeasyptp/CHDKTimelapse.hpp"
+#include "libeasyptp/CHDKRigTrigger.hpp"
+#include "libeasyptp/CHDKClockSync.hpp"
+#include "libeasyptp/CHDKPropertyCache.hpp"
+#include "libeasyptp/CHDKTable.hpp"
+#include "libeasyptp/CRC32C.hpp"
+#include "libeasyptp/CHDKMessageStream.hpp"
+#include "libeasyptp/chdk/ptp.h"
+
+using namespace EasyPTP;
+
+/*
+ * Allocation counting
+ */
+static std::atomic<long> allocations(0);
+static std::atomic<long> allocated_bytes(0);
+
+#ifdef __GLIBC__
+extern "C"
+{
+void * __libc_malloc(size_t size);
+void * __libc_calloc(size_t count, size_t size);
+void * __libc_realloc(void * ptr, size_t size);
+
+void * malloc(size_t size)
+{
+    allocations++;
+    allocated_bytes += size;
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size)
+{
+    allocations++;
+    allocated_bytes += count * size;
+    return __libc_calloc(count, size);
+}
+
+void * realloc(void * ptr, size_t size)
+{
+    allocations++;
+    allocated_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+}
+
+// operator new goes through malloc, so it is already counted
+#else
+void * operator new(size_t size)
+{
+    allocations++;
+    allocated_bytes += size;
+    void * out = std::malloc(size ? size : 1);
+    if (out == NULL) throw std::bad_alloc();
+    return out;
+}
+
+void * operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void * ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void * ptr) noexcept
+{
+    std::free(ptr);
+}
+#endif
+
+/**
+ * Replays a fixed script of messages, in a loop, to whoever reads from it.
+ * Writes are accepted and counted, and kept if \c record is set.  Nothing
+ * here allocates once the script is loaded, unless writes are being kept.
+ */
+class StubComm : public IPTPComm
+{
+private:
+    std::vector<std::vector<unsigned char> > script;
+    size_t next;
+    size_t offset;
+public:
+    int writes;
+    bool record;
+    std::vector<std::vector<unsigned char> > written;
+
+    StubComm() : next(0), offset(0), writes(0), record(false)
+    {
+    }
+
+    void add_message(const PTPContainer& container)
+    {
+        std::vector<unsigned char> packed(container.get_length());
+        container.pack_into(packed.data());
+        this->script.push_back(packed);
+    }
+
+    virtual bool is_open()
+    {
+        return true;
+    }
+
+    virtual bool _bulk_write(const unsigned char * bytestr, const int length, const int timeout = 0)
+    {
+        this->writes++;
+        if (this->record)
+        {
+            this->written.push_back(std::vector<unsigned char>(bytestr, bytestr + length));
+        }
+        return true;
+    }
+
+    virtual bool _bulk_read(unsigned char * data_out, const int size, int * transferred, const int timeout = 0)
+    {
+        const std::vector<unsigned char>& msg = this->script[this->next];
+        size_t count = msg.size() - this->offset;
+        if (count > (size_t) size) count = size;
+
+        std::memcpy(data_out, msg.data() + this->offset, count);
+        *transferred = count;
+
+        this->offset += count;
+        if (this->offset == msg.size())
+        {
+            this->offset = 0;
+            this->next = (this->next + 1) % this->script.size();
+        }
+
+        return true;
+    }
+};
+
+/**
+ * A camera which accepts commands but never answers.
+ */
+class SilentComm : public IPTPComm
+{
+public:
+    int reads;
+    int read_timeout; // The last read's
+    int cancels;
+    uint32_t cancelled_id;
+    bool unplugged; // Writes fail too
+
+    SilentComm() : reads(0), read_timeout(0), cancels(0), cancelled_id(0), unplugged(false)
+    {
+    }
+
+    virtual bool is_open()
+    {
+        return true;
+    }
+
+    virtual bool _bulk_write(const unsigned char * bytestr, const int length, const int timeout = 0)
+    {
+        return !this->unplugged;
+    }
+
+    virtual bool _bulk_read(unsigned char * data_out, const int size, int * transferred, const int timeout = 0)
+    {
+        this->reads++;
+        this->read_timeout = timeout;
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+        *transferred = 0;
+        return false;
+    }
+
+    virtual bool _cancel(const uint32_t transaction_id, const int timeout = 0)
+    {
+        this->cancels++;
+        this->cancelled_id = transaction_id;
+        return true;
+    }
+};
+
+/**
+ * Acts enough like a camera running CHDK to exercise its script system.
+ * Scripts run instantly, except that starting one costs \c compile_ms, as
+ * compiling and starting a script does on a real camera.  The fake only
+ * knows the library's own scripts, by their constants, and those a test
+ * teaches it with \c on_script; any other script must be
+ * "return <integer>", or it fails to compile.  The \c CHDKRpc dispatcher's
+ * handlers are played here: defined functions return their arguments
+ * joined with '+'.
+ */
+class FakeChdkComm : public IPTPComm
+{
+private:
+    struct ScriptMsg
+    {
+        uint32_t type;
+        uint32_t subtype;
+        uint32_t script_id;
+        std::string text;
+    };
+
+    // What a script which keeps running does with the messages sent to it
+    enum Resident
+    {
+        RESIDENT_LOOP, // Takes them into the inbox
+        RESIDENT_RIG, // Shoots on "fire", gives up on "cancel"
+        RESIDENT_RPC // Answers them as CHDKRpc requests
+    };
+
+    typedef std::function<void (const uint32_t id, const std::string& script)> ScriptHandler;
+
+    // How much of a script a known one's text is
+    enum ScriptMatch
+    {
+        SCRIPT_WHOLE,
+        SCRIPT_HEAD, // What a builder starts every script with
+        SCRIPT_TAIL // What follows the lines setting a script's arguments
+    };
+
+    struct KnownScript
+    {
+        std::string text;
+        ScriptMatch match;
+        ScriptHandler handler;
+    };
+
+    std::deque<std::vector<unsigned char> > outbox;
+    size_t offset;
+    PTPContainer pending; // A command waiting for its data phase
+    std::string incoming; // The data phase so far
+    uint32_t incoming_left;
+    std::deque<ScriptMsg> messages;
+    std::map<uint32_t, std::deque<std::pair<uint32_t, std::string> > > captured; // Chunks by format, with their positions
+    std::chrono::steady_clock::time_point shot_ready;
+    uint32_t shooting_id;
+    std::chrono::steady_clock::time_point shot_done;
+    uint32_t next_image;
+    std::string temp_data;
+    std::map<std::string, std::string> defined;
+    uint32_t next_script_id;
+    uint32_t resident_id;
+    Resident resident;
+    std::vector<KnownScript> scripts;
+
+    void queue(const PTPContainer& container)
+    {
+        std::vector<unsigned char> packed(container.get_length());
+        container.pack_into(packed.data());
+        this->outbox.push_back(packed);
+    }
+
+    void respond(const uint32_t tid, const std::vector<uint32_t>& params)
+    {
+        PTPContainer resp(PTPContainer::CONTAINER_TYPE_RESPONSE, CHDK_PTP_RC_OK);
+        resp.transaction_id = tid;
+        for (size_t i = 0; i < params.size(); i++) resp.add_param(params[i]);
+        this->queue(resp);
+    }
+
+    void post(const uint32_t type, const uint32_t subtype, const uint32_t script_id, const std::string& text)
+    {
+        ScriptMsg msg = { type, subtype, script_id, text };
+        this->messages.push_back(msg);
+    }
+
+    std::string dispatch(const std::string& request, bool * ok)
+    {
+        std::vector<std::string> fields;
+        std::string field;
+        for (size_t i = 0; i <= request.size(); i++)
+        {
+            if (i == request.size() || request[i] == '\t') { fields.push_back(field); field.clear(); }
+            else field += request[i];
+        }
+
+        *ok = true;
+        const std::string& name = fields[1];
+        if (name == "ping") return "pong";
+        if (name == "quit") { this->resident_id = 0; return ""; }
+        if (name == "exec") return "";
+        if (name == "def") { this->defined[fields[2]] = fields[3]; return "true"; }
+        if (this->defined.count(name) && this->defined[name] == "return get_tick_count()")
+        {
+            // The camera's clock: offset from ours, and running slow
+            double host_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+            int64_t tick = (int64_t) std::floor(host_us * (1 - this->tick_drift_ppm / 1e6) / 1000) + this->tick_offset_ms;
+            return std::to_string((int32_t) (uint32_t) tick);
+        }
+        if (this->defined.count(name))
+        {
+            std::string out;
+            for (size_t i = 2; i < fields.size(); i++) out += (i > 2 ? "+" : "") + fields[i];
+            return out;
+        }
+        *ok = false;
+        return "no such function: " + name;
+    }
+
+    // The string a script's first line sets, e.g. "local path = 'A/DCIM'"
+    static std::string argument(const std::string& script)
+    {
+        size_t quote = script.find('\'') + 1;
+        return script.substr(quote, script.find('\'', quote) - quote);
+    }
+
+    const KnownScript * find_script(const std::string& script) const
+    {
+        for (size_t i = 0; i < this->scripts.size(); i++)
+        {
+            const std::string& text = this->scripts[i].text;
+            ScriptMatch match = this->scripts[i].match;
+            if (script == text || (match != SCRIPT_WHOLE && script.size() > text.size()
+                && script.compare(match == SCRIPT_HEAD ? 0 : script.size() - text.size(), text.size(), text) == 0))
+            {
+                return &this->scripts[i];
+            }
+        }
+        return NULL;
+    }
+
+    // A script which runs until it's told to stop
+    void serve_resident(const std::string& script, const Resident kind, const std::string& greeting = std::string())
+    {
+        this->on_script(script, [this, kind, greeting](const uint32_t id, const std::string&)
+        {
+            this->resident_id = id;
+            this->resident = kind;
+            if (!greeting.empty() && !(kind == RESIDENT_RIG && this->never_arms))
+            {
+                this->post(PTP_CHDK_S_MSGTYPE_USER, PTP_CHDK_TYPE_STRING, id, greeting);
+            }
+        });
+    }
+
+    // Every file holds its own name, over and over
+    std::string file_content(const std::string& name)
+    {
+        size_t size = this->card.count(name) ? this->card[name].first : 100000;
+        std::string file;
+        while (file.size() < size) file += name;
+        file.resize(size);
+        return file;
+    }
+
+    void handle(const PTPContainer& cmd, const std::string& data)
+    {
+        std::vector<uint32_t> params;
+        switch (cmd.get_param_n(0))
+        {
+        case PTP_CHDK_ScriptStatus:
+            this->status_polls++;
+            while (this->hold_status.load()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            if (this->shooting_id && std::chrono::steady_clock::now() >= this->shot_done)
+            {
+                char name[64];
+                snprintf(name, sizeof name, "A/DCIM/100CANON/IMG_%04u.JPG", this->next_image++);
+                this->post(PTP_CHDK_S_MSGTYPE_RET, PTP_CHDK_TYPE_STRING, this->shooting_id, name);
+                this->shooting_id = 0;
+            }
+            params.push_back(((this->resident_id || this->shooting_id) ? PTP_CHDK_SCRIPT_STATUS_RUN : 0) | (this->messages.empty() ? 0 : PTP_CHDK_SCRIPT_STATUS_MSG));
+            break;
+        case PTP_CHDK_ExecuteScript:
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(this->compile_ms));
+            this->scripts_started++;
+            uint32_t id = this->next_script_id++;
+            const KnownScript * known = this->find_script(data);
+            char * end = NULL;
+            long value = data.compare(0, 7, "return ") == 0 ? std::strtol(data.c_str() + 7, &end, 10) : 0;
+            if (known)
+            {
+                known->handler(id, data);
+            }
+            else if (end != NULL && end != data.c_str() + 7 && *end == '\0')
+            {
+                // "return <integer>"
+                uint32_t result = (uint32_t) value;
+                this->post(PTP_CHDK_S_MSGTYPE_RET, PTP_CHDK_TYPE_INTEGER, id, std::string((const char *) &result, 4));
+            }
+            else
+            {
+                params.push_back(id);
+                params.push_back(PTP_CHDK_S_ERRTYPE_COMPILE);
+                break;
+            }
+            params.push_back(id);
+            params.push_back(PTP_CHDK_S_ERRTYPE_NONE);
+            break;
+        }
+        case PTP_CHDK_WriteScriptMsg:
+        {
+            uint32_t target = cmd.get_param_n(1);
+            if (this->resident_id == 0 || (target != 0 && target != this->resident_id))
+            {
+                params.push_back(PTP_CHDK_S_MSGSTATUS_NOTRUN);
+                break;
+            }
+            uint32_t id = this->resident_id;
+            if (this->resident == RESIDENT_LOOP)
+            {
+                // A control loop's message: queued for the script, which drains
+                //  its inbox each time it fills
+                if (this->inbox_limit > 0 && this->inbox_pending >= this->inbox_limit)
+                {
+                    if (!this->inbox_stuck) this->inbox_pending = 0;
+                    params.push_back(PTP_CHDK_S_MSGSTATUS_QFULL);
+                    break;
+                }
+                this->inbox.push_back(data);
+                this->inbox_pending++;
+                params.push_back(PTP_CHDK_S_MSGSTATUS_OK);
+                break;
+            }
+            if (this->resident == RESIDENT_RIG)
+            {
+                // An armed rig trigger: a shot, with the tick it was taken at, or nothing
+                if (data != "fire" && data != "cancel")
+                {
+                    params.push_back(PTP_CHDK_S_MSGSTATUS_OK);
+                    break;
+                }
+                this->rig_released_by = data;
+                this->resident_id = 0;
+                uint32_t tick = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+                if (data == "fire") this->post(PTP_CHDK_S_MSGTYPE_RET, PTP_CHDK_TYPE_INTEGER, id, std::string((const char *) &tick, 4));
+                else this->post(PTP_CHDK_S_MSGTYPE_RET, PTP_CHDK_TYPE_BOOLEAN, id, std::string(4, '\0'));
+                params.push_back(PTP_CHDK_S_MSGSTATUS_OK);
+                break;
+            }
+            bool ok;
+            std::string result = this->dispatch(data, &ok);
+            std::string request_id = data.substr(0, data.find('\t'));
+            this->post(PTP_CHDK_S_MSGTYPE_USER, PTP_CHDK_TYPE_STRING, id, request_id + (ok ? "\tok\t" : "\terr\t") + result);
+            params.push_back(PTP_CHDK_S_MSGSTATUS_OK);
+            break;
+        }
+        case PTP_CHDK_ReadScriptMsg:
+        {
+            ScriptMsg msg = { PTP_CHDK_S_MSGTYPE_NONE, 0, 0, "" };
+            if (!this->messages.empty())
+            {
+                msg = this->messages.front();
+                this->messages.pop_front();
+            }
+            PTPContainer out(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+            out.transaction_id = cmd.transaction_id;
+            if (msg.text.empty()) out.set_payload("", 1); // CHDK always sends at least one byte
+            else out.set_payload(msg.text.data(), msg.text.size());
+            this->queue(out);
+            params.push_back(msg.type);
+            params.push_back(msg.subtype);
+            params.push_back(msg.script_id);
+            params.push_back(msg.text.size());
+            break;
+        }
+        case PTP_CHDK_GetMemory:
+        {
+            // 0xFFFFFFFF wraps around to 0, as it does on the camera
+            uint32_t address = cmd.get_param_n(1);
+            uint32_t size = cmd.get_param_n(2);
+            std::vector<unsigned char> block(size, 0xEE);
+            uint32_t skip = (address == 0xFFFFFFFF) ? 1 : 0;
+            std::memcpy(block.data() + skip, this->memory.data() + (uint32_t) (address + skip), size - skip);
+            PTPContainer out(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+            out.transaction_id = cmd.transaction_id;
+            out.set_payload(block.data(), size);
+            this->queue(out);
+            break;
+        }
+        case PTP_CHDK_TempData:
+            this->temp_data = data;
+            break;
+        case PTP_CHDK_DownloadFile:
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(this->download_ms));
+            std::string file = this->file_content(this->temp_data);
+            if (this->corrupt_downloads) file[file.size() / 2] ^= 0x10;
+            this->downloads++;
+            PTPContainer out(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+            out.transaction_id = cmd.transaction_id;
+            out.set_payload(file.data(), file.size());
+            this->queue(out);
+            if (this->cut_downloads)
+            {
+                // The cable is pulled half way through
+                this->outbox.back().resize(this->outbox.back().size() / 2);
+                return;
+            }
+            break;
+        }
+        case PTP_CHDK_RemoteCaptureIsReady:
+        {
+            uint32_t ready = 0;
+            for (std::map<uint32_t, std::deque<std::pair<uint32_t, std::string> > >::iterator it = this->captured.begin(); it != this->captured.end(); ++it)
+            {
+                if (!it->second.empty()) ready |= it->first;
+            }
+            params.push_back(std::chrono::steady_clock::now() < this->shot_ready ? 0 : ready);
+            params.push_back(42);
+            break;
+        }
+        case PTP_CHDK_RemoteCaptureGetData:
+        {
+            std::deque<std::pair<uint32_t, std::string> >& chunks = this->captured[cmd.get_param_n(1)];
+            std::pair<uint32_t, std::string> chunk = chunks.front();
+            chunks.pop_front();
+            PTPContainer out(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+            out.transaction_id = cmd.transaction_id;
+            out.set_payload(chunk.second.data(), chunk.second.size());
+            this->queue(out);
+            params.push_back(chunk.second.size());
+            params.push_back(chunks.empty() ? 0 : 1);
+            params.push_back(chunk.first);
+            break;
+        }
+        case PTP_CHDK_CallFunction:
+        {
+            // Our only "function" sums its arguments onto its address
+            int32_t sum = 0;
+            for (size_t i = 0; i < data.size(); i += 4)
+            {
+                int32_t value;
+                std::memcpy(&value, data.data() + i, 4);
+                sum += value;
+            }
+            params.push_back(sum);
+            break;
+        }
+        case PTP_CHDK_SetMemory:
+            std::memcpy(this->memory.data() + cmd.get_param_n(1), data.data(), data.size());
+            break;
+        default:
+            break;
+        }
+        this->respond(cmd.transaction_id, params);
+    }
+public:
+    int compile_ms;
+    int scripts_started; // Each costing compile_ms
+    std::vector<unsigned char> memory;
+    std::map<uint32_t, std::deque<std::pair<uint32_t, std::string> > > shot; // What the next capture produces
+    int exposure_ms;
+    int shot_ms;
+    int download_ms;
+    int64_t tick_offset_ms;
+    double tick_drift_ppm;
+    std::map<std::string, std::string> properties; // Lua expressions, and what they return
+    int property_scripts;
+    std::map<std::string, std::pair<uint64_t, uint64_t> > card; // Files on the card, with their sizes and mtimes
+    int downloads;
+    bool corrupt_downloads;
+    bool cut_downloads; // Only half of each file arrives, then nothing more
+    std::vector<std::string> inbox; // Messages a control loop script has taken
+    uint32_t inbox_limit; // How many it holds before PTP_CHDK_S_MSGSTATUS_QFULL, or 0 for no limit
+    uint32_t inbox_pending;
+    bool inbox_stuck; // The script never drains its inbox
+    bool never_arms; // The rig trigger script half-presses, but never says it's armed
+    std::string rig_released_by; // What an armed rig trigger script was last told
+    std::atomic<int> status_polls;
+    std::atomic<bool> hold_status; // Keeps script status polls on the wire
+
+    FakeChdkComm() : offset(0), incoming_left(0), shooting_id(0), next_image(1), next_script_id(1), resident_id(0), resident(RESIDENT_LOOP),
+    compile_ms(0), scripts_started(0), exposure_ms(0), shot_ms(0), download_ms(0), tick_offset_ms(0), tick_drift_ppm(0), property_scripts(0), downloads(0), corrupt_downloads(false), cut_downloads(false), inbox_limit(0), inbox_pending(0), inbox_stuck(false), never_arms(false),
+    status_polls(0), hold_status(false)
+    {
+        this->serve_resident(CHDKRpc::dispatcher_script, RESIDENT_RPC);
+        this->serve_resident(CHDKRigTrigger::arm_script, RESIDENT_RIG, "armed");
+
+        this->on_script(CHDKTimelapse::shoot_script, [this](const uint32_t id, const std::string&)
+        {
+            this->shooting_id = id;
+            this->shot_done = std::chrono::steady_clock::now() + std::chrono::milliseconds(this->shot_ms);
+        });
+
+        // A property query: answer each "get(i, function() return <expr> end)" we know
+        std::string properties;
+        CHDKPropertyCache::build_script(std::vector<std::string>(), properties);
+        properties.resize(properties.size() - std::strlen("return r\n"));
+        this->on_script(properties, [this](const uint32_t id, const std::string& script)
+        {
+            std::string table;
+            for (size_t pos = script.find("\nget("); pos != std::string::npos; pos = script.find("\nget(", pos + 1))
+            {
+                size_t start = script.find("return ", pos) + 7;
+                std::string expression = script.substr(start, script.find(" end)", start) - start);
+                if (this->properties.count(expression))
+                {
+                    table += std::to_string(std::atoi(script.c_str() + pos + 5)) + "\t" + this->properties[expression] + "\n";
+                }
+            }
+            this->property_scripts++;
+            this->post(PTP_CHDK_S_MSGTYPE_RET, PTP_CHDK_TYPE_TABLE, id, table);
+        }, SCRIPT_HEAD);
+
+        // A checksum, bit by bit, as the script does it
+        this->on_script(CHDKCamera::crc32c_script, [this](const uint32_t id, const std::string& script)
+        {
+            std::string file = this->file_content(argument(script));
+            uint32_t crc = 0xFFFFFFFF;
+            for (size_t i = 0; i < file.size(); i++)
+            {
+                crc ^= (unsigned char) file[i];
+                for (int bit = 0; bit < 8; bit++) crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+            }
+            this->post(PTP_CHDK_S_MSGTYPE_RET, PTP_CHDK_TYPE_TABLE, id,
+                "crc\t" + std::to_string((int32_t) ~crc) + "\nsize\t" + std::to_string(file.size()) + "\n");
+        }, SCRIPT_TAIL);
+
+        // A manifest: every file on the card under root
+        this->on_script(CHDKCamera::sync_manifest_script, [this](const uint32_t id, const std::string& script)
+        {
+            std::string root = argument(script) + "/";
+            std::string table;
+            for (std::map<std::string, std::pair<uint64_t, uint64_t> >::iterator it = this->card.begin(); it != this->card.end(); ++it)
+            {
+                if (it->first.compare(0, root.size(), root) == 0)
+                {
+                    table += it->first.substr(root.size()) + "\t" + std::to_string(it->second.first) + "," + std::to_string(it->second.second) + "\n";
+                }
+            }
+            this->post(PTP_CHDK_S_MSGTYPE_RET, PTP_CHDK_TYPE_TABLE, id, table);
+        }, SCRIPT_TAIL);
+
+        this->on_script(DNGWriter::metadata_script, [this](const uint32_t id, const std::string&)
+        {
+            this->post(PTP_CHDK_S_MSGTYPE_RET, PTP_CHDK_TYPE_TABLE, id,
+                "platform\tixus870_sd880\nbuild\t1.4.1\ndate\t2026:10:19 12:00:00\n"
+                "tv96\t768\nav96\t384\nsv96\t480\ncfa\t33620224\nblack\t127\nwhite\t4095\n");
+        });
+
+        // Remote capture, in every combination of formats, and turning it off
+        for (uint32_t formats = 0; formats <= (PTP_CHDK_CAPTURE_JPG | PTP_CHDK_CAPTURE_RAW | PTP_CHDK_CAPTURE_DNGHDR); formats++)
+        {
+            char script[128];
+            snprintf(script, sizeof script, formats ? "init_usb_capture(%u) shoot() init_usb_capture(0)" : "init_usb_capture(%u)", (unsigned int) formats);
+            this->on_script(script, [this, formats](const uint32_t id, const std::string&)
+            {
+                this->captured.clear();
+                for (std::map<uint32_t, std::deque<std::pair<uint32_t, std::string> > >::iterator it = this->shot.begin(); it != this->shot.end(); ++it)
+                {
+                    if (formats & it->first) this->captured[it->first] = it->second;
+                }
+                this->shot_ready = std::chrono::steady_clock::now() + std::chrono::milliseconds(this->exposure_ms);
+                this->post(PTP_CHDK_S_MSGTYPE_RET, PTP_CHDK_TYPE_NIL, id, "");
+            });
+        }
+    }
+
+    // Teach the camera a script: \a handler runs whenever it's started
+    void on_script(const std::string& script, const ScriptHandler& handler, const ScriptMatch match = SCRIPT_WHOLE)
+    {
+        KnownScript known = { script, match, handler };
+        this->scripts.push_back(known);
+    }
+
+    // A control loop: a script which takes every message sent to it
+    void serve_loop(const std::string& script)
+    {
+        this->serve_resident(script, RESIDENT_LOOP);
+    }
+
+    // The resident script ends
+    void quit_resident()
+    {
+        this->resident_id = 0;
+    }
+
+    virtual bool is_open()
+    {
+        return true;
+    }
+
+    virtual bool _bulk_write(const unsigned char * bytestr, const int length, const int timeout = 0)
+    {
+        if (this->incoming_left > 0)
+        {
+            // The rest of a data phase
+            this->incoming.append((const char *) bytestr, length);
+            this->incoming_left -= length;
+        }
+        else
+        {
+            uint32_t total;
+            uint16_t type;
+            std::memcpy(&total, bytestr, 4);
+            std::memcpy(&type, bytestr + 4, 2);
+            if (type == PTPContainer::CONTAINER_TYPE_COMMAND)
+            {
+                PTPContainer msg(bytestr);
+                uint32_t op = msg.get_param_n(0);
+                if (op == PTP_CHDK_ExecuteScript || op == PTP_CHDK_WriteScriptMsg || op == PTP_CHDK_SetMemory || op == PTP_CHDK_CallFunction || op == PTP_CHDK_TempData)
+                {
+                    this->pending = msg; // Wait for the data phase
+                    return true;
+                }
+                this->handle(msg, std::string());
+                return true;
+            }
+            this->incoming.assign((const char *) bytestr + 12, length - 12);
+            this->incoming_left = total - length;
+        }
+
+        if (this->incoming_left == 0)
+        {
+            std::string data;
+            data.swap(this->incoming);
+            uint32_t op = this->pending.get_param_n(0);
+            if (op != PTP_CHDK_SetMemory && op != PTP_CHDK_CallFunction && !data.empty() && data[data.size() - 1] == '\0')
+            {
+                data.resize(data.size() - 1); // Scripts are sent with their terminator
+            }
+            this->handle(this->pending, data);
+        }
+        return true;
+    }
+
+    virtual bool _bulk_read(unsigned char * data_out, const int size, int * transferred, const int timeout = 0)
+    {
+        if (this->outbox.empty())
+        {
+            *transferred = 0;
+            return false;
+        }
+
+        const std::vector<unsigned char>& msg = this->outbox.front();
+        size_t count = msg.size() - this->offset;
+        if (count > (size_t) size) count = size;
+        std::memcpy(data_out, msg.data() + this->offset, count);
+        *transferred = count;
+
+        this->offset += count;
+        if (this->offset == msg.size())
+        {
+            this->offset = 0;
+            this->outbox.pop_front();
+        }
+        return true;
+    }
+};
+
+static int failures = 0;
+static bool benchmarks = false; // --bench: time things too, at full size
+
+#define CHECK(cond) do { if (!(cond)) { std::printf("  FAILED: %s (line %d)\n", #cond, __LINE__); failures++; } } while (0)
+
+static std::string read_file(const std::string& filename)
+{
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    std::ostringstream out;
+    out << in.rdbuf();
+    return out.str();
+}
+
+static PTPContainer make_response(const uint32_t param)
+{
+    PTPContainer resp(PTPContainer::CONTAINER_TYPE_RESPONSE, CHDK_PTP_RC_OK);
+    resp.add_param(param);
+    return resp;
+}
+
+/**
+ * Runs \a body \a warmup times, then counts the allocations made over
+ * \a iterations more runs.
+ */
+template<typename F>
+static long count_allocations(F body, const int warmup, const int iterations)
+{
+    for (int i = 0; i < warmup; i++) body();
+
+    long before = allocations.load();
+    for (int i = 0; i < iterations; i++) body();
+    return allocations.load() - before;
+}
+
+static void test_allocations_are_counted()
+{
+    std::printf("allocation counter\n");
+
+    PTPContainer container(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    container.add_param(PTP_CHDK_Version);
+    long allocs = count_allocations([&]() { delete[] container.pack(); }, 0, 10);
+    CHECK(allocs == 10);
+}
+
+static void test_script_status_does_not_allocate()
+{
+    std::printf("script status poll\n");
+
+    StubComm comm;
+    comm.add_message(make_response(PTP_CHDK_SCRIPT_STATUS_RUN));
+    CHDKCamera cam(&comm);
+
+    uint32_t status = 0;
+    long allocs = count_allocations([&]() { status = cam.check_script_status(); }, 4, 1000);
+
+    CHECK(status == PTP_CHDK_SCRIPT_STATUS_RUN);
+    CHECK(comm.writes == 1004);
+    CHECK(allocs == 0);
+    if (benchmarks) std::printf("  %ld allocations in 1000 transactions\n", allocs);
+}
+
+static void test_live_view_does_not_allocate()
+{
+    std::printf("live view loop\n");
+
+    const int width = 64, height = 48;
+
+    lv_data_header head;
+    std::memset(&head, 0, sizeof head);
+    head.version_major = 2;
+    head.version_minor = 1;
+    head.vp_desc_start = sizeof head;
+
+    lv_framebuffer_desc desc;
+    std::memset(&desc, 0, sizeof desc);
+    desc.fb_type = LV_FB_YUV8;
+    desc.data_start = sizeof head + sizeof desc;
+    desc.buffer_width = width;
+    desc.visible_width = width;
+    desc.visible_height = height;
+
+    std::vector<unsigned char> frame(desc.data_start + (width * height * 12) / 8, 0x80);
+    std::memcpy(frame.data(), &head, sizeof head);
+    std::memcpy(frame.data() + sizeof head, &desc, sizeof desc);
+
+    PTPContainer data(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+    data.set_payload(frame.data(), frame.size());
+
+    StubComm comm;
+    comm.add_message(data);
+    comm.add_message(make_response(frame.size()));
+    CHDKCamera cam(&comm);
+
+    LVData lv;
+    std::vector<uint8_t> rgb(width * height * 3);
+    int out_width = 0, out_height = 0;
+    long allocs = count_allocations([&]()
+    {
+        cam.get_live_view_data(lv);
+        lv.get_rgb(rgb.data(), rgb.size(), &out_width, &out_height);
+    }, 4, 200);
+
+    CHECK(out_width == width);
+    CHECK(out_height == height);
+    CHECK(lv.get_lv_version() > 2.0 && lv.get_lv_version() < 2.2);
+    CHECK(allocs == 0);
+    if (benchmarks) std::printf("  %ld allocations in 200 frames\n", allocs);
+}
+
+static void test_trace_export()
+{
+    std::printf("trace export\n");
+
+    StubComm comm;
+    comm.add_message(make_response(0));
+    CHDKCamera cam(&comm);
+
+    PTPTrace::clear();
+    PTPTrace::enable(true);
+    long allocs = count_allocations([&]() { cam.check_script_status(); }, 1, 100);
+    PTPTrace::enable(false);
+
+    std::ostringstream json;
+    PTPTrace::export_chrome_json(json);
+    std::string out = json.str();
+
+    CHECK(allocs == 0);
+    CHECK(out.find("{\"traceEvents\":[") == 0);
+    CHECK(out.find("\"CHDKCamera::check_script_status\"") != std::string::npos);
+    CHECK(out.find("\"PTPBase::ptp_transaction\"") != std::string::npos);
+    CHECK(out.find("\"usb read (first packet)\"") != std::string::npos);
+    CHECK(out.find("\"ph\":\"X\"") != std::string::npos);
+
+    // An exited thread's spans are still exported, once
+    PTPTrace::enable(true);
+    std::thread([]() { PTPTrace::Span span("exited thread"); }).join();
+    PTPTrace::enable(false);
+    std::ostringstream first, second;
+    PTPTrace::export_chrome_json(first);
+    PTPTrace::export_chrome_json(second);
+    CHECK(first.str().find("\"exited thread\"") != std::string::npos);
+    CHECK(second.str().find("\"exited thread\"") == std::string::npos);
+
+    // ...and then its buffer goes to the next thread, rather than a new one
+    PTPTrace::enable(true);
+    for (int i = 0; i < 2; i++) std::thread([]() { PTPTrace::Span span("short thread"); }).join();
+    PTPTrace::clear();
+    long before = allocated_bytes.load();
+    for (int i = 0; i < 20; i++)
+    {
+        std::thread([]() { PTPTrace::Span span("short thread"); }).join();
+        PTPTrace::clear();
+    }
+    long bytes = allocated_bytes.load() - before;
+    PTPTrace::enable(false);
+    CHECK(bytes < (long) (PTPTrace::buffer_size * sizeof(uint64_t))); // Less than one buffer's worth in all
+}
+
+static void test_transaction_deadline_cancels()
+{
+    std::printf("transaction deadline\n");
+
+    SilentComm comm;
+    CHDKCamera cam(&comm);
+
+    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    cmd.add_param(PTP_CHDK_ScriptStatus);
+    PTPContainer data, out_resp, out_data;
+
+    bool timed_out = false;
+    try
+    {
+        cam.ptp_transaction(cmd, data, true, out_resp, out_data, 50);
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+        timed_out = (e == ERR_TIMEOUT);
+    }
+
+    // One read, which waited no longer than the deadline, then the cancel
+    CHECK(timed_out);
+    CHECK(comm.reads == 1);
+    CHECK(comm.read_timeout > 0 && comm.read_timeout <= 50);
+    CHECK(comm.cancels == 1);
+    CHECK(comm.cancelled_id == cmd.transaction_id);
+
+    // A failed write is an error straight away, not a wait for the deadline
+    comm.unplugged = true;
+    LIBPTP_PP_ERRORS error = ERR_NONE;
+    try
+    {
+        cam.ptp_transaction(cmd, data, true, out_resp, out_data, 50);
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+        error = e;
+    }
+    CHECK(error == ERR_USB_ERROR);
+    CHECK(comm.reads == 1);
+    CHECK(comm.cancels == 2 && comm.cancelled_id == cmd.transaction_id);
+}
+
+static void test_worker()
+{
+    std::printf("worker\n");
+
+    // Results and exceptions come back through the future
+    {
+        PTPWorker worker(NULL);
+        CHECK(worker.submit([]() { return 42; }).get() == 42);
+
+        LIBPTP_PP_ERRORS error = ERR_NONE;
+        std::future<void> failing = worker.submit([]() { throw ERR_TIMEOUT; });
+        try
+        {
+            failing.get();
+        }
+        catch (LIBPTP_PP_ERRORS e)
+        {
+            error = e;
+        }
+        CHECK(error == ERR_TIMEOUT);
+    }
+
+    // Posts racing the worker going to sleep are never lost
+    {
+        PTPWorker worker(NULL);
+        int lost = 0;
+        for (int i = 0; i < 20000; i++)
+        {
+            if (i % 64 == 0)
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(i % 128));
+            }
+            std::future<int> result = worker.submit([i]() { return i; });
+            if (result.wait_for(std::chrono::seconds(5)) != std::future_status::ready || result.get() != i)
+            {
+                lost++;
+            }
+        }
+        CHECK(lost == 0);
+    }
+
+    // Many producers against stop(): every job either runs or is told it
+    // did not
+    {
+        const int producers = 8;
+        const int jobs = 2000;
+        std::atomic<int> ran(0), completed(0), stopped(0), other(0);
+        std::atomic<bool> go(false);
+        std::thread threads[producers];
+
+        {
+            PTPWorker worker(NULL);
+            for (int t = 0; t < producers; t++)
+            {
+                threads[t] = std::thread([&]()
+                {
+                    while (!go.load()) std::this_thread::yield();
+                    for (int i = 0; i < jobs; i++)
+                    {
+                        worker.post([&]() { ran++; }, [&](std::exception_ptr error)
+                        {
+                            completed++;
+                            if (!error) return;
+                            try { std::rethrow_exception(error); }
+                            catch (LIBPTP_PP_ERRORS e) { (e == ERR_PTPWORKER_STOPPED ? stopped : other)++; }
+                        });
+                    }
+                });
+            }
+
+            go.store(true);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            worker.stop();
+            for (int t = 0; t < producers; t++)
+            {
+                threads[t].join();
+            }
+        }
+
+        CHECK(completed.load() == producers * jobs);
+        CHECK(ran.load() + stopped.load() == producers * jobs);
+        CHECK(other.load() == 0);
+        if (benchmarks) std::printf("  %d ran, %d stopped\n", ran.load(), stopped.load());
+    }
+
+    // Once stopped, submissions fail straight away
+    {
+        PTPWorker worker(NULL);
+        worker.stop();
+        std::future<void> late = worker.submit([]() {});
+        CHECK(late.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+        LIBPTP_PP_ERRORS error = ERR_NONE;
+        try
+        {
+            late.get();
+        }
+        catch (LIBPTP_PP_ERRORS e)
+        {
+            error = e;
+        }
+        CHECK(error == ERR_PTPWORKER_STOPPED);
+    }
+}
+
+static void test_worker_priorities()
+{
+    std::printf("worker priorities\n");
+
+    PTPWorker worker(NULL);
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    std::promise<void> blocking;
+    worker.post([&]() { blocking.set_value(); released.wait(); });
+    blocking.get_future().wait();
+
+    // Background work queued behind the blocking job, then something urgent
+    // and something that will have expired by the time it is reached
+    std::vector<int> order;
+    std::vector<std::future<void> > background;
+    for (int i = 0; i < 4; i++)
+    {
+        background.push_back(worker.submit([&order, i]() { order.push_back(i); }, PTPWorker::PRIORITY_BACKGROUND));
+    }
+    std::future<void> urgent = worker.submit([&order]() { order.push_back(-1); }, PTPWorker::PRIORITY_CRITICAL);
+
+    bool expired_ran = false;
+    std::future<void> expired = worker.submit([&expired_ran]() { expired_ran = true; },
+        PTPWorker::PRIORITY_CRITICAL, PTPWorker::Clock::now() + std::chrono::milliseconds(1));
+    LIBPTP_PP_ERRORS callback_error = ERR_NONE;
+    worker.post([&expired_ran]() { expired_ran = true; }, [&callback_error](std::exception_ptr error)
+    {
+        try { if (error) std::rethrow_exception(error); }
+        catch (LIBPTP_PP_ERRORS e) { callback_error = e; }
+    }, PTPWorker::PRIORITY_NORMAL, PTPWorker::Clock::now() + std::chrono::milliseconds(1));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    release.set_value();
+
+    urgent.get();
+    for (size_t i = 0; i < background.size(); i++)
+    {
+        background[i].get();
+    }
+
+    int expected[] = { -1, 0, 1, 2, 3 };
+    CHECK(order == std::vector<int>(expected, expected + 5));
+
+    LIBPTP_PP_ERRORS error = ERR_NONE;
+    try
+    {
+        expired.get();
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+        error = e;
+    }
+    CHECK(error == ERR_PTPWORKER_DEADLINE_MISSED);
+    CHECK(callback_error == ERR_PTPWORKER_DEADLINE_MISSED);
+    CHECK(!expired_ran);
+    CHECK(worker.get_dropped_count() == 2);
+}
+
+static void test_coalesced_status()
+{
+    std::printf("coalesced status polls\n");
+
+    FakeChdkComm comm;
+    CHDKCamera cam(&comm);
+    cam.set_coalescing(true, 60000);
+
+    // Everybody who asks while the first poll is held on the wire shares it
+    const int callers = 8;
+    std::atomic<int> started(0);
+    uint32_t statuses[callers];
+    std::thread threads[callers];
+    comm.hold_status.store(true);
+    for (int i = 0; i < callers; i++)
+    {
+        threads[i] = std::thread([&, i]()
+        {
+            started++;
+            statuses[i] = cam.check_script_status();
+        });
+    }
+    while (started.load() < callers || comm.status_polls.load() == 0) std::this_thread::yield();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    comm.hold_status.store(false);
+    for (int i = 0; i < callers; i++)
+    {
+        threads[i].join();
+    }
+
+    CHECK(comm.status_polls.load() == 1);
+    bool same = true;
+    for (int i = 1; i < callers; i++) same = same && statuses[i] == statuses[0];
+    CHECK(same);
+
+    // Inside the freshness window the answer is reused, after it the wire is asked again
+    cam.set_coalescing(true, 200);
+    cam.check_script_status();
+    cam.check_script_status();
+    CHECK(comm.status_polls.load() == 2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    cam.check_script_status();
+    CHECK(comm.status_polls.load() == 3);
+
+    // Without coalescing, every call is a transaction
+    cam.set_coalescing(false);
+    cam.check_script_status();
+    cam.check_script_status();
+    CHECK(comm.status_polls.load() == 5);
+}
+
+static void test_download_streams_to_file()
+{
+    std::printf("streaming download\n");
+
+    // Bigger than one stream chunk, and not a multiple of 512
+    std::vector<unsigned char> file(3 * 1024 * 1024 + 123);
+    for (size_t i = 0; i < file.size(); i++) file[i] = (unsigned char) (i * 7 + (i >> 11));
+
+    PTPContainer data(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+    data.set_payload(file.data(), file.size());
+
+    StubComm comm;
+    comm.add_message(PTPContainer(PTPContainer::CONTAINER_TYPE_RESPONSE, CHDK_PTP_RC_OK)); // TempData
+    comm.add_message(data);
+    comm.add_message(PTPContainer(PTPContainer::CONTAINER_TYPE_RESPONSE, CHDK_PTP_RC_OK)); // DownloadFile
+    CHDKCamera cam(&comm);
+
+    char local[] = "/tmp/libeasyptp-download-XXXXXX";
+    close(mkstemp(local));
+
+    int calls = 0;
+    uint64_t last_done = 0, last_total = 0;
+    PTPTransferStats stats;
+    bool ok = cam.download_file("A/DCIM/100CANON/IMG_0001.JPG", std::string(local), 0,
+        [&](uint64_t done, uint64_t total) { calls++; last_done = done; last_total = total; }, &stats);
+
+    std::ifstream in(local, std::ios::binary);
+    std::vector<unsigned char> got((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    unlink(local);
+
+    CHECK(ok);
+    CHECK(comm.writes == 3); // TempData command and filename, DownloadFile command
+    CHECK(got == file);
+    CHECK(calls == 4); // The first packet, then three chunks
+    CHECK(last_done == file.size());
+    CHECK(last_total == file.size());
+    CHECK(stats.bytes == file.size());
+    CHECK(stats.seconds > 0);
+    if (benchmarks) std::printf("  %.1f MB/s\n", stats.mb_per_s());
+}
+
+static void test_upload_streams_from_file()
+{
+    std::printf("streaming upload\n");
+
+    std::vector<unsigned char> file(2 * 1024 * 1024 + 77);
+    for (size_t i = 0; i < file.size(); i++) file[i] = (unsigned char) (i * 13 + (i >> 9));
+
+    char local[] = "/tmp/libeasyptp-upload-XXXXXX";
+    int fd = mkstemp(local);
+    CHECK(write(fd, file.data(), file.size()) == (ssize_t) file.size());
+    close(fd);
+
+    StubComm comm;
+    comm.record = true;
+    comm.add_message(PTPContainer(PTPContainer::CONTAINER_TYPE_RESPONSE, CHDK_PTP_RC_OK));
+    CHDKCamera cam(&comm);
+
+    const std::string remote = "A/CHDK/SCRIPTS/TEST.LUA";
+    PTPTransferStats stats;
+    bool ok = cam.upload_file(std::string(local), remote, 0, PTPProgressCallback(), &stats);
+    unlink(local);
+
+    // Put the data phase back together: everything after the command
+    std::vector<unsigned char> wire;
+    for (size_t i = 1; i < comm.written.size(); i++)
+    {
+        CHECK(i + 1 == comm.written.size() || comm.written[i].size() % 512 == 0);
+        wire.insert(wire.end(), comm.written[i].begin(), comm.written[i].end());
+    }
+
+    uint32_t length = 0, name_length = 0;
+    uint16_t type = 0;
+    std::memcpy(&length, wire.data(), 4);
+    std::memcpy(&type, wire.data() + 4, 2);
+    std::memcpy(&name_length, wire.data() + 12, 4);
+
+    CHECK(ok);
+    CHECK(comm.written.size() == 4); // Command, then three chunks
+    CHECK(length == wire.size());
+    CHECK(type == PTPContainer::CONTAINER_TYPE_DATA);
+    CHECK(name_length == remote.length());
+    CHECK(std::string(wire.begin() + 16, wire.begin() + 16 + name_length) == remote);
+    CHECK(std::equal(file.begin(), file.end(), wire.begin() + 16 + name_length));
+    CHECK(stats.bytes == file.size());
+}
+
+static void test_batch_upload()
+{
+    std::printf("batch upload\n");
+
+    char dir[] = "/tmp/libeasyptp-batch-XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+
+    std::vector<CHDKUpload> files;
+    for (int i = 0; i < 50; i++)
+    {
+        CHDKUpload upload;
+        upload.local_filename = std::string(dir) + "/script" + std::to_string(i) + ".lua";
+        upload.remote_filename = "A/CHDK/SCRIPTS/S" + std::to_string(i) + ".LUA";
+        std::vector<char> body(2000 + i * 100, 'a' + (i % 26));
+        int fd = open(upload.local_filename.c_str(), O_WRONLY | O_CREAT, 0644);
+        CHECK(write(fd, body.data(), body.size()) == (ssize_t) body.size());
+        close(fd);
+        files.push_back(upload);
+    }
+    CHDKUpload missing;
+    missing.local_filename = std::string(dir) + "/missing.lua";
+    missing.remote_filename = "A/MISSING.LUA";
+    files.insert(files.begin() + 10, missing);
+
+    StubComm comm;
+    comm.add_message(PTPContainer(PTPContainer::CONTAINER_TYPE_RESPONSE, CHDK_PTP_RC_OK));
+    CHDKCamera cam(&comm);
+
+    CHDKBatchStats stats, read_ahead_stats;
+    std::vector<CHDKTransferResult> results = cam.upload_files(files, 0, &stats);
+    std::vector<CHDKTransferResult> read_ahead_results = cam.upload_files(files, 0, &read_ahead_stats, true);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int sequential_ok = 0;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        sequential_ok += cam.upload_file(files[i].local_filename, files[i].remote_filename) ? 1 : 0;
+    }
+    double sequential_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    CHECK(results.size() == files.size());
+    CHECK(!results[10].ok);
+    CHECK(results[10].error == ERR_DATASOURCE_FAILED);
+    CHECK(results[0].ok && results[0].stats.bytes == 2000);
+    CHECK(results[50].ok && results[50].stats.bytes == 2000 + 49 * 100);
+    CHECK(stats.files == 50);
+    CHECK(sequential_ok == 50);
+
+    // Reading ahead on another thread changes nothing but the timing
+    bool same = read_ahead_results.size() == results.size();
+    for (size_t i = 0; same && i < results.size(); i++)
+    {
+        same = read_ahead_results[i].ok == results[i].ok && read_ahead_results[i].error == results[i].error &&
+            read_ahead_results[i].stats.bytes == results[i].stats.bytes;
+    }
+    CHECK(same);
+    CHECK(read_ahead_stats.files == 50);
+    if (benchmarks)
+    {
+        std::printf("  batched %.0f files/s, read ahead %.0f files/s, one at a time %.0f files/s\n",
+            stats.files_per_s(), read_ahead_stats.files_per_s(), sequential_ok / sequential_seconds);
+    }
+
+    for (size_t i = 0; i < files.size(); i++) unlink(files[i].local_filename.c_str());
+    rmdir(dir);
+}
+
+static void test_rig_offload()
+{
+    std::printf("rig offload\n");
+
+    const int camera_count = 3, file_count = 2;
+
+    char dir[] = "/tmp/libeasyptp-offload-XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+
+    // Each file spans several staging buffers and isn't a multiple of the O_DIRECT alignment
+    std::vector<std::vector<unsigned char> > contents;
+    StubComm comms[camera_count];
+    CHDKCamera * cams[camera_count];
+    CHDKOffload offload(true, true);
+    for (int c = 0; c < camera_count; c++)
+    {
+        std::vector<CHDKDownload> files;
+        for (int f = 0; f < file_count; f++)
+        {
+            std::vector<unsigned char> file(9 * 1024 * 1024 + 321 * (c + 1) + f);
+            for (size_t i = 0; i < file.size(); i++) file[i] = (unsigned char) (i * (c + 3) + f + (i >> 12));
+
+            PTPContainer data(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+            data.set_payload(file.data(), file.size());
+            comms[c].add_message(PTPContainer(PTPContainer::CONTAINER_TYPE_RESPONSE, CHDK_PTP_RC_OK));
+            comms[c].add_message(data);
+            comms[c].add_message(PTPContainer(PTPContainer::CONTAINER_TYPE_RESPONSE, CHDK_PTP_RC_OK));
+
+            CHDKDownload download;
+            download.remote_filename = "A/DCIM/100CANON/IMG_000" + std::to_string(f) + ".JPG";
+            download.local_filename = std::string(dir) + "/cam" + std::to_string(c) + "_" + std::to_string(f) + ".jpg";
+            files.push_back(download);
+            contents.push_back(file);
+        }
+        cams[c] = new CHDKCamera(&comms[c]);
+        CHECK(offload.add_camera(cams[c], files) == c);
+    }
+
+    offload.run();
+    CHDKBatchStats stats = offload.get_stats();
+
+    uint64_t total = 0;
+    for (int c = 0; c < camera_count; c++)
+    {
+        CHDKOffloadProgress progress = offload.get_progress(c);
+        std::vector<CHDKTransferResult> results = offload.get_results(c);
+        CHECK(progress.finished);
+        CHECK(progress.files_done == (uint32_t) file_count);
+        for (int f = 0; f < file_count; f++)
+        {
+            const std::vector<unsigned char>& expected = contents[c * file_count + f];
+            std::string local = std::string(dir) + "/cam" + std::to_string(c) + "_" + std::to_string(f) + ".jpg";
+            std::string got = read_file(local);
+            CHECK(results[f].ok);
+            CHECK(got.size() == expected.size() && std::memcmp(got.data(), expected.data(), got.size()) == 0);
+            total += expected.size();
+            unlink(local.c_str());
+        }
+        delete cams[c];
+    }
+    rmdir(dir);
+
+    CHECK(stats.files == (uint32_t) (camera_count * file_count));
+    CHECK(stats.bytes == total);
+    if (benchmarks) std::printf("  %.1f MB/s across %d cameras\n", stats.mb_per_s(), camera_count);
+
+    // Anything a camera throws ends up in its results, not in std::terminate
+    struct FaultyComm : public SilentComm
+    {
+        virtual bool _bulk_read(unsigned char * data_out, const int size, int * transferred, const int timeout = 0)
+        {
+            throw std::runtime_error("unplugged");
+        }
+    } faulty;
+    CHDKCamera faulty_cam(&faulty);
+    std::vector<CHDKDownload> faulty_files(2);
+    faulty_files[0].remote_filename = faulty_files[1].remote_filename = "A/DCIM/100CANON/IMG_0001.JPG";
+    faulty_files[0].local_filename = faulty_files[1].local_filename = "/tmp/libeasyptp-offload-faulty.jpg";
+    CHDKOffload faulty_offload;
+    faulty_offload.add_camera(&faulty_cam, faulty_files);
+    faulty_offload.run();
+    std::vector<CHDKTransferResult> faulty_results = faulty_offload.get_results(0);
+    CHECK(faulty_offload.get_progress(0).finished && faulty_offload.get_progress(0).files_done == 2);
+    CHECK(!faulty_results[0].ok && faulty_results[0].exception && faulty_results[1].exception);
+
+    // Starting again while it runs waits for that run, then starts over
+    faulty_offload.start();
+    faulty_offload.start();
+    faulty_offload.wait();
+    CHECK(faulty_offload.get_progress(0).finished && faulty_offload.get_progress(0).files_done == 2);
+    CHECK(faulty_offload.get_results(0).size() == 2 && faulty_offload.get_results(0)[1].exception);
+    unlink(faulty_files[0].local_filename.c_str());
+}
+
+static void test_rpc_agent()
+{
+    std::printf("resident Lua agent\n");
+
+    FakeChdkComm comm;
+    comm.compile_ms = 5;
+    CHDKCamera cam(&comm);
+
+    CHDKRpc rpc(&cam);
+    CHECK(rpc.start(1000));
+    CHECK(rpc.is_running());
+    CHECK(rpc.define("add", "local a, b = ... return a + b", 1000));
+
+    std::vector<std::string> args;
+    args.push_back("2");
+    args.push_back("3\twith a tab");
+    std::string result;
+    CHECK(rpc.call("add", args, &result, 1000));
+    CHECK(result == "2+3\\twith a tab"); // Escaped on the wire; the real dispatcher unescapes it, the fake doesn't
+
+    CHECK(!rpc.call("missing", std::vector<std::string>(), &result, 1000));
+    CHECK(rpc.get_error() == "no such function: missing");
+
+    // Calls into the agent never compile a script; one-shot scripts compile one per command
+    const int calls = 100, scripts = 20;
+    args.resize(1);
+    CHECK(comm.scripts_started == 1);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int answered = 0;
+    for (int i = 0; i < calls; i++)
+    {
+        answered += rpc.call("add", args, &result, 1000) ? 1 : 0;
+    }
+    double rpc_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / calls;
+    CHECK(answered == calls && comm.scripts_started == 1);
+
+    CHECK(rpc.stop(1000));
+    CHECK(!rpc.is_running());
+
+    start = std::chrono::steady_clock::now();
+    PTPContainer resp, data;
+    for (int i = 0; i < scripts; i++)
+    {
+        uint32_t error = 0;
+        cam.execute_lua("return 5", &error);
+        do
+        {
+            cam.read_script_message(resp, data);
+        } while (resp.get_param_n(0) != PTP_CHDK_S_MSGTYPE_RET);
+    }
+    double script_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / scripts;
+
+    uint32_t value = 0;
+    int size = 0;
+    std::memcpy(&value, data.get_payload_ptr(&size), 4);
+    CHECK(value == 5);
+    CHECK(comm.scripts_started == 1 + scripts);
+    if (benchmarks)
+    {
+        std::printf("  %.0f us per agent call, %.0f us per one-shot script (%d ms simulated compile)\n", rpc_us, script_us, comm.compile_ms);
+    }
+}
+
+static void test_script_results()
+{
+    std::printf("typed script results\n");
+
+    CHDKScriptValue value;
+    int32_t number = -42;
+    CHDKCamera::decode_script_value(PTP_CHDK_TYPE_INTEGER, (const unsigned char *) &number, 4, value);
+    CHECK(value.type == PTP_CHDK_TYPE_INTEGER && value.integer == -42);
+
+    int32_t truth = 1;
+    CHDKCamera::decode_script_value(PTP_CHDK_TYPE_BOOLEAN, (const unsigned char *) &truth, 4, value);
+    CHECK(value.type == PTP_CHDK_TYPE_BOOLEAN && value.boolean);
+
+    CHDKCamera::decode_script_value(PTP_CHDK_TYPE_NIL, (const unsigned char *) "", 1, value);
+    CHECK(value.type == PTP_CHDK_TYPE_NIL && value.string.empty());
+
+    const char table[] = "1\tfirst\nname\tIXUS\nempty\t\n";
+    CHDKCamera::decode_script_value(PTP_CHDK_TYPE_TABLE, (const unsigned char *) table, sizeof table - 1, value);
+    CHECK(value.table.size() == 3);
+    CHECK(value.table["1"] == "first" && value.table["name"] == "IXUS" && value.table["empty"] == "");
+
+    FakeChdkComm comm;
+    CHDKCamera cam(&comm);
+
+    // A script round trip takes no more than the polls it needs: one which
+    //  finds the result, and one which finds the script finished
+    CHECK(cam.run_lua("return 17", &value, NULL, 1000));
+    CHECK(value.type == PTP_CHDK_TYPE_INTEGER && value.integer == 17);
+    CHECK(comm.status_polls <= 2);
+
+    // Waiting for one script keeps the messages of another for it
+    uint32_t error = 0;
+    uint32_t other = cam.execute_lua("return 7", &error);
+    CHECK(cam.run_lua("return 8", &value, NULL, 1000) && value.integer == 8);
+    CHDKScriptMessage kept;
+    CHECK(cam.read_script_message(kept, other) && kept.value.integer == 7);
+    CHECK(!cam.read_script_message(kept, other));
+
+    other = cam.execute_lua("return 6", &error);
+    CHDKTable table_result;
+    CHECK(!cam.run_lua("return 5", table_result, 1000));
+    std::vector<CHDKScriptMessage> returns = cam._wait_for_script_return(1000, other);
+    CHECK(returns.size() == 1 && returns[0].value.integer == 6);
+
+    // The text overload collects every script's messages
+    cam.execute_lua("return 9", &error);
+    std::vector<std::string> texts = cam._wait_for_script_return(1000);
+    CHECK(texts.size() == 1 && texts[0] == "9");
+
+    // The timeout is honoured, rather than being hit straight away
+    CHDKRpc rpc(&cam);
+    CHECK(rpc.start(1000));
+    bool timed_out = false;
+    int polls = comm.status_polls;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    try
+    {
+        cam._wait_for_script_return(30);
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+        timed_out = (e == ERR_TIMEOUT);
+    }
+    long elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    CHECK(timed_out);
+    CHECK(elapsed_ms >= 30 && comm.status_polls - polls > 1);
+    CHECK(elapsed_ms < 1000); // Only that it ends; how soon after the deadline is up to the scheduler
+}
+
+static void test_memory_access()
+{
+    std::printf("camera memory\n");
+
+    // Each range spans more than one transaction
+    FakeChdkComm comm;
+    comm.memory.assign(9 * 1024 * 1024 + 5, 0);
+    CHDKCamera cam(&comm);
+
+    std::vector<unsigned char> block(5 * 1024 * 1024 + 3);
+    for (size_t i = 0; i < block.size(); i++) block[i] = (unsigned char) (i * 13 + (i >> 9));
+    comm.memory[0] = 0x5A;
+
+    PTPTransferStats stats;
+    CHECK(cam.write_memory(0x10, block.data(), block.size(), 1000, &stats));
+    CHECK(stats.bytes == block.size());
+    CHECK(std::equal(block.begin(), block.end(), comm.memory.begin() + 0x10));
+
+    // Address 0 is read around CHDK's NULL check
+    std::vector<unsigned char> all(comm.memory.size());
+    CHECK(cam.read_memory(0, all.data(), all.size(), 1000, &stats));
+    CHECK(all == comm.memory);
+    CHECK(stats.bytes == all.size());
+    if (benchmarks) std::printf("  %.1f MB/s\n", stats.mb_per_s());
+
+    std::vector<unsigned char> first(100), second(6 * 1024 * 1024);
+    CHDKMemoryRegion regions[2] = {
+        { 0x20, (uint32_t) first.size(), first.data(), false },
+        { 0x1000, (uint32_t) second.size(), second.data(), false },
+    };
+    std::vector<CHDKMemoryRegion> batch(regions, regions + 2);
+    CHECK(cam.read_memory(batch, 1000));
+    CHECK(batch[0].ok && batch[1].ok);
+    CHECK(std::equal(first.begin(), first.end(), comm.memory.begin() + 0x20));
+    CHECK(std::equal(second.begin(), second.end(), comm.memory.begin() + 0x1000));
+}
+
+static void test_function_calls()
+{
+    std::printf("firmware function calls\n");
+
+    FakeChdkComm comm;
+    CHDKCamera cam(&comm);
+
+    std::vector<int32_t> args;
+    args.push_back(2);
+    args.push_back(-5);
+    CHECK(cam.call_function(0x1000, args) == 0x1000 - 3);
+
+    args.assign(11, 1);
+    bool refused = false;
+    try
+    {
+        cam.call_function(0x1000, args);
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+        refused = (e == ERR_CHDK_TOO_MANY_ARGUMENTS);
+    }
+    CHECK(refused);
+
+    std::vector<CHDKFunctionCall> calls(200);
+    for (size_t i = 0; i < calls.size(); i++)
+    {
+        calls[i].function = 0x2000;
+        calls[i].arg_count = i % (CHDKFunctionCall::max_args + 1);
+        for (int j = 0; j < calls[i].arg_count; j++) calls[i].args[j] = j;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    CHECK(cam.call_functions(calls, 1000));
+    long elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    bool all_right = true;
+    for (size_t i = 0; i < calls.size(); i++)
+    {
+        int n = calls[i].arg_count;
+        all_right = all_right && calls[i].ok && calls[i].result == 0x2000 + n * (n - 1) / 2;
+    }
+    CHECK(all_right);
+    if (benchmarks) std::printf("  %.1f us per batched call\n", (double) elapsed_us / calls.size());
+}
+
+/**
+ * Keeps what's written to it at each offset, and whether it was ended well.
+ */
+class StringSink : public IPTPDataSink
+{
+public:
+    std::string data;
+    bool begun;
+    bool ended;
+
+    StringSink() : begun(false), ended(false)
+    {
+    }
+
+    virtual bool begin(const uint64_t total_size)
+    {
+        this->begun = true;
+        return true;
+    }
+
+    virtual bool write(const uint64_t offset, const unsigned char * data, const uint32_t length)
+    {
+        if (this->data.size() < offset + length) this->data.resize(offset + length);
+        this->data.replace(offset, length, (const char *) data, length);
+        return true;
+    }
+
+    virtual bool end(const bool success)
+    {
+        this->ended = success;
+        return success;
+    }
+};
+
+static void test_remote_capture()
+{
+    std::printf("remote capture\n");
+
+    std::string jpeg(300 * 1024 + 17, 0), header(8192, 0), raw(3 * 1024 * 1024 + 5, 0);
+    for (size_t i = 0; i < jpeg.size(); i++) jpeg[i] = (char) (i * 3 + 1);
+    for (size_t i = 0; i < header.size(); i++) header[i] = (char) (i ^ 0x55);
+    for (size_t i = 0; i < raw.size(); i++) raw[i] = (char) (i * 11 + (i >> 10));
+
+    // The JPEG's first chunk comes last, with a seek back to the start
+    FakeChdkComm comm;
+    comm.exposure_ms = 20;
+    std::deque<std::pair<uint32_t, std::string> >& jpeg_chunks = comm.shot[PTP_CHDK_CAPTURE_JPG];
+    jpeg_chunks.push_back(std::make_pair(1000u, jpeg.substr(1000, 100000)));
+    jpeg_chunks.push_back(std::make_pair(0xFFFFFFFFu, jpeg.substr(101000)));
+    jpeg_chunks.push_back(std::make_pair(0u, jpeg.substr(0, 1000)));
+    comm.shot[PTP_CHDK_CAPTURE_DNGHDR].push_back(std::make_pair(0xFFFFFFFFu, header));
+    comm.shot[PTP_CHDK_CAPTURE_RAW].push_back(std::make_pair(0xFFFFFFFFu, raw.substr(0, 2 * 1024 * 1024)));
+    comm.shot[PTP_CHDK_CAPTURE_RAW].push_back(std::make_pair(0xFFFFFFFFu, raw.substr(2 * 1024 * 1024)));
+    CHDKCamera cam(&comm);
+
+    char base[] = "/tmp/libeasyptp-capture-XXXXXX";
+    close(mkstemp(base));
+
+    CHDKCaptureStats stats;
+    bool ok = cam.remote_shoot(PTP_CHDK_CAPTURE_JPG | PTP_CHDK_CAPTURE_RAW | PTP_CHDK_CAPTURE_DNGHDR, base, 1000, &stats);
+    std::string got_jpeg = read_file(std::string(base) + ".jpg");
+    std::string got_dng = read_file(std::string(base) + ".dng");
+    unlink(base);
+    unlink((std::string(base) + ".jpg").c_str());
+    unlink((std::string(base) + ".dng").c_str());
+
+    CHECK(ok);
+    CHECK(got_jpeg == jpeg);
+    CHECK(got_dng == header + raw);
+    CHECK(stats.bytes == jpeg.size() + header.size() + raw.size());
+    CHECK(stats.image_number == 42);
+    CHECK(stats.ready_ms >= 20); // Not before the exposure is over
+    CHECK(stats.total_ms >= stats.ready_ms + stats.transfer_ms - 0.001);
+    if (benchmarks) std::printf("  ready after %.1f ms, on the host %.1f ms later\n", stats.ready_ms, stats.transfer_ms);
+
+    // The same shot can go to sinks rather than files
+    StringSink jpg_sink, raw_sink;
+    CHECK(cam.remote_shoot(PTP_CHDK_CAPTURE_JPG | PTP_CHDK_CAPTURE_RAW | PTP_CHDK_CAPTURE_DNGHDR, jpg_sink, raw_sink, 1000));
+    CHECK(jpg_sink.ended && jpg_sink.data == jpeg);
+    CHECK(raw_sink.ended && raw_sink.data == header + raw);
+
+    // A shot which times out doesn't leave the camera holding it
+    comm.exposure_ms = 100;
+    bool timed_out = false;
+    try
+    {
+        cam.remote_shoot(PTP_CHDK_CAPTURE_JPG, base, 20);
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+        timed_out = (e == ERR_TIMEOUT);
+    }
+    CHECK(timed_out);
+    CHECK(access((std::string(base) + ".jpg").c_str(), F_OK) != 0); // Not left half written
+    std::this_thread::sleep_for(std::chrono::milliseconds(150));
+    CHECK(cam.remote_capture_is_ready() == 0);
+    CHECK(cam.check_script_status() == 0);
+}
+
+/**
+ * Packs \a pixels the way CHDK does: most significant bit first, into
+ * little-endian 16-bit words.
+ */
+static std::vector<uint8_t> pack_raw(const std::vector<uint16_t>& pixels, const int bpp)
+{
+    std::vector<uint8_t> stream(RawData::get_packed_size(pixels.size(), bpp), 0);
+    for (size_t i = 0; i < pixels.size(); i++)
+    {
+        for (int b = 0; b < bpp; b++)
+        {
+            size_t bit = i * bpp + b;
+            if (pixels[i] & (1 << (bpp - 1 - b))) stream[bit / 8] |= 0x80 >> (bit % 8);
+        }
+    }
+    for (size_t i = 0; i + 1 < stream.size(); i += 2) std::swap(stream[i], stream[i + 1]);
+    return stream;
+}
+
+static void test_raw_unpack()
+{
+    std::printf("raw unpacking\n");
+
+    // CHDK's own get_raw_pixel, for the first pixels of a 10-bit frame
+    const uint8_t addr[10] = { 0x9D, 0x37, 0x42, 0xE1, 0x0F, 0xA8, 0x5C, 0x73, 0xC6, 0x2B };
+    const uint16_t chdk[8] = {
+        (uint16_t) ((0x3fc & (addr[1] << 2)) | (addr[0] >> 6)),
+        (uint16_t) ((0x3f0 & (addr[0] << 4)) | (addr[3] >> 4)),
+        (uint16_t) ((0x3c0 & (addr[3] << 6)) | (addr[2] >> 2)),
+        (uint16_t) ((0x300 & (addr[2] << 8)) | (addr[5])),
+        (uint16_t) ((0x3fc & (addr[4] << 2)) | (addr[7] >> 6)),
+        (uint16_t) ((0x3f0 & (addr[7] << 4)) | (addr[6] >> 4)),
+        (uint16_t) ((0x3c0 & (addr[6] << 6)) | (addr[9] >> 2)),
+        (uint16_t) ((0x300 & (addr[9] << 8)) | (addr[8])),
+    };
+    uint16_t got[8];
+    RawData::unpack(addr, sizeof addr, got, 8, 10, 0, RawData::KERNEL_SCALAR);
+    CHECK(std::equal(got, got + 8, chdk));
+
+    const RawData::Kernel kernels[3] = { RawData::KERNEL_SCALAR, RawData::KERNEL_SSE41, RawData::KERNEL_AVX2 };
+    const char * names[3] = { "scalar", "SSE4.1", "AVX2" };
+    const int depths[3] = { 10, 12, 14 };
+
+    // Every kernel matches the reference, including a ragged tail, with and without a black level
+    for (int d = 0; d < 3; d++)
+    {
+        const int bpp = depths[d];
+        std::vector<uint16_t> pixels(1000 + 13);
+        uint32_t seed = 12345 + bpp;
+        for (size_t i = 0; i < pixels.size(); i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            pixels[i] = (seed >> 8) & ((1 << bpp) - 1);
+        }
+        pixels[0] = (1 << bpp) - 1;
+        pixels[1] = 0;
+        std::vector<uint8_t> packed = pack_raw(pixels, bpp);
+
+        for (int k = 0; k < 3; k++)
+        {
+            if (!RawData::is_supported(kernels[k])) continue;
+            const uint16_t black = 64;
+            std::vector<uint16_t> out(pixels.size()), expected(pixels.size());
+            RawData::unpack(packed.data(), packed.size(), out.data(), out.size(), bpp, 0, kernels[k]);
+            CHECK(out == pixels);
+            for (size_t i = 0; i < pixels.size(); i++) expected[i] = pixels[i] > black ? pixels[i] - black : 0;
+            RawData::unpack(packed.data(), packed.size(), out.data(), out.size(), bpp, black, kernels[k]);
+            CHECK(out == expected);
+        }
+    }
+
+    bool refused = false;
+    try
+    {
+        RawData::unpack(addr, sizeof addr, got, 8, 12);
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+        refused = (e == ERR_RAWDATA_NOT_ENOUGH_DATA);
+    }
+    CHECK(refused);
+
+    // A whole frame at each depth: 12 Mpx, timed, when benchmarking
+    const int width = benchmarks ? 4000 : 400, height = benchmarks ? 3000 : 300, runs = benchmarks ? 5 : 1;
+    RawData frame;
+    for (int d = 0; d < 3; d++)
+    {
+        std::vector<uint16_t> pixels((size_t) width * height);
+        for (size_t i = 0; i < pixels.size(); i++) pixels[i] = (i * 2654435761u >> 7) & ((1 << depths[d]) - 1);
+        std::vector<uint8_t> packed = pack_raw(pixels, depths[d]);
+        std::vector<uint16_t> out(pixels.size());
+
+        if (benchmarks) std::printf("  %d-bit:", depths[d]);
+        for (int k = 0; k < 3; k++)
+        {
+            if (!RawData::is_supported(kernels[k])) continue;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (int r = 0; r < runs; r++) RawData::unpack(packed.data(), packed.size(), out.data(), out.size(), depths[d], 0, kernels[k]);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+            CHECK(out == pixels);
+            if (benchmarks) std::printf(" %s %.2f ms", names[k], ms);
+        }
+        if (benchmarks) std::printf("\n");
+
+        frame.read(packed.data(), packed.size(), width, height, depths[d]);
+        CHECK(frame.get_width() == width && frame.get_bpp() == depths[d]);
+        CHECK(std::equal(pixels.begin(), pixels.end(), frame.get_pixels()));
+    }
+}
+
+/**
+ * The tags of the first image directory of a little-endian TIFF, by tag:
+ * type, count, and where the value is.
+ */
+struct TIFFTag
+{
+    uint16_t type;
+    uint32_t count;
+    uint32_t value_offset;
+};
+
+static std::map<uint16_t, TIFFTag> read_tiff_tags(const std::string& file, bool * sorted)
+{
+    std::map<uint16_t, TIFFTag> tags;
+    uint32_t ifd;
+    std::memcpy(&ifd, file.data() + 4, 4);
+    uint16_t count;
+    std::memcpy(&count, file.data() + ifd, 2);
+
+    static const int type_sizes[11] = { 0, 1, 1, 2, 4, 8, 0, 1, 0, 0, 8 };
+    uint16_t last = 0;
+    *sorted = true;
+    for (int i = 0; i < count; i++)
+    {
+        const char * entry = file.data() + ifd + 2 + i * 12;
+        uint16_t tag;
+        TIFFTag t;
+        std::memcpy(&tag, entry, 2);
+        std::memcpy(&t.type, entry + 2, 2);
+        std::memcpy(&t.count, entry + 4, 4);
+        t.value_offset = ifd + 2 + i * 12 + 8;
+        if (type_sizes[t.type] * t.count > 4) std::memcpy(&t.value_offset, entry + 8, 4);
+        *sorted = *sorted && tag > last;
+        last = tag;
+        tags[tag] = t;
+    }
+    return tags;
+}
+
+static uint32_t tiff_long(const std::string& file, const TIFFTag& tag, const uint32_t index = 0)
+{
+    if (tag.type == 3)
+    {
+        uint16_t value;
+        std::memcpy(&value, file.data() + tag.value_offset + index * 2, 2);
+        return value;
+    }
+    uint32_t value;
+    std::memcpy(&value, file.data() + tag.value_offset + index * 4, 4);
+    return value;
+}
+
+static void test_dng_writer()
+{
+    std::printf("DNG writer\n");
+
+    FakeChdkComm comm;
+    CHDKCamera cam(&comm);
+    DNGMetadata meta;
+    CHECK(DNGWriter::get_metadata(cam, meta, 1000));
+    CHECK(meta.model == "ixus870_sd880" && meta.software == "CHDK 1.4.1");
+    CHECK(std::fabs(meta.exposure_time - 1.0 / 256) < 1e-9 && std::fabs(meta.f_number - 4) < 1e-9 && meta.iso == 100);
+    CHECK(meta.cfa_pattern[0] == 0 && meta.cfa_pattern[1] == 1 && meta.cfa_pattern[2] == 1 && meta.cfa_pattern[3] == 2);
+    CHECK(meta.black_level == 127 && meta.white_level == 4095);
+
+    // Tall enough for several strips
+    const int width = 1024, height = 1000, bpp = 12;
+    std::vector<uint16_t> pixels((size_t) width * height);
+    for (size_t i = 0; i < pixels.size(); i++) pixels[i] = (i * 2654435761u >> 9) & 0xFFF;
+    std::vector<uint8_t> packed = pack_raw(pixels, bpp);
+
+    char name[] = "/tmp/libeasyptp-dng-XXXXXX";
+    close(mkstemp(name));
+
+    for (int unpacked = 0; unpacked < 2; unpacked++)
+    {
+        DNGWriter writer(4);
+        writer.set_unpacked(unpacked);
+        CHECK(writer.write(std::string(name), packed.data(), packed.size(), width, height, bpp, meta));
+        std::string file = read_file(name);
+        CHECK(file.compare(0, 4, "II*\0", 4) == 0);
+
+        bool sorted;
+        std::map<uint16_t, TIFFTag> tags = read_tiff_tags(file, &sorted);
+        CHECK(sorted);
+        CHECK(tiff_long(file, tags[256]) == (uint32_t) width && tiff_long(file, tags[257]) == (uint32_t) height);
+        CHECK(tiff_long(file, tags[258]) == (uint32_t) (unpacked ? 16 : bpp));
+        CHECK(tiff_long(file, tags[262]) == 32803);
+        CHECK(tiff_long(file, tags[50714]) == 127 && tiff_long(file, tags[50717]) == 4095);
+        CHECK(std::string(file.data() + tags[272].value_offset) == "ixus870_sd880");
+        CHECK(tiff_long(file, tags[33434], 0) == 1 && tiff_long(file, tags[33434], 1) == 256);
+        CHECK(tags[273].count > 1 && tags[273].count == tags[279].count);
+
+        // The strips put back together are the frame, packed big-endian or unpacked
+        std::string strips;
+        for (uint32_t s = 0; s < tags[273].count; s++)
+        {
+            strips.append(file, tiff_long(file, tags[273], s), tiff_long(file, tags[279], s));
+        }
+        bool same = true;
+        if (unpacked)
+        {
+            same = strips.size() == pixels.size() * 2 && std::memcmp(strips.data(), pixels.data(), strips.size()) == 0;
+        }
+        else
+        {
+            same = strips.size() == packed.size();
+            for (size_t i = 0; same && i < packed.size(); i++) same = ((uint8_t) strips[i] == packed[i ^ 1]);
+        }
+        CHECK(same);
+    }
+
+    // A 12 Mpx frame, against just writing the same number of bytes
+    if (!benchmarks)
+    {
+        unlink(name);
+        return;
+    }
+    const int big_width = 4000, big_height = 3000;
+    std::vector<uint8_t> frame(RawData::get_packed_size(big_width * big_height, bpp));
+    for (size_t i = 0; i < frame.size(); i++) frame[i] = (uint8_t) (i * 31);
+    PTPTransferStats stats;
+    CHECK(DNGWriter().write(std::string(name), frame.data(), frame.size(), big_width, big_height, bpp, meta, &stats));
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int fd = open(name, O_WRONLY | O_TRUNC);
+    CHECK(write(fd, frame.data(), frame.size()) == (ssize_t) frame.size());
+    close(fd);
+    double plain_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    unlink(name);
+
+    std::printf("  12 Mpx DNG in %.1f ms (%.0f MB/s); a plain write of the frame takes %.1f ms\n",
+        stats.seconds * 1000, stats.mb_per_s(), plain_ms);
+}
+
+static void test_timelapse()
+{
+    std::printf("timelapse\n");
+
+    char dir[] = "/tmp/libeasyptp-timelapse-XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    std::string pattern = std::string(dir) + "/shot_%03u.jpg";
+
+    // Each download fits in the time the camera spends on the next shot, with
+    //  most of the interval to spare, so a busy machine doesn't drop ticks
+    FakeChdkComm comm;
+    comm.shot_ms = 10;
+    comm.download_ms = 5;
+    CHDKCamera cam(&comm);
+
+    CHDKTimelapse timelapse(&cam, 50, pattern);
+    CHECK(timelapse.run(8, 5000));
+    CHDKTimelapseStats stats = timelapse.get_stats();
+    CHECK(stats.shots_taken == 8 && stats.files_downloaded == 8);
+    CHECK(stats.shots_dropped_busy == 0 && stats.shots_dropped_backlog == 0 && stats.shots_dropped_late == 0);
+    CHECK(stats.mean_lateness_ms <= stats.max_lateness_ms);
+    CHECK(stats.seconds >= 0.35); // Seven intervals on the grid, then the last shot and its download
+    CHECK(read_file(std::string(dir) + "/shot_007.jpg").compare(0, 28, "A/DCIM/100CANON/IMG_0008.JPG") == 0);
+    if (benchmarks)
+    {
+        std::printf("  %u shots in %.0f ms, %.2f ms late on average, %.2f ms at worst\n",
+            stats.shots_taken, stats.seconds * 1000, stats.mean_lateness_ms, stats.max_lateness_ms);
+    }
+
+    // Downloads slower than the interval: ticks are dropped, not delayed
+    comm.download_ms = 80;
+    CHDKTimelapse slow(&cam, 50, pattern);
+    slow.set_max_backlog(1);
+    CHECK(!slow.run(8, 5000));
+    stats = slow.get_stats();
+    uint32_t dropped = stats.shots_dropped_backlog + stats.shots_dropped_busy + stats.shots_dropped_late;
+    CHECK(dropped > 0);
+    CHECK(stats.shots_taken + dropped == 8);
+    CHECK(stats.shots_taken > 0 && stats.files_downloaded == stats.shots_taken);
+    if (benchmarks)
+    {
+        std::printf("  with slow downloads: %u taken, %u dropped (%u backlog, %u busy, %u late)\n",
+            stats.shots_taken, dropped, stats.shots_dropped_backlog, stats.shots_dropped_busy, stats.shots_dropped_late);
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        char name[64];
+        snprintf(name, sizeof name, "/shot_%03d.jpg", i);
+        unlink((std::string(dir) + name).c_str());
+    }
+    rmdir(dir);
+}
+
+static void test_rig_trigger()
+{
+    std::printf("rig trigger\n");
+
+    const int count = 4;
+    FakeChdkComm comms[count];
+    std::vector<CHDKCamera *> cams;
+    CHDKRigTrigger trigger;
+    for (int i = 0; i < count; i++)
+    {
+        comms[i].compile_ms = 40 * i; // Arming takes longer on some cameras than others
+        cams.push_back(new CHDKCamera(&comms[i]));
+        CHECK(trigger.add_camera(cams[i]) == i);
+    }
+
+    CHECK(!trigger.fire(1000)); // Not armed yet
+
+    CHECK(trigger.arm(5000));
+    CHECK(trigger.fire(5000));
+    std::vector<CHDKTriggerResult> shots = trigger.get_results();
+    CHECK(shots.size() == (size_t) count);
+    bool quickest = false;
+    for (int i = 0; i < count; i++)
+    {
+        CHECK(shots[i].armed && shots[i].fired);
+        CHECK(shots[i].camera_tick != 0);
+        CHECK(shots[i].skew_us >= 0);
+        quickest = quickest || shots[i].skew_us == 0;
+    }
+    CHECK(quickest);
+    // The 120 ms stagger in arming must not show up in the release; the
+    //  bound is loose, as a busy machine can delay any one camera
+    CHECK(trigger.get_spread_us() < 60000);
+    if (benchmarks) std::printf("  %d cameras released within %.0f us of each other\n", count, trigger.get_spread_us());
+
+    // Arming again and letting go takes no shots
+    CHECK(trigger.arm(5000));
+    trigger.disarm();
+    shots = trigger.get_results();
+    for (int i = 0; i < count; i++)
+    {
+        CHECK(shots[i].armed && !shots[i].fired);
+        CHECK(comms[i].rig_released_by == "cancel");
+    }
+
+    // One camera which never gets ready: the arm fails, and every script,
+    //  that one's included, is cancelled rather than left half-pressed
+    comms[2].never_arms = true;
+    for (int i = 0; i < count; i++)
+    {
+        comms[i].rig_released_by.clear();
+    }
+    CHECK(!trigger.arm(300));
+    shots = trigger.get_results();
+    CHECK(!shots[2].armed);
+    for (int i = 0; i < count; i++)
+    {
+        CHECK(comms[i].rig_released_by == "cancel" && !shots[i].fired);
+        CHECK(cams[i]->check_script_status() == 0);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        delete cams[i];
+    }
+}
+
+static void test_clock_sync()
+{
+    std::printf("clock sync\n");
+
+    // A clock near the wrap, running 5% slow so the drift shows within a test
+    FakeChdkComm comm;
+    comm.tick_offset_ms = 0xFFFFFF00LL - (int64_t) (std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count() * 0.95);
+    comm.tick_drift_ppm = 50000;
+    CHDKCamera cam(&comm);
+
+    CHDKClockSync sync(&cam);
+    CHECK(!sync.is_synchronized());
+    bool threw = false;
+    try
+    {
+        sync.to_host(0);
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+        threw = (e == ERR_CLOCKSYNC_NOT_SYNCHRONIZED);
+    }
+    CHECK(threw);
+
+    for (int i = 0; i < 10; i++)
+    {
+        CHECK(sync.sample(8, 1000));
+        std::this_thread::sleep_for(std::chrono::milliseconds(40));
+    }
+    CHDKClockReport report = sync.get_report();
+    CHECK(report.samples == 80 && report.points == 10);
+    // Loose bounds: a busy machine stretches the round trips, which costs
+    //  accuracy, but never hides the drift or beats the clock's resolution
+    CHECK(std::fabs(report.drift_ppm - 50000) < 25000);
+    CHECK(report.accuracy_us >= 500 && report.accuracy_us < 20000);
+
+    // The tick read now, mapped back, is now; and the other way round, across the wrap
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double host_us = std::chrono::duration<double, std::micro>(now.time_since_epoch()).count();
+    int64_t tick = (int64_t) std::floor(host_us * 0.95 / 1000) + comm.tick_offset_ms;
+    CHECK(tick > 0xFFFFFFFFLL);
+    double error_us = std::chrono::duration<double, std::micro>(sync.to_host((uint32_t) tick) - now).count();
+    CHECK(std::fabs(error_us) < 20000);
+    CHECK(std::llabs(sync.to_camera(now) - tick) <= 20);
+    if (benchmarks)
+    {
+        std::printf("  %u points: drift %.0f ppm, best round trip %.0f us, accuracy %.0f us; now mapped %.0f us off\n",
+            report.points, report.drift_ppm, report.best_rtt_us, report.accuracy_us, error_us);
+    }
+
+    CHECK(sync.stop(1000));
+}
+
+static void test_property_cache()
+{
+    std::printf("property cache\n");
+
+    FakeChdkComm comm;
+    comm.properties["get_tv96()"] = "768";
+    comm.properties["get_av96()"] = "-32";
+    comm.properties["get_vbatt()"] = "3987";
+    comm.properties["get_shooting()"] = "false";
+    comm.properties["get_prop(221)"] = "spot";
+    CHDKCamera cam(&comm);
+
+    CHDKPropertyCache cache(&cam, 60000);
+    cache.define("metering", "get_prop(221)");
+    std::vector<std::string> names;
+    names.push_back("tv96");
+    names.push_back("av96");
+    names.push_back("battery_mv");
+    names.push_back("shooting");
+    names.push_back("metering");
+    names.push_back("get_temperature(1)"); // Not a name, so an expression; the fake doesn't know it
+    names.push_back("tv96");
+
+    std::map<std::string, CHDKScriptValue> values;
+    CHECK(cache.query(names, values, 1000));
+    CHECK(comm.property_scripts == 1);
+    CHECK(values.size() == 6);
+    CHECK(values["tv96"].type == PTP_CHDK_TYPE_INTEGER && values["tv96"].integer == 768);
+    CHECK(values["av96"].type == PTP_CHDK_TYPE_INTEGER && values["av96"].integer == -32);
+    CHECK(values["battery_mv"].integer == 3987);
+    CHECK(values["shooting"].type == PTP_CHDK_TYPE_BOOLEAN && !values["shooting"].boolean);
+    CHECK(values["metering"].type == PTP_CHDK_TYPE_STRING && values["metering"].string == "spot");
+    CHECK(values["get_temperature(1)"].type == PTP_CHDK_TYPE_NIL);
+
+    // Served from the cache, without a script
+    values.clear();
+    CHECK(cache.query(names, values, 1000));
+    CHECK(comm.property_scripts == 1);
+    CHECK(values["tv96"].integer == 768);
+
+    // Only what was forgotten goes back to the camera
+    comm.properties["get_tv96()"] = "800";
+    cache.invalidate("tv96");
+    CHDKScriptValue tv;
+    CHECK(cache.get("tv96", tv, 1000));
+    CHECK(comm.property_scripts == 2 && tv.integer == 800);
+
+    CHDKPropertyStats stats = cache.get_stats();
+    CHECK(stats.queries == 3 && stats.scripts == 2);
+    CHECK(stats.misses == 7 && stats.hits == 7);
+
+    // With no time to live, every query goes to the camera
+    cache.set_ttl(0);
+    CHECK(cache.get("battery_mv", tv, 1000));
+    CHECK(comm.property_scripts == 3);
+}
+
+static void test_table_parser()
+{
+    std::printf("table parser\n");
+
+    CHDKTable table;
+    const char small[] = "name\tIMG_0001.JPG\nsize\t2345678\nis_dir\tfalse\nbad line\nneg\t-2147483648\nbig\t2147483648\nlast\t";
+    table.parse(small, sizeof small - 1);
+    CHECK(table.size() == 6);
+    CHECK(std::strcmp(table.get_key(0), "name") == 0 && std::strcmp(table.get_value(0), "IMG_0001.JPG") == 0);
+    CHECK(table.find("size") == 1 && table.find("bad line") == -1 && table.find("nam") == -1);
+    int32_t value = 0;
+    CHECK(table.get_integer(1, value) && value == 2345678);
+    CHECK(table.get_integer(3, value) && value == INT32_MIN);
+    CHECK(!table.get_integer(4, value) && !table.get_integer(0, value));
+    uint32_t length = 1;
+    CHECK(table.get_value(5, &length)[0] == '\0' && length == 0);
+    CHDKScriptValue typed;
+    table.get_script_value(2, typed);
+    CHECK(typed.type == PTP_CHDK_TYPE_BOOLEAN && !typed.boolean);
+    table.get_script_value(4, typed);
+    CHECK(typed.type == PTP_CHDK_TYPE_STRING && typed.string == "2147483648");
+
+    // A directory listing's worth of entries
+    std::string text;
+    for (int i = 0; i < 10000; i++)
+    {
+        char line[64];
+        snprintf(line, sizeof line, "IMG_%04d.JPG\t%d\n", i, 1000000 + i);
+        text += line;
+    }
+
+    long allocs = count_allocations([&]() { table.parse(text.data(), text.size()); }, 1, 10);
+    CHECK(allocs == 0);
+    CHECK(table.size() == 10000);
+    CHECK(table.find("IMG_9999.JPG") == 9999);
+    CHECK(table.get_integer(9999, value) && value == 1009999);
+
+    // Decoding into a map allocates for every entry, where parsing in place allocated nothing
+    CHDKScriptValue map_value;
+    long map_allocs = count_allocations([&]() {
+        CHDKCamera::decode_script_value(PTP_CHDK_TYPE_TABLE, (const unsigned char *) text.data(), text.size(), map_value);
+    }, 1, 1);
+    CHECK(map_value.table.size() == 10000);
+    CHECK(map_allocs >= 10000);
+
+    if (benchmarks)
+    {
+        const int runs = 20;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < runs; i++)
+        {
+            table.parse(text.data(), text.size());
+        }
+        double table_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / runs;
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < runs; i++)
+        {
+            CHDKCamera::decode_script_value(PTP_CHDK_TYPE_TABLE, (const unsigned char *) text.data(), text.size(), map_value);
+        }
+        double map_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / runs;
+        std::printf("  10k entries: %.0f us parsed in place, %.0f us into a map (%.1fx)\n", table_us, map_us, map_us / table_us);
+    }
+}
+
+static void test_sync_directory()
+{
+    std::printf("sync directory\n");
+
+    char dir[] = "/tmp/libeasyptp-sync-XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+
+    FakeChdkComm comm;
+    for (int i = 1; i <= 500; i++)
+    {
+        char name[64];
+        snprintf(name, sizeof name, "A/DCIM/%dCANON/IMG_%04d.JPG", 100 + i / 200, i);
+        comm.card[name] = std::make_pair((uint64_t) 2000 + i, (uint64_t) 1700000000 + i);
+    }
+    comm.card["A/CHDK/not_mirrored.lua"] = std::make_pair((uint64_t) 10, (uint64_t) 1);
+    CHDKCamera cam(&comm);
+
+    CHDKSyncStats stats;
+    CHECK(cam.sync_directory("A/DCIM", dir, 10000, &stats));
+    CHECK(stats.files == 500 && stats.files_downloaded == 500 && stats.files_unchanged == 0 && stats.files_failed == 0);
+    CHECK(comm.downloads == 500);
+    std::string content = read_file(std::string(dir) + "/102CANON/IMG_0400.JPG");
+    CHECK(content.size() == 2400 && content.compare(0, 28, "A/DCIM/102CANON/IMG_0400.JPG") == 0);
+    double first_s = stats.seconds;
+
+    // Five new shots, one changed, and one lost locally
+    for (int i = 501; i <= 505; i++)
+    {
+        char name[64];
+        snprintf(name, sizeof name, "A/DCIM/102CANON/IMG_%04d.JPG", i);
+        comm.card[name] = std::make_pair((uint64_t) 3000, (uint64_t) 1700001000);
+    }
+    comm.card["A/DCIM/100CANON/IMG_0001.JPG"].second++;
+    unlink((std::string(dir) + "/101CANON/IMG_0300.JPG").c_str());
+    comm.card.erase("A/DCIM/101CANON/IMG_0299.JPG");
+
+    comm.downloads = 0;
+    CHECK(cam.sync_directory("A/DCIM", dir, 10000, &stats));
+    CHECK(stats.files == 504 && stats.files_downloaded == 7 && stats.files_unchanged == 497);
+    CHECK(comm.downloads == 7);
+    if (benchmarks)
+    {
+        std::printf("  500 files in %.1f ms; re-synced 7 of 504 in %.1f ms (manifest %.1f ms)\n",
+            first_s * 1000, stats.seconds * 1000, stats.manifest_seconds * 1000);
+    }
+
+    // Nothing to do
+    comm.downloads = 0;
+    CHECK(cam.sync_directory("A/DCIM", dir, 10000, &stats));
+    CHECK(stats.files_downloaded == 0 && comm.downloads == 0);
+    CHECK(read_file(std::string(dir) + "/" + CHDKCamera::sync_index_name).find("IMG_0299") == std::string::npos);
+
+    // A re-download which is cut short leaves the old copy alone, and no
+    //  partial file; it is tried again next time
+    const std::string changed = std::string(dir) + "/102CANON/IMG_0400.JPG";
+    comm.card["A/DCIM/102CANON/IMG_0400.JPG"].second++;
+    comm.cut_downloads = true;
+    bool interrupted = false;
+    try
+    {
+        cam.sync_directory("A/DCIM", dir, 10000, &stats);
+    }
+    catch (LIBPTP_PP_ERRORS e)
+    {
+        interrupted = true;
+    }
+    CHECK(interrupted);
+    CHECK(read_file(changed) == content);
+    CHECK(access((changed + ".part").c_str(), F_OK) != 0);
+
+    comm.cut_downloads = false;
+    comm.downloads = 0;
+    CHECK(cam.sync_directory("A/DCIM", dir, 10000, &stats));
+    CHECK(stats.files_downloaded == 1 && comm.downloads == 1);
+    CHECK(read_file(changed) == content);
+
+    // Names which would land outside the directory aren't fetched
+    comm.card["A/DCIM/../escaped.JPG"] = std::make_pair((uint64_t) 10, (uint64_t) 1);
+    comm.card["A/DCIM//tmp/absolute.JPG"] = std::make_pair((uint64_t) 10, (uint64_t) 1);
+    comm.card["A/DCIM/100CANON/../../up.JPG"] = std::make_pair((uint64_t) 10, (uint64_t) 1);
+    comm.downloads = 0;
+    CHECK(!cam.sync_directory("A/DCIM", dir, 10000, &stats));
+    CHECK(stats.files_failed == 3 && comm.downloads == 0);
+    CHECK(access((std::string(dir) + "/../escaped.JPG").c_str(), F_OK) != 0);
+
+    std::string command = std::string("rm -rf ") + dir;
+    CHECK(std::system(command.c_str()) == 0);
+}
+
+static void test_crc32c()
+{
+    std::printf("crc32c\n");
+
+    // The standard check value, and nothing at all
+    for (int k = CRC32C::KERNEL_TABLE; k <= CRC32C::KERNEL_SSE42; k++)
+    {
+        CRC32C::Kernel kernel = (CRC32C::Kernel) k;
+        if (!CRC32C::is_supported(kernel)) continue;
+        CHECK(CRC32C::compute("123456789", 9, kernel) == 0xE3069283);
+        CHECK(CRC32C::compute("", 0, kernel) == 0);
+    }
+
+    // Any split gives the same checksum, whichever kernel takes it
+    std::vector<unsigned char> data(8 * 1024 * 1024 + 13);
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 24;
+    }
+    uint32_t whole = CRC32C::compute(data.data(), data.size(), CRC32C::KERNEL_TABLE);
+    CRC32C pieces;
+    for (size_t done = 0, step = 1; done < data.size(); done += step, step = step * 3 + 1)
+    {
+        pieces.update(data.data() + done, std::min(step, data.size() - done));
+    }
+    CHECK(pieces.get_value() == whole);
+
+    for (int k = CRC32C::KERNEL_TABLE; k <= CRC32C::KERNEL_SSE42; k++)
+    {
+        CRC32C::Kernel kernel = (CRC32C::Kernel) k;
+        if (!CRC32C::is_supported(kernel)) continue;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        CHECK(CRC32C::compute(data.data(), data.size(), kernel) == whole);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (benchmarks) std::printf("  %s: %.0f MB/s\n", kernel == CRC32C::KERNEL_SSE42 ? "sse4.2" : "table", data.size() / 1e6 / seconds);
+    }
+
+    // A download checked against the camera's own checksum
+    FakeChdkComm comm;
+    comm.card["A/DCIM/100CANON/IMG_0001.JPG"] = std::make_pair((uint64_t) 300001, (uint64_t) 1);
+    CHDKCamera cam(&comm);
+    char name[] = "/tmp/libeasyptp-crc-XXXXXX";
+    int fd = mkstemp(name);
+    CHECK(fd >= 0);
+    close(fd);
+
+    uint32_t remote = 0;
+    uint64_t size = 0;
+    CHECK(cam.get_file_crc32c("A/DCIM/100CANON/IMG_0001.JPG", remote, &size, 1000));
+    CHECK(size == 300001);
+    uint32_t local = 0;
+    CHECK(cam.download_file_verified("A/DCIM/100CANON/IMG_0001.JPG", name, 1000, PTPProgressCallback(), NULL, &local));
+    CHECK(local == remote);
+    std::string content = read_file(name);
+    CHECK(CRC32C::compute(content.data(), content.size()) == remote);
+
+    comm.corrupt_downloads = true;
+    CHECK(!cam.download_file_verified("A/DCIM/100CANON/IMG_0001.JPG", name, 1000));
+    unlink(name);
+}
+
+static void test_message_stream()
+{
+    std::printf("message stream\n");
+
+    FakeChdkComm comm;
+    comm.inbox_limit = 16;
+    CHDKCamera cam(&comm);
+    uint32_t status = 0;
+    const std::string loop = "while true do local msg = read_usb_msg(10) end";
+    comm.serve_loop(loop);
+    uint32_t script_id = cam.execute_lua(loop, &status);
+
+    const int count = 2000;
+    CHDKMessageStream stream(&cam, script_id, 32);
+    char message[32];
+    for (int i = 0; i < count; i++)
+    {
+        int length = snprintf(message, sizeof message, "set %d", i);
+        CHECK(stream.send(message, length, 1000));
+    }
+    CHECK(stream.flush(5000));
+
+    // Every message arrived, in order, with the full inbox waited out
+    CHECK(comm.inbox.size() == (size_t) count);
+    CHECK(comm.inbox.front() == "set 0" && comm.inbox.back() == "set 1999");
+    bool in_order = true;
+    for (int i = 0; i < count && i < (int) comm.inbox.size(); i++)
+    {
+        in_order = in_order && comm.inbox[i] == "set " + std::to_string(i);
+    }
+    CHECK(in_order);
+    CHDKStreamStats stats = stream.get_stats();
+    CHECK(stats.messages == (uint64_t) count && stats.queue_full == count / 16 - 1);
+    CHECK(!stream.is_failed() && stream.get_status() == PTP_CHDK_S_MSGSTATUS_OK);
+
+    if (benchmarks) std::printf("  %u queue full waited out\n", stats.queue_full);
+
+    // With room in the inbox, against one transaction at a time
+    comm.inbox_limit = 0;
+    CHDKMessageStream unlimited(&cam, script_id, 32);
+    for (int i = 0; i < count; i++)
+    {
+        int length = snprintf(message, sizeof message, "set %d", i);
+        unlimited.send(message, length, 1000);
+    }
+    CHECK(unlimited.flush(5000));
+    stats = unlimited.get_stats();
+    CHECK(stats.messages == (uint64_t) count);
+    if (benchmarks)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; i++)
+        {
+            cam.write_script_message("set " + std::to_string(i), script_id);
+        }
+        double direct_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::printf("  %.0f messages/s streamed (%.0f us mean latency); %.0f messages/s one at a time\n",
+            stats.messages_per_s(), stats.mean_latency_us, count / direct_s);
+    }
+    unlimited.stop();
+
+    // A script which stops reading fails the stream, rather than hanging stop()
+    comm.inbox_limit = 1;
+    comm.inbox_pending = 0;
+    comm.inbox_stuck = true;
+    size_t before = comm.inbox.size();
+    {
+        CHDKMessageStream stalled(&cam, script_id, 4, 50);
+        for (int i = 0; i < 4; i++)
+        {
+            stalled.send("set", 3, 1000);
+        }
+        stalled.stop();
+        CHECK(stalled.is_failed() && stalled.get_status() == PTP_CHDK_S_MSGSTATUS_QFULL);
+        CHECK(!stalled.send("set", 3, 1000));
+        CHECK(comm.inbox.size() == before + 1);
+    }
+    comm.inbox_stuck = false;
+    comm.inbox_limit = 0;
+
+    // Once the script has gone, the stream fails rather than blocking
+    comm.quit_resident();
+    CHECK(stream.send("set", 3, 1000));
+    stream.flush(1000);
+    CHECK(stream.is_failed() && stream.get_status() == PTP_CHDK_S_MSGSTATUS_NOTRUN);
+    CHECK(!stream.send("set", 3, 1000));
+}
 
 int main(int argc, char *argv[])
 {
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--bench") == 0) benchmarks = true;
+    }
+
+    test_allocations_are_counted();
+    test_script_status_does_not_allocate();
+    test_live_view_does_not_allocate();
+    test_trace_export();
+    test_transaction_deadline_cancels();
+    test_worker();
+    test_worker_priorities();
+    test_coalesced_status();
+    test_download_streams_to_file();
+    test_upload_streams_from_file();
+    test_batch_upload();
+    test_rig_offload();
+    test_rpc_agent();
+    test_script_results();
+    test_memory_access();
+    test_function_calls();
+    test_remote_capture();
+    test_raw_unpack();
+    test_dng_writer();
+    test_timelapse();
+    test_rig_trigger();
+    test_clock_sync();
+    test_property_cache();
+    test_table_parser();
+    test_sync_directory();
+    test_crc32c();
+    test_message_stream();
+
+    if (failures > 0)
+    {
+        std::printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    std::printf("All tests passed\n");
     return 0;
 }
-